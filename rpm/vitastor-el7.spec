@@ -148,6 +148,7 @@ mkdir -p /etc/vitastor
 %files -n vitastor-client
 %_bindir/vitastor-nbd
 %_bindir/vitastor-nfs
+%_bindir/vitastor-nfs-stress
 %_bindir/vitastor-cli
 %_bindir/vitastor-rm
 %_bindir/vitastor-kv
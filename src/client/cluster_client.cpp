@@ -550,7 +550,8 @@ bool cluster_client_t::flush()
 void cluster_client_t::execute(cluster_op_t *op)
 {
     if (op->opcode != OSD_OP_SYNC && op->opcode != OSD_OP_READ &&
-        op->opcode != OSD_OP_READ_BITMAP && op->opcode != OSD_OP_READ_CHAIN_BITMAP && op->opcode != OSD_OP_WRITE)
+        op->opcode != OSD_OP_READ_BITMAP && op->opcode != OSD_OP_READ_CHAIN_BITMAP && op->opcode != OSD_OP_WRITE &&
+        op->opcode != OSD_OP_COPY)
     {
         op->retval = -EINVAL;
         auto cb = std::move(op->callback);
@@ -676,8 +677,10 @@ bool cluster_client_t::check_rw(cluster_op_t *op)
         return false;
     }
     // Check alignment
-    if (!op->len && (op->opcode == OSD_OP_READ_BITMAP || op->opcode == OSD_OP_READ_CHAIN_BITMAP || op->opcode == OSD_OP_WRITE) ||
-        op->offset % pool_it->second.bitmap_granularity || op->len % pool_it->second.bitmap_granularity)
+    if (!op->len && (op->opcode == OSD_OP_READ_BITMAP || op->opcode == OSD_OP_READ_CHAIN_BITMAP || op->opcode == OSD_OP_WRITE ||
+        op->opcode == OSD_OP_COPY) ||
+        op->offset % pool_it->second.bitmap_granularity || op->len % pool_it->second.bitmap_granularity ||
+        op->opcode == OSD_OP_COPY && INODE_POOL(op->src_inode) != pool_id)
     {
         op->retval = -EINVAL;
         auto cb = std::move(op->callback);
@@ -688,7 +691,8 @@ bool cluster_client_t::check_rw(cluster_op_t *op)
     {
         op->flags |= OP_IMMEDIATE_COMMIT;
     }
-    if ((op->opcode == OSD_OP_WRITE || op->opcode == OSD_OP_DELETE) && !(op->flags & OSD_OP_IGNORE_READONLY))
+    if ((op->opcode == OSD_OP_WRITE || op->opcode == OSD_OP_DELETE || op->opcode == OSD_OP_COPY) &&
+        !(op->flags & OSD_OP_IGNORE_READONLY))
     {
         auto ino_it = st_cli.inode_config.find(op->inode);
         if (ino_it != st_cli.inode_config.end() && ino_it->second.readonly)
@@ -731,7 +735,8 @@ resume_0:
     // Slice the operation into parts
     slice_rw(op);
     op->needs_reslice = false;
-    if ((op->opcode == OSD_OP_WRITE || op->opcode == OSD_OP_DELETE) && op->version && op->parts.size() > 1)
+    if ((op->opcode == OSD_OP_WRITE || op->opcode == OSD_OP_DELETE || op->opcode == OSD_OP_COPY) &&
+        op->version && op->parts.size() > 1)
     {
         // Atomic writes to multiple stripes are unsupported
         op->retval = -EINVAL;
@@ -974,7 +979,8 @@ void cluster_client_t::slice_rw(cluster_op_t *op)
                 op->parts[i].flags = PART_DONE;
             }
         }
-        else if (op->opcode != OSD_OP_READ_BITMAP && op->opcode != OSD_OP_READ_CHAIN_BITMAP && op->opcode != OSD_OP_DELETE)
+        else if (op->opcode != OSD_OP_READ_BITMAP && op->opcode != OSD_OP_READ_CHAIN_BITMAP && op->opcode != OSD_OP_DELETE &&
+            op->opcode != OSD_OP_COPY)
         {
             add_iov(end-begin, false, op, iov_idx, iov_pos, op->parts[i].iov, NULL, 0);
         }
@@ -1033,7 +1039,8 @@ bool cluster_client_t::try_send(cluster_op_t *op, int i)
             uint64_t meta_rev = 0;
             if (op->opcode != OSD_OP_READ_BITMAP && op->opcode != OSD_OP_READ_CHAIN_BITMAP && op->opcode != OSD_OP_DELETE)
             {
-                auto ino_it = st_cli.inode_config.find(op->inode);
+                // Copy reads the source inode through its parents
+                auto ino_it = st_cli.inode_config.find(op->opcode == OSD_OP_COPY ? op->src_inode : op->inode);
                 if (ino_it != st_cli.inode_config.end())
                     meta_rev = ino_it->second.mod_revision;
             }
@@ -1061,6 +1068,11 @@ bool cluster_client_t::try_send(cluster_op_t *op, int i)
                     handle_op_part(part);
                 },
             };
+            if (op->opcode == OSD_OP_COPY)
+            {
+                part->op.req.copy.src_inode = op->src_inode;
+                part->op.req.copy.flags = op->version ? OSD_COPY_CAS : 0;
+            }
             part->op.iov = part->iov;
             msgr.outbox_push(&part->op);
             return true;
@@ -1232,7 +1244,8 @@ void cluster_client_t::handle_op_part(cluster_op_part_t *part)
     {
         // OK
         op->inflight_count--;
-        if ((op->opcode == OSD_OP_WRITE || op->opcode == OSD_OP_DELETE) && !(op->flags & OP_IMMEDIATE_COMMIT))
+        if ((op->opcode == OSD_OP_WRITE || op->opcode == OSD_OP_DELETE || op->opcode == OSD_OP_COPY) &&
+            !(op->flags & OP_IMMEDIATE_COMMIT))
             dirty_osds.insert(part->osd_num);
         part->flags |= PART_DONE;
         op->done_count++;
@@ -1245,6 +1258,10 @@ void cluster_client_t::handle_op_part(cluster_op_part_t *part)
         {
             op->version = op->parts.size() == 1 ? part->op.reply.rw.version : 0;
         }
+        else if (op->opcode == OSD_OP_COPY)
+        {
+            op->version = op->parts.size() == 1 ? part->op.reply.copy.version : 0;
+        }
         if (op->inflight_count == 0 && !op->retry_after)
         {
             if (op->opcode == OSD_OP_SYNC)
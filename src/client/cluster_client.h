@@ -11,6 +11,8 @@
 #define DEFAULT_CLIENT_MAX_BUFFERED_BYTES 32*1024*1024
 #define DEFAULT_CLIENT_MAX_BUFFERED_OPS 1024
 #define DEFAULT_CLIENT_MAX_WRITEBACK_IODEPTH 256
+#define DEFAULT_DIFF_PARALLEL_PGS 32
+#define DEFAULT_DIFF_PARALLEL_OPS 128
 #define INODE_LIST_DONE 1
 #define INODE_LIST_HAS_UNSTABLE 2
 #define OSD_OP_READ_BITMAP OSD_OP_SEC_READ_BMP
@@ -34,17 +36,22 @@ struct cluster_op_part_t
 
 struct cluster_op_t
 {
-    uint64_t opcode; // OSD_OP_READ, OSD_OP_WRITE, OSD_OP_SYNC, OSD_OP_DELETE, OSD_OP_READ_BITMAP, OSD_OP_READ_CHAIN_BITMAP
+    uint64_t opcode; // OSD_OP_READ, OSD_OP_WRITE, OSD_OP_SYNC, OSD_OP_DELETE, OSD_OP_READ_BITMAP, OSD_OP_READ_CHAIN_BITMAP, OSD_OP_COPY
     uint64_t inode;
     uint64_t offset;
     uint64_t len;
+    // for OSD_OP_COPY: inode to copy data from (read through its parents from the same pool)
+    // to <inode> at the same offset. It must be in the same pool. Copy is done by OSDs and
+    // doesn't see data buffered in the client's writeback cache
+    uint64_t src_inode = 0;
     // for reads and writes within a single object (stripe),
     // reads can return current version and writes can use "CAS" semantics
+    // non-zero version for OSD_OP_COPY means that OSDs should use "CAS" writes
     uint64_t version = 0;
     // now only OSD_OP_IGNORE_READONLY is supported
     uint64_t flags = 0;
     // negative retval is an error number
-    // write and read return len on success
+    // write, read and copy return len on success
     // sync and delete return 0 on success
     // read_bitmap and read_chain_bitmap return the length of bitmap in bits(!)
     int retval;
@@ -72,6 +79,13 @@ protected:
 
 struct inode_list_t;
 struct inode_list_osd_t;
+struct inode_diff_t;
+struct inode_diff_pg_t;
+
+struct inode_extent_t
+{
+    uint64_t offset, len;
+};
 class writeback_cache_t;
 
 // FIXME: Split into public and private interfaces
@@ -140,6 +154,11 @@ public:
     int list_pg_count(inode_list_t *lst);
     const std::vector<osd_num_t> & list_inode_get_inactive_osds(inode_list_t *lst);
     void list_inode_next(inode_list_t *lst, int next_pgs);
+    // Calculate extents of <to_inode> which may differ from <from_inode> (its ancestor),
+    // i.e. all extents written in layers after <from_inode>. from_inode == 0 means all allocated extents.
+    // Extents are reported PG by PG, sorted and merged within each call, and the last call has done = true
+    void diff_inode(inode_t from_inode, inode_t to_inode, int parallel_pgs, int parallel_ops,
+        std::function<void(int status, bool done, std::vector<inode_extent_t> && extents)> callback);
     //inline uint32_t get_bs_bitmap_granularity() { return st_cli.global_bitmap_granularity; }
     //inline uint64_t get_bs_block_size() { return st_cli.global_block_size; }
     uint64_t next_op_id();
@@ -168,6 +187,9 @@ protected:
     void continue_listing(inode_list_t *lst);
     void send_list(inode_list_osd_t *cur_list);
     void continue_raw_ops(osd_num_t peer_osd);
+    void diff_list_pool(inode_diff_t *d);
+    void continue_diff(inode_diff_t *d);
+    void diff_read_bitmap(inode_diff_t *d, inode_diff_pg_t *pg, object_id obj);
 
     friend class writeback_cache_t;
 };
@@ -0,0 +1,277 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#include <algorithm>
+#include "cluster_client.h"
+
+struct inode_diff_pg_t
+{
+    int listed = 0;
+    int in_flight = 0;
+    std::set<object_id> objects;
+    std::set<object_id>::iterator pos;
+    std::vector<inode_extent_t> extents;
+};
+
+struct inode_diff_t
+{
+    std::vector<inode_t> layers;
+    uint64_t size = 0;
+    int parallel_pgs = 0, parallel_ops = 0;
+    // Layers of the pool which is currently being processed
+    int next_layer = 0;
+    int pool_layers = 0;
+    std::vector<inode_list_t*> lists;
+    int lists_todo = 0;
+    int in_flight = 0;
+    int errcode = 0;
+    bool submitting = false, repeat = false;
+    std::map<pg_num_t, inode_diff_pg_t> pgs;
+    std::function<void(int status, bool done, std::vector<inode_extent_t> && extents)> callback;
+};
+
+// Changed block tracking for incremental backups: every layer between <from_inode>
+// and <to_inode> only contains data written after <from_inode> was snapshotted, so
+// the difference is the union of bitmaps of all objects of these layers.
+// Images may be huge, so the difference is calculated and reported PG by PG: all
+// layers of the same pool are listed in lockstep, objects of a PG are kept only until
+// it's listed in all layers and their bitmaps are read, and the next PG is only
+// requested after that. So only about <parallel_pgs> PGs are held in memory.
+void cluster_client_t::diff_inode(inode_t from_inode, inode_t to_inode, int parallel_pgs, int parallel_ops,
+    std::function<void(int status, bool done, std::vector<inode_extent_t> && extents)> callback)
+{
+    auto to_it = st_cli.inode_config.find(to_inode);
+    if (to_it == st_cli.inode_config.end() ||
+        from_inode && st_cli.inode_config.find(from_inode) == st_cli.inode_config.end())
+    {
+        callback(-ENOENT, true, {});
+        return;
+    }
+    inode_diff_t *d = new inode_diff_t;
+    d->size = to_it->second.size;
+    d->parallel_pgs = parallel_pgs > 0 ? parallel_pgs : 1;
+    d->parallel_ops = parallel_ops > 0 ? parallel_ops : 1;
+    d->callback = callback;
+    inode_t cur = to_inode;
+    while (cur != from_inode)
+    {
+        auto it = st_cli.inode_config.find(cur);
+        if (it == st_cli.inode_config.end() ||
+            std::find(d->layers.begin(), d->layers.end(), cur) != d->layers.end())
+        {
+            // Broken or looped chain
+            delete d;
+            callback(-ENOENT, true, {});
+            return;
+        }
+        d->layers.push_back(cur);
+        cur = it->second.parent_id;
+        if (!cur && from_inode)
+        {
+            // <from_inode> is not an ancestor of <to_inode>
+            delete d;
+            callback(-EINVAL, true, {});
+            return;
+        }
+    }
+    // Layers of the same pool have the same PGs and are processed together
+    std::stable_sort(d->layers.begin(), d->layers.end(), [](inode_t a, inode_t b)
+    {
+        return INODE_POOL(a) < INODE_POOL(b);
+    });
+    init_msgr();
+    continue_diff(d);
+}
+
+void cluster_client_t::diff_list_pool(inode_diff_t *d)
+{
+    pool_id_t pool_id = INODE_POOL(d->layers[d->next_layer]);
+    d->lists.clear();
+    d->pool_layers = 0;
+    while (d->next_layer < d->layers.size() && INODE_POOL(d->layers[d->next_layer]) == pool_id)
+    {
+        inode_t layer = d->layers[d->next_layer++];
+        int list_idx = d->lists.size();
+        inode_list_t *lst = list_inode_start(layer, [this, d, list_idx](
+            inode_list_t *lst, std::set<object_id>&& objects, pg_num_t pg_num, osd_num_t primary_osd, int status)
+        {
+            auto & pg = d->pgs[pg_num];
+            if (!d->errcode)
+            {
+                for (object_id obj: objects)
+                {
+                    pg.objects.insert(obj);
+                }
+            }
+            pg.listed++;
+            if (pg.listed == d->pool_layers)
+            {
+                pg.pos = pg.objects.begin();
+            }
+            if (status & INODE_LIST_DONE)
+            {
+                // Lister is freed after the last PG
+                d->lists[list_idx] = NULL;
+                d->lists_todo--;
+            }
+            continue_diff(d);
+        });
+        if (!lst)
+        {
+            // Pool of this layer is deleted, so it doesn't contain any data
+            continue;
+        }
+        if (!list_pg_count(lst))
+        {
+            // All PGs are inactive
+            continue;
+        }
+        d->lists.push_back(lst);
+        d->pool_layers++;
+        d->lists_todo++;
+    }
+    for (auto lst: d->lists)
+    {
+        list_inode_next(lst, d->parallel_pgs);
+    }
+}
+
+void cluster_client_t::continue_diff(inode_diff_t *d)
+{
+    if (d->submitting)
+    {
+        // Operations may complete synchronously, don't let them finish the diff under us
+        d->repeat = true;
+        return;
+    }
+    d->submitting = true;
+    do
+    {
+        d->repeat = false;
+        if (!d->lists_todo && !d->pgs.size() && !d->in_flight && d->next_layer < d->layers.size())
+        {
+            diff_list_pool(d);
+            d->repeat = true;
+            continue;
+        }
+        auto pg_it = d->pgs.begin();
+        while (pg_it != d->pgs.end())
+        {
+            auto & pg = pg_it->second;
+            if (pg.listed < d->pool_layers)
+            {
+                // Not listed in all layers yet
+                pg_it++;
+                continue;
+            }
+            while (!d->errcode && d->in_flight < d->parallel_ops && pg.pos != pg.objects.end())
+            {
+                object_id obj = *pg.pos;
+                pg.pos++;
+                diff_read_bitmap(d, &pg, obj);
+            }
+            if (pg.in_flight > 0 || !d->errcode && pg.pos != pg.objects.end())
+            {
+                pg_it++;
+                continue;
+            }
+            // PG is finished, merge overlapping extents of different layers and report them
+            std::vector<inode_extent_t> merged;
+            if (!d->errcode)
+            {
+                std::sort(pg.extents.begin(), pg.extents.end(), [](const inode_extent_t & a, const inode_extent_t & b)
+                {
+                    return a.offset < b.offset;
+                });
+                for (auto & ext: pg.extents)
+                {
+                    if (merged.size() && merged.back().offset+merged.back().len >= ext.offset)
+                    {
+                        if (merged.back().offset+merged.back().len < ext.offset+ext.len)
+                            merged.back().len = ext.offset+ext.len-merged.back().offset;
+                    }
+                    else
+                        merged.push_back(ext);
+                }
+            }
+            d->pgs.erase(pg_it++);
+            if (merged.size())
+            {
+                d->callback(0, false, std::move(merged));
+            }
+            // Request the next PG. Listing is continued even after an error to free listers
+            for (auto lst: d->lists)
+            {
+                if (lst)
+                    list_inode_next(lst, 1);
+            }
+        }
+    } while (d->repeat);
+    d->submitting = false;
+    if (d->lists_todo || d->pgs.size() || d->in_flight || d->next_layer < d->layers.size())
+    {
+        return;
+    }
+    auto cb = std::move(d->callback);
+    int errcode = d->errcode;
+    delete d;
+    cb(errcode, true, {});
+}
+
+void cluster_client_t::diff_read_bitmap(inode_diff_t *d, inode_diff_pg_t *pg, object_id obj)
+{
+    auto & pool_cfg = st_cli.pool_config.at(INODE_POOL(obj.inode));
+    uint64_t block_size = pool_cfg.data_block_size *
+        (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
+    uint32_t granularity = pool_cfg.bitmap_granularity;
+    uint64_t offset = obj.stripe - obj.stripe % block_size;
+    if (offset >= d->size)
+    {
+        // Object is beyond the end of the image
+        return;
+    }
+    cluster_op_t *op = new cluster_op_t;
+    // Only read the bitmap of this exact layer, without parents
+    op->opcode = OSD_OP_READ_BITMAP;
+    op->inode = obj.inode;
+    op->offset = offset;
+    op->len = offset+block_size > d->size ? d->size-offset : block_size;
+    op->len = ((op->len + granularity - 1) / granularity) * granularity;
+    op->callback = [this, d, pg, granularity](cluster_op_t *op)
+    {
+        d->in_flight--;
+        pg->in_flight--;
+        if (op->retval < 0)
+        {
+            d->errcode = op->retval;
+        }
+        else
+        {
+            uint8_t *bitmap = (uint8_t*)op->bitmap_buf;
+            uint32_t bits = op->len / granularity;
+            uint32_t start = 0;
+            while (start < bits)
+            {
+                while (start < bits && !((bitmap[start >> 3] >> (start & 7)) & 1))
+                    start++;
+                uint32_t end = start;
+                while (end < bits && ((bitmap[end >> 3] >> (end & 7)) & 1))
+                    end++;
+                if (end > start && op->offset + start*granularity < d->size)
+                {
+                    uint64_t ext_offset = op->offset + start*granularity;
+                    uint64_t ext_len = (end-start)*granularity;
+                    if (ext_offset+ext_len > d->size)
+                        ext_len = d->size-ext_offset;
+                    pg->extents.push_back((inode_extent_t){ .offset = ext_offset, .len = ext_len });
+                }
+                start = end;
+            }
+        }
+        delete op;
+        continue_diff(d);
+    };
+    d->in_flight++;
+    pg->in_flight++;
+    execute(op);
+}
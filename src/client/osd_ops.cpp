@@ -23,4 +23,6 @@ const char* osd_op_names[] = {
     "sec_read_bmp",
     "scrub",
     "describe",
+    "delete_range",
+    "copy",
 };
@@ -31,7 +31,9 @@
 #define OSD_OP_SEC_READ_BMP         16
 #define OSD_OP_SCRUB                17
 #define OSD_OP_DESCRIBE             18
-#define OSD_OP_MAX                  18
+#define OSD_OP_DELETE_RANGE         19
+#define OSD_OP_COPY                 20
+#define OSD_OP_MAX                  20
 #define OSD_RW_MAX                  64*1024*1024
 #define OSD_PROTOCOL_VERSION        1
 #define OSD_OP_RECOVERY_RELATED     (uint32_t)1
@@ -279,6 +281,62 @@ struct __attribute__((__packed__)) osd_reply_describe_item_t
     osd_num_t osd_num;  // OSD number
 };
 
+// delete all objects of an inode in an offset range within one PG
+struct __attribute__((__packed__)) osd_op_delete_range_t
+{
+    osd_op_header_t header;
+    // inode
+    uint64_t inode;
+    // offset range [min_offset, max_offset), max_offset = 0 means no upper limit
+    uint64_t min_offset, max_offset;
+    // PG number
+    uint32_t pg_num;
+    // maximum number of objects deleted in parallel, 0 = default
+    uint32_t parallel;
+};
+
+struct __attribute__((__packed__)) osd_reply_delete_range_t
+{
+    osd_reply_header_t header;
+    // number of deleted objects
+    uint64_t deleted_count;
+    // number of objects which failed to be deleted
+    uint64_t error_count;
+};
+
+// copy data of an inode (read through its parents from the same pool) to another
+// inode of the same pool at the same offset (must be within individual stripe)
+// first fields are the same as in osd_op_rw_t
+struct __attribute__((__packed__)) osd_op_copy_t
+{
+    osd_op_header_t header;
+    // target inode
+    uint64_t inode;
+    // offset
+    uint64_t offset;
+    // length
+    uint32_t len;
+    // flags: OSD_COPY_CAS
+    uint32_t flags;
+    // source inode metadata revision
+    uint64_t meta_revision;
+    // source inode
+    uint64_t src_inode;
+};
+
+// "CAS" copy: only write data if the object isn't modified between read and write.
+// Only makes sense when src_inode == inode, i.e. when parents are merged into the child
+#define OSD_COPY_CAS 1
+
+struct __attribute__((__packed__)) osd_reply_copy_t
+{
+    osd_reply_header_t header;
+    // number of bytes actually written to the target
+    uint64_t written;
+    // target object version after the last write
+    uint64_t version;
+};
+
 // FIXME it would be interesting to try to unify blockstore_op and osd_op formats
 union osd_any_op_t
 {
@@ -293,6 +351,8 @@ union osd_any_op_t
     osd_op_rw_t rw;
     osd_op_sync_t sync;
     osd_op_describe_t describe;
+    osd_op_delete_range_t delete_range;
+    osd_op_copy_t copy;
     uint8_t buf[OSD_PACKET_SIZE];
 };
 
@@ -309,6 +369,8 @@ union osd_any_reply_t
     osd_reply_rw_t rw;
     osd_reply_sync_t sync;
     osd_reply_describe_t describe;
+    osd_reply_delete_range_t delete_range;
+    osd_reply_copy_t copy;
     uint8_t buf[OSD_PACKET_SIZE];
 };
 
@@ -321,6 +321,22 @@ void vitastor_c_read_bitmap(vitastor_c *client, uint64_t inode, uint64_t offset,
     client->cli->execute(op);
 }
 
+void vitastor_c_diff(vitastor_c *client, uint64_t from_inode, uint64_t to_inode, VitastorDiffHandler cb, void *opaque)
+{
+    client->cli->diff_inode(from_inode, to_inode, DEFAULT_DIFF_PARALLEL_PGS, DEFAULT_DIFF_PARALLEL_OPS,
+        [cb, opaque](int status, bool done, std::vector<inode_extent_t> && extents)
+    {
+        std::vector<uint64_t> pairs;
+        pairs.reserve(extents.size()*2);
+        for (auto & ext: extents)
+        {
+            pairs.push_back(ext.offset);
+            pairs.push_back(ext.len);
+        }
+        cb(opaque, status, done, pairs.data(), extents.size());
+    });
+}
+
 void vitastor_c_sync(vitastor_c *client, VitastorIOHandler cb, void *opaque)
 {
     cluster_op_t *op = new cluster_op_t;
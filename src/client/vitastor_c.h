@@ -7,7 +7,7 @@
 #define VITASTOR_QEMU_PROXY_H
 
 // C API wrapper version
-#define VITASTOR_C_API_VERSION 4
+#define VITASTOR_C_API_VERSION 5
 
 #ifndef POOL_ID_BITS
 #define POOL_ID_BITS 16
@@ -25,6 +25,9 @@ typedef struct vitastor_c vitastor_c;
 typedef void VitastorReadHandler(void *opaque, long retval, uint64_t version);
 typedef void VitastorIOHandler(void *opaque, long retval);
 typedef void VitastorReadBitmapHandler(void *opaque, long retval, uint8_t *bitmap);
+// extents are <count> pairs of (offset, length), only valid during the callback.
+// The handler is called once per PG with extents sorted within the call, then once more with done = 1
+typedef void VitastorDiffHandler(void *opaque, long retval, int done, uint64_t *extents, uint64_t count);
 
 // QEMU
 typedef void IOHandler(void *opaque);
@@ -57,6 +60,7 @@ void vitastor_c_write(vitastor_c *client, uint64_t inode, uint64_t offset, uint6
     struct iovec *iov, int iovcnt, VitastorIOHandler cb, void *opaque);
 void vitastor_c_read_bitmap(vitastor_c *client, uint64_t inode, uint64_t offset, uint64_t len,
     int with_parents, VitastorReadBitmapHandler cb, void *opaque);
+void vitastor_c_diff(vitastor_c *client, uint64_t from_inode, uint64_t to_inode, VitastorDiffHandler cb, void *opaque);
 void vitastor_c_sync(vitastor_c *client, VitastorIOHandler cb, void *opaque);
 void vitastor_c_watch_inode(vitastor_c *client, char *image, VitastorIOHandler cb, void *opaque);
 void vitastor_c_close_watch(vitastor_c *client, void *handle);
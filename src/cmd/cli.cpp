@@ -66,11 +66,43 @@ static const char* help_text =
     "  Flatten a layer, i.e. merge data and detach it from parents.\n"
     "\n"
     "vitastor-cli rm-data --pool <pool> --inode <inode> [--wait-list] [--min-offset <offset>]\n"
-    "  Remove inode data without changing metadata.\n"
-    "  --wait-list   Retrieve full objects listings before starting to remove objects.\n"
-    "                Requires more memory, but allows to show correct removal progress.\n"
+    "  Remove inode data without changing metadata. Objects are listed and removed\n"
+    "  by primary OSDs of each PG, the client only sends one request per PG.\n"
+    "  --wait-list   Retrieve full objects listings on the client before starting to remove\n"
+    "                objects and remove them one by one. Requires more memory and traffic,\n"
+    "                but allows to show correct removal progress.\n"
     "  --min-offset  Purge only data starting with specified offset.\n"
     "\n"
+    "vitastor-cli export <image> <file> [--fsync 0]\n"
+    "  Export image data (including parent layers) to a sparse raw file.\n"
+    "  Only allocated parts of the image are read and written, others become holes.\n"
+    "\n"
+    "vitastor-cli import <file> <image> [--force]\n"
+    "  Import a raw file or block device into an existing image of sufficient size.\n"
+    "  Holes and zero blocks are skipped, so the image must be empty and have no parent.\n"
+    "  With --force, import into any image: its old data then remains where the file has zeros.\n"
+    "\n"
+    "vitastor-cli diff [<from>] <to>\n"
+    "  Show extents of <to> changed since <from> as \"<offset> <length>\" lines, for incremental\n"
+    "  backups. <to> must be a child of <from>. Only object bitmaps of layers after <from>\n"
+    "  are read. Without <from>, show all allocated extents of <to> including its parents.\n"
+    "\n"
+    "vitastor-cli bench [--rw <mode>] [--bs 4k] [--iodepth 32] [--jobs 1] [--runtime 10] [OPTIONS]\n"
+    "  Run a benchmark through the cluster client on a temporary image and report IOPS,\n"
+    "  bandwidth and latency percentiles in total, per primary OSD and per PG (with --json).\n"
+    "  --rw MODE        read, write, randread, randwrite (default), rw or randrw\n"
+    "  --bs SIZE        Block size (default 4k)\n"
+    "  --iodepth N      Queue depth of each job (default 32)\n"
+    "  --jobs N         Number of parallel jobs, each with its own part of the image (default 1)\n"
+    "  --runtime SEC    Test duration in seconds (default 10)\n"
+    "  --rwmixread N    Percentage of reads for rw and randrw modes (default 50)\n"
+    "  --fsync N        Send a sync after every N writes of each job (default 0 = never)\n"
+    "  -p|--pool POOL   Create the temporary image in this pool\n"
+    "  -s|--size SIZE   Size of the temporary image (default 1G)\n"
+    "  --image NAME     Use an existing image instead of a temporary one. Careful: overwrites data!\n"
+    "  --prefill 0      Don't fill the temporary image with data before read tests\n"
+    "  --keep 1         Don't remove the temporary image after the test\n"
+    "\n"
     "vitastor-cli merge-data <from> <to> [--target <target>]\n"
     "  Merge layer data without changing metadata. Merge <from>..<to> to <target>.\n"
     "  <to> must be a child of <from> and <target> may be one of the layers between\n"
@@ -374,6 +406,45 @@ static int run(cli_tool_t *p, json11::Json::object cfg)
         }
         action_cb = p->start_rm(cfg);
     }
+    else if (cmd[0] == "export")
+    {
+        // Export image data to a file
+        if (cmd.size() > 1)
+        {
+            cfg["image"] = cmd[1];
+            if (cmd.size() > 2)
+                cfg["file"] = cmd[2];
+        }
+        action_cb = p->start_export(cfg);
+    }
+    else if (cmd[0] == "import")
+    {
+        // Import image data from a file
+        if (cmd.size() > 1)
+        {
+            cfg["file"] = cmd[1];
+            if (cmd.size() > 2)
+                cfg["image"] = cmd[2];
+        }
+        action_cb = p->start_import(cfg);
+    }
+    else if (cmd[0] == "diff")
+    {
+        // Show changed extents between a snapshot and its child
+        if (cmd.size() > 2)
+        {
+            cfg["from"] = cmd[1];
+            cfg["to"] = cmd[2];
+        }
+        else if (cmd.size() > 1)
+            cfg["to"] = cmd[1];
+        action_cb = p->start_diff(cfg);
+    }
+    else if (cmd[0] == "bench")
+    {
+        // Run a benchmark
+        action_cb = p->start_bench(cfg);
+    }
     else if (cmd[0] == "describe")
     {
         // Describe unclean objects
@@ -14,6 +14,10 @@ struct rm_inode_t;
 struct snap_merger_t;
 struct snap_flattener_t;
 struct snap_remover_t;
+struct image_exporter_t;
+struct image_importer_t;
+struct snap_differ_t;
+struct cluster_bench_t;
 
 class epoll_manager_t;
 class cluster_client_t;
@@ -55,6 +59,10 @@ public:
     friend struct snap_merger_t;
     friend struct snap_flattener_t;
     friend struct snap_remover_t;
+    friend struct image_exporter_t;
+    friend struct image_importer_t;
+    friend struct snap_differ_t;
+    friend struct cluster_bench_t;
 
     std::function<bool(cli_result_t &)> start_status(json11::Json);
     std::function<bool(cli_result_t &)> start_describe(json11::Json);
@@ -66,6 +74,10 @@ public:
     std::function<bool(cli_result_t &)> start_merge(json11::Json);
     std::function<bool(cli_result_t &)> start_flatten(json11::Json);
     std::function<bool(cli_result_t &)> start_rm(json11::Json);
+    std::function<bool(cli_result_t &)> start_export(json11::Json);
+    std::function<bool(cli_result_t &)> start_import(json11::Json);
+    std::function<bool(cli_result_t &)> start_diff(json11::Json);
+    std::function<bool(cli_result_t &)> start_bench(json11::Json);
     std::function<bool(cli_result_t &)> start_rm_osd(json11::Json cfg);
     std::function<bool(cli_result_t &)> start_alloc_osd(json11::Json cfg);
     std::function<bool(cli_result_t &)> start_pool_create(json11::Json);
@@ -0,0 +1,536 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#include <unistd.h>
+#include "cli.h"
+#include "cluster_client.h"
+#include "str_util.h"
+
+// Latencies below 16 us are counted exactly, larger ones in 8 buckets per power of 2
+#define BENCH_HIST_SIZE (16 + 60*8)
+
+static uint64_t bench_now_us()
+{
+    timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec*1000000 + tv.tv_nsec/1000;
+}
+
+struct bench_stat_t
+{
+    uint64_t ops = 0, bytes = 0, lat_sum = 0, lat_min = 0, lat_max = 0;
+    uint64_t hist[BENCH_HIST_SIZE] = {};
+
+    void add(uint64_t lat, uint64_t len)
+    {
+        if (!ops || lat_min > lat)
+            lat_min = lat;
+        if (lat_max < lat)
+            lat_max = lat;
+        ops++;
+        bytes += len;
+        lat_sum += lat;
+        int b = lat;
+        if (lat >= 16)
+        {
+            int e = 63 - __builtin_clzll(lat);
+            b = 16 + (e-4)*8 + ((lat >> (e-3)) & 7);
+        }
+        hist[b]++;
+    }
+
+    // Returns the middle of the histogram bucket which contains the percentile
+    uint64_t percentile(double p)
+    {
+        uint64_t want = ops*p, seen = 0;
+        for (int b = 0; b < BENCH_HIST_SIZE; b++)
+        {
+            seen += hist[b];
+            if (seen > want)
+            {
+                if (b < 16)
+                    return b;
+                int e = (b-16)/8 + 4;
+                return ((uint64_t)(8 + (b-16)%8) << (e-3)) + (((uint64_t)1 << (e-3)) >> 1);
+            }
+        }
+        return lat_max;
+    }
+
+    json11::Json to_json(uint64_t runtime_us)
+    {
+        return json11::Json::object {
+            { "ops", ops },
+            { "bytes", bytes },
+            { "iops", runtime_us ? ops*1000000/runtime_us : 0 },
+            { "bps", runtime_us ? bytes*1000000/runtime_us : 0 },
+            { "lat_usec", json11::Json::object {
+                { "avg", ops ? lat_sum/ops : 0 },
+                { "min", lat_min },
+                { "max", lat_max },
+                { "p50", percentile(0.5) },
+                { "p90", percentile(0.9) },
+                { "p99", percentile(0.99) },
+                { "p999", percentile(0.999) },
+            } },
+        };
+    }
+
+    std::string to_text(uint64_t runtime_us)
+    {
+        if (!runtime_us)
+            return "";
+        return std::to_string(ops*1000000/runtime_us)+" iops, "+format_size(bytes*1000000/runtime_us)+"/s, "+
+            "lat avg "+std::to_string(ops ? lat_sum/ops : 0)+" us, p50 "+std::to_string(percentile(0.5))+
+            " us, p99 "+std::to_string(percentile(0.99))+" us, max "+std::to_string(lat_max)+" us";
+    }
+};
+
+struct bench_rw_stat_t
+{
+    bench_stat_t read, write;
+
+    json11::Json to_json(uint64_t runtime_us)
+    {
+        json11::Json::object res;
+        if (read.ops)
+            res["read"] = read.to_json(runtime_us);
+        if (write.ops)
+            res["write"] = write.to_json(runtime_us);
+        return res;
+    }
+};
+
+struct bench_job_t
+{
+    uint64_t region_start = 0, region_size = 0, pos = 0;
+    uint64_t writes_since_sync = 0;
+    int in_flight = 0;
+    bool submitting = false;
+};
+
+// Built-in cluster benchmark, similar to fio with the cluster engine, but
+// without external dependencies. Creates a temporary image, runs the requested
+// workload for the specified time and reports IOPS, bandwidth and latency
+// percentiles in total, per primary OSD and per PG
+struct cluster_bench_t
+{
+    cli_tool_t *parent;
+
+    std::string image_name, pool;
+    bool temp_image = false, keep = false;
+    uint64_t size = 0, bs = 0, runtime_sec = 0, fsync = 0;
+    uint64_t rwmixread = 0;
+    bool random = false, prefill = true;
+    std::string rw;
+    int jobs = 1;
+
+    inode_config_t *image_cfg = NULL;
+    std::function<bool(cli_result_t &)> sub_cb;
+    uint8_t *write_buf = NULL, *read_buf = NULL;
+    std::vector<bench_job_t> job_list;
+    uint64_t prefill_pos = 0, prefill_block = 0;
+    uint64_t start_us = 0, end_us = 0, finish_us = 0, last_progress_us = 0;
+    int in_flight = 0;
+    std::string error;
+    bench_rw_stat_t total;
+    bench_stat_t sync_stat;
+    std::map<osd_num_t, bench_rw_stat_t> osd_stats;
+    std::map<pg_num_t, bench_rw_stat_t> pg_stats;
+
+    int state = 0;
+    cli_result_t result;
+
+    bool is_done()
+    {
+        return state == 100;
+    }
+
+    bool parse_rw()
+    {
+        random = rw.substr(0, 4) == "rand";
+        std::string mode = random ? rw.substr(4) : rw;
+        if (mode == "read")
+            rwmixread = 100;
+        else if (mode == "write")
+            rwmixread = 0;
+        else if (mode != "rw" && mode != "readwrite")
+            return false;
+        return true;
+    }
+
+    void start_bench()
+    {
+        if (!parse_rw())
+        {
+            result = (cli_result_t){
+                .err = EINVAL,
+                .text = "Unknown mode "+rw+", must be one of read, write, randread, randwrite, rw, randrw",
+            };
+            state = 100;
+            return;
+        }
+        if (!bs || bs % 512 || jobs < 1)
+        {
+            result = (cli_result_t){ .err = EINVAL, .text = "Block size must be a multiple of 512 and jobs must be at least 1" };
+            state = 100;
+            return;
+        }
+        if (image_name == "")
+        {
+            image_name = "bench-"+std::to_string(getpid());
+            temp_image = true;
+            sub_cb = parent->start_create(json11::Json::object {
+                { "image", image_name },
+                { "pool", pool },
+                { "size", std::to_string(size) },
+            });
+        }
+    }
+
+    void open_image()
+    {
+        image_cfg = parent->get_inode_cfg(image_name);
+        if (!image_cfg)
+        {
+            error = "Image "+image_name+" does not exist";
+            return;
+        }
+        size = image_cfg->size;
+        if (size < bs*jobs)
+        {
+            error = "Image "+image_name+" is too small for "+std::to_string(jobs)+" jobs with block size "+std::to_string(bs);
+            return;
+        }
+        auto & pool_cfg = parent->cli->st_cli.pool_config.at(INODE_POOL(image_cfg->num));
+        prefill_block = pool_cfg.data_block_size * (pool_cfg.scheme == POOL_SCHEME_REPLICATED
+            ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
+        uint64_t buf_size = bs > prefill_block ? bs : prefill_block;
+        write_buf = (uint8_t*)malloc_or_die(buf_size);
+        for (uint64_t i = 0; i < buf_size; i++)
+            write_buf[i] = rand();
+        read_buf = (uint8_t*)malloc_or_die(bs);
+        // Each job works with its own part of the image
+        uint64_t region = (size / jobs) / bs * bs;
+        job_list.resize(jobs);
+        for (int i = 0; i < jobs; i++)
+        {
+            job_list[i].region_start = region*i;
+            job_list[i].region_size = region;
+        }
+        // Reads from unallocated space don't touch disks, so fill only new images
+        prefill = prefill && temp_image && rwmixread > 0;
+    }
+
+    void prefill_next()
+    {
+        cluster_op_t *op = new cluster_op_t;
+        op->opcode = OSD_OP_WRITE;
+        op->inode = image_cfg->num;
+        op->offset = prefill_pos;
+        op->len = prefill_pos+prefill_block > size ? size-prefill_pos : prefill_block;
+        op->iov.push_back(write_buf, op->len);
+        op->callback = [this](cluster_op_t *op)
+        {
+            if (op->retval != op->len)
+                error = "Error writing image at offset "+std::to_string(op->offset)+": "+strerror(-op->retval);
+            delete op;
+            in_flight--;
+            parent->ringloop->wakeup();
+        };
+        prefill_pos += op->len;
+        in_flight++;
+        parent->cli->execute(op);
+    }
+
+    bool running()
+    {
+        if (finish_us)
+            return false;
+        if (error != "" || bench_now_us() >= end_us)
+        {
+            finish_us = bench_now_us();
+            return false;
+        }
+        return true;
+    }
+
+    void fill_job(bench_job_t *job)
+    {
+        job->submitting = true;
+        while ((uint64_t)job->in_flight < parent->iodepth && running())
+        {
+            submit_op(job);
+        }
+        job->submitting = false;
+        if (!in_flight)
+            parent->ringloop->wakeup();
+    }
+
+    void submit_op(bench_job_t *job)
+    {
+        cluster_op_t *op = new cluster_op_t;
+        if (fsync && job->writes_since_sync >= fsync)
+        {
+            job->writes_since_sync = 0;
+            op->opcode = OSD_OP_SYNC;
+            op->offset = op->len = 0;
+        }
+        else
+        {
+            op->opcode = (rwmixread == 100 || rwmixread > 0 && (uint64_t)(rand() % 100) < rwmixread)
+                ? OSD_OP_READ : OSD_OP_WRITE;
+            op->inode = image_cfg->num;
+            op->len = bs;
+            if (random)
+            {
+                uint64_t r = ((uint64_t)rand() << 31) ^ (uint64_t)rand();
+                op->offset = job->region_start + (r % (job->region_size / bs)) * bs;
+            }
+            else
+            {
+                if (job->pos+bs > job->region_size)
+                    job->pos = 0;
+                op->offset = job->region_start + job->pos;
+                job->pos += bs;
+            }
+            op->iov.push_back(op->opcode == OSD_OP_READ ? read_buf : write_buf, bs);
+            if (op->opcode == OSD_OP_WRITE)
+                job->writes_since_sync++;
+        }
+        // Attribute the operation to the PG and primary OSD of its first byte
+        pg_num_t pg_num = 0;
+        osd_num_t primary_osd = 0;
+        if (op->opcode != OSD_OP_SYNC)
+        {
+            auto & pool_cfg = parent->cli->st_cli.pool_config.at(INODE_POOL(image_cfg->num));
+            uint64_t stripe = (op->offset / prefill_block) * prefill_block;
+            pg_num = (stripe/pool_cfg.pg_stripe_size) % pool_cfg.real_pg_count + 1;
+            auto pg_it = pool_cfg.pg_config.find(pg_num);
+            if (pg_it != pool_cfg.pg_config.end())
+                primary_osd = pg_it->second.cur_primary;
+        }
+        uint64_t op_start = bench_now_us();
+        op->callback = [this, job, op_start, pg_num, primary_osd](cluster_op_t *op)
+        {
+            uint64_t lat = bench_now_us() - op_start;
+            if (op->retval != op->len)
+            {
+                error = op->opcode == OSD_OP_SYNC ? std::string("Error during sync: ")+strerror(-op->retval)
+                    : std::string("Error during ")+(op->opcode == OSD_OP_READ ? "read" : "write")+
+                        " at offset "+std::to_string(op->offset)+": "+strerror(-op->retval);
+            }
+            else if (op->opcode == OSD_OP_SYNC)
+            {
+                sync_stat.add(lat, 0);
+            }
+            else
+            {
+                bool is_read = op->opcode == OSD_OP_READ;
+                (is_read ? total.read : total.write).add(lat, op->len);
+                (is_read ? osd_stats[primary_osd].read : osd_stats[primary_osd].write).add(lat, op->len);
+                (is_read ? pg_stats[pg_num].read : pg_stats[pg_num].write).add(lat, op->len);
+            }
+            delete op;
+            job->in_flight--;
+            in_flight--;
+            report_progress();
+            if (!job->submitting)
+                fill_job(job);
+        };
+        job->in_flight++;
+        in_flight++;
+        parent->cli->execute(op);
+    }
+
+    void report_progress()
+    {
+        if (!parent->progress || parent->json_output)
+            return;
+        uint64_t now = bench_now_us();
+        if (now - last_progress_us < 1000000)
+            return;
+        last_progress_us = now;
+        fprintf(stderr, parent->color ? "\rRunning: %ju/%ju s, %ju read + %ju write ops"
+            : "Running: %ju/%ju s, %ju read + %ju write ops\n",
+            (now-start_us)/1000000, runtime_sec, total.read.ops, total.write.ops);
+    }
+
+    void make_result()
+    {
+        uint64_t runtime_us = finish_us - start_us;
+        json11::Json::object osds, pgs;
+        for (auto & sp: osd_stats)
+            osds[std::to_string(sp.first)] = sp.second.to_json(runtime_us);
+        for (auto & sp: pg_stats)
+            pgs[std::to_string(sp.first)] = sp.second.to_json(runtime_us);
+        json11::Json::object total_json = total.to_json(runtime_us).object_items();
+        if (sync_stat.ops)
+            total_json["sync"] = sync_stat.to_json(runtime_us);
+        std::string text = "Benchmark "+rw+" on "+image_name+": "+format_size(bs)+" blocks, "+
+            std::to_string(jobs)+" jobs x "+std::to_string(parent->iodepth)+" iodepth, "+
+            std::to_string(runtime_us/1000000)+" s\n";
+        if (total.read.ops)
+            text += "read:  "+total.read.to_text(runtime_us)+"\n";
+        if (total.write.ops)
+            text += "write: "+total.write.to_text(runtime_us)+"\n";
+        if (sync_stat.ops)
+            text += "sync:  "+sync_stat.to_text(runtime_us)+"\n";
+        for (auto & sp: osd_stats)
+        {
+            if (sp.second.read.ops)
+                text += "osd."+std::to_string(sp.first)+" read:  "+sp.second.read.to_text(runtime_us)+"\n";
+            if (sp.second.write.ops)
+                text += "osd."+std::to_string(sp.first)+" write: "+sp.second.write.to_text(runtime_us)+"\n";
+        }
+        result = (cli_result_t){
+            .text = text,
+            .data = json11::Json::object {
+                { "image", image_name },
+                { "rw", rw },
+                { "bs", bs },
+                { "iodepth", parent->iodepth },
+                { "jobs", jobs },
+                { "rwmixread", rwmixread },
+                { "fsync", fsync },
+                { "runtime_usec", runtime_us },
+                { "total", total_json },
+                { "osds", osds },
+                { "pgs", pgs },
+            },
+        };
+    }
+
+    void loop()
+    {
+        if (state == 1)
+            goto resume_1;
+        else if (state == 2)
+            goto resume_2;
+        else if (state == 3)
+            goto resume_3;
+        else if (state == 4)
+            goto resume_4;
+        else if (state == 100)
+            return;
+        start_bench();
+        if (state == 100)
+            return;
+        state = 1;
+    resume_1:
+        if (sub_cb)
+        {
+            // Wait for image creation
+            if (!sub_cb(result))
+                return;
+            sub_cb = NULL;
+            if (result.err)
+            {
+                state = 100;
+                return;
+            }
+        }
+        open_image();
+        state = 2;
+    resume_2:
+        // Fill the image with data for read tests
+        while (prefill && error == "" && prefill_pos < size && (uint64_t)in_flight < parent->iodepth*jobs)
+        {
+            prefill_next();
+        }
+        if (prefill && (in_flight > 0 || error == "" && prefill_pos < size))
+        {
+            return;
+        }
+        if (error == "")
+        {
+            start_us = last_progress_us = bench_now_us();
+            end_us = start_us + runtime_sec*1000000;
+            for (auto & job: job_list)
+            {
+                fill_job(&job);
+            }
+        }
+        state = 3;
+    resume_3:
+        if (in_flight > 0 || running())
+        {
+            return;
+        }
+        if (parent->progress && !parent->json_output && parent->color && last_progress_us > start_us)
+        {
+            fprintf(stderr, "\n");
+        }
+        if (error != "")
+            result = (cli_result_t){ .err = EIO, .text = error };
+        else
+            make_result();
+        if (temp_image && !keep)
+        {
+            sub_cb = parent->start_rm(json11::Json::object {
+                { "from", image_name },
+            });
+        }
+        state = 4;
+    resume_4:
+        if (sub_cb)
+        {
+            // Wait for temporary image removal
+            cli_result_t rm_result;
+            if (!sub_cb(rm_result))
+                return;
+            sub_cb = NULL;
+            if (rm_result.err)
+            {
+                fprintf(stderr, "Failed to remove temporary image %s: %s\n", image_name.c_str(), rm_result.text.c_str());
+            }
+        }
+        state = 100;
+    }
+};
+
+std::function<bool(cli_result_t &)> cli_tool_t::start_bench(json11::Json cfg)
+{
+    auto bench = new cluster_bench_t();
+    bench->parent = this;
+    bench->image_name = cfg["image"].string_value();
+    bench->pool = cfg["pool"].string_value();
+    bench->keep = cfg["keep"].bool_value();
+    bench->rw = cfg["rw"].string_value() != "" ? cfg["rw"].string_value() : "randwrite";
+    bench->rwmixread = cfg["rwmixread"].is_null() ? 50 : cfg["rwmixread"].uint64_value();
+    bench->jobs = cfg["jobs"].uint64_value() ? cfg["jobs"].uint64_value() : 1;
+    bench->runtime_sec = cfg["runtime"].uint64_value() ? cfg["runtime"].uint64_value() : 10;
+    bench->fsync = cfg["fsync"].uint64_value();
+    bench->prefill = cfg["prefill"].is_null() || cfg["prefill"].bool_value();
+    bench->bs = 4096;
+    bench->size = 1024*1024*1024;
+    bool ok = true;
+    if (cfg["bs"].string_value() != "")
+        bench->bs = parse_size(cfg["bs"].string_value(), &ok);
+    if (ok && cfg["size"].string_value() != "")
+        bench->size = parse_size(cfg["size"].string_value(), &ok);
+    if (!ok || bench->rwmixread > 100)
+    {
+        delete bench;
+        return [](cli_result_t & result)
+        {
+            result = (cli_result_t){ .err = EINVAL, .text = "Invalid syntax for --bs, --size or --rwmixread" };
+            return true;
+        };
+    }
+    return [bench](cli_result_t & result)
+    {
+        bench->loop();
+        if (bench->is_done())
+        {
+            result = bench->result;
+            if (bench->write_buf)
+                free(bench->write_buf);
+            if (bench->read_buf)
+                free(bench->read_buf);
+            delete bench;
+            return true;
+        }
+        return false;
+    };
+}
@@ -0,0 +1,152 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#include "cli.h"
+#include "cluster_client.h"
+
+// Show extents of an image or snapshot changed since its older snapshot,
+// for incremental backups (changed block tracking)
+struct snap_differ_t
+{
+    cli_tool_t *parent;
+
+    std::string from_name, to_name;
+    uint64_t changed = 0;
+    bool printed = false;
+
+    int state = 0;
+    cli_result_t result;
+
+    bool is_done()
+    {
+        return state == 100;
+    }
+
+    void loop()
+    {
+        if (state == 1)
+            goto resume_1;
+        else if (state == 100)
+            return;
+        start_diff();
+        if (state == 100)
+            return;
+        state = 1;
+    resume_1:
+        // Wait for the diff
+        return;
+    }
+
+    void start_diff()
+    {
+        if (to_name == "")
+        {
+            result = (cli_result_t){ .err = EINVAL, .text = "Image name is required" };
+            state = 100;
+            return;
+        }
+        inode_config_t *from_cfg = NULL;
+        if (from_name != "")
+        {
+            from_cfg = parent->get_inode_cfg(from_name);
+            if (!from_cfg)
+            {
+                result = (cli_result_t){ .err = ENOENT, .text = "Layer "+from_name+" does not exist" };
+                state = 100;
+                return;
+            }
+        }
+        inode_config_t *to_cfg = parent->get_inode_cfg(to_name);
+        if (!to_cfg)
+        {
+            result = (cli_result_t){ .err = ENOENT, .text = "Layer "+to_name+" does not exist" };
+            state = 100;
+            return;
+        }
+        state = 1;
+        parent->cli->diff_inode(from_cfg ? from_cfg->num : 0, to_cfg->num, parent->parallel_osds,
+            parent->iodepth*parent->parallel_osds, [this](int status, bool done, std::vector<inode_extent_t> && extents)
+        {
+            if (!done)
+            {
+                print_extents(extents);
+                return;
+            }
+            finish_diff(status);
+            parent->ringloop->wakeup();
+        });
+    }
+
+    // Extents are printed as they arrive, PG by PG, so that the whole list is never kept in memory
+    void print_extents(std::vector<inode_extent_t> & extents)
+    {
+        std::string out;
+        for (auto & ext: extents)
+        {
+            changed += ext.len;
+            if (parent->json_output)
+            {
+                out += (printed ? "," : "{\"from\":"+json11::Json(from_name).dump()+
+                    ",\"to\":"+json11::Json(to_name).dump()+",\"extents\":[");
+                out += json11::Json(json11::Json::object {
+                    { "offset", ext.offset },
+                    { "len", ext.len },
+                }).dump();
+            }
+            else
+                out += std::to_string(ext.offset)+" "+std::to_string(ext.len)+"\n";
+            printed = true;
+        }
+        fwrite(out.data(), 1, out.size(), stdout);
+    }
+
+    void finish_diff(int status)
+    {
+        state = 100;
+        if (parent->json_output)
+        {
+            // Close the streamed object even on error, the error is printed after it
+            std::string out = (printed ? "]" : "{\"from\":"+json11::Json(from_name).dump()+
+                ",\"to\":"+json11::Json(to_name).dump()+",\"extents\":[]");
+            if (status >= 0 || printed)
+            {
+                out += (status >= 0 ? ",\"changed_bytes\":"+std::to_string(changed) : std::string(""))+"}\n";
+                fwrite(out.data(), 1, out.size(), stdout);
+            }
+        }
+        fflush(stdout);
+        if (status == -EINVAL)
+        {
+            result = (cli_result_t){ .err = EINVAL, .text = "Layer "+to_name+" is not a child of "+from_name };
+            return;
+        }
+        if (status < 0)
+        {
+            result = (cli_result_t){
+                .err = -status,
+                .text = "Failed to calculate difference between "+from_name+" and "+to_name+": "+strerror(-status),
+            };
+            return;
+        }
+        result = (cli_result_t){};
+    }
+};
+
+std::function<bool(cli_result_t &)> cli_tool_t::start_diff(json11::Json cfg)
+{
+    auto differ = new snap_differ_t();
+    differ->parent = this;
+    differ->from_name = cfg["from"].string_value();
+    differ->to_name = cfg["to"].string_value();
+    return [differ](cli_result_t & result)
+    {
+        differ->loop();
+        if (differ->is_done())
+        {
+            result = differ->result;
+            delete differ;
+            return true;
+        }
+        return false;
+    };
+}
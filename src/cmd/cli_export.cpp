@@ -0,0 +1,300 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "cli.h"
+#include "cluster_client.h"
+#include "cpp-btree/safe_btree_set.h"
+
+// Export an image (with all its parents) into a sparse raw file.
+// Only objects which exist in some layer are read, and only ranges present
+// in the read bitmap are written, everything else is left as holes
+struct image_exporter_t
+{
+    cli_tool_t *parent;
+
+    std::string image_name, file_name;
+    bool fsync = true;
+
+    inode_config_t *image_cfg = NULL;
+    std::vector<inode_t> layers;
+    uint64_t block_size = 0;
+    uint32_t bitmap_granularity = 0;
+    int fd = -1;
+    int state = 0;
+    int lists_todo = 0;
+    btree::safe_btree_set<uint64_t> offsets;
+    btree::safe_btree_set<uint64_t>::iterator oit;
+    int in_flight = 0;
+    uint64_t processed = 0, to_process = 0, written = 0;
+    std::string error;
+
+    cli_result_t result;
+
+    bool is_done()
+    {
+        return state == 100;
+    }
+
+    void start_export()
+    {
+        if (image_name == "" || file_name == "")
+        {
+            result = (cli_result_t){ .err = EINVAL, .text = "Image name and file name are required" };
+            state = 100;
+            return;
+        }
+        image_cfg = parent->get_inode_cfg(image_name);
+        if (!image_cfg)
+        {
+            result = (cli_result_t){ .err = ENOENT, .text = "Image "+image_name+" does not exist" };
+            state = 100;
+            return;
+        }
+        // Collect the whole chain of parents, their objects are also visible through the image
+        inode_config_t *cur = image_cfg;
+        layers.push_back(cur->num);
+        while (cur->parent_id != 0 && cur->parent_id != image_cfg->num)
+        {
+            auto it = parent->cli->st_cli.inode_config.find(cur->parent_id);
+            if (it == parent->cli->st_cli.inode_config.end())
+            {
+                result = (cli_result_t){
+                    .err = ENOENT,
+                    .text = "Parent inode of layer "+cur->name+" (id "+std::to_string(cur->parent_id)+") does not exist",
+                };
+                state = 100;
+                return;
+            }
+            cur = &it->second;
+            layers.push_back(cur->num);
+        }
+        block_size = get_block_size(image_cfg->num, &bitmap_granularity);
+        fd = open(file_name.c_str(), O_WRONLY|O_CREAT, 0644);
+        if (fd < 0)
+        {
+            result = (cli_result_t){ .err = errno, .text = "Failed to open "+file_name+": "+strerror(errno) };
+            state = 100;
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+        {
+            result = (cli_result_t){ .err = EINVAL, .text = file_name+" is not a regular file" };
+            state = 100;
+            return;
+        }
+        // Recreate file contents as holes
+        if (ftruncate(fd, 0) < 0 || ftruncate(fd, image_cfg->size) < 0)
+        {
+            result = (cli_result_t){ .err = errno, .text = "Failed to truncate "+file_name+": "+strerror(errno) };
+            state = 100;
+            return;
+        }
+    }
+
+    uint64_t get_block_size(inode_t inode, uint32_t *bitmap_granularity)
+    {
+        auto & pool_cfg = parent->cli->st_cli.pool_config.at(INODE_POOL(inode));
+        uint64_t pg_data_size = (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
+        if (bitmap_granularity)
+            *bitmap_granularity = pool_cfg.bitmap_granularity;
+        return pool_cfg.data_block_size * pg_data_size;
+    }
+
+    void list_layers()
+    {
+        for (inode_t src: layers)
+        {
+            if (parent->cli->st_cli.pool_config.find(INODE_POOL(src)) == parent->cli->st_cli.pool_config.end())
+            {
+                continue;
+            }
+            uint64_t layer_block = get_block_size(src, NULL);
+            lists_todo++;
+            inode_list_t* lst = parent->cli->list_inode_start(src, [this, src, layer_block](
+                inode_list_t *lst, std::set<object_id>&& objects, pg_num_t pg_num, osd_num_t primary_osd, int status)
+            {
+                for (object_id obj: objects)
+                {
+                    uint64_t start = obj.stripe - obj.stripe % block_size;
+                    for (uint64_t i = 0; i < layer_block && start+i < image_cfg->size; i += block_size)
+                    {
+                        offsets.insert(start+i);
+                    }
+                }
+                if (status & INODE_LIST_DONE)
+                {
+                    lists_todo--;
+                    parent->ringloop->wakeup();
+                }
+                else
+                {
+                    parent->cli->list_inode_next(lst, 1);
+                }
+            });
+            parent->cli->list_inode_next(lst, parent->parallel_osds);
+        }
+    }
+
+    void read_block(uint64_t offset)
+    {
+        cluster_op_t *op = new cluster_op_t;
+        op->opcode = OSD_OP_READ;
+        op->inode = image_cfg->num;
+        op->offset = offset;
+        op->len = offset+block_size > image_cfg->size ? image_cfg->size-offset : block_size;
+        // Image size may be unaligned, extra data is then just not written
+        op->len = ((op->len + bitmap_granularity - 1) / bitmap_granularity) * bitmap_granularity;
+        void *buf = malloc_or_die(op->len);
+        op->iov.push_back(buf, op->len);
+        op->callback = [this, buf](cluster_op_t *op)
+        {
+            if (op->retval != op->len)
+            {
+                error = "Error reading image at offset "+std::to_string(op->offset)+": "+strerror(-op->retval);
+            }
+            else
+            {
+                write_set_ranges(op, (uint8_t*)buf);
+            }
+            free(buf);
+            delete op;
+            in_flight--;
+            parent->ringloop->wakeup();
+        };
+        parent->cli->execute(op);
+    }
+
+    // Write only ranges which are present in the image, leave holes in place of others
+    void write_set_ranges(cluster_op_t *op, uint8_t *buf)
+    {
+        uint32_t bits = op->len / bitmap_granularity;
+        uint32_t start = 0;
+        while (start < bits && error == "")
+        {
+            while (start < bits && !((((uint8_t*)op->bitmap_buf)[start >> 3] >> (start & 7)) & 1))
+                start++;
+            uint32_t end = start;
+            while (end < bits && ((((uint8_t*)op->bitmap_buf)[end >> 3] >> (end & 7)) & 1))
+                end++;
+            if (end > start)
+            {
+                uint64_t pos = start*bitmap_granularity, len = (end-start)*bitmap_granularity;
+                if (op->offset+pos+len > image_cfg->size)
+                    len = op->offset+pos < image_cfg->size ? image_cfg->size-op->offset-pos : 0;
+                while (len > 0)
+                {
+                    ssize_t r = pwrite(fd, buf+pos, len, op->offset+pos);
+                    if (r < 0 && errno != EINTR)
+                    {
+                        error = "Error writing "+file_name+": "+strerror(errno);
+                        return;
+                    }
+                    if (r > 0)
+                    {
+                        pos += r;
+                        len -= r;
+                        written += r;
+                    }
+                }
+            }
+            start = end;
+        }
+    }
+
+    void loop()
+    {
+        if (state == 1)
+            goto resume_1;
+        else if (state == 2)
+            goto resume_2;
+        else if (state == 100)
+            return;
+        start_export();
+        if (state == 100)
+            return;
+        list_layers();
+        state = 1;
+    resume_1:
+        if (lists_todo > 0)
+        {
+            // Wait for listings
+            return;
+        }
+        state = 2;
+        oit = offsets.begin();
+        to_process = offsets.size();
+    resume_2:
+        while (in_flight < parent->iodepth*parent->parallel_osds && oit != offsets.end() && error == "")
+        {
+            in_flight++;
+            uint64_t offset = *oit;
+            oit++;
+            processed++;
+            read_block(offset);
+            if (parent->progress && !(processed % 128))
+            {
+                fprintf(stderr, parent->color
+                    ? "\rExporting blocks: %ju/%ju"
+                    : "Exporting blocks: %ju/%ju\n", processed, to_process);
+            }
+        }
+        if (in_flight > 0 || oit != offsets.end() && error == "")
+        {
+            // Wait for reads
+            return;
+        }
+        if (parent->progress && to_process > 0)
+        {
+            fprintf(stderr, parent->color
+                ? "\rExporting blocks: %ju/%ju\n"
+                : "Exporting blocks: %ju/%ju\n", processed, to_process);
+        }
+        if (error == "" && fsync && ::fsync(fd) < 0)
+        {
+            error = "Error syncing "+file_name+": "+strerror(errno);
+        }
+        if (error != "")
+        {
+            result = (cli_result_t){ .err = EIO, .text = error };
+        }
+        else
+        {
+            result = (cli_result_t){
+                .text = "Done, image "+image_name+" exported to "+file_name,
+                .data = json11::Json::object {
+                    { "image", image_name },
+                    { "file", file_name },
+                    { "size", image_cfg->size },
+                    { "written", written },
+                },
+            };
+        }
+        state = 100;
+    }
+};
+
+std::function<bool(cli_result_t &)> cli_tool_t::start_export(json11::Json cfg)
+{
+    auto exporter = new image_exporter_t();
+    exporter->parent = this;
+    exporter->image_name = cfg["image"].string_value();
+    exporter->file_name = cfg["file"].string_value();
+    exporter->fsync = cfg["fsync"].is_null() || cfg["fsync"].uint64_value() != 0;
+    return [exporter](cli_result_t & result)
+    {
+        exporter->loop();
+        if (exporter->is_done())
+        {
+            if (exporter->fd >= 0)
+                close(exporter->fd);
+            result = exporter->result;
+            delete exporter;
+            return true;
+        }
+        return false;
+    };
+}
@@ -0,0 +1,382 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "cli.h"
+#include "cluster_client.h"
+
+struct import_block_t
+{
+    void *buf = NULL;
+    int todo = 0;
+};
+
+// Import a raw file or block device into an existing image.
+// Holes of the file are skipped using SEEK_DATA/SEEK_HOLE and only non-zero
+// parts of data are written, so the image must be empty and have no parent,
+// otherwise old data would remain where the file has zeros. It's checked
+// with one listing pass unless --force is given
+struct image_importer_t
+{
+    cli_tool_t *parent;
+
+    std::string file_name, image_name;
+    bool force = false;
+    bool listed = false, has_objects = false;
+
+    inode_config_t *image_cfg = NULL;
+    uint64_t block_size = 0;
+    uint32_t bitmap_granularity = 0;
+    int fd = -1;
+    uint64_t file_size = 0;
+    uint64_t pos = 0, data_end = 0;
+    int state = 0;
+    int in_flight = 0;
+    uint64_t written = 0, last_progress = 0;
+    std::string error;
+
+    cli_result_t result;
+
+    bool is_done()
+    {
+        return state == 100;
+    }
+
+    void start_import()
+    {
+        if (image_name == "" || file_name == "")
+        {
+            result = (cli_result_t){ .err = EINVAL, .text = "File name and image name are required" };
+            state = 100;
+            return;
+        }
+        image_cfg = parent->get_inode_cfg(image_name);
+        if (!image_cfg)
+        {
+            result = (cli_result_t){ .err = ENOENT, .text = "Image "+image_name+" does not exist" };
+            state = 100;
+            return;
+        }
+        fd = open(file_name.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            result = (cli_result_t){ .err = errno, .text = "Failed to open "+file_name+": "+strerror(errno) };
+            state = 100;
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0)
+        {
+            result = (cli_result_t){ .err = errno, .text = "Failed to stat "+file_name+": "+strerror(errno) };
+            state = 100;
+            return;
+        }
+        if (S_ISBLK(st.st_mode))
+        {
+            if (ioctl(fd, BLKGETSIZE64, &file_size) < 0)
+            {
+                result = (cli_result_t){ .err = errno, .text = "Failed to get size of "+file_name+": "+strerror(errno) };
+                state = 100;
+                return;
+            }
+        }
+        else
+            file_size = st.st_size;
+        if (file_size > image_cfg->size)
+        {
+            result = (cli_result_t){
+                .err = ENOSPC,
+                .text = "Image "+image_name+" is smaller than "+file_name+" ("+
+                    std::to_string(image_cfg->size)+" < "+std::to_string(file_size)+" bytes), resize it first",
+            };
+            state = 100;
+            return;
+        }
+        auto & pool_cfg = parent->cli->st_cli.pool_config.at(INODE_POOL(image_cfg->num));
+        bitmap_granularity = pool_cfg.bitmap_granularity;
+        block_size = pool_cfg.data_block_size * (pool_cfg.scheme == POOL_SCHEME_REPLICATED
+            ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
+        if (force)
+        {
+            listed = true;
+            return;
+        }
+        if (image_cfg->parent_id)
+        {
+            result = (cli_result_t){
+                .err = EINVAL,
+                .text = "Image "+image_name+" has a parent, its data would remain where "+file_name+
+                    " has zeros. Use --force to import anyway",
+            };
+            state = 100;
+            return;
+        }
+        inode_list_t *lister = parent->cli->list_inode_start(image_cfg->num, [this](inode_list_t *lst,
+            std::set<object_id>&& objects, pg_num_t pg_num, osd_num_t primary_osd, int status)
+        {
+            if (objects.size())
+                has_objects = true;
+            if (status & INODE_LIST_DONE)
+            {
+                listed = true;
+                parent->ringloop->wakeup();
+            }
+            else
+                parent->cli->list_inode_next(lst, 1);
+        });
+        if (!lister)
+        {
+            result = (cli_result_t){
+                .err = EIO,
+                .text = "Failed to list objects of image "+image_name,
+            };
+            state = 100;
+            return;
+        }
+        parent->cli->list_inode_next(lister, parent->parallel_osds);
+    }
+
+    // Find the next data extent of the file, returns false at the end of the file
+    bool next_data()
+    {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        if (data < 0)
+        {
+            if (errno == ENXIO)
+            {
+                // No more data
+                return false;
+            }
+            // SEEK_DATA is not supported, treat everything as data
+            data_end = file_size;
+            return true;
+        }
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        data_end = hole < 0 ? file_size : hole;
+        pos = data - data % block_size;
+        return true;
+    }
+
+    static bool is_zero(const uint8_t *buf, size_t len)
+    {
+        for (size_t i = 0; i < len; i += sizeof(uint64_t))
+        {
+            if (*(const uint64_t*)(buf+i))
+                return false;
+        }
+        return true;
+    }
+
+    void import_block()
+    {
+        uint64_t len = block_size - pos % block_size;
+        if (len > file_size-pos)
+            len = file_size-pos;
+        uint64_t aligned_len = ((len + bitmap_granularity - 1) / bitmap_granularity) * bitmap_granularity;
+        import_block_t *blk = new import_block_t;
+        blk->buf = calloc_or_die(1, aligned_len);
+        uint64_t done = 0;
+        while (done < len)
+        {
+            ssize_t r = pread(fd, (uint8_t*)blk->buf+done, len-done, pos+done);
+            if (r < 0 && errno != EINTR || r == 0)
+            {
+                error = "Error reading "+file_name+" at offset "+std::to_string(pos+done)+": "+(r == 0 ? "unexpected EOF" : strerror(errno));
+                free(blk->buf);
+                delete blk;
+                return;
+            }
+            if (r > 0)
+                done += r;
+        }
+        // Write non-zero ranges
+        blk->todo = 1;
+        uint32_t start = 0, end = 0, bits = aligned_len / bitmap_granularity;
+        while (start < bits)
+        {
+            while (start < bits && is_zero((uint8_t*)blk->buf + start*bitmap_granularity, bitmap_granularity))
+                start++;
+            end = start;
+            while (end < bits && !is_zero((uint8_t*)blk->buf + end*bitmap_granularity, bitmap_granularity))
+                end++;
+            if (end > start)
+            {
+                blk->todo++;
+                write_range(blk, pos + start*bitmap_granularity, (uint8_t*)blk->buf + start*bitmap_granularity,
+                    (end-start)*bitmap_granularity);
+            }
+            start = end;
+        }
+        pos += len;
+        unref_block(blk);
+    }
+
+    void write_range(import_block_t *blk, uint64_t offset, uint8_t *buf, uint64_t len)
+    {
+        cluster_op_t *op = new cluster_op_t;
+        op->opcode = OSD_OP_WRITE;
+        op->inode = image_cfg->num;
+        op->offset = offset;
+        op->len = len;
+        op->iov.push_back(buf, len);
+        op->callback = [this, blk](cluster_op_t *op)
+        {
+            if (op->retval != op->len)
+            {
+                error = "Error writing image at offset "+std::to_string(op->offset)+": "+strerror(-op->retval);
+            }
+            else
+            {
+                written += op->len;
+            }
+            delete op;
+            in_flight--;
+            unref_block(blk);
+            parent->ringloop->wakeup();
+        };
+        in_flight++;
+        parent->cli->execute(op);
+    }
+
+    void unref_block(import_block_t *blk)
+    {
+        blk->todo--;
+        if (!blk->todo)
+        {
+            free(blk->buf);
+            delete blk;
+        }
+    }
+
+    void loop()
+    {
+        if (state == 1)
+            goto resume_1;
+        else if (state == 2)
+            goto resume_2;
+        else if (state == 3)
+            goto resume_3;
+        else if (state == 4)
+            goto resume_4;
+        else if (state == 100)
+            return;
+        start_import();
+        if (state == 100)
+            return;
+        state = 4;
+    resume_4:
+        if (!listed)
+        {
+            // Wait for the listing
+            return;
+        }
+        if (has_objects)
+        {
+            result = (cli_result_t){
+                .err = ENOTEMPTY,
+                .text = "Image "+image_name+" is not empty, its data would remain where "+file_name+
+                    " has zeros. Use --force to import anyway",
+            };
+            state = 100;
+            return;
+        }
+        state = 1;
+    resume_1:
+        while (in_flight < parent->iodepth*parent->parallel_osds && pos < file_size && error == "")
+        {
+            if (pos >= data_end && !next_data())
+            {
+                pos = file_size;
+                break;
+            }
+            import_block();
+            if (parent->progress && pos/(1024*1024*1024) != last_progress)
+            {
+                last_progress = pos/(1024*1024*1024);
+                fprintf(stderr, parent->color
+                    ? "\rImporting: %ju/%ju MB, %ju MB written"
+                    : "Importing: %ju/%ju MB, %ju MB written\n",
+                    pos/1024/1024, file_size/1024/1024, written/1024/1024);
+            }
+        }
+        if (in_flight > 0 || pos < file_size && error == "")
+        {
+            // Wait for writes
+            return;
+        }
+        if (parent->progress && file_size > 0)
+        {
+            fprintf(stderr, parent->color
+                ? "\rImporting: %ju/%ju MB, %ju MB written\n"
+                : "Importing: %ju/%ju MB, %ju MB written\n",
+                pos/1024/1024, file_size/1024/1024, written/1024/1024);
+        }
+        if (error == "")
+        {
+            cluster_op_t *op = new cluster_op_t;
+            op->opcode = OSD_OP_SYNC;
+            op->callback = [this](cluster_op_t *op)
+            {
+                if (op->retval != 0)
+                    error = std::string("Error syncing image: ")+strerror(-op->retval);
+                delete op;
+                state = 3;
+                parent->ringloop->wakeup();
+            };
+            state = 2;
+            parent->cli->execute(op);
+        }
+        else
+            state = 3;
+    resume_2:
+        if (state == 2)
+        {
+            // Wait for sync
+            return;
+        }
+    resume_3:
+        if (error != "")
+        {
+            result = (cli_result_t){ .err = EIO, .text = error };
+        }
+        else
+        {
+            result = (cli_result_t){
+                .text = "Done, "+file_name+" imported to image "+image_name,
+                .data = json11::Json::object {
+                    { "image", image_name },
+                    { "file", file_name },
+                    { "size", file_size },
+                    { "written", written },
+                },
+            };
+        }
+        state = 100;
+    }
+};
+
+std::function<bool(cli_result_t &)> cli_tool_t::start_import(json11::Json cfg)
+{
+    auto importer = new image_importer_t();
+    importer->parent = this;
+    importer->file_name = cfg["file"].string_value();
+    importer->image_name = cfg["image"].string_value();
+    importer->force = cfg["force"].bool_value();
+    return [importer](cli_result_t & result)
+    {
+        importer->loop();
+        if (importer->is_done())
+        {
+            if (importer->fd >= 0)
+                close(importer->fd);
+            result = importer->result;
+            delete importer;
+            return true;
+        }
+        return false;
+    };
+}
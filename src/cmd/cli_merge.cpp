@@ -39,6 +39,9 @@ struct snap_merger_t
     bool check_delete_source = false;
     // interval between fsyncs
     int fsync_interval = 128;
+    // copy data with OSD_OP_COPY on OSDs instead of reading and writing it
+    // (only possible when all layers are in the same pool)
+    bool server_copy = false;
 
     // -- STATE --
     inode_t target, to_num;
@@ -199,12 +202,23 @@ struct snap_merger_t
             use_cas = 0;
         }
         sources.erase(target);
+        // OSDs read layers through parents only within the same pool
+        server_copy = true;
+        for (auto & sp: sources)
+        {
+            if (INODE_POOL(sp.first) != INODE_POOL(target))
+            {
+                server_copy = false;
+                break;
+            }
+        }
         if (parent->progress)
         {
             printf(
-                "Merging %zd layer(s) into target %s%s (inode %ju in pool %u)\n",
+                "Merging %zd layer(s) into target %s%s%s (inode %ju in pool %u)\n",
                 sources.size(), target_cfg->name.c_str(),
-                use_cas ? " online (with CAS)" : "", INODE_NO_POOL(target), INODE_POOL(target)
+                use_cas ? " online (with CAS)" : "", server_copy ? " on OSDs" : "",
+                INODE_NO_POOL(target), INODE_POOL(target)
             );
         }
         target_block_size = get_block_size(target, &target_bitmap_granularity);
@@ -462,11 +476,57 @@ struct snap_merger_t
         // Initialize counter to 1 to later allow write_subop() to return immediately
         // (even though it shouldn't really do that)
         rwo->todo = 1;
-        rwo->buf = malloc(target_block_size);
         rwo->offset = offset;
+        if (server_copy)
+        {
+            rwo_copy(rwo);
+            return;
+        }
+        rwo->buf = malloc(target_block_size);
         rwo_read(rwo);
     }
 
+    // Copy <offset> from <to> to <target> on OSDs without transferring data to the client
+    void rwo_copy(snap_rw_op_t *rwo)
+    {
+        cluster_op_t *op = &rwo->op;
+        op->opcode = OSD_OP_COPY;
+        op->inode = target;
+        op->src_inode = to_num;
+        op->offset = rwo->offset;
+        op->len = target_block_size;
+        op->version = use_cas && to_num == target ? 1 : 0;
+        op->flags = OSD_OP_IGNORE_READONLY;
+        op->callback = [this, rwo](cluster_op_t *op)
+        {
+            if (op->retval == -EINVAL && server_copy)
+            {
+                // OSDs don't support OSD_OP_COPY, fall back to reading and writing
+                if (parent->progress)
+                    fprintf(stderr, "OSDs do not support server-side copy, copying data through the client\n");
+                server_copy = false;
+            }
+            if (op->retval == -EINVAL && !server_copy)
+            {
+                op->src_inode = 0;
+                op->version = 0;
+                op->flags = 0;
+                rwo->buf = malloc(target_block_size);
+                rwo_read(rwo);
+                return;
+            }
+            if (op->retval != op->len)
+            {
+                rwo->error_code = -op->retval;
+                rwo->error_offset = op->offset;
+                rwo->error_read = false;
+            }
+            rwo->todo--;
+            autofree_op(rwo);
+        };
+        parent->cli->execute(op);
+    }
+
     void rwo_read(snap_rw_op_t *rwo)
     {
         cluster_op_t *op = &rwo->op;
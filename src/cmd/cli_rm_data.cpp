@@ -3,6 +3,7 @@
 
 #include "cli.h"
 #include "cluster_client.h"
+#include "pg_states.h"
 
 #define RM_LISTING 1
 #define RM_REMOVING 2
@@ -20,6 +21,20 @@ struct rm_pg_t
     bool synced = false;
 };
 
+// PG deleted with one server-side OSD_OP_DELETE_RANGE request
+struct rm_range_pg_t
+{
+    pg_num_t pg_num;
+    osd_num_t rm_osd_num;
+    int state = 0;
+    bool synced = false;
+};
+
+#define RM_PG_PENDING 0
+#define RM_PG_DELETING 1
+#define RM_PG_SYNCING 2
+#define RM_PG_DONE 3
+
 struct rm_inode_t
 {
     uint64_t inode = 0;
@@ -30,6 +45,9 @@ struct rm_inode_t
     cli_tool_t *parent = NULL;
     inode_list_t *lister = NULL;
     std::vector<rm_pg_t*> lists;
+    std::vector<rm_range_pg_t> range_pgs;
+    int range_in_flight = 0, range_pgs_done = 0, skipped_pgs = 0;
+    bool range_unsupported = false;
     std::vector<osd_num_t> inactive_osds;
     uint64_t total_count = 0, total_done = 0, total_prev_pct = 0;
     uint64_t pgs_to_list = 0;
@@ -104,6 +122,182 @@ struct rm_inode_t
         parent->cli->list_inode_next(lister, parent->parallel_osds);
     }
 
+    // Delete PG by PG with OSD_OP_DELETE_RANGE: primary OSDs list and delete
+    // objects themselves, so the client only sends one request per PG
+    void start_range_delete()
+    {
+        auto pool_it = parent->cli->st_cli.pool_config.find(pool_id);
+        if (pool_it == parent->cli->st_cli.pool_config.end())
+        {
+            result = (cli_result_t){ .err = ENOENT, .text = "Pool "+std::to_string(pool_id)+" does not exist" };
+            state = 100;
+            return;
+        }
+        std::set<osd_num_t> inactive_osd_set;
+        for (auto & pg_item: pool_it->second.pg_config)
+        {
+            auto & pg = pg_item.second;
+            if (pg.pause || !pg.cur_primary || !(pg.cur_state & PG_ACTIVE))
+            {
+                skipped_pgs++;
+                if (parent->progress)
+                    fprintf(stderr, "PG %u is inactive, skipping\n", pg_item.first);
+                continue;
+            }
+            if (pg.cur_state != PG_ACTIVE)
+            {
+                // Objects on OSDs which are down are not deleted
+                for (auto & hist_item: pg.target_history)
+                    for (osd_num_t pg_osd: hist_item)
+                        if (pg_osd && parent->cli->st_cli.peer_states.find(pg_osd) == parent->cli->st_cli.peer_states.end())
+                            inactive_osd_set.insert(pg_osd);
+                for (osd_num_t pg_osd: pg.all_peers)
+                    if (pg_osd && parent->cli->st_cli.peer_states.find(pg_osd) == parent->cli->st_cli.peer_states.end())
+                        inactive_osd_set.insert(pg_osd);
+            }
+            range_pgs.push_back((rm_range_pg_t){
+                .pg_num = pg_item.first,
+                .rm_osd_num = pg.cur_primary,
+                .state = RM_PG_PENDING,
+                .synced = parent->cli->get_immediate_commit(inode),
+            });
+        }
+        inactive_osds.assign(inactive_osd_set.begin(), inactive_osd_set.end());
+        if (inactive_osds.size() && !parent->json_output)
+        {
+            fprintf(stderr, "Some data may remain after delete on OSDs which are currently down: ");
+            for (int i = 0; i < inactive_osds.size(); i++)
+            {
+                fprintf(stderr, i > 0 ? ", %ju" : "%ju", inactive_osds[i]);
+            }
+            fprintf(stderr, "\n");
+        }
+    }
+
+    void send_range_op(rm_range_pg_t *pg)
+    {
+        osd_op_t *op = new osd_op_t();
+        op->op_type = OSD_OP_OUT;
+        op->peer_fd = parent->cli->msgr.osd_peer_fds.at(pg->rm_osd_num);
+        if (pg->state == RM_PG_PENDING)
+        {
+            op->req = (osd_any_op_t){
+                .delete_range = {
+                    .header = {
+                        .magic = SECONDARY_OSD_OP_MAGIC,
+                        .id = parent->cli->next_op_id(),
+                        .opcode = OSD_OP_DELETE_RANGE,
+                    },
+                    .inode = inode,
+                    .min_offset = min_offset,
+                    .max_offset = 0,
+                    .pg_num = pg->pg_num,
+                    .parallel = (uint32_t)parent->iodepth,
+                },
+            };
+            pg->state = RM_PG_DELETING;
+        }
+        else
+        {
+            op->req = (osd_any_op_t){
+                .sync = {
+                    .header = {
+                        .magic = SECONDARY_OSD_OP_MAGIC,
+                        .id = parent->cli->next_op_id(),
+                        .opcode = OSD_OP_SYNC,
+                    },
+                },
+            };
+        }
+        op->callback = [this, pg](osd_op_t *op)
+        {
+            range_in_flight--;
+            if (op->req.hdr.opcode == OSD_OP_DELETE_RANGE)
+            {
+                if (op->reply.hdr.retval == -EINVAL)
+                {
+                    // Old OSD without OSD_OP_DELETE_RANGE
+                    range_unsupported = true;
+                    op->reply.delete_range.deleted_count = 0;
+                    op->reply.delete_range.error_count = 0;
+                }
+                total_done += op->reply.delete_range.deleted_count;
+                total_count += op->reply.delete_range.deleted_count + op->reply.delete_range.error_count;
+                if (op->reply.hdr.retval < 0 && !range_unsupported)
+                {
+                    fprintf(stderr, "Failed to remove objects from PG %u (OSD %ju) (retval=%jd)\n",
+                        pg->pg_num, pg->rm_osd_num, op->reply.hdr.retval);
+                    error_count++;
+                }
+                pg->state = pg->synced || op->reply.delete_range.deleted_count == 0 ? RM_PG_DONE : RM_PG_SYNCING;
+            }
+            else
+            {
+                if (op->reply.hdr.retval < 0)
+                {
+                    fprintf(stderr, "Failed to sync OSD %ju (retval=%jd)\n", pg->rm_osd_num, op->reply.hdr.retval);
+                    error_count++;
+                }
+                pg->state = RM_PG_DONE;
+            }
+            if (pg->state == RM_PG_DONE)
+                range_pgs_done++;
+            delete op;
+            continue_range_delete();
+        };
+        range_in_flight++;
+        parent->cli->msgr.outbox_push(op);
+    }
+
+    void continue_range_delete()
+    {
+        parent->cli->init_msgr();
+        for (auto & pg: range_pgs)
+        {
+            if (range_unsupported || range_in_flight >= parent->parallel_osds)
+                break;
+            if (pg.state != RM_PG_PENDING && pg.state != RM_PG_SYNCING)
+                continue;
+            if (parent->cli->msgr.osd_peer_fds.find(pg.rm_osd_num) == parent->cli->msgr.osd_peer_fds.end())
+            {
+                // Initiate connection
+                parent->cli->msgr.connect_peer(pg.rm_osd_num, parent->cli->st_cli.peer_states[pg.rm_osd_num]);
+                continue;
+            }
+            send_range_op(&pg);
+        }
+        if (parent->progress && range_pgs.size() > 0 && total_done != total_prev_pct)
+        {
+            fprintf(stderr, parent->color
+                ? "\rRemoved %ju objects, %zu/%zu PGs done..."
+                : "Removed %ju objects, %zu/%zu PGs done...\n", total_done, (size_t)range_pgs_done, range_pgs.size());
+            total_prev_pct = total_done;
+        }
+        if (range_in_flight > 0 || range_pgs_done < range_pgs.size() && !range_unsupported)
+        {
+            return;
+        }
+        if (parent->progress && range_pgs.size() > 0)
+        {
+            fprintf(stderr, "\n");
+        }
+        if (range_unsupported)
+        {
+            // Fall back to listing and deleting objects from the client
+            if (parent->progress)
+                fprintf(stderr, "Some OSDs do not support server-side range delete, removing objects one by one\n");
+            total_count = total_done = total_prev_pct = 0;
+            error_count = 0;
+            range_pgs.clear();
+            state = 1;
+            start_delete();
+            if (state != 100)
+                continue_delete();
+            return;
+        }
+        finish_delete(skipped_pgs > 0);
+    }
+
     void send_ops(rm_pg_t *cur_list)
     {
         parent->cli->init_msgr();
@@ -224,30 +418,35 @@ struct rm_inode_t
             {
                 fprintf(stderr, "\n");
             }
-            bool is_error = (total_done < total_count || inactive_osds.size() > 0 || error_count > 0);
-            if (parent->progress && is_error)
-            {
-                fprintf(
-                    stderr, "Warning: Pool:%u,ID:%ju inode data may not have been fully removed.\n"
-                    "Use `vitastor-cli rm-data --pool %u --inode %ju` if you encounter it in listings.\n",
-                    pool_id, INODE_NO_POOL(inode), pool_id, INODE_NO_POOL(inode)
-                );
-            }
-            result = (cli_result_t){
-                .err = is_error && !down_ok ? EIO : 0,
-                .text = is_error ? "Some blocks were not removed" : (
-                    "Done, inode "+std::to_string(INODE_NO_POOL(inode))+" from pool "+
-                    std::to_string(pool_id)+" removed"),
-                .data = json11::Json::object {
-                    { "removed_objects", total_done },
-                    { "total_objects", total_count },
-                    { "inactive_osds", inactive_osds },
-                },
-            };
-            state = 100;
+            finish_delete(false);
         }
     }
 
+    void finish_delete(bool skipped)
+    {
+        bool is_error = (total_done < total_count || inactive_osds.size() > 0 || error_count > 0 || skipped);
+        if (parent->progress && is_error)
+        {
+            fprintf(
+                stderr, "Warning: Pool:%u,ID:%ju inode data may not have been fully removed.\n"
+                "Use `vitastor-cli rm-data --pool %u --inode %ju` if you encounter it in listings.\n",
+                pool_id, INODE_NO_POOL(inode), pool_id, INODE_NO_POOL(inode)
+            );
+        }
+        result = (cli_result_t){
+            .err = is_error && !down_ok ? EIO : 0,
+            .text = is_error ? "Some blocks were not removed" : (
+                "Done, inode "+std::to_string(INODE_NO_POOL(inode))+" from pool "+
+                std::to_string(pool_id)+" removed"),
+            .data = json11::Json::object {
+                { "removed_objects", total_done },
+                { "total_objects", total_count },
+                { "inactive_osds", inactive_osds },
+            },
+        };
+        state = 100;
+    }
+
     bool is_done()
     {
         return state == 100;
@@ -257,6 +456,8 @@ struct rm_inode_t
     {
         if (state == 1)
             goto resume_1;
+        if (state == 2)
+            goto resume_2;
         if (state == 100)
             return;
         if (!pool_id)
@@ -265,6 +466,16 @@ struct rm_inode_t
             state = 100;
             return;
         }
+        if (!parent->list_first)
+        {
+            start_range_delete();
+            if (state == 100)
+                return;
+            state = 2;
+        resume_2:
+            continue_range_delete();
+            return;
+        }
         start_delete();
         if (state == 100)
             return;
@@ -39,8 +39,9 @@ public:
 
     std::function<void(int)> load_cb;
     bool loading_json = false, in_loadjson = false;
-    int load_state = 0;
+    int load_state = 0, load_res = 0;
     std::string load_key;
+    void *bulk_handle = NULL;
 
     ~kv_cli_t();
 
@@ -95,6 +96,15 @@ void kv_cli_t::parse_args(int narg, const char *args[])
                 "  dump [<start> [end]]\n"
                 "  dumpjson [<start> [end]]\n"
                 "  loadjson\n"
+                "  bulkload\n"
+                "  stats\n"
+                "  gc\n"
+                "  compact\n"
+                "\n"
+                "bulkload reads the same JSON as loadjson, but requires keys to be sorted\n"
+                "and the DB to be empty, and builds the tree bottom-up. Use it to restore dumps.\n"
+                "gc reclaims space of overwritten and deleted values stored outside of the tree.\n"
+                "compact merges underfull leaves and removes unneeded root levels.\n"
                 "\n"
                 "<IMAGE> should be the name of Vitastor image with the DB.\n"
                 "Without <COMMAND>, you get an interactive DB shell.\n"
@@ -102,18 +112,23 @@ void kv_cli_t::parse_args(int narg, const char *args[])
                 "OPTIONS:\n"
                 "  --kv_block_size 4k\n"
                 "    Key-value B-Tree block size\n"
+                "  --kv_block_format 2\n"
+                "    Block format for new writes. 2 = prefix-compressed keys with varint lengths,\n"
+                "    1 = old format, readable by older vitastor-kv versions\n"
+                "  --kv_value_separation 0\n"
+                "    Store values of at least this size outside of the tree to keep leaves small.\n"
+                "    Requires block format 2. 0 = disabled\n"
+                "  --kv_value_seal_timeout 600\n"
+                "    gc collects value segments left unsealed by crashed clients if they\n"
+                "    aren't written to for this number of seconds\n"
+                "  --kv_merge_fill 50\n"
+                "    Merge adjacent leaves during compaction if they fit into this percentage of a block\n"
+                "  --kv_auto_compact 0\n"
+                "    Merge leaves left underfull by deletes in background\n"
                 "  --kv_memory_limit 128M\n"
                 "    Maximum memory to use for vitastor-kv index cache\n"
                 "  --kv_allocate_blocks 4\n"
                 "    Number of PG blocks used for new tree block allocation in parallel\n"
-                "  --kv_evict_max_misses 10\n"
-                "    Eviction algorithm parameter: retry eviction from another random spot\n"
-                "    if this number of keys is used currently or was used recently\n"
-                "  --kv_evict_attempts_per_level 3\n"
-                "    Retry eviction at most this number of times per tree level, starting\n"
-                "    with bottom-most levels\n"
-                "  --kv_evict_unused_age 1000\n"
-                "    Evict only keys unused during this number of last operations\n"
                 "  --kv_log_level 1\n"
                 "    Log level. 0 = errors, 1 = warnings, 10 = trace operations\n"
                 ,
@@ -343,7 +358,21 @@ st_5:
         {
             loading_json = false;
             auto cb = std::move(load_cb);
-            cb(0);
+            if (bulk_handle)
+            {
+                auto handle = bulk_handle;
+                bulk_handle = NULL;
+                db->bulk_load_finish(handle, [this, cb](int res)
+                {
+                    if (res < 0)
+                        fprintf(stderr, "Error: %s (code %d)\n", strerror(-res), res);
+                    else if (!load_res)
+                        fprintf(interactive ? stdout : stderr, "OK\n");
+                    cb(res < 0 ? res : load_res);
+                });
+            }
+            else
+                cb(0);
         }
         in_loadjson = false;
         return;
@@ -394,11 +423,30 @@ st_5:
                 else
                 {
                     in_progress++;
-                    handle_cmd({ "set", load_key, str }, [this](int res)
+                    if (bulk_handle)
                     {
-                        in_progress--;
-                        next_cmd();
-                    });
+                        db->bulk_load_add(bulk_handle, load_key, str, [this](int res)
+                        {
+                            if (res < 0 && !load_res)
+                            {
+                                if (res == -EINVAL)
+                                    fprintf(stderr, "Error: keys are not sorted or too large, for example %s\n", addslashes(load_key).c_str());
+                                else
+                                    fprintf(stderr, "Error: %s (code %d)\n", strerror(-res), res);
+                                load_res = res;
+                            }
+                            in_progress--;
+                            next_cmd();
+                        });
+                    }
+                    else
+                    {
+                        handle_cmd({ "set", load_key, str }, [this](int res)
+                        {
+                            in_progress--;
+                            next_cmd();
+                        });
+                    }
                     if (in_progress >= load_parallelism)
                     {
                         break;
@@ -501,15 +549,18 @@ void kv_cli_t::handle_cmd(const std::vector<std::string> & cmd, std::function<vo
         auto & value = cmd[2];
         if (key != "kv_memory_limit" &&
             key != "kv_allocate_blocks" &&
-            key != "kv_evict_max_misses" &&
-            key != "kv_evict_attempts_per_level" &&
-            key != "kv_evict_unused_age" &&
             key != "kv_log_level" &&
+            key != "kv_block_format" &&
+            key != "kv_value_separation" &&
+            key != "kv_value_seal_timeout" &&
+            key != "kv_merge_fill" &&
+            key != "kv_auto_compact" &&
             key != "kv_block_size")
         {
             fprintf(
                 stderr, "Allowed properties: kv_block_size, kv_memory_limit, kv_allocate_blocks,"
-                " kv_evict_max_misses, kv_evict_attempts_per_level, kv_evict_unused_age, kv_log_level\n"
+                " kv_log_level, kv_block_format, kv_value_separation, kv_value_seal_timeout,"
+                " kv_merge_fill, kv_auto_compact\n"
             );
             cb(-EINVAL);
         }
@@ -626,13 +677,68 @@ void kv_cli_t::handle_cmd(const std::vector<std::string> & cmd, std::function<vo
             }
         });
     }
-    else if (opname == "loadjson")
+    else if (opname == "loadjson" || opname == "bulkload")
     {
+        if (opname == "bulkload")
+        {
+            bulk_handle = db->bulk_load_start(load_parallelism);
+            if (!bulk_handle)
+            {
+                fprintf(stderr, "Error: bulk load is only possible into an empty DB\n");
+                cb(-EEXIST);
+                return;
+            }
+        }
+        load_res = 0;
         loading_json = true;
         load_state = 0;
         load_cb = cb;
         loadjson();
     }
+    else if (opname == "stats")
+    {
+        auto stats = db->get_stats();
+        uint64_t total = stats.cache_hits + stats.cache_misses;
+        printf(
+            "Cache: %ju blocks, %s (%s hot)\n"
+            "Hits: %ju (%.2f%%), misses: %ju, evictions: %ju, ghost hits: %ju\n"
+            "Separate values: %ju reads, %ju writes, %ju moved by GC, %ju segments freed\n"
+            "Compaction: %ju leaves merged, %ju root levels removed\n"
+            "Operations: %ju get (%ju us avg), %ju set (%ju us avg), %ju delete (%ju us avg), %ju batch (%ju us avg)\n",
+            stats.cache_blocks, format_size(stats.cache_bytes).c_str(), format_size(stats.cache_hot_bytes).c_str(),
+            stats.cache_hits, total ? 100.0*stats.cache_hits/total : 0.0, stats.cache_misses,
+            stats.cache_evictions, stats.cache_ghost_hits,
+            stats.value_reads, stats.value_writes, stats.value_gc_moved, stats.value_gc_segments,
+            stats.leaf_merges, stats.root_shrinks,
+            stats.get_ops.count, stats.get_ops.usec/(stats.get_ops.count ? stats.get_ops.count : 1),
+            stats.set_ops.count, stats.set_ops.usec/(stats.set_ops.count ? stats.set_ops.count : 1),
+            stats.del_ops.count, stats.del_ops.usec/(stats.del_ops.count ? stats.del_ops.count : 1),
+            stats.batch_ops.count, stats.batch_ops.usec/(stats.batch_ops.count ? stats.batch_ops.count : 1)
+        );
+        cb(0);
+    }
+    else if (opname == "gc")
+    {
+        db->gc_values([=](int res)
+        {
+            if (res < 0)
+                fprintf(stderr, "Error: %s (code %d)\n", strerror(-res), res);
+            else
+                fprintf(interactive ? stdout : stderr, "OK\n");
+            cb(res);
+        });
+    }
+    else if (opname == "compact")
+    {
+        db->compact([=](int res)
+        {
+            if (res < 0)
+                fprintf(stderr, "Error: %s (code %d)\n", strerror(-res), res);
+            else
+                fprintf(interactive ? stdout : stderr, "OK\n");
+            cb(res);
+        });
+    }
     else if (opname == "close")
     {
         db->close([=]()
@@ -654,7 +760,7 @@ void kv_cli_t::handle_cmd(const std::vector<std::string> & cmd, std::function<vo
             "open <image>\nopen <pool_id> <inode_id>\n"
             "config <property> <value>\n"
             "get <key>\nset <key> <value>\ndel <key>\n"
-            "list [<start> [end]]\ndump [<start> [end]]\ndumpjson [<start> [end]]\nloadjson\n"
+            "list [<start> [end]]\ndump [<start> [end]]\ndumpjson [<start> [end]]\nloadjson\nbulkload\nstats\ngc\n"
             "close\nquit\n", opname.c_str()
         );
         cb(-EINVAL);
@@ -13,12 +13,19 @@
 #include <fcntl.h>
 //#include <signal.h>
 
+#include <algorithm>
+#include <list>
+#include <set>
+#include <unordered_map>
+
 #include "cluster_client.h"
+#include "http_client.h" // json_is_true
 #include "str_util.h"
 #include "vitastor_kv.h"
 
 // 0x VITASTOR OPTBTREE
 #define KV_BLOCK_MAGIC 0x761A5106097B18EE
+#define KV_BLOCK_MAGIC_V2 0x761A5106097B18E2
 #define KV_BLOCK_MAX_ITEMS 1048576
 #define KV_INDEX_MAX_SIZE (uint64_t)1024*1024*1024*1024
 
@@ -27,6 +34,7 @@
 #define KV_SET 3
 #define KV_DEL 4
 #define KV_LIST 5
+#define KV_BATCH 6
 
 #define KV_INT 1
 #define KV_INT_SPLIT 2
@@ -45,82 +53,471 @@
 #define KV_CH_UPD 3
 #define KV_CH_SPLIT 4
 #define KV_CH_CLEAR_RIGHT 8
+// Merges: freeze the block, extend key_lt to change_rh, mark the block as merged into change_rh_block
+#define KV_CH_FREEZE 16
+#define KV_CH_EXTEND 32
+#define KV_CH_MERGED 64
 
-#define LEVEL_BITS 8
-#define NO_LEVEL_MASK (((uint64_t)1 << (64-LEVEL_BITS)) - 1)
+#define KV_CACHE_LEAF 0
+#define KV_CACHE_INNER 1
 
 #define BLK_NOCHANGE 0
 #define BLK_RELOADED 1
 #define BLK_UPDATING 2
 
+#define KV_BLOCK_FORMAT_V1 1
+#define KV_BLOCK_FORMAT_V2 2
+// Average number of items between restart points in the V2 format
+#define KV_RESTART_INTERVAL 16
+
+#define KV_VALUE_SEGMENT_MAGIC 0x761A5106097B18E3
+#define KV_VALUE_MAGIC 0x761A5106097B18E4
+
+// States of value segments
+#define KV_SEGMENT_OPEN 0
+#define KV_SEGMENT_SEALED 1
+#define KV_SEGMENT_FREED 2
+
+// Writers recheck blocks frozen by a merge after this delay
+#define KV_MERGE_WAIT_MS 10
+// Compaction finishes or rolls back merges of other clients if their blocks stay frozen for so long
+#define KV_MERGE_RECOVERY_MS 10000
+
 struct __attribute__((__packed__)) kv_stored_block_t
 {
     uint64_t magic;
     uint32_t block_size;
     uint32_t type; // KV_*
     uint64_t items; // number of items
+    // V1 format (KV_BLOCK_MAGIC):
+    // { key_ge_len, key_ge..., key_lt_len, key_lt... }, then for split nodes
+    // { right_half_len, right_half..., <right_half_block> }, then
     // root/int nodes: { delimiter_len, delimiter..., 8, <block_offset> }[]
     // leaf nodes: { key_len, key..., value_len, value... }[]
+    // All lengths are 32-bit.
+    // V2 format (KV_BLOCK_MAGIC_V2) has the same layout, but all lengths are varints
+    // and items are prefix-compressed:
+    // { shared_len, unshared_len, value_len, unshared_key..., value... }[],
+    // followed by a 32-bit restart point count and 32-bit restart point offsets.
+    // Restart points always have shared_len=0.
+    // Leaf values in V2 blocks may also be references to separately stored values,
+    // the lowest bit of value_len is set for them and value is a kv_value_ref_t.
     uint8_t data[0];
 };
 
+// Large values may be stored outside of leaves, in "value segments" - inode blocks
+// filled sequentially by one client. Each segment starts with a header block
+// and contains records aligned to kv_block_size:
+// { kv_value_hdr_t, key..., value... }[]
+struct __attribute__((__packed__)) kv_value_segment_t
+{
+    uint64_t magic;
+    uint32_t block_size;
+    // KV_SEGMENT_*. Set to SEALED when the owner stops writing into the segment, only sealed
+    // segments are collected. Collected segments are deleted and replaced by a FREED header
+    uint32_t sealed;
+    // end of records, relative to the segment start
+    uint64_t used;
+};
+
+struct __attribute__((__packed__)) kv_value_hdr_t
+{
+    uint64_t magic;
+    uint32_t key_len;
+    uint32_t value_len;
+};
+
+struct __attribute__((__packed__)) kv_value_ref_t
+{
+    uint64_t offset;
+    uint32_t len;
+};
+
+// Non-owning reference to a key or a value stored in a block buffer
+struct kv_str_t
+{
+    const char *ptr = "";
+    uint32_t len = 0;
+
+    kv_str_t() {}
+    kv_str_t(const char *ptr, uint32_t len): ptr(ptr), len(len) {}
+    kv_str_t(const std::string & s): ptr(s.data()), len(s.size()) {}
+    const char *data() const { return ptr; }
+    size_t size() const { return len; }
+    char operator[](size_t i) const { return ptr[i]; }
+    std::string str() const { return std::string(ptr, len); }
+    std::string substr(size_t pos, size_t n) const { return std::string(ptr+pos, std::min(n, len-pos)); }
+    size_t find(char c, size_t pos) const
+    {
+        auto r = pos < len ? (const char*)memchr(ptr+pos, c, len-pos) : NULL;
+        return r ? r-ptr : std::string::npos;
+    }
+    int compare(const kv_str_t & b) const
+    {
+        int r = memcmp(ptr, b.ptr, len < b.len ? len : b.len);
+        return r ? r : (len < b.len ? -1 : (len > b.len ? 1 : 0));
+    }
+};
+
+static inline bool operator == (const kv_str_t & a, const kv_str_t & b) { return a.len == b.len && !memcmp(a.ptr, b.ptr, a.len); }
+static inline bool operator != (const kv_str_t & a, const kv_str_t & b) { return !(a == b); }
+static inline bool operator < (const kv_str_t & a, const kv_str_t & b) { return a.compare(b) < 0; }
+static inline bool operator > (const kv_str_t & a, const kv_str_t & b) { return a.compare(b) > 0; }
+static inline bool operator <= (const kv_str_t & a, const kv_str_t & b) { return a.compare(b) <= 0; }
+static inline bool operator >= (const kv_str_t & a, const kv_str_t & b) { return a.compare(b) >= 0; }
+
+struct kv_item_t
+{
+    kv_str_t first, second;
+    // second is a kv_value_ref_t
+    bool value_ref = false;
+};
+
+// Sorted flat key/value array backed by the raw block buffer.
+// Items loaded from disk reference the read buffer directly, items added
+// or changed later reference the overlay, which is compacted when it grows.
+struct kv_block_data_t
+{
+    typedef kv_item_t* iterator;
+
+    kv_block_data_t() {}
+    kv_block_data_t(const kv_block_data_t & other) = delete;
+    kv_block_data_t(kv_block_data_t && other);
+    kv_block_data_t & operator = (const kv_block_data_t & other) = delete;
+    kv_block_data_t & operator = (kv_block_data_t && other);
+    ~kv_block_data_t();
+
+    iterator begin() { return items.data(); }
+    iterator end() { return items.data()+items.size(); }
+    size_t size() const { return items.size(); }
+    iterator lower_bound(const kv_str_t & key);
+    iterator upper_bound(const kv_str_t & key);
+    iterator find(const kv_str_t & key);
+    // Takes ownership of the malloc'ed buffer with raw block contents and items pointing into it.
+    // If <keys> is set, item keys are given as offsets in it instead of pointers
+    void adopt(uint8_t *buf, uint32_t buf_size, std::vector<kv_item_t> && items, std::string *keys = NULL);
+    // Copies the item from another block or from outside
+    void push_back(const kv_str_t & key, const kv_str_t & value, bool value_ref = false);
+    void set(const kv_str_t & key, const kv_str_t & value, bool value_ref = false);
+    void assign(iterator first, iterator last);
+    void erase(iterator it) { erase(it, it+1); }
+    void erase(iterator first, iterator last);
+    void clear();
+    // Approximate memory usage
+    uint64_t mem_size() const { return buf_size + overlay_size + items.capacity()*sizeof(kv_item_t); }
+
+protected:
+    std::vector<kv_item_t> items;
+    uint8_t *buf = NULL;
+    uint32_t buf_size = 0;
+    std::list<std::string> overlay;
+    uint32_t overlay_size = 0;
+
+    kv_str_t store(const kv_str_t & s);
+    void compact();
+};
+
+struct kv_change_t
+{
+    // KV_CH_ADD, KV_CH_UPD or KV_CH_DEL
+    int type;
+    std::string key, value;
+    bool value_ref;
+};
+
 struct kv_block_t
 {
     // level of the block. root block has level equal to -db->base_block_level
     int level;
-    // usage flag. set to db->usage_counter when block is used
-    int usage;
+    // block cache state: referenced since the last visit of the CLOCK hand,
+    // hot (reused after being loaded) or cold, and list membership
+    bool cache_ref = false, cache_hot = false;
+    int cache_list = -1;
+    uint64_t cache_size = 0;
+    std::list<uint64_t>::iterator cache_it;
     // current data size, to estimate whether the block can fit more items
     uint32_t data_size;
     uint32_t type;
+    // on-disk format used to write the block
+    int format = KV_BLOCK_FORMAT_V2;
     uint64_t offset;
     // block only contains keys in [key_ge, key_lt). I.e. key_ge <= key < key_lt.
     std::string key_ge, key_lt;
     // KV_INT_SPLIT/KV_LEAF_SPLIT nodes also contain one reference to another block
     // with keys in [right_half, key_lt)
     // This is required for CAS to guarantee consistency during split
+    // Merges reuse the same header: a frozen block references itself with right_half == key_lt,
+    // and a block merged into another one is empty and references it with right_half == key_ge
     std::string right_half;
     uint64_t right_half_block;
     // non-leaf nodes: ( MIN_BOUND_i => BLOCK_i )[]
     // leaf nodes: ( KEY_i => VALUE_i )[]
-    // FIXME: use flat map?
-    std::map<std::string, std::string> data;
+    kv_block_data_t data;
 
     // set during update
     int updating = 0;
     bool invalidated = false;
     int change_type;
-    std::string change_key, change_value;
+    // sorted by key
+    std::vector<kv_change_t> changes;
     std::string change_rh;
     uint64_t change_rh_block;
 
     void set_data_size();
-    static int kv_size(const std::string & key, const std::string & value);
-    int parse(uint64_t offset, uint8_t *data, int size);
+    void add_change(int type, const std::string & key, const std::string & value, bool value_ref = false);
+    static int kv_size(const kv_str_t & key, const kv_str_t & value);
+    static int kv_del_size(const kv_str_t & key, const kv_str_t & value);
+    int parse(uint64_t offset, uint8_t *data, int size, int format);
+    int encode(uint8_t *buf, int size, bool with_changes);
     bool serialize(uint8_t *data, int size);
     void apply_change();
     void cancel_change();
     void dump(int base_level);
 };
 
+kv_block_data_t::kv_block_data_t(kv_block_data_t && other)
+{
+    *this = std::move(other);
+}
+
+kv_block_data_t & kv_block_data_t::operator = (kv_block_data_t && other)
+{
+    if (this != &other)
+    {
+        if (buf)
+            free(buf);
+        // std::list and std::vector moves keep element addresses, so views stay valid
+        items = std::move(other.items);
+        overlay = std::move(other.overlay);
+        buf = other.buf;
+        buf_size = other.buf_size;
+        overlay_size = other.overlay_size;
+        other.items.clear();
+        other.overlay.clear();
+        other.buf = NULL;
+        other.buf_size = other.overlay_size = 0;
+    }
+    return *this;
+}
+
+kv_block_data_t::~kv_block_data_t()
+{
+    if (buf)
+        free(buf);
+}
+
+kv_block_data_t::iterator kv_block_data_t::lower_bound(const kv_str_t & key)
+{
+    return std::lower_bound(begin(), end(), key, [](const kv_item_t & a, const kv_str_t & b) { return a.first < b; });
+}
+
+kv_block_data_t::iterator kv_block_data_t::upper_bound(const kv_str_t & key)
+{
+    return std::upper_bound(begin(), end(), key, [](const kv_str_t & a, const kv_item_t & b) { return a < b.first; });
+}
+
+kv_block_data_t::iterator kv_block_data_t::find(const kv_str_t & key)
+{
+    auto it = lower_bound(key);
+    return it != end() && it->first == key ? it : end();
+}
+
+void kv_block_data_t::adopt(uint8_t *new_buf, uint32_t new_size, std::vector<kv_item_t> && new_items, std::string *keys)
+{
+    clear();
+    buf = new_buf;
+    buf_size = new_size;
+    items = std::move(new_items);
+    if (keys)
+    {
+        overlay.push_back(std::move(*keys));
+        overlay_size += overlay.back().size();
+        const char *base = overlay.back().data();
+        for (auto & kv: items)
+            kv.first.ptr = base + (uintptr_t)kv.first.ptr;
+    }
+}
+
+kv_str_t kv_block_data_t::store(const kv_str_t & s)
+{
+    overlay.emplace_back(s.data(), s.size());
+    overlay_size += s.size();
+    return kv_str_t(overlay.back());
+}
+
+void kv_block_data_t::push_back(const kv_str_t & key, const kv_str_t & value, bool value_ref)
+{
+    assert(!items.size() || items.back().first < key);
+    items.push_back((kv_item_t){ .first = store(key), .second = store(value), .value_ref = value_ref });
+}
+
+void kv_block_data_t::set(const kv_str_t & key, const kv_str_t & value, bool value_ref)
+{
+    auto it = lower_bound(key);
+    if (it != end() && it->first == key)
+    {
+        it->second = store(value);
+        it->value_ref = value_ref;
+    }
+    else
+    {
+        auto new_key = store(key);
+        items.insert(items.begin() + (it-begin()), (kv_item_t){ .first = new_key, .second = store(value), .value_ref = value_ref });
+    }
+    if (overlay_size > buf_size && overlay.size() > 16)
+        compact();
+}
+
+void kv_block_data_t::assign(iterator first, iterator last)
+{
+    clear();
+    items.reserve(last-first);
+    for (auto it = first; it != last; it++)
+        items.push_back(*it);
+    // Copy keys and values from the other block into our own buffer
+    compact();
+}
+
+void kv_block_data_t::erase(iterator first, iterator last)
+{
+    items.erase(items.begin() + (first-begin()), items.begin() + (last-begin()));
+}
+
+void kv_block_data_t::clear()
+{
+    items.clear();
+    overlay.clear();
+    overlay_size = 0;
+    if (buf)
+        free(buf);
+    buf = NULL;
+    buf_size = 0;
+}
+
+void kv_block_data_t::compact()
+{
+    // Move all live keys and values into a new contiguous buffer
+    uint32_t new_size = 0;
+    for (auto & kv: items)
+        new_size += kv.first.size() + kv.second.size();
+    uint8_t *new_buf = (uint8_t*)malloc_or_die(new_size ? new_size : 1);
+    uint32_t pos = 0;
+    for (auto & kv: items)
+    {
+        memcpy(new_buf+pos, kv.first.data(), kv.first.size());
+        kv.first = kv_str_t((char*)new_buf+pos, kv.first.size());
+        pos += kv.first.size();
+        memcpy(new_buf+pos, kv.second.data(), kv.second.size());
+        kv.second = kv_str_t((char*)new_buf+pos, kv.second.size());
+        pos += kv.second.size();
+    }
+    overlay.clear();
+    overlay_size = 0;
+    if (buf)
+        free(buf);
+    buf = new_buf;
+    buf_size = new_size;
+}
+
+static inline int varint_size(uint64_t v)
+{
+    int n = 1;
+    while (v >= 0x80)
+    {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static bool kv_is_restart(const kv_str_t & key)
+{
+    // Restart points depend only on the key itself and not on its position in the block
+    // (FNV-1a hash). So adding or removing items never moves other restart points and
+    // never makes other items larger, which allows to estimate block size incrementally
+    uint32_t h = 2166136261;
+    for (size_t i = 0; i < key.size(); i++)
+        h = (h ^ (uint8_t)key[i]) * 16777619;
+    return !(h % KV_RESTART_INTERVAL);
+}
+
+// Exact size of an item following <prev> in a block (prev = NULL for the first item)
+static int kv_item_size(int format, const kv_str_t *prev, const kv_str_t & key, const kv_str_t & value)
+{
+    if (format == KV_BLOCK_FORMAT_V1)
+        return 4*2 + key.size() + value.size();
+    int shared = 0;
+    bool restart = !prev || kv_is_restart(key);
+    if (!restart)
+        while (shared < key.size() && shared < prev->size() && key[shared] == (*prev)[shared])
+            shared++;
+    return varint_size(shared) + varint_size(key.size()-shared) + varint_size(2*value.size()+1) +
+        key.size() - shared + value.size() + (restart ? 4 : 0);
+}
+
 void kv_block_t::set_data_size()
 {
-    data_size = sizeof(kv_stored_block_t) + 4*2 + key_ge.size() + key_lt.size();
-    if (this->type == KV_INT_SPLIT || this->type == KV_LEAF_SPLIT)
-        data_size += 4 + right_half.size() + 8;
-    for (auto & kv: data)
-        data_size += kv_size(kv.first, kv.second);
+    data_size = encode(NULL, INT_MAX, false);
 }
 
-int kv_block_t::kv_size(const std::string & key, const std::string & value)
+int kv_block_t::kv_size(const kv_str_t & key, const kv_str_t & value)
 {
-    return 4*2 + key.size() + value.size();
+    // Upper bound of the item size in both formats, including a possible restart point
+    return 4*2 + 2*varint_size(key.size()) + varint_size(2*value.size()+1) + key.size() + value.size();
 }
 
+int kv_block_t::kv_del_size(const kv_str_t & key, const kv_str_t & value)
+{
+    // Lower bound of space freed by removing an item in both formats.
+    // The next item may absorb the removed key's unshared part, but not the value
+    return value.size();
+}
+
+// Version-only reads of an inode block. Checks started while a probe
+// is running wait for the next probe, so they never get an outdated version
+struct kv_version_probe_t
+{
+    bool inflight = false;
+    std::vector<std::function<void(int)>> cur, next;
+};
+
 struct kv_continue_write_t
 {
     kv_block_t *blk;
     std::function<void(int)> cb;
+    bool sync;
+};
+
+// Leaf change waiting for the current write of the block to finish
+// to be written together with all other such changes
+struct kv_leaf_update_t
+{
+    bool is_delete;
+    std::string key, value;
+    bool value_ref;
+    std::function<bool(int res, const std::string & value)> cas_cb;
+    std::function<void()> retry;
+    // loads the separately stored current value for cas_cb, then retries
+    std::function<void(uint64_t leaf_offset, const kv_str_t & ref)> load_retry;
+    std::function<void(int)> cb;
+};
+
+// Value segment written by this client
+struct kv_open_segment_t
+{
+    // records being written or not yet referenced from written leaves.
+    // the segment is sealed only when there are none of them
+    int inflight = 0;
+    bool full = false;
+    uint64_t used = 0;
+};
+
+// Unsealed segment of another client seen by the GC
+struct kv_idle_segment_t
+{
+    uint64_t version = 0;
+    // CLOCK_MONOTONIC milliseconds when the GC first saw this version
+    uint64_t since = 0;
 };
 
 struct kv_alloc_block_t
@@ -141,30 +538,57 @@ struct kv_db_t
     uint32_t ino_block_size = 0;
     bool immediate_commit = false;
     uint64_t memory_limit = 128*1024*1024;
-    uint64_t evict_unused_age = 1000;
-    uint64_t evict_max_misses = 10;
-    uint64_t evict_attempts_per_level = 3;
     uint64_t max_allocate_blocks = 4;
     uint64_t log_level = 1;
+    int block_format = KV_BLOCK_FORMAT_V2;
+    uint64_t value_separation = 0;
+    uint64_t merge_fill = 50;
+    bool auto_compact = false;
+    uint64_t value_seal_timeout = 600;
 
     // state
-    uint64_t evict_unused_counter = 0;
-    uint64_t cache_max_blocks = 0;
     int base_block_level = 0;
-    int usage_counter = 1;
     int allocating_block_pos = 0;
     std::vector<kv_alloc_block_t> allocating_blocks;
-    std::set<uint64_t> block_levels;
+    // Block cache (CLOCK-Pro-like): leaves and inner nodes are kept in separate CLOCK
+    // lists, inner nodes are only evicted when there are no evictable leaves.
+    // Cold leaves are promoted to hot when referenced again while in cache.
+    // Evicted cold leaves are remembered as "ghosts", and leaves reloaded while
+    // they're still remembered start as hot, so single scans don't evict the working set
+    std::list<uint64_t> cache_lists[2];
+    std::list<uint64_t>::iterator cache_hands[2] = { cache_lists[0].end(), cache_lists[1].end() };
+    std::list<uint64_t> cache_ghosts;
+    std::unordered_map<uint64_t, std::list<uint64_t>::iterator> cache_ghost_map;
+    uint64_t cache_bytes = 0, cache_hot_bytes = 0, cache_cold_target = 0;
+    kv_stats_t stats;
     std::map<uint64_t, kv_block_t> block_cache;
     std::map<uint64_t, uint64_t> known_versions;
     std::map<uint64_t, uint64_t> new_versions;
     std::multimap<uint64_t, kv_continue_write_t> continue_write;
     std::multimap<uint64_t, std::function<void()>> continue_update;
+    std::map<uint64_t, std::vector<kv_leaf_update_t>> leaf_updates;
+    std::map<uint64_t, kv_version_probe_t> version_probes;
+    // Separately stored values: the segment being filled and a small LRU cache
+    // of values. Values are never modified in place, so cached values never get outdated
+    uint64_t value_seg = UINT64_MAX, value_seg_pos = 0;
+    bool value_seg_ready = false;
+    std::vector<std::function<void(int)>> value_seg_waiting;
+    std::map<uint64_t, kv_open_segment_t> value_segs;
+    uint64_t value_seg_written = 0;
+    // Unsealed segments of other clients are collected if they aren't written to for <value_seal_timeout>
+    std::map<uint64_t, kv_idle_segment_t> idle_segs;
+    std::list<uint64_t> value_lru;
+    std::unordered_map<uint64_t, std::pair<std::string, std::list<uint64_t>::iterator>> value_cache;
+    uint64_t value_cache_bytes = 0;
+    // Leaves left underfull by deletes, merged by background compaction
+    std::set<std::string> compact_hints;
+    bool compacting = false, compact_armed = false;
 
     bool closing = false;
     int active_ops = 0;
     std::function<void()> on_close;
 
+    uint64_t alloc_ino_block();
     uint64_t alloc_block();
     void clear_allocation_block(uint64_t offset);
     void confirm_allocation_block(uint64_t offset);
@@ -177,6 +601,7 @@ struct kv_db_t
     void find_size(uint64_t min, uint64_t max, int phase, std::function<void(int, uint64_t)> cb);
     void run_continue_update(uint64_t offset);
     void stop_updating(kv_block_t *blk);
+    void flush_leaf_updates(uint64_t offset);
 };
 
 struct kv_path_t
@@ -194,6 +619,17 @@ struct kv_op_t
     bool done = false;
     std::function<void(kv_op_t *)> callback;
     std::function<bool(int res, const std::string & value)> cas_cb;
+    // KV_BATCH: changes and their results
+    std::vector<kv_write_t> batch;
+    std::vector<int> batch_res;
+    // KV_GET with multiple keys: keys and results
+    std::vector<kv_read_t> reads;
+    // KV_GET/KV_LIST: return references to separately stored values as is
+    bool resolve_refs = true;
+    // <value> is a reference to a separately stored value
+    bool value_ref = false;
+    // records of separately stored values referenced by this operation
+    std::vector<uint64_t> held_values;
 
     void exec();
     void next(); // for list
@@ -208,42 +644,81 @@ protected:
     int updating_on_path = 0;
     int retry = 0;
     bool skip_equal = false;
+    std::vector<int> batch_group;
+    int batch_failed = -1;
+    std::vector<int> read_order;
+    int read_pos = 0;
+    std::vector<bool> batch_ref;
+    int values_pending = 0, values_res = 0;
+    timespec tv_begin = {};
 
     void finish(int res);
     void get();
+    void get_leaf(kv_block_t *blk);
+    void restart_get();
+    void write_values(std::function<void()> next);
+    void load_value(uint64_t leaf_offset, const std::string & key, const kv_str_t & ref,
+        std::function<void(int, const std::string &)> cb);
     int handle_block(int res, int refresh, bool stop_on_split);
 
     void update();
     void update_find();
+    void update_done(int res);
     void create_root();
     void resume_split();
+    void wait_merge();
+    bool parent_has_split(kv_block_t *blk);
     void update_block(int path_pos, bool is_delete, const std::string & key, const std::string & value, std::function<void(int)> cb);
+    void update_batch();
+    int next_batch_item();
 
     void next_handle_block(int res, int refresh);
     void next_get();
     void next_go_up();
 };
 
-static std::string read_string(uint8_t *data, int size, int *pos)
+static uint64_t read_len(int format, uint8_t *data, int size, int *pos)
 {
-    if (*pos+4 > size)
+    if (format == KV_BLOCK_FORMAT_V1)
     {
-        *pos = -1;
-        return "";
+        if (*pos+4 > size)
+        {
+            *pos = -1;
+            return 0;
+        }
+        uint32_t len = *(uint32_t*)(data+*pos);
+        *pos += sizeof(uint32_t);
+        return len;
+    }
+    uint64_t len = 0;
+    for (int shift = 0; shift < 35; shift += 7)
+    {
+        if (*pos >= size)
+            break;
+        uint8_t b = data[(*pos)++];
+        len |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return len;
     }
-    uint32_t len = *(uint32_t*)(data+*pos);
-    *pos += sizeof(uint32_t);
-    if (*pos+len > size)
+    *pos = -1;
+    return 0;
+}
+
+static kv_str_t read_string(int format, uint8_t *data, int size, int *pos)
+{
+    uint64_t len = read_len(format, data, size, pos);
+    if (*pos < 0 || *pos+len > size)
     {
         *pos = -1;
-        return "";
+        return kv_str_t();
     }
-    std::string key((char*)data+*pos, len);
+    kv_str_t key((char*)data+*pos, len);
     *pos += len;
     return key;
 }
 
-int kv_block_t::parse(uint64_t offset, uint8_t *data, int size)
+// Takes ownership of <data> on success. <format> is the format to use for subsequent writes
+int kv_block_t::parse(uint64_t offset, uint8_t *data, int size, int format)
 {
     kv_stored_block_t *blk = (kv_stored_block_t *)data;
     if (blk->magic == 0 || blk->type == KV_EMPTY)
@@ -253,23 +728,24 @@ int kv_block_t::parse(uint64_t offset, uint8_t *data, int size)
             fprintf(stderr, "K/V: Block %ju is %s\n", offset, blk->magic == 0 ? "empty" : "cleared");
         return -ENOTBLK;
     }
-    if (blk->magic != KV_BLOCK_MAGIC || blk->block_size != size ||
+    if (blk->magic != KV_BLOCK_MAGIC && blk->magic != KV_BLOCK_MAGIC_V2 || blk->block_size != size ||
         !blk->type || blk->type > KV_EMPTY || blk->items > KV_BLOCK_MAX_ITEMS)
     {
         // invalid block
         fprintf(stderr, "K/V: Invalid block %ju magic, size, type or item count\n", offset);
         return -EILSEQ;
     }
+    int stored_format = blk->magic == KV_BLOCK_MAGIC_V2 ? KV_BLOCK_FORMAT_V2 : KV_BLOCK_FORMAT_V1;
     assert(!this->type);
     this->type = blk->type;
     int pos = blk->data - data;
-    this->key_ge = read_string(data, size, &pos);
+    this->key_ge = read_string(stored_format, data, size, &pos).str();
     if (pos < 0)
     {
         fprintf(stderr, "K/V: Invalid block %ju left bound\n", offset);
         return -EILSEQ;
     }
-    this->key_lt = read_string(data, size, &pos);
+    this->key_lt = read_string(stored_format, data, size, &pos).str();
     if (pos < 0)
     {
         fprintf(stderr, "K/V: Invalid block %ju right bound\n", offset);
@@ -277,7 +753,7 @@ int kv_block_t::parse(uint64_t offset, uint8_t *data, int size)
     }
     if (this->type == KV_INT_SPLIT || this->type == KV_LEAF_SPLIT)
     {
-        this->right_half = read_string(data, size, &pos);
+        this->right_half = read_string(stored_format, data, size, &pos).str();
         if (pos < 0)
         {
             fprintf(stderr, "K/V: Invalid block %ju split bound\n", offset);
@@ -291,123 +767,305 @@ int kv_block_t::parse(uint64_t offset, uint8_t *data, int size)
         this->right_half_block = *(uint64_t*)(data+pos);
         pos += 8;
     }
+    std::vector<kv_item_t> items;
+    items.reserve(blk->items);
+    // V2 keys are restored into a separate buffer, items refer to it by offsets until adopt()
+    std::string keys;
+    size_t prev_pos = 0, prev_len = 0;
     for (int i = 0; i < blk->items; i++)
     {
-        auto key = read_string(data, size, &pos);
+        kv_str_t key, value;
+        bool order_ok = true, value_ref = false;
+        if (stored_format == KV_BLOCK_FORMAT_V1)
+        {
+            key = read_string(stored_format, data, size, &pos);
+            order_ok = !items.size() || items.back().first < key;
+        }
+        else
+        {
+            uint64_t shared = read_len(stored_format, data, size, &pos);
+            uint64_t unshared = pos >= 0 ? read_len(stored_format, data, size, &pos) : 0;
+            uint64_t value_len = pos >= 0 ? read_len(stored_format, data, size, &pos) : 0;
+            value_ref = (value_len & 1);
+            value_len >>= 1;
+            if (value_ref && value_len != sizeof(kv_value_ref_t))
+                pos = -1;
+            if (pos >= 0 && (shared > prev_len || pos+unshared > size))
+                pos = -1;
+            if (pos >= 0)
+            {
+                size_t key_pos = keys.size();
+                keys.append(keys, prev_pos, shared);
+                keys.append((char*)data+pos, unshared);
+                pos += unshared;
+                order_ok = !i || kv_str_t(keys.data()+prev_pos, prev_len) < kv_str_t(keys.data()+key_pos, shared+unshared);
+                prev_pos = key_pos;
+                prev_len = shared+unshared;
+                key = kv_str_t((const char*)prev_pos, prev_len);
+                if (pos+value_len > size)
+                    pos = -1;
+                else
+                {
+                    value = kv_str_t((char*)data+pos, value_len);
+                    pos += value_len;
+                }
+            }
+        }
         if (pos < 0)
         {
             fprintf(stderr, "K/V: Invalid block %ju key %d\n", offset, i);
             return -EILSEQ;
         }
-        auto value = read_string(data, size, &pos);
-        if (pos < 0)
+        if (!order_ok)
+        {
+            fprintf(stderr, "K/V: Invalid block %ju key %d order\n", offset, i);
+            return -EILSEQ;
+        }
+        if (stored_format == KV_BLOCK_FORMAT_V1)
+        {
+            value = read_string(stored_format, data, size, &pos);
+            if (pos < 0)
+            {
+                fprintf(stderr, "K/V: Invalid block %ju value %d\n", offset, i);
+                return -EILSEQ;
+            }
+        }
+        items.push_back((kv_item_t){ .first = key, .second = value, .value_ref = value_ref });
+    }
+    if (stored_format == KV_BLOCK_FORMAT_V2)
+    {
+        // Restart point index is only used by readers which don't decode the whole block
+        uint64_t restarts = pos+4 <= size ? *(uint32_t*)(data+pos) : UINT64_MAX;
+        if (restarts > blk->items || pos+4+4*restarts > size)
         {
-            fprintf(stderr, "K/V: Invalid block %ju value %d\n", offset, i);
+            fprintf(stderr, "K/V: Invalid block %ju restart points\n", offset);
             return -EILSEQ;
         }
-        this->data[key] = value;
+        pos += 4+4*restarts;
     }
-    this->data_size = pos;
+    this->data.adopt(data, size, std::move(items), stored_format == KV_BLOCK_FORMAT_V2 ? &keys : NULL);
     this->offset = offset;
+    this->format = format;
+    if (format == stored_format)
+        this->data_size = pos;
+    else
+    {
+        set_data_size();
+        if (data_size > size)
+        {
+            // Doesn't fit into the requested format, keep the stored one
+            this->format = stored_format;
+            this->data_size = pos;
+        }
+    }
     return 0;
 }
 
-static bool write_string(uint8_t *data, int size, int *pos, const std::string & s)
+// Helper for encode(), only calculates the size when buf is NULL
+struct kv_block_writer_t
 {
-    if (*pos+s.size()+4 > size)
-        return false;
-    *(uint32_t*)(data+*pos) = s.size();
-    *pos += 4;
-    memcpy(data+*pos, s.data(), s.size());
-    *pos += s.size();
-    return true;
-}
+    uint8_t *buf;
+    int size;
+    int format;
+    int pos;
 
-bool kv_block_t::serialize(uint8_t *buf, int size)
+    bool put_len(uint64_t len)
+    {
+        if (format == KV_BLOCK_FORMAT_V1)
+        {
+            if (pos+4 > size)
+                return false;
+            if (buf)
+                *(uint32_t*)(buf+pos) = len;
+            pos += 4;
+            return true;
+        }
+        do
+        {
+            if (pos >= size)
+                return false;
+            if (buf)
+                buf[pos] = (len & 0x7F) | (len >= 0x80 ? 0x80 : 0);
+            pos++;
+            len >>= 7;
+        } while (len);
+        return true;
+    }
+
+    bool put_bytes(const void *data, size_t len)
+    {
+        if (pos+len > size)
+            return false;
+        if (buf)
+            memcpy(buf+pos, data, len);
+        pos += len;
+        return true;
+    }
+
+    bool put_string(const kv_str_t & s)
+    {
+        return put_len(s.size()) && put_bytes(s.data(), s.size());
+    }
+};
+
+// Returns encoded size or -1 if the block doesn't fit into <size> bytes
+int kv_block_t::encode(uint8_t *buf, int size, bool with_changes)
 {
-    kv_stored_block_t *blk = (kv_stored_block_t *)buf;
-    blk->magic = KV_BLOCK_MAGIC;
-    blk->block_size = size;
-    if ((change_type & KV_CH_CLEAR_RIGHT))
+    int ch_type = with_changes ? change_type : 0;
+    int format = this->format;
+    if (format == KV_BLOCK_FORMAT_V1)
+    {
+        // References to separately stored values can only be written in the V2 format
+        for (auto & kv: data)
+            if (kv.value_ref)
+                format = KV_BLOCK_FORMAT_V2;
+        for (auto & ch: changes)
+            if (with_changes && ch.value_ref)
+                format = KV_BLOCK_FORMAT_V2;
+    }
+    kv_stored_block_t hdr = {};
+    hdr.magic = format == KV_BLOCK_FORMAT_V1 ? KV_BLOCK_MAGIC : KV_BLOCK_MAGIC_V2;
+    hdr.block_size = size;
+    if ((ch_type & KV_CH_CLEAR_RIGHT))
     {
         if (type == KV_LEAF_SPLIT)
-            blk->type = KV_LEAF;
+            hdr.type = KV_LEAF;
         else if (type == KV_INT_SPLIT)
-            blk->type = KV_INT;
+            hdr.type = KV_INT;
         else
-            blk->type = type;
+            hdr.type = type;
     }
-    else if ((change_type & KV_CH_SPLIT))
+    else if ((ch_type & (KV_CH_SPLIT | KV_CH_FREEZE | KV_CH_MERGED)))
     {
         if (type == KV_LEAF)
-            blk->type = KV_LEAF_SPLIT;
+            hdr.type = KV_LEAF_SPLIT;
         else if (type == KV_INT)
-            blk->type = KV_INT_SPLIT;
+            hdr.type = KV_INT_SPLIT;
         else
-            blk->type = type;
+            hdr.type = type;
     }
     else
-        blk->type = type;
-    int pos = blk->data - buf;
-    if (!write_string(buf, size, &pos, key_ge))
-        return false;
-    if (!write_string(buf, size, &pos, (change_type & KV_CH_CLEAR_RIGHT) ? right_half : key_lt))
-        return false;
-    if (blk->type == KV_LEAF_SPLIT || blk->type == KV_INT_SPLIT)
+        hdr.type = type;
+    kv_block_writer_t w = { .buf = buf, .size = size, .format = format, .pos = sizeof(kv_stored_block_t) };
+    if (w.pos > size)
+        return -1;
+    if (!w.put_string(key_ge))
+        return -1;
+    if (!w.put_string((ch_type & KV_CH_CLEAR_RIGHT) ? right_half : ((ch_type & KV_CH_EXTEND) ? change_rh : key_lt)))
+        return -1;
+    if (hdr.type == KV_LEAF_SPLIT || hdr.type == KV_INT_SPLIT)
     {
-        if (!write_string(buf, size, &pos, (change_type & KV_CH_SPLIT) ? change_rh : right_half))
-            return false;
-        if (pos+8 > size)
-            return false;
-        *(uint64_t*)(buf+pos) = (change_type & KV_CH_SPLIT) ? change_rh_block : right_half_block;
-        pos += 8;
+        if (!w.put_string((ch_type & KV_CH_SPLIT) ? change_rh
+            : ((ch_type & KV_CH_FREEZE) ? key_lt : ((ch_type & KV_CH_MERGED) ? key_ge : right_half))))
+            return -1;
+        uint64_t rh_block = (ch_type & (KV_CH_SPLIT | KV_CH_MERGED)) ? change_rh_block
+            : ((ch_type & KV_CH_FREEZE) ? offset : right_half_block);
+        if (!w.put_bytes(&rh_block, 8))
+            return -1;
+    }
+    auto kv_it = data.begin();
+    auto end_it = (ch_type & KV_CH_MERGED) ? data.begin()
+        : ((ch_type & KV_CH_SPLIT) ? data.lower_bound(change_rh) : data.end());
+    auto ch_it = changes.begin();
+    auto ch_end = with_changes && !(ch_type & KV_CH_MERGED) ? changes.end() : changes.begin();
+    if ((ch_type & KV_CH_SPLIT))
+    {
+        ch_end = std::lower_bound(changes.begin(), changes.end(), change_rh,
+            [](const kv_change_t & a, const std::string & b) { return a.key < b; });
     }
-    auto old_it = (change_type & KV_CH_UPD) ? data.lower_bound(change_key) : data.end();
-    auto end_it = (change_type & KV_CH_SPLIT) ? data.lower_bound(change_rh) : data.end();
-    blk->items = 0;
-    for (auto kv_it = data.begin(); kv_it != end_it; kv_it++)
+    std::vector<uint32_t> restarts;
+    kv_str_t prev_key;
+    while (kv_it != end_it || ch_it != ch_end)
     {
-        if (!(change_type & KV_CH_DEL) || kv_it != old_it || old_it->first != change_key)
+        kv_str_t key, value;
+        bool value_ref;
+        if (ch_it != ch_end && (kv_it == end_it || kv_str_t(ch_it->key) <= kv_it->first))
         {
-            if (!write_string(buf, size, &pos, kv_it->first) ||
-                !write_string(buf, size, &pos, kv_it->second))
-                return false;
-            blk->items++;
+            if (kv_it != end_it && kv_it->first == ch_it->key)
+                kv_it++;
+            bool add = (ch_it->type & KV_CH_ADD);
+            key = ch_it->key;
+            value = ch_it->value;
+            value_ref = ch_it->value_ref;
+            ch_it++;
+            if (!add)
+                continue;
+        }
+        else
+        {
+            key = kv_it->first;
+            value = kv_it->second;
+            value_ref = kv_it->value_ref;
+            kv_it++;
         }
-        if ((change_type & KV_CH_ADD) && kv_it == old_it)
+        if (format == KV_BLOCK_FORMAT_V1)
         {
-            if (!write_string(buf, size, &pos, change_key) ||
-                !write_string(buf, size, &pos, change_value))
-                return false;
-            blk->items++;
+            if (!w.put_string(key) || !w.put_string(value))
+                return -1;
+        }
+        else
+        {
+            int shared = 0;
+            if (!hdr.items || kv_is_restart(key))
+                restarts.push_back(w.pos);
+            else
+            {
+                while (shared < key.size() && shared < prev_key.size() && key[shared] == prev_key[shared])
+                    shared++;
+            }
+            if (!w.put_len(shared) || !w.put_len(key.size()-shared) || !w.put_len(2*value.size() | value_ref) ||
+                !w.put_bytes(key.data()+shared, key.size()-shared) ||
+                !w.put_bytes(value.data(), value.size()))
+                return -1;
+            prev_key = key;
         }
+        hdr.items++;
     }
-    if ((change_type & KV_CH_ADD) && end_it == old_it)
+    if (format != KV_BLOCK_FORMAT_V1)
     {
-        if (!write_string(buf, size, &pos, change_key) ||
-            !write_string(buf, size, &pos, change_value))
-            return false;
-        blk->items++;
+        uint32_t restart_count = restarts.size();
+        if (!w.put_bytes(&restart_count, 4) || !w.put_bytes(restarts.data(), 4*restarts.size()))
+            return -1;
     }
-    return true;
+    if (buf)
+        memcpy(buf, &hdr, sizeof(kv_stored_block_t));
+    return w.pos;
+}
+
+bool kv_block_t::serialize(uint8_t *buf, int size)
+{
+    return encode(buf, size, true) >= 0;
+}
+
+void kv_block_t::add_change(int type, const std::string & key, const std::string & value, bool value_ref)
+{
+    auto ch_it = std::lower_bound(changes.begin(), changes.end(), key,
+        [](const kv_change_t & a, const std::string & b) { return a.key < b; });
+    assert(ch_it == changes.end() || ch_it->key != key);
+    changes.insert(ch_it, (kv_change_t){ .type = type, .key = key, .value = value, .value_ref = value_ref });
+    change_type |= type;
 }
 
 void kv_block_t::apply_change()
 {
-    if ((change_type & KV_CH_UPD) == KV_CH_DEL)
+    for (auto & ch: changes)
     {
-        auto kv_it = data.find(change_key);
-        assert(kv_it != data.end());
-        data_size -= kv_block_t::kv_size(kv_it->first, kv_it->second);
-        data.erase(kv_it);
+        if ((ch.type & KV_CH_UPD) == KV_CH_DEL)
+        {
+            auto kv_it = data.find(ch.key);
+            assert(kv_it != data.end());
+            data.erase(kv_it);
+        }
+        if ((ch.type & KV_CH_ADD))
+        {
+            data.set(ch.key, ch.value, ch.value_ref);
+        }
     }
-    if ((change_type & KV_CH_ADD))
+    bool changed = changes.size() > 0;
+    if ((change_type & KV_CH_EXTEND))
     {
-        auto kv_it = data.find(change_key);
-        if (kv_it != data.end())
-            data_size -= kv_block_t::kv_size(kv_it->first, kv_it->second);
-        data_size += kv_block_t::kv_size(change_key, change_value);
-        data[change_key] = change_value;
+        key_lt = change_rh;
+        changed = true;
     }
     if ((change_type & KV_CH_CLEAR_RIGHT) && (type == KV_INT_SPLIT || type == KV_LEAF_SPLIT))
     {
@@ -425,17 +1083,50 @@ void kv_block_t::apply_change()
         data.erase(data.lower_bound(change_rh), data.end());
         set_data_size();
     }
+    else if ((change_type & KV_CH_FREEZE) && (type == KV_INT || type == KV_LEAF))
+    {
+        type = (type == KV_LEAF ? KV_LEAF_SPLIT : KV_INT_SPLIT);
+        right_half = key_lt;
+        right_half_block = offset;
+        set_data_size();
+    }
+    else if ((change_type & KV_CH_MERGED))
+    {
+        type = (type == KV_LEAF || type == KV_LEAF_SPLIT ? KV_LEAF_SPLIT : KV_INT_SPLIT);
+        right_half = key_ge;
+        right_half_block = change_rh_block;
+        data.clear();
+        set_data_size();
+    }
+    else if (changed)
+        set_data_size();
     change_type = 0;
-    change_key = change_value = change_rh = "";
+    changes.clear();
+    change_rh = "";
     change_rh_block = 0;
 }
 
 void kv_block_t::cancel_change()
 {
     change_type = 0;
+    changes.clear();
     apply_change();
 }
 
+// A block frozen by a merge may be read, but not changed until the merge finishes
+static bool is_frozen(kv_block_t *blk)
+{
+    return (blk->type == KV_LEAF_SPLIT || blk->type == KV_INT_SPLIT) &&
+        blk->right_half_block == blk->offset && blk->right_half == blk->key_lt;
+}
+
+// A merged block is empty, its keys are now stored in right_half_block
+static bool is_merged(kv_block_t *blk)
+{
+    return (blk->type == KV_LEAF_SPLIT || blk->type == KV_INT_SPLIT) &&
+        blk->right_half_block != blk->offset && blk->right_half == blk->key_ge;
+}
+
 static const char *block_type_names[] = {
     "unknown",
     "int",
@@ -445,7 +1136,7 @@ static const char *block_type_names[] = {
     "empty",
 };
 
-static void dump_str(const std::string & str)
+static void dump_str(const kv_str_t & str)
 {
     size_t pos = 0;
     fwrite("\"", 1, 1, stdout);
@@ -490,37 +1181,350 @@ void kv_block_t::dump(int base_level)
         printf("        ");
         dump_str(kv.first);
         printf(": ");
-        if (type == KV_LEAF || type == KV_LEAF_SPLIT || kv.second.size() != 8)
+        if (kv.value_ref)
+        {
+            auto ref = (kv_value_ref_t*)kv.second.data();
+            printf("{ \"value_offset\": %ju, \"value_len\": %u }", ref->offset, ref->len);
+        }
+        else if (type == KV_LEAF || type == KV_LEAF_SPLIT || kv.second.size() != 8)
             dump_str(kv.second);
         else
-            printf("%ju", *(uint64_t*)kv.second.c_str());
+            printf("%ju", *(uint64_t*)kv.second.data());
         printf(",\n");
     }
     printf("    }\n}\n");
 }
 
-void kv_db_t::open(inode_t inode_id, json11::Json cfg, std::function<void(int)> cb)
+static uint64_t value_record_size(kv_db_t *db, uint64_t key_len, uint64_t value_len)
 {
-    if (block_cache.size() > 0)
-    {
-        cb(-EINVAL);
-        return;
-    }
-    auto pool_it = cli->st_cli.pool_config.find(INODE_POOL(inode_id));
-    if (pool_it == cli->st_cli.pool_config.end())
-    {
-        cb(-EINVAL);
-        return;
-    }
-    auto & pool_cfg = pool_it->second;
-    uint32_t pg_data_size = (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
-    uint64_t kv_block_size = cfg["kv_block_size"].uint64_value();
-    if (!kv_block_size)
-        kv_block_size = 4096;
-    if ((pool_cfg.data_block_size*pg_data_size) % kv_block_size ||
-        kv_block_size < pool_cfg.bitmap_granularity)
-    {
-        cb(-EINVAL);
+    uint64_t size = sizeof(kv_value_hdr_t) + key_len + value_len;
+    return (size + db->kv_block_size - 1) / db->kv_block_size * db->kv_block_size;
+}
+
+// Values of at least <value_separation> bytes are stored outside of leaves
+static bool is_separated(kv_db_t *db, const std::string & value)
+{
+    return db->value_separation && db->block_format == KV_BLOCK_FORMAT_V2 && value.size() >= db->value_separation;
+}
+
+static bool value_fits(kv_db_t *db, const std::string & key, const std::string & value)
+{
+    return value_record_size(db, key.size(), value.size()) <= db->ino_block_size - db->kv_block_size;
+}
+
+static std::string make_value_ref(uint64_t offset, uint32_t len)
+{
+    kv_value_ref_t ref = { .offset = offset, .len = len };
+    return std::string((char*)&ref, sizeof(ref));
+}
+
+static kv_value_ref_t parse_value_ref(const kv_str_t & s)
+{
+    kv_value_ref_t ref;
+    assert(s.size() == sizeof(ref));
+    memcpy(&ref, s.data(), sizeof(ref));
+    return ref;
+}
+
+static const std::string *find_value(kv_db_t *db, uint64_t offset)
+{
+    auto v_it = db->value_cache.find(offset);
+    if (v_it == db->value_cache.end())
+        return NULL;
+    db->value_lru.splice(db->value_lru.end(), db->value_lru, v_it->second.second);
+    return &v_it->second.first;
+}
+
+static void cache_value(kv_db_t *db, uint64_t offset, const std::string & value)
+{
+    // Values take at most 1/8 of the memory limit
+    uint64_t limit = db->memory_limit/8;
+    if (value.size() > limit || db->value_cache.find(offset) != db->value_cache.end())
+        return;
+    while (db->value_cache_bytes + value.size() > limit)
+    {
+        auto v_it = db->value_cache.find(db->value_lru.front());
+        db->value_cache_bytes -= v_it->second.first.size();
+        db->value_cache.erase(v_it);
+        db->value_lru.pop_front();
+    }
+    db->value_lru.push_back(offset);
+    db->value_cache[offset] = std::make_pair(value, std::prev(db->value_lru.end()));
+    db->value_cache_bytes += value.size();
+}
+
+static uint64_t monotonic_ms()
+{
+    timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec*1000 + tv.tv_nsec/1000000;
+}
+
+static void seal_value_segment(kv_db_t *db, uint64_t seg, std::function<void()> cb)
+{
+    auto s_it = db->value_segs.find(seg);
+    assert(s_it != db->value_segs.end() && s_it->second.full && !s_it->second.inflight);
+    kv_value_segment_t hdr = {
+        .magic = KV_VALUE_SEGMENT_MAGIC,
+        .block_size = db->kv_block_size,
+        .sealed = KV_SEGMENT_SEALED,
+        .used = s_it->second.used,
+    };
+    db->value_segs.erase(s_it);
+    cluster_op_t *op = new cluster_op_t;
+    op->opcode = OSD_OP_WRITE;
+    op->inode = db->inode_id;
+    op->offset = seg;
+    op->len = db->kv_block_size;
+    op->iov.push_back(calloc_or_die(1, op->len), op->len);
+    memcpy(op->iov.buf[0].iov_base, &hdr, sizeof(hdr));
+    op->callback = [db, cb](cluster_op_t *op)
+    {
+        if (op->retval != op->len)
+        {
+            // The segment just won't be collected
+            fprintf(stderr, "K/V: Failed to seal value segment %ju: %s (code %d)\n",
+                op->offset, strerror(op->retval < 0 ? -op->retval : EIO), op->retval);
+        }
+        free(op->iov.buf[0].iov_base);
+        delete op;
+        if (cb)
+            cb();
+    };
+    db->cli->execute(op);
+}
+
+// Called when the record is referenced from a written leaf or isn't needed anymore
+static void release_value(kv_db_t *db, uint64_t offset)
+{
+    auto s_it = db->value_segs.find(offset - offset % db->ino_block_size);
+    assert(s_it != db->value_segs.end() && s_it->second.inflight > 0);
+    s_it->second.inflight--;
+    if (!s_it->second.inflight && s_it->second.full)
+        seal_value_segment(db, s_it->first, NULL);
+}
+
+static void start_value_segment(kv_db_t *db)
+{
+    uint64_t seg = db->alloc_ino_block();
+    db->value_seg = seg;
+    db->value_seg_ready = false;
+    kv_value_segment_t hdr = {
+        .magic = KV_VALUE_SEGMENT_MAGIC,
+        .block_size = db->kv_block_size,
+        .sealed = KV_SEGMENT_OPEN,
+    };
+    cluster_op_t *op = new cluster_op_t;
+    op->opcode = OSD_OP_WRITE;
+    op->inode = db->inode_id;
+    op->offset = seg;
+    // Claim the inode block like any new tree block: with a CAS write of its first version
+    op->version = 1+db->known_versions[seg/db->ino_block_size];
+    op->len = db->kv_block_size;
+    op->iov.push_back(calloc_or_die(1, op->len), op->len);
+    memcpy(op->iov.buf[0].iov_base, &hdr, sizeof(hdr));
+    op->callback = [db](cluster_op_t *op)
+    {
+        int res = op->retval == op->len ? 0 : (op->retval > 0 ? -EIO : op->retval);
+        free(op->iov.buf[0].iov_base);
+        if (res == 0)
+        {
+            db->known_versions[op->offset/db->ino_block_size] = op->version;
+            db->value_segs[op->offset] = (kv_open_segment_t){};
+            db->value_seg_ready = true;
+            db->value_seg_pos = db->kv_block_size;
+            db->value_seg_written = monotonic_ms();
+        }
+        delete op;
+        if (res == -EINTR)
+        {
+            // Somebody else got this block, try the next one
+            start_value_segment(db);
+            return;
+        }
+        if (res < 0)
+            db->value_seg = UINT64_MAX;
+        auto waiting = std::move(db->value_seg_waiting);
+        db->value_seg_waiting.clear();
+        for (auto & cb: waiting)
+            cb(res);
+    };
+    db->cli->execute(op);
+}
+
+// Append a value record to the current value segment. Records are written without CAS
+// because the segment belongs to this client. The record is held until release_value()
+static void write_value(kv_db_t *db, const std::string & key, const std::string & value, std::function<void(int, uint64_t)> cb)
+{
+    if (db->value_seg == UINT64_MAX || !db->value_seg_ready)
+    {
+        db->value_seg_waiting.push_back([=](int res)
+        {
+            if (res < 0)
+                cb(res, 0);
+            else
+                write_value(db, key, value, cb);
+        });
+        if (db->value_seg == UINT64_MAX)
+            start_value_segment(db);
+        return;
+    }
+    uint64_t rec_size = value_record_size(db, key.size(), value.size());
+    assert(value_fits(db, key, value));
+    uint64_t now = monotonic_ms();
+    if (db->value_seg_pos + rec_size > db->ino_block_size ||
+        now >= db->value_seg_written + db->value_seal_timeout*1000/2)
+    {
+        // Segment is full or stayed idle for so long that other clients may soon consider
+        // it abandoned and collect it, start the next one
+        auto & seg = db->value_segs[db->value_seg];
+        seg.full = true;
+        seg.used = db->value_seg_pos;
+        if (!seg.inflight)
+            seal_value_segment(db, db->value_seg, NULL);
+        db->value_seg = UINT64_MAX;
+        write_value(db, key, value, cb);
+        return;
+    }
+    uint64_t offset = db->value_seg + db->value_seg_pos;
+    db->value_seg_pos += rec_size;
+    db->value_seg_written = now;
+    db->value_segs[db->value_seg].inflight++;
+    kv_value_hdr_t hdr = {
+        .magic = KV_VALUE_MAGIC,
+        .key_len = (uint32_t)key.size(),
+        .value_len = (uint32_t)value.size(),
+    };
+    cluster_op_t *op = new cluster_op_t;
+    op->opcode = OSD_OP_WRITE;
+    op->inode = db->inode_id;
+    op->offset = offset;
+    op->len = rec_size;
+    uint8_t *buf = (uint8_t*)malloc_or_die(rec_size);
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf+sizeof(hdr), key.data(), key.size());
+    memcpy(buf+sizeof(hdr)+key.size(), value.data(), value.size());
+    memset(buf+sizeof(hdr)+key.size()+value.size(), 0, rec_size-sizeof(hdr)-key.size()-value.size());
+    op->iov.push_back(buf, rec_size);
+    db->stats.value_writes++;
+    op->callback = [db, value, cb](cluster_op_t *op)
+    {
+        int res = op->retval == op->len ? 0 : (op->retval > 0 ? -EIO : op->retval);
+        uint64_t offset = op->offset;
+        free(op->iov.buf[0].iov_base);
+        delete op;
+        if (res < 0)
+        {
+            release_value(db, offset);
+            cb(res, 0);
+        }
+        else if (db->immediate_commit)
+        {
+            cache_value(db, offset, value);
+            cb(0, offset);
+        }
+        else
+        {
+            // The value must be durable before the leaf referencing it
+            op = new cluster_op_t;
+            op->opcode = OSD_OP_SYNC;
+            op->callback = [db, offset, value, cb](cluster_op_t *op)
+            {
+                auto res = op->retval;
+                delete op;
+                if (res < 0)
+                    release_value(db, offset);
+                else
+                    cache_value(db, offset, value);
+                cb(res, res < 0 ? 0 : offset);
+            };
+            db->cli->execute(op);
+        }
+    };
+    db->cli->execute(op);
+}
+
+// Read a value record. Returns -EAGAIN if the record doesn't match the reference,
+// i.e. if the reference is outdated and the record was removed by the garbage collector
+static void read_value(kv_db_t *db, const std::string & key, const kv_value_ref_t & ref,
+    std::function<void(int, const std::string &)> cb)
+{
+    auto cached = find_value(db, ref.offset);
+    if (cached)
+    {
+        cb(0, *cached);
+        return;
+    }
+    cluster_op_t *op = new cluster_op_t;
+    op->opcode = OSD_OP_READ;
+    op->inode = db->inode_id;
+    op->offset = ref.offset;
+    op->len = value_record_size(db, key.size(), ref.len);
+    op->iov.push_back(malloc_or_die(op->len), op->len);
+    db->stats.value_reads++;
+    op->callback = [db, key, ref, cb](cluster_op_t *op)
+    {
+        int res = op->retval == op->len ? 0 : (op->retval > 0 ? -EIO : op->retval);
+        uint8_t *buf = (uint8_t*)op->iov.buf[0].iov_base;
+        kv_value_hdr_t *hdr = (kv_value_hdr_t*)buf;
+        std::string value;
+        if (res == 0)
+        {
+            if (hdr->magic != KV_VALUE_MAGIC || hdr->key_len != key.size() || hdr->value_len != ref.len ||
+                memcmp(buf+sizeof(kv_value_hdr_t), key.data(), key.size()) != 0)
+                res = -EAGAIN;
+            else
+            {
+                value.assign((char*)buf+sizeof(kv_value_hdr_t)+key.size(), ref.len);
+                cache_value(db, ref.offset, value);
+            }
+        }
+        free(buf);
+        delete op;
+        cb(res, value);
+    };
+    db->cli->execute(op);
+}
+
+// Check the CAS callback against an existing item or NULL. Returns 1 if the change is
+// allowed, 0 if it isn't, and -1 if the item references a value which isn't loaded yet
+static int check_cas(kv_db_t *db, const std::function<bool(int, const std::string &)> & cas_cb, kv_item_t *item)
+{
+    if (!cas_cb)
+        return 1;
+    if (!item)
+        return cas_cb(-ENOENT, "") ? 1 : 0;
+    if (!item->value_ref)
+        return cas_cb(0, item->second.str()) ? 1 : 0;
+    auto value = find_value(db, parse_value_ref(item->second).offset);
+    if (!value)
+        return -1;
+    // Copy the value because the callback may change the cache
+    return cas_cb(0, std::string(*value)) ? 1 : 0;
+}
+
+void kv_db_t::open(inode_t inode_id, json11::Json cfg, std::function<void(int)> cb)
+{
+    if (block_cache.size() > 0)
+    {
+        cb(-EINVAL);
+        return;
+    }
+    auto pool_it = cli->st_cli.pool_config.find(INODE_POOL(inode_id));
+    if (pool_it == cli->st_cli.pool_config.end())
+    {
+        cb(-EINVAL);
+        return;
+    }
+    auto & pool_cfg = pool_it->second;
+    uint32_t pg_data_size = (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
+    uint64_t kv_block_size = cfg["kv_block_size"].uint64_value();
+    if (!kv_block_size)
+        kv_block_size = 4096;
+    if ((pool_cfg.data_block_size*pg_data_size) % kv_block_size ||
+        kv_block_size < pool_cfg.bitmap_granularity)
+    {
+        cb(-EINVAL);
         return;
     }
     this->inode_id = inode_id;
@@ -545,16 +1549,37 @@ void kv_db_t::open(inode_t inode_id, json11::Json cfg, std::function<void(int)>
 void kv_db_t::set_config(json11::Json cfg)
 {
     this->memory_limit = cfg["kv_memory_limit"].is_null() ? 128*1024*1024 : cfg["kv_memory_limit"].uint64_value();
-    this->evict_max_misses = cfg["kv_evict_max_misses"].is_null() ? 10 : cfg["kv_evict_max_misses"].uint64_value();
-    this->evict_attempts_per_level = cfg["kv_evict_attempts_per_level"].is_null() ? 3 : cfg["kv_evict_attempts_per_level"].uint64_value();
-    this->evict_unused_age = cfg["kv_evict_unused_age"].is_null() ? 1000 : cfg["kv_evict_unused_age"].uint64_value();
-    this->cache_max_blocks = this->memory_limit / this->kv_block_size;
+    this->cache_cold_target = this->memory_limit/4;
     this->max_allocate_blocks = cfg["kv_allocate_blocks"].uint64_value() ? cfg["kv_allocate_blocks"].uint64_value() : 4;
     this->log_level = !cfg["kv_log_level"].is_null() ? cfg["kv_log_level"].uint64_value() : 1;
+    // Old clients can't read V2 blocks, so allow to keep writing V1 blocks
+    this->block_format = cfg["kv_block_format"].uint64_value() == KV_BLOCK_FORMAT_V1 ? KV_BLOCK_FORMAT_V1 : KV_BLOCK_FORMAT_V2;
+    // Values of at least this size are stored outside of leaves, 0 = disabled. Requires V2 blocks
+    this->value_separation = cfg["kv_value_separation"].uint64_value();
+    // Adjacent leaves are merged if they fit into this percentage of a block together
+    this->merge_fill = cfg["kv_merge_fill"].uint64_value() ? cfg["kv_merge_fill"].uint64_value() : 50;
+    if (this->merge_fill > 90)
+        this->merge_fill = 90;
+    this->auto_compact = json_is_true(cfg["kv_auto_compact"]);
+    // Unsealed value segments left by crashed clients are collected after this number of seconds
+    // without writes. Clients start a new segment after half of this time without writes
+    this->value_seal_timeout = cfg["kv_value_seal_timeout"].uint64_value()
+        ? cfg["kv_value_seal_timeout"].uint64_value() : 600;
 }
 
 void kv_db_t::close(std::function<void()> cb)
 {
+    if (active_ops <= 0 && value_seg != UINT64_MAX && value_seg_ready)
+    {
+        // Seal the current value segment so that it can be collected later
+        auto & seg = value_segs[value_seg];
+        seg.full = true;
+        seg.used = value_seg_pos;
+        closing = true;
+        seal_value_segment(this, value_seg, [this, cb]() { close(cb); });
+        value_seg = UINT64_MAX;
+        return;
+    }
     if (active_ops <= 0)
     {
         closing = false;
@@ -566,6 +1591,22 @@ void kv_db_t::close(std::function<void()> cb)
         immediate_commit = false;
         block_cache.clear();
         known_versions.clear();
+        for (int i = 0; i < 2; i++)
+        {
+            cache_lists[i].clear();
+            cache_hands[i] = cache_lists[i].end();
+        }
+        cache_ghosts.clear();
+        cache_ghost_map.clear();
+        cache_bytes = cache_hot_bytes = 0;
+        value_seg = UINT64_MAX;
+        value_seg_ready = false;
+        value_segs.clear();
+        idle_segs.clear();
+        value_lru.clear();
+        value_cache.clear();
+        value_cache_bytes = 0;
+        compact_hints.clear();
         cb();
     }
     else
@@ -575,6 +1616,27 @@ void kv_db_t::close(std::function<void()> cb)
     }
 }
 
+// Allocate a new inode block in the end of the index
+uint64_t kv_db_t::alloc_ino_block()
+{
+    auto known_max = known_versions.end();
+    while (known_max != known_versions.begin())
+    {
+        known_max--;
+        // try v0 and only v0 of a new inode block
+        if (known_max->second != 0)
+        {
+            auto probably_unused = (known_max->first+1)*ino_block_size;
+            if (next_free < probably_unused)
+                next_free = probably_unused;
+            break;
+        }
+    }
+    auto offset = next_free;
+    next_free += ino_block_size;
+    return offset;
+}
+
 uint64_t kv_db_t::alloc_block()
 {
     // select from at least <max_allocate_blocks> allocation blocks
@@ -602,26 +1664,11 @@ uint64_t kv_db_t::alloc_block()
     }
     if (allocating_blocks[allocating_block_pos].offset == UINT64_MAX)
     {
-        // allocate new blocks in the end
-        auto known_max = known_versions.end();
-        while (known_max != known_versions.begin())
-        {
-            known_max--;
-            // try v0 and only v0 of a new inode block
-            if (known_max->second != 0)
-            {
-                auto probably_unused = (known_max->first+1)*ino_block_size;
-                if (next_free < probably_unused)
-                    next_free = probably_unused;
-                break;
-            }
-        }
         allocating_blocks[allocating_block_pos] = {
-            .offset = next_free,
+            .offset = alloc_ino_block(),
             .writing = false,
             .confirmed = false,
         };
-        next_free += ino_block_size;
     }
     auto pos = allocating_blocks[allocating_block_pos].offset;
     allocating_blocks[allocating_block_pos].writing = true;
@@ -742,6 +1789,11 @@ void kv_db_t::run_continue_update(uint64_t offset)
         continue_update.erase(b_it);
         cb();
     }
+    else
+    {
+        // All other waiters are done, write queued leaf changes
+        flush_leaf_updates(offset);
+    }
 }
 
 void kv_db_t::stop_updating(kv_block_t *blk)
@@ -752,14 +1804,80 @@ void kv_db_t::stop_updating(kv_block_t *blk)
         run_continue_update(blk->offset);
 }
 
-static void del_block_level(kv_db_t *db, kv_block_t *blk)
+static uint64_t block_mem_size(kv_block_t *blk)
+{
+    return sizeof(kv_block_t) + blk->data.mem_size() +
+        blk->key_ge.capacity() + blk->key_lt.capacity() + blk->right_half.capacity();
+}
+
+static void cache_resize(kv_db_t *db, kv_block_t *blk)
+{
+    uint64_t size = block_mem_size(blk);
+    db->cache_bytes += size - blk->cache_size;
+    if (blk->cache_hot)
+        db->cache_hot_bytes += size - blk->cache_size;
+    blk->cache_size = size;
+}
+
+static void cache_touch(kv_db_t *db, kv_block_t *blk)
+{
+    blk->cache_ref = true;
+    if (blk->cache_list >= 0)
+        cache_resize(db, blk);
+}
+
+static void cache_del_block(kv_db_t *db, kv_block_t *blk)
+{
+    if (blk->cache_list < 0)
+        return;
+    auto & hand = db->cache_hands[blk->cache_list];
+    if (hand == blk->cache_it)
+        hand++;
+    db->cache_lists[blk->cache_list].erase(blk->cache_it);
+    db->cache_bytes -= blk->cache_size;
+    if (blk->cache_hot)
+        db->cache_hot_bytes -= blk->cache_size;
+    blk->cache_list = -1;
+    blk->cache_hot = false;
+    blk->cache_size = 0;
+}
+
+static void cache_add_block(kv_db_t *db, kv_block_t *blk)
 {
-    db->block_levels.erase((((uint64_t)(db->base_block_level+blk->level) & 0xFFFF) << (64-LEVEL_BITS)) | (blk->offset/db->kv_block_size));
+    assert(blk->cache_list < 0);
+    blk->cache_list = blk->type == KV_LEAF || blk->type == KV_LEAF_SPLIT ? KV_CACHE_LEAF : KV_CACHE_INNER;
+    blk->cache_ref = false;
+    blk->cache_hot = false;
+    auto g_it = db->cache_ghost_map.find(blk->offset);
+    if (g_it != db->cache_ghost_map.end())
+    {
+        // Leaf was evicted too early => start it as hot and give more space to cold blocks
+        db->cache_ghosts.erase(g_it->second);
+        db->cache_ghost_map.erase(g_it);
+        db->stats.cache_ghost_hits++;
+        blk->cache_hot = true;
+        if (db->cache_cold_target + db->kv_block_size <= db->memory_limit/2)
+            db->cache_cold_target += db->kv_block_size;
+    }
+    // Insert just behind the hand, i.e. visit it last
+    blk->cache_it = db->cache_lists[blk->cache_list].insert(db->cache_hands[blk->cache_list], blk->offset);
+    blk->cache_size = 0;
+    cache_resize(db, blk);
 }
 
-static void add_block_level(kv_db_t *db, kv_block_t *blk)
+static void cache_add_ghost(kv_db_t *db, uint64_t offset)
 {
-    db->block_levels.insert((((uint64_t)(db->base_block_level+blk->level) & 0xFFFF) << (64-LEVEL_BITS)) | (blk->offset/db->kv_block_size));
+    db->cache_ghosts.push_back(offset);
+    db->cache_ghost_map[offset] = std::prev(db->cache_ghosts.end());
+    // Remember at most as many ghosts as there are resident leaves
+    while (db->cache_ghosts.size() > db->cache_lists[KV_CACHE_LEAF].size()+1)
+    {
+        // Ghost expired without being reused => give less space to cold blocks
+        db->cache_ghost_map.erase(db->cache_ghosts.front());
+        db->cache_ghosts.pop_front();
+        if (db->cache_cold_target >= db->memory_limit/32 + db->kv_block_size)
+            db->cache_cold_target -= db->kv_block_size;
+    }
 }
 
 static void invalidate(kv_db_t *db, uint64_t offset, uint64_t version)
@@ -786,7 +1904,7 @@ static void invalidate(kv_db_t *db, uint64_t offset, uint64_t version)
             else
             {
                 auto blk = &b_it->second;
-                del_block_level(db, blk);
+                cache_del_block(db, blk);
                 db->block_cache.erase(b_it++);
             }
         }
@@ -794,73 +1912,103 @@ static void invalidate(kv_db_t *db, uint64_t offset, uint64_t version)
     }
 }
 
-static uint64_t get_max_level(kv_db_t *db)
-{
-    auto el_it = db->block_levels.end();
-    if (el_it == db->block_levels.begin())
-    {
-        return 0;
-    }
-    el_it--;
-    return (*el_it >> (64-LEVEL_BITS));
-}
-
+// Run the CLOCK hand until the cache fits into memory_limit. Referenced cold blocks become hot,
+// unreferenced hot blocks become cold when hot blocks exceed their share, unreferenced cold blocks
+// are evicted. Leaves are evicted first, hot leaves are forcibly demoted only if nothing else
+// can be evicted, and inner nodes are evicted only when there are no evictable leaves at all
 static void try_evict(kv_db_t *db)
 {
-    // Evict blocks from cache based on memory limit and block level
-    if (db->cache_max_blocks <= 10 || db->block_cache.size() <= db->cache_max_blocks)
+    for (int pass = 0; pass < 3 && db->cache_bytes > db->memory_limit; pass++)
     {
-        return;
-    }
-    for (uint64_t evict_level = get_max_level(db); evict_level > 0; evict_level--)
-    {
-        // Do <evict_attempts_per_level> eviction attempts at random block positions per each block level
-        for (int attempt = 0; attempt < db->evict_attempts_per_level; attempt++)
+        int list = pass < 2 ? KV_CACHE_LEAF : KV_CACHE_INNER;
+        bool force = pass > 0;
+        auto & lst = db->cache_lists[list];
+        auto & hand = db->cache_hands[list];
+        // Each block has to be visited at most 3 times to be evicted
+        size_t visits = 3*lst.size();
+        while (lst.size() > 0 && visits > 0 && db->cache_bytes > db->memory_limit)
         {
-            auto start_it = db->block_levels.lower_bound(evict_level << (64-LEVEL_BITS));
-            auto end_it = db->block_levels.lower_bound((evict_level+1) << (64-LEVEL_BITS));
-            if (start_it == end_it)
-                continue;
-            end_it--;
-            if (start_it == end_it)
-                continue;
-            auto random_pos = *start_it + (lrand48() % (*end_it - *start_it));
-            auto random_it = db->block_levels.lower_bound(random_pos);
-            int misses = 0;
-            bool wrapped = false;
-            while (db->block_cache.size() > db->cache_max_blocks &&
-                (db->evict_max_misses <= 0 || misses < db->evict_max_misses))
-            {
-                if (random_it == db->block_levels.end() || (*random_it >> (64-LEVEL_BITS)) > evict_level)
-                {
-                    if (wrapped)
-                        break;
-                    random_it = db->block_levels.lower_bound(evict_level << (64-LEVEL_BITS));
-                    wrapped = true;
-                }
-                else if (wrapped && *random_it >= random_pos)
-                    break;
-                auto b_it = db->block_cache.find((*random_it & NO_LEVEL_MASK) * db->kv_block_size);
-                auto blk = &b_it->second;
-                if (b_it != db->block_cache.end() && !blk->updating && blk->usage < db->usage_counter)
-                {
-                    db->block_cache.erase(b_it);
-                    db->block_levels.erase(random_it++);
-                }
-                else
+            visits--;
+            if (hand == lst.end())
+                hand = lst.begin();
+            auto b_it = db->block_cache.find(*hand);
+            assert(b_it != db->block_cache.end());
+            auto blk = &b_it->second;
+            cache_resize(db, blk);
+            if (blk->updating > 0)
+            {
+                hand++;
+            }
+            else if (blk->cache_ref)
+            {
+                blk->cache_ref = false;
+                if (!blk->cache_hot && list == KV_CACHE_LEAF)
                 {
-                    random_it++;
-                    misses++;
+                    blk->cache_hot = true;
+                    db->cache_hot_bytes += blk->cache_size;
                 }
+                hand++;
             }
-            if (db->block_cache.size() <= db->cache_max_blocks)
+            else if (blk->cache_hot && !force && db->cache_hot_bytes + db->cache_cold_target <= db->memory_limit)
             {
-                return;
+                hand++;
+            }
+            else if (blk->cache_hot)
+            {
+                blk->cache_hot = false;
+                db->cache_hot_bytes -= blk->cache_size;
+                hand++;
+            }
+            else
+            {
+                if (list == KV_CACHE_LEAF)
+                    cache_add_ghost(db, blk->offset);
+                cache_del_block(db, blk);
+                db->block_cache.erase(b_it);
+                db->stats.cache_evictions++;
             }
         }
     }
 }
 
+static void send_version_probe(kv_db_t *db, uint64_t offset)
+{
+    auto & probe = db->version_probes[offset/db->ino_block_size];
+    probe.inflight = true;
+    probe.cur.swap(probe.next);
+    cluster_op_t *op = new cluster_op_t;
+    op->opcode = OSD_OP_READ;
+    op->inode = db->inode_id;
+    op->offset = offset;
+    op->len = 0;
+    op->callback = [db](cluster_op_t *op)
+    {
+        int res = op->retval == 0 ? 0 : (op->retval > 0 ? -EIO : op->retval);
+        if (res == 0)
+            invalidate(db, op->offset, op->version);
+        auto p_it = db->version_probes.find(op->offset/db->ino_block_size);
+        auto cbs = std::move(p_it->second.cur);
+        p_it->second.cur.clear();
+        if (p_it->second.next.size())
+            send_version_probe(db, op->offset);
+        else
+            db->version_probes.erase(p_it);
+        delete op;
+        for (auto & cb: cbs)
+            cb(res);
+    };
+    db->cli->execute(op);
+}
+
+// Recheck the version of an inode block and invalidate cached blocks if it changed
+static void probe_version(kv_db_t *db, uint64_t offset, std::function<void(int)> cb)
+{
+    auto & probe = db->version_probes[offset/db->ino_block_size];
+    probe.next.push_back(cb);
+    if (!probe.inflight)
+        send_version_probe(db, offset);
+}
+
 static void get_block(kv_db_t *db, uint64_t offset, int cur_level, int recheck_policy, std::function<void(int, int)> cb)
 {
     auto b_it = db->block_cache.find(offset);
@@ -880,37 +2028,64 @@ static void get_block(kv_db_t *db, uint64_t offset, int cur_level, int recheck_p
             return;
         }
         // Block already in cache, we can proceed
-        blk->usage = db->usage_counter;
+        cache_touch(db, blk);
+        db->stats.cache_hits++;
         cb(0, BLK_UPDATING);
         return;
     }
-    cluster_op_t *op = new cluster_op_t;
-    op->opcode = OSD_OP_READ;
-    op->inode = db->inode_id;
-    op->offset = offset;
     if (b_it != db->block_cache.end() && !b_it->second.invalidated && !b_it->second.updating)
     {
         // just recheck version - it's cheaper than re-reading the block
-        op->len = 0;
-    }
-    else
-    {
-        op->len = db->kv_block_size;
-        op->iov.push_back(malloc_or_die(op->len), op->len);
-    }
-    op->callback = [=](cluster_op_t *op)
-    {
-        if (op->retval != op->len)
+        probe_version(db, offset, [=](int res)
         {
-            // error
-            if (op->len)
-                free(op->iov.buf[0].iov_base);
-            cb(op->retval >= 0 ? -EIO : op->retval, BLK_NOCHANGE);
-            delete op;
-            return;
-        }
-        invalidate(db, op->offset, op->version);
-        auto blk_it = db->block_cache.find(op->offset);
+            if (res < 0)
+            {
+                cb(res, BLK_NOCHANGE);
+                return;
+            }
+            auto blk_it = db->block_cache.find(offset);
+            if (blk_it == db->block_cache.end() || blk_it->second.invalidated && !blk_it->second.updating)
+            {
+                // Version check failed, re-read block
+                get_block(db, offset, cur_level, recheck_policy, cb);
+                return;
+            }
+            auto blk = &blk_it->second;
+            if (blk->updating > 0 && recheck_policy == KV_RECHECK_WAIT)
+            {
+                // Wait until block update stops
+                db->continue_update.emplace(blk->offset, [=, blk_offset = blk->offset]()
+                {
+                    get_block(db, offset, cur_level, recheck_policy, cb);
+                    db->run_continue_update(blk_offset);
+                });
+                return;
+            }
+            cache_touch(db, blk);
+            db->stats.cache_hits++;
+            cb(0, blk->updating > 0 ? BLK_UPDATING : BLK_NOCHANGE);
+        });
+        return;
+    }
+    cluster_op_t *op = new cluster_op_t;
+    op->opcode = OSD_OP_READ;
+    op->inode = db->inode_id;
+    op->offset = offset;
+    op->len = db->kv_block_size;
+    op->iov.push_back(malloc_or_die(op->len), op->len);
+    db->stats.cache_misses++;
+    op->callback = [=](cluster_op_t *op)
+    {
+        if (op->retval != op->len)
+        {
+            // error
+            free(op->iov.buf[0].iov_base);
+            cb(op->retval >= 0 ? -EIO : op->retval, BLK_NOCHANGE);
+            delete op;
+            return;
+        }
+        invalidate(db, op->offset, op->version);
+        auto blk_it = db->block_cache.find(op->offset);
         if (blk_it != db->block_cache.end() &&
             // read may start BEFORE update and end AFTER update, in this case known will be > returned version
             (db->known_versions[op->offset/db->ino_block_size] >= op->version && !blk_it->second.invalidated || blk_it->second.updating > 0))
@@ -919,8 +2094,7 @@ static void get_block(kv_db_t *db, uint64_t offset, int cur_level, int recheck_p
             if (blk->updating > 0 && recheck_policy == KV_RECHECK_WAIT)
             {
                 // Wait until block update stops
-                if (op->len)
-                    free(op->iov.buf[0].iov_base);
+                free(op->iov.buf[0].iov_base);
                 delete op;
                 db->continue_update.emplace(blk->offset, [=, blk_offset = blk->offset]()
                 {
@@ -929,30 +2103,24 @@ static void get_block(kv_db_t *db, uint64_t offset, int cur_level, int recheck_p
                 });
                 return;
             }
-            blk->usage = db->usage_counter;
+            cache_touch(db, blk);
             cb(0, blk->updating > 0 ? BLK_UPDATING : BLK_NOCHANGE);
         }
         else
         {
-            if (!op->len)
-            {
-                // Version check failed, re-read block
-                delete op;
-                get_block(db, offset, cur_level, recheck_policy, cb);
-                return;
-            }
             auto blk = &db->block_cache[op->offset];
             if (blk_it != db->block_cache.end())
             {
-                del_block_level(db, blk);
+                cache_del_block(db, blk);
                 *blk = {};
             }
-            int err = blk->parse(op->offset, (uint8_t*)op->iov.buf[0].iov_base, op->len);
+            int err = blk->parse(op->offset, (uint8_t*)op->iov.buf[0].iov_base, op->len, db->block_format);
             if (err == 0)
             {
+                // Buffer is now owned by the block
+                op->iov.buf[0].iov_base = NULL;
                 blk->level = cur_level;
-                blk->usage = db->usage_counter;
-                add_block_level(db, blk);
+                cache_add_block(db, blk);
                 cb(0, BLK_RELOADED);
             }
             else
@@ -962,8 +2130,7 @@ static void get_block(kv_db_t *db, uint64_t offset, int cur_level, int recheck_p
             }
             try_evict(db);
         }
-        if (op->len)
-            free(op->iov.buf[0].iov_base);
+        free(op->iov.buf[0].iov_base);
         delete op;
     };
     db->cli->execute(op);
@@ -974,17 +2141,13 @@ void kv_op_t::exec()
     if (started)
         return;
     started = true;
+    clock_gettime(CLOCK_MONOTONIC, &tv_begin);
     db->active_ops++;
     if (!db->inode_id || db->closing)
     {
         finish(-EINVAL);
         return;
     }
-    if (++db->evict_unused_counter >= db->evict_unused_age)
-    {
-        db->evict_unused_counter = 0;
-        db->usage_counter++;
-    }
     cur_level = -db->base_block_level;
     if (opcode == KV_LIST)
     {
@@ -992,10 +2155,52 @@ void kv_op_t::exec()
         path.push_back((kv_path_t){ .offset = 0 });
     }
     recheck_policy = (opcode == KV_GET ? KV_RECHECK_LEAF : KV_RECHECK_NONE);
-    if (opcode == KV_GET || opcode == KV_GET_CACHED)
+    if ((opcode == KV_GET || opcode == KV_GET_CACHED) && reads.size())
+    {
+        // Read keys in sorted order to visit each leaf only once
+        read_order.resize(reads.size());
+        for (int i = 0; i < reads.size(); i++)
+            read_order[i] = i;
+        std::sort(read_order.begin(), read_order.end(), [this](int a, int b)
+        {
+            return reads[a].key < reads[b].key;
+        });
+        read_pos = 0;
+        key = reads[read_order[0]].key;
+        get();
+    }
+    else if (opcode == KV_GET || opcode == KV_GET_CACHED)
         get();
     else if (opcode == KV_SET || opcode == KV_DEL)
-        update();
+    {
+        if (opcode == KV_SET && !value_ref && is_separated(db, value) && !value_fits(db, key, value))
+        {
+            finish(-EINVAL);
+            return;
+        }
+        write_values([this]() { update(); });
+    }
+    else if (opcode == KV_BATCH)
+    {
+        std::set<std::string> keys;
+        for (auto & w: batch)
+        {
+            if (!w.del && (is_separated(db, w.value)
+                ? (!value_fits(db, w.key, w.value) || kv_block_t::kv_size(w.key, make_value_ref(0, 0)) > (db->kv_block_size-sizeof(kv_stored_block_t)) / 4)
+                : kv_block_t::kv_size(w.key, w.value) > (db->kv_block_size-sizeof(kv_stored_block_t)) / 4) ||
+                !keys.insert(w.key).second)
+            {
+                // Item is too large or duplicate
+                batch_res.assign(batch.size(), -ECANCELED);
+                finish(-EINVAL);
+                return;
+            }
+        }
+        if (next_batch_item() < 0)
+            finish(0);
+        else
+            write_values([this]() { update(); });
+    }
     else if (opcode == KV_LIST)
     {
         // Do nothing, next() does everything
@@ -1016,9 +2221,21 @@ kv_op_t::~kv_op_t()
 void kv_op_t::finish(int res)
 {
     auto db = this->db;
+    for (auto offset: held_values)
+        release_value(db, offset);
+    held_values.clear();
     this->res = res;
     this->done = true;
     db->active_ops--;
+    if (opcode != KV_LIST)
+    {
+        timespec tv_end;
+        clock_gettime(CLOCK_MONOTONIC, &tv_end);
+        auto & op_stat = (opcode == KV_SET ? db->stats.set_ops : (opcode == KV_DEL ? db->stats.del_ops
+            : (opcode == KV_BATCH ? db->stats.batch_ops : db->stats.get_ops)));
+        op_stat.count++;
+        op_stat.usec += (tv_end.tv_sec - tv_begin.tv_sec)*1000000 + (tv_end.tv_nsec - tv_begin.tv_nsec)/1000;
+    }
     (std::function<void(kv_op_t *)>(callback))(this);
     if (!db->active_ops && db->closing)
         db->close(db->on_close);
@@ -1040,6 +2257,13 @@ void kv_op_t::get()
                 fprintf(stderr, "K/V: Hit empty block %ju while searching\n", cur_block);
                 finish(-EILSEQ);
             }
+            else if (reads.size())
+            {
+                // Empty DB
+                for (; read_pos < read_order.size(); read_pos++)
+                    reads[read_order[read_pos]].res = -ENOENT;
+                finish(0);
+            }
             else
                 finish(-ENOENT);
         }
@@ -1049,22 +2273,142 @@ void kv_op_t::get()
         }
         else
         {
-            auto blk = &db->block_cache.at(cur_block);
-            auto kv_it = blk->data.find(key);
-            if (kv_it == blk->data.end())
+            get_leaf(&db->block_cache.at(cur_block));
+        }
+    });
+}
+
+void kv_op_t::get_leaf(kv_block_t *blk)
+{
+    if (!reads.size())
+    {
+        auto kv_it = blk->data.find(key);
+        if (kv_it == blk->data.end())
+        {
+            finish(-ENOENT);
+        }
+        else if (kv_it->value_ref && resolve_refs)
+        {
+            load_value(blk->offset, key, kv_it->second, [this](int res, const std::string & value)
             {
-                finish(-ENOENT);
-            }
-            else
+                if (res == -EAGAIN)
+                    restart_get();
+                else
+                {
+                    this->value = value;
+                    finish(res);
+                }
+            });
+        }
+        else
+        {
+            this->res = 0;
+            this->value = kv_it->second.str();
+            this->value_ref = kv_it->value_ref;
+            finish(0);
+        }
+        return;
+    }
+    // Serve all following keys residing in the same leaf
+    auto & key_lt = blk->type == KV_LEAF_SPLIT ? blk->right_half : blk->key_lt;
+    while (read_pos < read_order.size())
+    {
+        auto & rd = reads[read_order[read_pos]];
+        if (rd.key < blk->key_ge || key_lt != "" && rd.key >= key_lt)
+            break;
+        auto kv_it = blk->data.find(rd.key);
+        auto cached = kv_it != blk->data.end() && kv_it->value_ref
+            ? find_value(db, parse_value_ref(kv_it->second).offset) : NULL;
+        if (kv_it != blk->data.end() && kv_it->value_ref && !cached)
+        {
+            // Load the value and continue with the next key from the root
+            load_value(blk->offset, rd.key, kv_it->second, [this](int res, const std::string & value)
             {
-                this->res = 0;
-                this->value = kv_it->second;
-                finish(0);
-            }
+                if (res < 0 && res != -EAGAIN)
+                {
+                    finish(res);
+                    return;
+                }
+                if (res == 0)
+                {
+                    reads[read_order[read_pos]].res = 0;
+                    reads[read_order[read_pos]].value = value;
+                    read_pos++;
+                }
+                if (read_pos >= read_order.size())
+                    finish(0);
+                else
+                    restart_get();
+            });
+            return;
+        }
+        rd.res = kv_it == blk->data.end() ? -ENOENT : 0;
+        rd.value = kv_it == blk->data.end() ? "" : (cached ? *cached : kv_it->second.str());
+        read_pos++;
+    }
+    if (read_pos >= read_order.size())
+    {
+        finish(0);
+        return;
+    }
+    restart_get();
+}
+
+// Find the next leaf starting from the root. Inner blocks are usually cached,
+// so only leaves are actually read
+void kv_op_t::restart_get()
+{
+    if (reads.size())
+        key = reads[read_order[read_pos]].key;
+    prev_key_ge = prev_key_lt = "";
+    cur_level = -db->base_block_level;
+    cur_block = 0;
+    retry = 0;
+    updating_on_path = 0;
+    recheck_policy = (opcode == KV_GET ? KV_RECHECK_LEAF : KV_RECHECK_NONE);
+    get();
+}
+
+// Load a separately stored value referenced from a cached leaf. If the record doesn't match
+// the reference, the value was moved by the garbage collector and the leaf is outdated.
+// In this case the leaf version is rechecked and -EAGAIN is returned to restart the operation
+void kv_op_t::load_value(uint64_t leaf_offset, const std::string & key, const kv_str_t & ref,
+    std::function<void(int, const std::string &)> cb)
+{
+    read_value(db, key, parse_value_ref(ref), [=](int res, const std::string & value)
+    {
+        if (res != -EAGAIN)
+        {
+            cb(res, value);
+            return;
         }
+        auto old_version = db->known_versions[leaf_offset/db->ino_block_size];
+        probe_version(db, leaf_offset, [=](int res)
+        {
+            if (res == 0 && db->known_versions[leaf_offset/db->ino_block_size] == old_version)
+            {
+                fprintf(stderr, "K/V: Value of %s referenced from block %ju is missing\n", key.c_str(), leaf_offset);
+                res = -EILSEQ;
+            }
+            cb(res == 0 ? -EAGAIN : res, "");
+        });
     });
 }
 
+// Merges may move the right boundary of a leaf, so a parent read before a merge
+// doesn't prove that the split is finished. Only a reference to the right half does
+bool kv_op_t::parent_has_split(kv_block_t *blk)
+{
+    if (path.size() < 2)
+        return true;
+    auto p_it = db->block_cache.find(path[path.size()-2].offset);
+    if (p_it == db->block_cache.end())
+        return false;
+    auto ref_it = p_it->second.data.find(blk->right_half);
+    return ref_it != p_it->second.data.end() && ref_it->second.size() == sizeof(uint64_t) &&
+        *(uint64_t*)ref_it->second.data() == blk->right_half_block;
+}
+
 int kv_op_t::handle_block(int res, int refresh, bool stop_on_split)
 {
     if (res < 0)
@@ -1081,7 +2425,8 @@ int kv_op_t::handle_block(int res, int refresh, bool stop_on_split)
         assert(path.size() > 0);
         path[path.size()-1].version = blk->invalidated ? 0 : db->known_versions[cur_block/db->ino_block_size];
     }
-    if (key < blk->key_ge || blk->key_lt.size() && key >= blk->key_lt)
+    if (key < blk->key_ge || blk->key_lt.size() && key >= blk->key_lt ||
+        is_merged(blk) && !blk->right_half_block)
     {
         // We got an unrelated block - recheck the whole chain from the beginning
         // May happen during split:
@@ -1091,6 +2436,7 @@ int kv_op_t::handle_block(int res, int refresh, bool stop_on_split)
         // 4) A = [a, c)
         // We may read P on step (1), get a link to A, and read A on step (4).
         // It will miss data from [c, b).
+        // Also happens when the only child of the root is merged into the root.
         // Retry once. If we don't see any updates after retrying - fail with EILSEQ.
         bool fatal = !this->updating_on_path && this->retry > 0;
         if (fatal || db->log_level > 0)
@@ -1133,13 +2479,23 @@ int kv_op_t::handle_block(int res, int refresh, bool stop_on_split)
         }
         return -EAGAIN;
     }
-    if (stop_on_split && (blk->type == KV_LEAF_SPLIT || blk->type == KV_INT_SPLIT) &&
-        (prev_key_lt == "" || prev_key_lt > blk->right_half))
+    bool frozen = is_frozen(blk);
+    if (frozen && stop_on_split && blk->type == KV_LEAF_SPLIT)
+    {
+        // Leaf is being merged, wait until the merge finishes
+        return -EBUSY;
+    }
+    if (stop_on_split && (blk->type == KV_LEAF_SPLIT || blk->type == KV_INT_SPLIT) && !frozen && !is_merged(blk) &&
+        (prev_key_lt == "" || prev_key_lt > blk->right_half || !parent_has_split(blk)))
     {
         return -ECHILD;
     }
-    else if ((blk->type == KV_INT_SPLIT || blk->type == KV_LEAF_SPLIT) && key >= blk->right_half)
+    else if ((blk->type == KV_INT_SPLIT || blk->type == KV_LEAF_SPLIT) && !frozen && key >= blk->right_half)
     {
+        // Follow the right half of a split block or the block which took data of a merged one.
+        // The latter is to the left, so its cached copy may still point here
+        if (is_merged(blk) && recheck_policy != KV_RECHECK_WAIT)
+            recheck_policy = KV_RECHECK_ALL;
         cur_block = blk->right_half_block;
         if (opcode != KV_GET && opcode != KV_GET_CACHED)
         {
@@ -1165,7 +2521,7 @@ int kv_op_t::handle_block(int res, int refresh, bool stop_on_split)
         }
         auto m = child_it == blk->data.end()
             ? (blk->type == KV_LEAF_SPLIT || blk->type == KV_INT_SPLIT
-                ? blk->right_half : blk->key_lt) : child_it->first;
+                ? blk->right_half : blk->key_lt) : child_it->first.str();
         child_it--;
         if (child_it->second.size() != sizeof(uint64_t))
         {
@@ -1174,7 +2530,7 @@ int kv_op_t::handle_block(int res, int refresh, bool stop_on_split)
             return -EILSEQ;
         }
         // Track left and right boundaries which have led us to cur_block
-        prev_key_ge = child_it->first;
+        prev_key_ge = child_it->first.str();
         prev_key_lt = m;
         cur_level++;
         cur_block = *((uint64_t*)child_it->second.data());
@@ -1187,6 +2543,17 @@ int kv_op_t::handle_block(int res, int refresh, bool stop_on_split)
     return 0;
 }
 
+// Shortest key <= next which is still greater than prev
+static std::string leaf_separator(const kv_str_t & prev, const kv_str_t & next)
+{
+    int i = 0;
+    while (i < next.size() && i < prev.size() && next[i] == prev[i])
+    {
+        i++;
+    }
+    return i < next.size() ? next.substr(0, i+1) : next.str();
+}
+
 static std::string find_splitter(kv_db_t *db, kv_block_t *blk)
 {
     uint32_t new_size = blk->data_size;
@@ -1194,24 +2561,20 @@ static std::string find_splitter(kv_db_t *db, kv_block_t *blk)
     while (d_it != blk->data.begin() && new_size > db->kv_block_size/2)
     {
         d_it--;
-        new_size -= kv_block_t::kv_size(d_it->first, d_it->second);
+        new_size -= kv_item_size(blk->format, d_it != blk->data.begin() ? &std::prev(d_it)->first : NULL,
+            d_it->first, d_it->second);
     }
     assert(d_it != blk->data.begin() && d_it != blk->data.end());
     if (blk->type != KV_LEAF && blk->type != KV_LEAF_SPLIT)
     {
-        return d_it->first;
-    }
-    auto prev_it = std::prev(d_it);
-    int i = 0;
-    while (i < d_it->first.size() && i < prev_it->first.size() && d_it->first[i] == prev_it->first[i])
-    {
-        i++;
+        return d_it->first.str();
     }
-    auto separator = i < d_it->first.size() ? d_it->first.substr(0, i+1) : d_it->first;
-    return separator;
+    return leaf_separator(std::prev(d_it)->first, d_it->first);
 }
 
-static void write_block(kv_db_t *db, kv_block_t *blk, std::function<void(int)> cb)
+// Write block with CAS, serializing writes into the same inode block.
+// With sync=false, the write isn't followed by a SYNC even without immediate_commit
+static void write_block(kv_db_t *db, kv_block_t *blk, std::function<void(int)> cb, bool sync = true)
 {
     if (blk->invalidated)
     {
@@ -1230,7 +2593,7 @@ static void write_block(kv_db_t *db, kv_block_t *blk, std::function<void(int)> c
     if (new_version != 0)
     {
         // Wait if block is being modified
-        db->continue_write.emplace(blk->offset/db->ino_block_size, (kv_continue_write_t){ .blk = blk, .cb = cb });
+        db->continue_write.emplace(blk->offset/db->ino_block_size, (kv_continue_write_t){ .blk = blk, .cb = cb, .sync = sync });
         return;
     }
     new_version = 1+db->known_versions[blk->offset/db->ino_block_size];
@@ -1251,7 +2614,7 @@ static void write_block(kv_db_t *db, kv_block_t *blk, std::function<void(int)> c
         abort();
         return;
     }
-    op->callback = [db, blk, cb](cluster_op_t *op)
+    op->callback = [db, blk, cb, sync](cluster_op_t *op)
     {
         db->new_versions.erase(blk->offset/db->ino_block_size);
         free(op->iov.buf[0].iov_base);
@@ -1265,7 +2628,7 @@ static void write_block(kv_db_t *db, kv_block_t *blk, std::function<void(int)> c
             {
                 auto cont = b_it->second;
                 db->continue_write.erase(b_it++);
-                write_block(db, cont.blk, cont.cb);
+                write_block(db, cont.blk, cont.cb, cont.sync);
             }
         }
         else
@@ -1280,7 +2643,7 @@ static void write_block(kv_db_t *db, kv_block_t *blk, std::function<void(int)> c
             }
         }
         delete op;
-        if (res < 0 || db->immediate_commit)
+        if (res < 0 || db->immediate_commit || !sync)
         {
             cb(res);
         }
@@ -1300,24 +2663,139 @@ static void write_block(kv_db_t *db, kv_block_t *blk, std::function<void(int)> c
     db->cli->execute(op);
 }
 
+static void hint_compaction(kv_db_t *db, kv_block_t *blk);
+
+void kv_db_t::flush_leaf_updates(uint64_t offset)
+{
+    auto lu_it = leaf_updates.find(offset);
+    if (lu_it == leaf_updates.end())
+    {
+        return;
+    }
+    auto b_it = block_cache.find(offset);
+    if (b_it != block_cache.end() && b_it->second.updating > 0)
+    {
+        // Will be written when the current update finishes
+        return;
+    }
+    auto waiting = std::move(lu_it->second);
+    leaf_updates.erase(lu_it);
+    auto blk = b_it != block_cache.end() ? &b_it->second : NULL;
+    if (!blk || blk->invalidated || blk->type != KV_LEAF)
+    {
+        // Block is not in cache anymore or is being split, restart all changes
+        for (auto & w: waiting)
+            w.retry();
+        return;
+    }
+    // Check CAS callbacks against the current contents of the block and merge changes.
+    // Changes of the same key, changes which don't fit or fall out of the block
+    // after a split are retried individually
+    assert(!blk->change_type);
+    std::vector<kv_leaf_update_t> group, retry;
+    std::vector<std::pair<kv_leaf_update_t, std::string>> load;
+    std::vector<std::pair<std::function<void(int)>, int>> done;
+    int64_t new_size = blk->data_size;
+    for (auto & w: waiting)
+    {
+        auto ch_it = std::lower_bound(blk->changes.begin(), blk->changes.end(), w.key,
+            [](const kv_change_t & a, const std::string & b) { return a.key < b; });
+        if (w.key < blk->key_ge || blk->key_lt != "" && w.key >= blk->key_lt ||
+            ch_it != blk->changes.end() && ch_it->key == w.key)
+        {
+            retry.push_back(std::move(w));
+            continue;
+        }
+        auto d_it = blk->data.find(w.key);
+        bool exists = d_it != blk->data.end();
+        int cas_res = 1;
+        if (exists ? (!w.is_delete && d_it->value_ref == w.value_ref && d_it->second == w.value) : w.is_delete)
+        {
+            // Nothing to do
+            done.push_back({ std::move(w.cb), 0 });
+        }
+        else if ((cas_res = check_cas(this, w.cas_cb, exists ? d_it : NULL)) < 0)
+        {
+            // The current value is stored separately and has to be loaded before
+            // retrying, otherwise the change may get here again in the same state
+            load.push_back({ std::move(w), d_it->second.str() });
+        }
+        else if (!cas_res)
+        {
+            // CAS failure
+            done.push_back({ std::move(w.cb), -EAGAIN });
+        }
+        else
+        {
+            int64_t delta = w.is_delete ? -kv_block_t::kv_del_size(d_it->first, d_it->second)
+                : kv_block_t::kv_size(w.key, w.value) - (exists ? kv_block_t::kv_size(d_it->first, d_it->second) : 0);
+            if (new_size + delta >= kv_block_size)
+            {
+                // Requires a split
+                retry.push_back(std::move(w));
+                continue;
+            }
+            new_size += delta;
+            if (w.is_delete)
+                blk->add_change(KV_CH_DEL, w.key, "");
+            else
+                blk->add_change(exists ? KV_CH_UPD : KV_CH_ADD, w.key, w.value, w.value_ref);
+            group.push_back(std::move(w));
+        }
+    }
+    if (group.size() > 0)
+    {
+        blk->updating++;
+        write_block(this, blk, [this, blk, offset, group](int res)
+        {
+            if (res < 0)
+            {
+                cache_del_block(this, blk);
+                block_cache.erase(offset);
+                run_continue_update(offset);
+            }
+            else
+            {
+                blk->apply_change();
+                hint_compaction(this, blk);
+                stop_updating(blk);
+            }
+            for (auto & w: group)
+            {
+                if (res == -EINTR)
+                    w.retry();
+                else
+                    w.cb(res);
+            }
+        });
+    }
+    // Retried changes will wait for the group write if it's started
+    for (auto & d: done)
+        d.first(d.second);
+    for (auto & w: retry)
+        w.retry();
+    for (auto & l: load)
+        l.first.load_retry(offset, kv_str_t(l.second));
+}
+
 static kv_block_t *create_new_block(kv_db_t *db, kv_block_t *old_blk, const std::string & separator,
-    const std::string & added_key, const std::string & added_value, bool right)
+    const std::string & added_key, const std::string & added_value, bool added_ref, bool right)
 {
     auto new_offset = db->alloc_block();
     auto blk = &db->block_cache[new_offset];
-    blk->usage = db->usage_counter;
     blk->level = old_blk->level;
     blk->type = old_blk->type == KV_LEAF_SPLIT || old_blk->type == KV_LEAF ? KV_LEAF : KV_INT;
+    blk->format = db->block_format;
     blk->offset = new_offset;
     blk->updating++;
     blk->key_ge = right ? separator : old_blk->key_ge;
     blk->key_lt = right ? old_blk->key_lt : separator;
-    blk->data.insert(right ? old_blk->data.lower_bound(separator) : old_blk->data.begin(),
+    blk->data.assign(right ? old_blk->data.lower_bound(separator) : old_blk->data.begin(),
         right ? old_blk->data.end() : old_blk->data.lower_bound(separator));
     if ((added_key >= separator) == right)
-        blk->data[added_key] = added_value;
+        blk->data.set(added_key, added_value, added_ref);
     blk->set_data_size();
-    add_block_level(db, blk);
+    cache_add_block(db, blk);
     return blk;
 }
 
@@ -1327,13 +2805,13 @@ static void place_again(kv_db_t *db, kv_block_t *blk, std::function<void(int, kv
 {
     auto old_offset = blk->offset;
     auto new_offset = db->alloc_block();
-    del_block_level(db, blk);
+    cache_del_block(db, blk);
     std::swap(db->block_cache[new_offset], db->block_cache[old_offset]);
     db->block_cache.erase(old_offset);
     auto new_blk = &db->block_cache[new_offset];
     new_blk->offset = new_offset;
     new_blk->invalidated = false;
-    add_block_level(db, new_blk);
+    cache_add_block(db, new_blk);
     write_new_block(db, new_blk, cb);
 }
 
@@ -1367,7 +2845,7 @@ static void write_new_block(kv_db_t *db, kv_block_t *blk, std::function<void(int
                 if (op->retval != op->len)
                 {
                     // Read error => free the new unreferenced block and die
-                    del_block_level(db, blk);
+                    cache_del_block(db, blk);
                     db->block_cache.erase(blk->offset);
                     cb(op->retval >= 0 ? -EIO : op->retval, NULL);
                     free(op->iov.buf[0].iov_base);
@@ -1395,7 +2873,7 @@ static void write_new_block(kv_db_t *db, kv_block_t *blk, std::function<void(int
         {
             // Other failure => free the new unreferenced block and die
             db->clear_allocation_block(blk->offset);
-            del_block_level(db, blk);
+            cache_del_block(db, blk);
             db->block_cache.erase(blk->offset);
             cb(res > 0 ? -EIO : res, NULL);
         }
@@ -1435,11 +2913,70 @@ static void clear_block(kv_db_t *db, kv_block_t *blk, uint64_t version, std::fun
         delete op;
         cb(res);
     };
-    del_block_level(db, blk);
+    cache_del_block(db, blk);
     db->block_cache.erase(blk->offset);
     db->cli->execute(op);
 }
 
+// Write values to be stored separately before changing leaves
+void kv_op_t::write_values(std::function<void()> next)
+{
+    if (opcode == KV_SET && !value_ref && is_separated(db, value))
+    {
+        write_value(db, key, value, [this, next](int res, uint64_t offset)
+        {
+            if (res < 0)
+            {
+                finish(res);
+                return;
+            }
+            held_values.push_back(offset);
+            value = make_value_ref(offset, value.size());
+            value_ref = true;
+            next();
+        });
+        return;
+    }
+    if (opcode != KV_BATCH)
+    {
+        next();
+        return;
+    }
+    batch_ref.resize(batch.size());
+    auto done = [this, next]()
+    {
+        if (values_res < 0)
+        {
+            batch_res.assign(batch.size(), -ECANCELED);
+            finish(values_res);
+        }
+        else
+            next();
+    };
+    values_pending = 1;
+    for (int i = 0; i < batch.size(); i++)
+    {
+        if (batch[i].del || batch_ref[i] || !is_separated(db, batch[i].value))
+            continue;
+        values_pending++;
+        write_value(db, batch[i].key, batch[i].value, [this, i, done](int res, uint64_t offset)
+        {
+            if (res < 0)
+                values_res = res;
+            else
+            {
+                held_values.push_back(offset);
+                batch[i].value = make_value_ref(offset, batch[i].value.size());
+                batch_ref[i] = true;
+            }
+            if (!--values_pending)
+                done();
+        });
+    }
+    if (!--values_pending)
+        done();
+}
+
 void kv_op_t::update()
 {
     if (opcode == KV_SET && kv_block_t::kv_size(key, value) > (db->kv_block_size-sizeof(kv_stored_block_t)) / 4)
@@ -1448,6 +2985,11 @@ void kv_op_t::update()
         finish(-EINVAL);
         return;
     }
+    if (opcode == KV_BATCH)
+    {
+        // Continue with the first uncommitted change
+        key = batch[next_batch_item()].key;
+    }
     prev_key_ge = prev_key_lt = "";
     cur_level = -db->base_block_level;
     cur_block = 0;
@@ -1457,6 +2999,16 @@ void kv_op_t::update()
     update_find();
 }
 
+// Blocks frozen by a merge are rechecked after a small delay
+void kv_op_t::wait_merge()
+{
+    db->cli->msgr.tfd->set_timer(KV_MERGE_WAIT_MS, false, [this](int)
+    {
+        recheck_policy = KV_RECHECK_ALL;
+        update();
+    });
+}
+
 void kv_op_t::update_find()
 {
     get_block(db, cur_block, cur_level, recheck_policy, [=, checked_block = cur_block](int res, int refresh)
@@ -1468,11 +3020,25 @@ void kv_op_t::update_find()
         }
         else if (res == -ENOTBLK)
         {
-            if (opcode == KV_SET)
+            if (opcode == KV_BATCH)
+            {
+                // Empty DB - create it with the first change
+                batch_group.assign(1, next_batch_item());
+                auto & w = batch[batch_group[0]];
+                if (w.del)
+                {
+                    update_done(0);
+                    return;
+                }
+                value = w.value;
+                value_ref = batch_ref[batch_group[0]];
+                cas_cb = w.cas_compare;
+            }
+            if (opcode == KV_SET || opcode == KV_BATCH)
             {
                 // Check CAS callback
                 if (cas_cb && !cas_cb(-ENOENT, ""))
-                    finish(-EAGAIN);
+                    update_done(-EAGAIN);
                 else
                     create_root();
             }
@@ -1485,10 +3051,18 @@ void kv_op_t::update_find()
         {
             resume_split();
         }
+        else if (res == -EBUSY)
+        {
+            wait_merge();
+        }
         else if (res < 0)
         {
             finish(res);
         }
+        else if (opcode == KV_BATCH)
+        {
+            update_batch();
+        }
         else
         {
             update_block(path.size()-1, opcode == KV_DEL, key, value, [=](int res)
@@ -1499,27 +3073,200 @@ void kv_op_t::update_find()
     });
 }
 
-void kv_op_t::create_root()
+int kv_op_t::next_batch_item()
 {
-    // if the block does not exist (is empty) - it should be the root block.
-    // in this case we just create a new root leaf block.
-    // if a referenced non-root block is empty, we just return an error.
-    if (cur_block != 0 || db->next_free != 0)
+    for (int i = 0; i < batch_res.size(); i++)
+        if (batch_res[i] == -EINPROGRESS)
+            return i;
+    return -1;
+}
+
+void kv_op_t::update_done(int res)
+{
+    if (opcode != KV_BATCH)
     {
-        fprintf(stderr, "K/V: create_root called with non-empty DB (cur_block=%ju)\n", cur_block);
+        finish(res);
+        return;
+    }
+    if (res == -EAGAIN && batch_failed < 0)
+        batch_failed = batch_group[0];
+    for (int i: batch_group)
+        batch_res[i] = res == -EAGAIN && i != batch_failed ? -ECANCELED : res;
+    batch_group.clear();
+    if (res == 0 && next_batch_item() >= 0)
+    {
+        update();
+        return;
+    }
+    finish(res);
+}
+
+void kv_op_t::update_batch()
+{
+    auto blk_it = db->block_cache.find(path[path.size()-1].offset);
+    if (blk_it == db->block_cache.end())
+    {
+        // Block is not in cache anymore, recheck
+        db->run_continue_update(path[path.size()-1].offset);
+        update();
+        return;
+    }
+    auto blk = &blk_it->second;
+    if (blk->updating)
+    {
+        // Wait if block is being modified
+        db->continue_update.emplace(blk->offset, [=]() { update_batch(); });
+        return;
+    }
+    if (db->known_versions[blk->offset/db->ino_block_size] != path[path.size()-1].version || blk->invalidated)
+    {
+        // Recheck if block was modified in the meantime
+        db->run_continue_update(blk->offset);
+        update();
+        return;
+    }
+    if (is_frozen(blk))
+    {
+        // Leaf is being merged
+        db->run_continue_update(blk->offset);
+        wait_merge();
+        return;
+    }
+    // Collect all uncommitted changes of keys residing in this leaf, while they fit
+    int first = next_batch_item();
+    auto & key_lt = blk->type == KV_LEAF_SPLIT ? blk->right_half : blk->key_lt;
+    int64_t new_size = blk->data_size;
+    batch_group.clear();
+    for (int i = first; i < batch.size(); i++)
+    {
+        auto & w = batch[i];
+        if (batch_res[i] != -EINPROGRESS || w.key < blk->key_ge || key_lt != "" && w.key >= key_lt)
+            continue;
+        auto d_it = blk->data.find(w.key);
+        int64_t delta = d_it == blk->data.end() ? (w.del ? 0 : kv_block_t::kv_size(w.key, w.value))
+            : (w.del ? -kv_block_t::kv_del_size(d_it->first, d_it->second)
+                : kv_block_t::kv_size(w.key, w.value) - kv_block_t::kv_size(d_it->first, d_it->second));
+        if (new_size + delta >= db->kv_block_size)
+            break;
+        new_size += delta;
+        batch_group.push_back(i);
+    }
+    if (batch_group.size() <= 1)
+    {
+        // Single change, possibly requiring a split
+        batch_group.assign(1, first);
+        auto & w = batch[first];
+        value = w.value;
+        value_ref = batch_ref[first];
+        cas_cb = w.cas_compare;
+        update_block(path.size()-1, w.del, key, value, [=](int res)
+        {
+            update_done(res);
+        });
+        return;
+    }
+    assert(!blk->change_type);
+    for (int i: batch_group)
+    {
+        auto & w = batch[i];
+        auto d_it = blk->data.find(w.key);
+        if (d_it == blk->data.end() ? w.del : (!w.del && d_it->value_ref == batch_ref[i] && d_it->second == w.value))
+        {
+            // Nothing to do
+            continue;
+        }
+        int cas_res = check_cas(db, w.cas_compare, d_it != blk->data.end() ? d_it : NULL);
+        if (cas_res < 0)
+        {
+            // Load the current value and retry
+            blk->cancel_change();
+            db->run_continue_update(blk->offset);
+            load_value(blk->offset, w.key, d_it->second, [this](int res, const std::string & value)
+            {
+                if (res < 0 && res != -EAGAIN)
+                    update_done(res);
+                else
+                    update();
+            });
+            return;
+        }
+        if (!cas_res)
+        {
+            // CAS failure
+            blk->cancel_change();
+            batch_failed = i;
+            db->run_continue_update(blk->offset);
+            update_done(-EAGAIN);
+            return;
+        }
+        if (w.del)
+            blk->add_change(KV_CH_DEL, w.key, "");
+        else
+            blk->add_change(d_it != blk->data.end() ? KV_CH_UPD : KV_CH_ADD, w.key, w.value, batch_ref[i]);
+    }
+    if (!blk->changes.size())
+    {
+        blk->cancel_change();
+        db->run_continue_update(blk->offset);
+        update_done(0);
+        return;
+    }
+    if (blk->type == KV_LEAF_SPLIT)
+    {
+        if (prev_key_lt == "" || prev_key_lt > blk->right_half)
+        {
+            // Should not happen - we should have resumed the split
+            blk->dump(0);
+            fprintf(stderr, "K/V: attempt to write into block %ju instead of resuming the split (got here from %s..%s)\n",
+                blk->offset, prev_key_ge.c_str(), prev_key_lt.c_str());
+            abort();
+        }
+        blk->change_type |= KV_CH_CLEAR_RIGHT;
+    }
+    blk->updating++;
+    write_block(db, blk, [=](int res)
+    {
+        if (res < 0)
+        {
+            auto blk_offset = blk->offset;
+            cache_del_block(db, blk);
+            db->block_cache.erase(blk_offset);
+            db->run_continue_update(blk_offset);
+        }
+        else
+        {
+            blk->apply_change();
+            hint_compaction(db, blk);
+            db->stop_updating(blk);
+        }
+        if (res == -EINTR)
+            update();
+        else
+            update_done(res);
+    });
+}
+
+void kv_op_t::create_root()
+{
+    // if the block does not exist (is empty) - it should be the root block.
+    // in this case we just create a new root leaf block.
+    // if a referenced non-root block is empty, we just return an error.
+    if (cur_block != 0 || db->next_free != 0)
+    {
+        fprintf(stderr, "K/V: create_root called with non-empty DB (cur_block=%ju)\n", cur_block);
         finish(-EILSEQ);
         return;
     }
     auto new_offset = db->alloc_block();
     assert(new_offset == 0);
     auto blk = &db->block_cache[0];
-    blk->usage = db->usage_counter;
     blk->level = -db->base_block_level;
     blk->type = KV_LEAF;
+    blk->format = db->block_format;
     blk->offset = new_offset;
-    blk->data[key] = value;
+    blk->data.set(key, value, value_ref);
     blk->set_data_size();
-    add_block_level(db, blk);
+    cache_add_block(db, blk);
     blk->updating++;
     write_block(db, blk, [=](int res)
     {
@@ -1527,7 +3274,7 @@ void kv_op_t::create_root()
         {
             db->clear_allocation_block(blk->offset);
             auto blk_offset = blk->offset;
-            del_block_level(db, blk);
+            cache_del_block(db, blk);
             db->block_cache.erase(blk_offset);
             db->run_continue_update(blk_offset);
             update();
@@ -1537,7 +3284,7 @@ void kv_op_t::create_root()
             db->stop_writing_new(blk->offset);
             db->confirm_allocation_block(blk->offset);
             db->stop_updating(blk);
-            finish(res);
+            update_done(res);
         }
     });
 }
@@ -1584,6 +3331,50 @@ void kv_op_t::update_block(int path_pos, bool is_delete, const std::string & key
     }
     auto blk = &blk_it->second;
     auto block_ver = path[path_pos].version;
+    // Only leaf items may reference separately stored values
+    bool ref = value_ref && path_pos == path.size()-1;
+    if (cas_cb && path_pos == path.size()-1)
+    {
+        auto d_it = blk->data.find(key);
+        if (d_it != blk->data.end() && d_it->value_ref && !find_value(db, parse_value_ref(d_it->second).offset))
+        {
+            // CAS callback requires the current value which is stored separately
+            db->run_continue_update(blk->offset);
+            load_value(blk->offset, key, d_it->second, [=](int res, const std::string & value)
+            {
+                if (res < 0 && res != -EAGAIN)
+                    cb(res);
+                else
+                    update();
+            });
+            return;
+        }
+    }
+    if (blk->updating && path_pos == path.size()-1 && blk->type == KV_LEAF)
+    {
+        // Leaf is being modified - write the change together with all other
+        // changes queued during the current write (group commit)
+        db->leaf_updates[blk->offset].push_back((kv_leaf_update_t){
+            .is_delete = is_delete,
+            .key = key,
+            .value = value,
+            .value_ref = ref,
+            .cas_cb = cas_cb,
+            .retry = [this]() { update(); },
+            .load_retry = [=](uint64_t leaf_offset, const kv_str_t & ref)
+            {
+                load_value(leaf_offset, key, ref, [=](int res, const std::string & value)
+                {
+                    if (res < 0 && res != -EAGAIN)
+                        cb(res);
+                    else
+                        update();
+                });
+            },
+            .cb = cb,
+        });
+        return;
+    }
     if (blk->updating)
     {
         // Wait if block is being modified
@@ -1597,11 +3388,18 @@ void kv_op_t::update_block(int path_pos, bool is_delete, const std::string & key
         update();
         return;
     }
+    if (is_frozen(blk))
+    {
+        // Block is being merged, it can't be changed now
+        db->run_continue_update(blk->offset);
+        wait_merge();
+        return;
+    }
     uint32_t rm_size = 0;
     auto d_it = blk->data.find(key);
     if (d_it != blk->data.end())
     {
-        if (!is_delete && d_it->second == value)
+        if (!is_delete && d_it->value_ref == ref && d_it->second == value)
         {
             // Nothing to do
             db->run_continue_update(blk->offset);
@@ -1617,11 +3415,15 @@ void kv_op_t::update_block(int path_pos, bool is_delete, const std::string & key
         cb(0);
         return;
     }
-    if (cas_cb && path_pos == path.size()-1 && !cas_cb(d_it != blk->data.end() ? 0 : -ENOENT, d_it != blk->data.end() ? d_it->second : ""))
+    int cas_res = path_pos == path.size()-1 ? check_cas(db, cas_cb, d_it != blk->data.end() ? d_it : NULL) : 1;
+    if (cas_res <= 0)
     {
-        // CAS failure
+        // CAS failure or the value was just evicted from the cache
         db->run_continue_update(blk->offset);
-        cb(-EAGAIN);
+        if (cas_res < 0)
+            update();
+        else
+            cb(-EAGAIN);
         return;
     }
     // This condition means this is a block split during previous updates
@@ -1656,28 +3458,23 @@ void kv_op_t::update_block(int path_pos, bool is_delete, const std::string & key
             abort();
         }
         if (is_delete)
-        {
-            blk->change_type |= KV_CH_DEL;
-            blk->change_key = key;
-        }
+            blk->add_change(KV_CH_DEL, key, "");
         else
-        {
-            blk->change_type |= (d_it != blk->data.end() ? KV_CH_UPD : KV_CH_ADD);
-            blk->change_key = key;
-            blk->change_value = value;
-        }
+            blk->add_change(d_it != blk->data.end() ? KV_CH_UPD : KV_CH_ADD, key, value, ref);
         write_block(db, blk, [=](int res)
         {
             if (res < 0)
             {
                 auto blk_offset = blk->offset;
-                del_block_level(db, blk);
+                cache_del_block(db, blk);
                 db->block_cache.erase(blk_offset);
                 db->run_continue_update(blk_offset);
             }
             else
             {
                 blk->apply_change();
+                if (is_delete)
+                    hint_compaction(db, blk);
                 db->stop_updating(blk);
             }
             if (res == -EINTR)
@@ -1700,7 +3497,7 @@ void kv_op_t::update_block(int path_pos, bool is_delete, const std::string & key
     // New item doesn't fit. The most interesting case.
     // Write the right half into a new block
     auto separator = find_splitter(db, blk);
-    auto orig_right_blk = create_new_block(db, blk, separator, key, value, true);
+    auto orig_right_blk = create_new_block(db, blk, separator, key, value, ref, true);
     write_new_block(db, orig_right_blk, [=](int res, kv_block_t *right_blk)
     {
         if (res < 0)
@@ -1714,7 +3511,7 @@ void kv_op_t::update_block(int path_pos, bool is_delete, const std::string & key
         {
             // Split the root block
             // Write the left half into a new block
-            auto orig_left_blk = create_new_block(db, blk, separator, key, value, false);
+            auto orig_left_blk = create_new_block(db, blk, separator, key, value, ref, false);
             write_new_block(db, orig_left_blk, [=](int res, kv_block_t *left_blk)
             {
                 if (res < 0)
@@ -1729,13 +3526,13 @@ void kv_op_t::update_block(int path_pos, bool is_delete, const std::string & key
                 // Write references to halves into the new root block
                 auto new_root = new kv_block_t;
                 new_root->offset = 0;
-                new_root->usage = db->usage_counter;
                 new_root->type = KV_INT;
+                new_root->format = db->block_format;
                 new_root->level = blk->level-1;
                 new_root->change_type = 0;
                 new_root->data.clear();
-                new_root->data[""] = std::string((char*)&left_blk->offset, sizeof(left_blk->offset));
-                new_root->data[separator] = std::string((char*)&right_blk->offset, sizeof(right_blk->offset));
+                new_root->data.set(kv_str_t(), kv_str_t((char*)&left_blk->offset, sizeof(left_blk->offset)));
+                new_root->data.set(separator, kv_str_t((char*)&right_blk->offset, sizeof(right_blk->offset)));
                 new_root->set_data_size();
                 new_root->updating++;
                 if (blk->invalidated)
@@ -1747,7 +3544,7 @@ void kv_op_t::update_block(int path_pos, bool is_delete, const std::string & key
                     if (write_res < 0)
                     {
                         auto blk_offset = blk->offset;
-                        del_block_level(db, blk);
+                        cache_del_block(db, blk);
                         db->block_cache.erase(blk_offset);
                         db->run_continue_update(blk_offset);
                         clear_block(db, left_blk, 0, [=, left_offset = left_blk->offset](int res)
@@ -1768,7 +3565,9 @@ void kv_op_t::update_block(int path_pos, bool is_delete, const std::string & key
                     }
                     else
                     {
+                        cache_del_block(db, &db->block_cache[0]);
                         std::swap(db->block_cache[0], *new_root);
+                        cache_add_block(db, &db->block_cache[0]);
                         db->base_block_level = -new_root->level;
                         db->stop_updating(left_blk);
                         db->stop_updating(right_blk);
@@ -1793,17 +3592,13 @@ void kv_op_t::update_block(int path_pos, bool is_delete, const std::string & key
             blk->change_rh = separator;
             blk->change_rh_block = right_blk->offset;
             if (key < separator)
-            {
-                blk->change_type |= (blk->data.find(key) != blk->data.end() ? KV_CH_UPD : KV_CH_ADD);
-                blk->change_key = key;
-                blk->change_value = value;
-            }
+                blk->add_change(blk->data.find(key) != blk->data.end() ? KV_CH_UPD : KV_CH_ADD, key, value, ref);
             write_block(db, blk, [=](int write_res)
             {
                 if (write_res < 0)
                 {
                     auto blk_offset = blk->offset;
-                    del_block_level(db, blk);
+                    cache_del_block(db, blk);
                     db->block_cache.erase(blk_offset);
                     db->run_continue_update(blk_offset);
                     clear_block(db, right_blk, 0, [=, right_offset = right_blk->offset](int res)
@@ -1888,14 +3683,44 @@ void kv_op_t::next_get()
     {
         // Send this item
         assert(blk->type == KV_LEAF || blk->type == KV_LEAF_SPLIT);
+        auto cached = kv_it->value_ref && resolve_refs
+            ? find_value(db, parse_value_ref(kv_it->second).offset) : NULL;
+        if (kv_it->value_ref && resolve_refs && !cached)
+        {
+            auto item_key = kv_it->first.str();
+            load_value(cur_block, item_key, kv_it->second, [this, item_key](int res, const std::string & value)
+            {
+                if (res == -EAGAIN)
+                {
+                    // Leaf is changed, continue listing from the same key
+                    key = item_key;
+                    skip_equal = false;
+                    recheck_policy = KV_RECHECK_LEAF;
+                    next();
+                }
+                else if (res < 0)
+                    finish(res);
+                else
+                {
+                    this->res = 0;
+                    this->key = item_key;
+                    this->value = value;
+                    this->value_ref = false;
+                    skip_equal = true;
+                    (std::function<void(kv_op_t *)>(callback))(this);
+                }
+            });
+            return;
+        }
         this->res = 0;
-        this->key = kv_it->first;
-        this->value = kv_it->second;
+        this->key = kv_it->first.str();
+        this->value = cached ? *cached : kv_it->second.str();
+        this->value_ref = kv_it->value_ref && !resolve_refs;
         skip_equal = true;
         (std::function<void(kv_op_t *)>(callback))(this);
     }
     // Find next block
-    else if (blk->type == KV_LEAF_SPLIT)
+    else if (blk->type == KV_LEAF_SPLIT && !is_frozen(blk))
     {
         // Left half finished, go to the right
         recheck_policy = KV_RECHECK_LEAF;
@@ -1958,118 +3783,1658 @@ void kv_op_t::next_go_up()
     }
 }
 
-kv_dbw_t::kv_dbw_t(cluster_client_t *cli)
+struct kv_bulk_level_t
 {
-    db = new kv_db_t();
-    db->cli = cli;
-}
+    // block being filled
+    kv_block_t *blk = NULL;
+    // exact encoded size of <blk> with empty key_lt
+    uint32_t size = 0;
+    // lower bound of the next block
+    std::string next_ge;
+    // number of already closed blocks
+    uint64_t closed = 0;
+};
 
-kv_dbw_t::~kv_dbw_t()
+// Bottom-up bulk loader: fills blocks sequentially with sorted items, writes them
+// without waiting for upper levels and installs the root when everything else is written.
+// New blocks are unreferenced until the root is written, so they're written without
+// intermediate syncs and their CAS failures are not retried
+struct kv_bulk_load_t
 {
-    delete db;
-}
+    kv_db_t *db = NULL;
+    int parallel = 16;
+    int in_flight = 0;
+    int res = 0;
+    bool finishing = false, finished = false, root_synced = false;
+    int busy = 0;
+    uint64_t added = 0;
+    std::string last_key;
+    std::vector<kv_bulk_level_t> levels;
+    kv_block_t *root = NULL;
+    std::vector<std::function<void(int)>> waiting;
+    std::function<void(int)> finish_cb;
 
-void kv_dbw_t::open(uint64_t inode_id, std::map<std::string, std::string> cfg, std::function<void(int)> cb)
+    ~kv_bulk_load_t();
+    int add(const std::string & key, const std::string & value);
+    void add_item(int level, const kv_str_t & key, const kv_str_t & value);
+    void start_block(int level);
+    void close_block(int level, const std::string & key_lt, bool is_root);
+    void write_done(kv_block_t *blk, int res);
+    void resume();
+    void finish();
+    void write_root();
+    void complete(int res);
+};
+
+kv_bulk_load_t::~kv_bulk_load_t()
 {
-    db->open(inode_id, cfg, cb);
+    for (auto & lvl: levels)
+        if (lvl.blk)
+            delete lvl.blk;
+    if (root)
+        delete root;
 }
 
-void kv_dbw_t::set_config(std::map<std::string, std::string> cfg)
+int kv_bulk_load_t::add(const std::string & key, const std::string & value)
 {
-    db->set_config(cfg);
+    if (res < 0)
+        return res;
+    if (finishing || added > 0 && key <= last_key ||
+        kv_block_t::kv_size(key, value) > (db->kv_block_size-sizeof(kv_stored_block_t)) / 4)
+    {
+        // Keys should be added in ascending order, and they should fit into the B-Tree
+        return -EINVAL;
+    }
+    add_item(0, key, value);
+    last_key = key;
+    added++;
+    return 0;
 }
 
-uint64_t kv_dbw_t::get_size()
+void kv_bulk_load_t::start_block(int level)
 {
-    return db->next_free;
+    auto blk = new kv_block_t();
+    blk->type = level == 0 ? KV_LEAF : KV_INT;
+    blk->format = db->block_format;
+    blk->key_ge = levels[level].next_ge;
+    blk->set_data_size();
+    levels[level].blk = blk;
+    levels[level].size = blk->data_size;
 }
 
-void kv_dbw_t::close(std::function<void()> cb)
+void kv_bulk_load_t::add_item(int level, const kv_str_t & key, const kv_str_t & value)
 {
-    db->close(cb);
+    if (levels.size() <= level)
+        levels.resize(level+1);
+    if (levels[level].blk)
+    {
+        auto blk = levels[level].blk;
+        auto & last = std::prev(blk->data.end())->first;
+        if (levels[level].size + kv_item_size(blk->format, &last, key, value) > db->kv_block_size)
+        {
+            // Block is full. Int nodes are split exactly at the first key of the next node
+            close_block(level, level == 0 ? leaf_separator(last, key) : key.str(), false);
+        }
+    }
+    if (!levels[level].blk)
+        start_block(level);
+    auto blk = levels[level].blk;
+    levels[level].size += kv_item_size(blk->format, blk->data.size() ? &std::prev(blk->data.end())->first : NULL, key, value);
+    blk->data.push_back(key, value);
 }
 
-void kv_dbw_t::get(const std::string & key, std::function<void(int res, const std::string & value)> cb, bool cached)
+void kv_bulk_load_t::close_block(int level, const std::string & key_lt, bool is_root)
 {
-    auto *op = new kv_op_t;
-    op->db = db;
-    op->opcode = cached ? KV_GET_CACHED : KV_GET;
-    op->key = key;
-    op->callback = [cb](kv_op_t *op)
+    auto blk = levels[level].blk;
+    levels[level].blk = NULL;
+    levels[level].closed++;
+    blk->key_lt = key_lt;
+    blk->set_data_size();
+    // Items were added while key_lt was unknown, so the block may have to give
+    // some of them to the next block
+    std::vector<std::pair<std::string, std::string>> carry;
+    while (blk->data_size > db->kv_block_size && blk->data.size() > 1)
     {
-        cb(op->res, op->value);
-        delete op;
-    };
-    op->exec();
+        auto last_it = std::prev(blk->data.end());
+        carry.insert(carry.begin(), std::make_pair(last_it->first.str(), last_it->second.str()));
+        blk->data.erase(last_it, blk->data.end());
+        blk->key_lt = level == 0 ? leaf_separator(std::prev(blk->data.end())->first, carry[0].first) : carry[0].first;
+        blk->set_data_size();
+    }
+    levels[level].next_ge = blk->key_lt;
+    if (is_root)
+    {
+        blk->offset = 0;
+        root = blk;
+    }
+    else
+    {
+        blk->offset = db->alloc_block();
+        add_item(level+1, blk->key_ge, kv_str_t((char*)&blk->offset, sizeof(blk->offset)));
+        in_flight++;
+        write_block(db, blk, [this, blk](int res) { write_done(blk, res); }, false);
+    }
+    for (auto & kv: carry)
+        add_item(level, kv.first, kv.second);
 }
 
-void kv_dbw_t::set(const std::string & key, const std::string & value, std::function<void(int res)> cb,
-    std::function<bool(int res, const std::string & value)> cas_compare)
+void kv_bulk_load_t::write_done(kv_block_t *blk, int res)
 {
-    auto *op = new kv_op_t;
-    op->db = db;
-    op->opcode = KV_SET;
-    op->key = key;
-    op->value = value;
-    if (cas_compare)
+    db->stop_writing_new(blk->offset);
+    if (res < 0)
+        db->clear_allocation_block(blk->offset);
+    else if (!(blk->offset % db->ino_block_size))
+        db->confirm_allocation_block(blk->offset);
+    delete blk;
+    in_flight--;
+    if (res < 0 && this->res == 0)
     {
-        op->cas_cb = cas_compare;
+        fprintf(stderr, "K/V: Bulk load block write failed: %s (code %d)\n", strerror(-res), res);
+        this->res = res;
     }
-    op->callback = [cb](kv_op_t *op)
-    {
-        cb(op->res);
-        delete op;
-    };
-    op->exec();
+    resume();
 }
 
-void kv_dbw_t::del(const std::string & key, std::function<void(int res)> cb,
-    std::function<bool(int res, const std::string & value)> cas_compare)
+void kv_bulk_load_t::resume()
 {
-    auto *op = new kv_op_t;
-    op->db = db;
-    op->opcode = KV_DEL;
-    op->key = key;
-    if (cas_compare)
+    busy++;
+    while (waiting.size() && (in_flight < parallel || res < 0))
     {
-        op->cas_cb = cas_compare;
+        auto cb = std::move(waiting.front());
+        waiting.erase(waiting.begin());
+        cb(res);
     }
-    op->callback = [cb](kv_op_t *op)
+    if (finishing && !finished && !in_flight)
     {
-        cb(op->res);
-        delete op;
-    };
-    op->exec();
+        if (res < 0 || !root)
+            complete(res);
+        else
+            write_root();
+    }
+    busy--;
+    if (finished && !busy)
+        delete this;
 }
 
-void* kv_dbw_t::list_start(const std::string & start)
+void kv_bulk_load_t::finish()
 {
-    if (!db->inode_id || db->closing)
-        return NULL;
-    auto *op = new kv_op_t;
-    op->db = db;
-    op->opcode = KV_LIST;
-    op->key = start;
-    op->callback = [](kv_op_t *){};
-    op->exec();
-    return op;
+    finishing = true;
+    if (res == 0)
+    {
+        if (!levels.size())
+        {
+            // Empty input, create an empty root leaf
+            levels.resize(1);
+            start_block(0);
+        }
+        for (int level = 0; level < levels.size(); level++)
+        {
+            while (levels[level].blk)
+            {
+                // The last level with a single block is the root
+                close_block(level, "", level == levels.size()-1 && !levels[level].closed);
+            }
+        }
+    }
+    resume();
 }
 
-void kv_dbw_t::list_next(void *handle, std::function<void(int res, const std::string & key, const std::string & value)> cb)
+void kv_bulk_load_t::write_root()
 {
-    kv_op_t *op = (kv_op_t*)handle;
-    if (cb)
+    if (!db->immediate_commit && !root_synced)
     {
-        op->callback = [cb](kv_op_t *op)
+        // Sync all blocks before referencing them from the root
+        cluster_op_t *op = new cluster_op_t;
+        op->opcode = OSD_OP_SYNC;
+        op->callback = [this](cluster_op_t *op)
         {
-            cb(op->res, op->key, op->value);
+            int res = op->retval;
+            delete op;
+            if (res < 0)
+            {
+                complete(res);
+                return;
+            }
+            root_synced = true;
+            write_root();
         };
+        db->cli->execute(op);
+        return;
     }
-    op->next();
+    write_block(db, root, [this](int res)
+    {
+        if (res == -EINTR)
+        {
+            // Someone else has created the root
+            fprintf(stderr, "K/V: Bulk load failed: DB was modified concurrently\n");
+            res = -EEXIST;
+        }
+        complete(res);
+    });
 }
 
-void kv_dbw_t::list_close(void *handle)
+void kv_bulk_load_t::complete(int res)
 {
-    kv_op_t *op = (kv_op_t*)handle;
+    auto db = this->db;
+    finished = true;
+    if (res < 0)
+        db->clear_allocation_block(0);
+    else
+        db->confirm_allocation_block(0);
+    db->stop_writing_new(0);
+    db->active_ops--;
+    auto cb = std::move(finish_cb);
+    cb(res);
+    if (!db->active_ops && db->closing)
+        db->close(db->on_close);
+    if (!busy)
+        delete this;
+}
+
+// Garbage collector of separately stored values. Scans all sealed value segments,
+// moves values still referenced from leaves into the current segment of this client
+// and deletes the segments. Values are moved using the usual CAS updates, so the GC
+// may run in parallel with any other operations, including other clients.
+// Segments left unsealed by crashed clients are sealed by the GC itself when their
+// object version doesn't change for <kv_value_seal_timeout> between GC runs.
+// Deleted segments are replaced by FREED headers because the index size is found by
+// a binary search over existing inode blocks on open, which would stop at holes
+struct kv_value_gc_t
+{
+    kv_db_t *db;
+    std::function<void(int)> cb;
+    uint64_t seg = 0, end = 0;
+    uint8_t *buf = NULL;
+    uint64_t len = 0, pos = 0;
+    int seg_res = 0;
+    bool in_loop = false, repeat = false;
+
+    void next_segment();
+    void check_idle(uint64_t version);
+    void seal_idle(uint64_t version);
+    void read_segment(uint64_t used);
+    void next_record();
+    void check_record();
+    void move_value(const std::string & key, const std::string & value, uint64_t old_offset);
+    void skip_segment(int res);
+    void delete_segment();
+    void free_segment();
+    void complete(int res);
+};
+
+void kv_value_gc_t::next_segment()
+{
+    while (seg < end && (seg == db->value_seg || db->value_segs.find(seg) != db->value_segs.end()))
+    {
+        // Skip segments still written by us
+        seg += db->ino_block_size;
+    }
+    if (seg >= end || db->closing)
+    {
+        complete(0);
+        return;
+    }
+    cluster_op_t *op = new cluster_op_t;
+    op->opcode = OSD_OP_READ;
+    op->inode = db->inode_id;
+    op->offset = seg;
+    op->len = db->kv_block_size;
+    op->iov.push_back(malloc_or_die(op->len), op->len);
+    op->callback = [this](cluster_op_t *op)
+    {
+        int res = op->retval == op->len ? 0 : (op->retval > 0 ? -EIO : op->retval);
+        kv_value_segment_t hdr = *(kv_value_segment_t*)op->iov.buf[0].iov_base;
+        uint64_t version = op->version;
+        free(op->iov.buf[0].iov_base);
+        delete op;
+        if (res < 0)
+        {
+            complete(res);
+            return;
+        }
+        bool is_segment = hdr.magic == KV_VALUE_SEGMENT_MAGIC && hdr.block_size == db->kv_block_size;
+        if (!is_segment || hdr.sealed != KV_SEGMENT_OPEN)
+            db->idle_segs.erase(seg);
+        if (is_segment && hdr.sealed == KV_SEGMENT_SEALED &&
+            hdr.used >= db->kv_block_size && hdr.used <= db->ino_block_size)
+            read_segment(hdr.used);
+        else if (is_segment && hdr.sealed == KV_SEGMENT_OPEN)
+            check_idle(version);
+        else
+        {
+            // Not a value segment or an already freed segment
+            seg += db->ino_block_size;
+            next_segment();
+        }
+    };
+    db->cli->execute(op);
+}
+
+void kv_value_gc_t::check_idle(uint64_t version)
+{
+    // The owner may still write into the segment, but it starts a new segment after
+    // half of <kv_value_seal_timeout> without writes, so it's abandoned if its version
+    // stays the same for the whole timeout
+    uint64_t now = monotonic_ms();
+    auto i_it = db->idle_segs.find(seg);
+    if (i_it == db->idle_segs.end() || i_it->second.version != version)
+    {
+        db->idle_segs[seg] = (kv_idle_segment_t){ .version = version, .since = now };
+    }
+    else if (now >= i_it->second.since + db->value_seal_timeout*1000)
+    {
+        seal_idle(version);
+        return;
+    }
+    seg += db->ino_block_size;
+    next_segment();
+}
+
+void kv_value_gc_t::seal_idle(uint64_t version)
+{
+    // The size of written records is unknown, so the whole segment is scanned
+    kv_value_segment_t hdr = {
+        .magic = KV_VALUE_SEGMENT_MAGIC,
+        .block_size = db->kv_block_size,
+        .sealed = KV_SEGMENT_SEALED,
+        .used = db->ino_block_size,
+    };
+    cluster_op_t *op = new cluster_op_t;
+    op->opcode = OSD_OP_WRITE;
+    op->inode = db->inode_id;
+    op->offset = seg;
+    // Fails if the owner has written something after all
+    op->version = version+1;
+    op->len = db->kv_block_size;
+    op->iov.push_back(calloc_or_die(1, op->len), op->len);
+    memcpy(op->iov.buf[0].iov_base, &hdr, sizeof(hdr));
+    op->callback = [this](cluster_op_t *op)
+    {
+        int res = op->retval == op->len ? 0 : (op->retval > 0 ? -EIO : op->retval);
+        free(op->iov.buf[0].iov_base);
+        delete op;
+        db->idle_segs.erase(seg);
+        if (res == -EINTR)
+        {
+            seg += db->ino_block_size;
+            next_segment();
+        }
+        else if (res < 0)
+            skip_segment(res);
+        else
+        {
+            fprintf(stderr, "K/V: Value segment %ju was not written for %ju s, sealed it\n", seg, db->value_seal_timeout);
+            read_segment(db->ino_block_size);
+        }
+    };
+    db->cli->execute(op);
+}
+
+void kv_value_gc_t::read_segment(uint64_t used)
+{
+    seg_res = 0;
+    pos = 0;
+    len = used - db->kv_block_size;
+    if (!len)
+    {
+        delete_segment();
+        return;
+    }
+    cluster_op_t *op = new cluster_op_t;
+    op->opcode = OSD_OP_READ;
+    op->inode = db->inode_id;
+    op->offset = seg + db->kv_block_size;
+    op->len = len;
+    buf = (uint8_t*)malloc_or_die(len);
+    op->iov.push_back(buf, len);
+    op->callback = [this](cluster_op_t *op)
+    {
+        int res = op->retval == op->len ? 0 : (op->retval > 0 ? -EIO : op->retval);
+        delete op;
+        if (res < 0)
+            skip_segment(res);
+        else
+            next_record();
+    };
+    db->cli->execute(op);
+}
+
+void kv_value_gc_t::next_record()
+{
+    // Records are usually checked synchronously because leaves are cached, don't recurse
+    if (in_loop)
+    {
+        repeat = true;
+        return;
+    }
+    in_loop = true;
+    do
+    {
+        repeat = false;
+        check_record();
+    } while (repeat);
+    in_loop = false;
+}
+
+void kv_value_gc_t::check_record()
+{
+    if (pos >= len)
+    {
+        delete_segment();
+        return;
+    }
+    kv_value_hdr_t *hdr = (kv_value_hdr_t*)(buf+pos);
+    if (pos+sizeof(kv_value_hdr_t) <= len && hdr->magic == 0)
+    {
+        // Unwritten space in a segment sealed by the GC. Writes of a crashed owner
+        // may complete in any order, so there may be records after it
+        pos += db->kv_block_size;
+        next_record();
+        return;
+    }
+    if (pos+sizeof(kv_value_hdr_t) > len || hdr->magic != KV_VALUE_MAGIC ||
+        pos+value_record_size(db, hdr->key_len, hdr->value_len) > len)
+    {
+        fprintf(stderr, "K/V: Invalid value record at %ju\n", seg+db->kv_block_size+pos);
+        skip_segment(-EILSEQ);
+        return;
+    }
+    uint64_t offset = seg+db->kv_block_size+pos;
+    std::string key((char*)buf+pos+sizeof(kv_value_hdr_t), hdr->key_len);
+    pos += value_record_size(db, hdr->key_len, hdr->value_len);
+    // Check if the record is still referenced
+    auto op = new kv_op_t;
+    op->db = db;
+    op->opcode = KV_GET;
+    op->key = key;
+    op->resolve_refs = false;
+    op->callback = [this, offset, hdr](kv_op_t *op)
+    {
+        int res = op->res;
+        bool live = res == 0 && op->value_ref && parse_value_ref(op->value).offset == offset;
+        std::string key = std::move(op->key);
+        delete op;
+        if (res < 0 && res != -ENOENT)
+            skip_segment(res);
+        else if (live)
+            move_value(key, std::string((char*)hdr+sizeof(kv_value_hdr_t)+hdr->key_len, hdr->value_len), offset);
+        else
+            next_record();
+    };
+    op->exec();
+}
+
+void kv_value_gc_t::move_value(const std::string & key, const std::string & value, uint64_t old_offset)
+{
+    // The CAS callback compares values, so the old value must be in the cache
+    cache_value(db, old_offset, value);
+    write_value(db, key, value, [this, key, value](int res, uint64_t new_offset)
+    {
+        if (res < 0)
+        {
+            skip_segment(res);
+            return;
+        }
+        auto op = new kv_op_t;
+        op->db = db;
+        op->opcode = KV_SET;
+        op->key = key;
+        op->value = make_value_ref(new_offset, value.size());
+        op->value_ref = true;
+        op->held_values.push_back(new_offset);
+        op->cas_cb = [value](int res, const std::string & cur)
+        {
+            return res == 0 && cur == value;
+        };
+        op->callback = [this](kv_op_t *op)
+        {
+            int res = op->res;
+            delete op;
+            if (res == 0)
+                db->stats.value_gc_moved++;
+            // -EAGAIN means that the value was changed in the meantime
+            if (res < 0 && res != -EAGAIN)
+                skip_segment(res);
+            else
+                next_record();
+        };
+        op->exec();
+    });
+}
+
+void kv_value_gc_t::skip_segment(int res)
+{
+    fprintf(stderr, "K/V: Failed to collect value segment %ju: %s (code %d)\n", seg, strerror(-res), res);
+    if (buf)
+        free(buf);
+    buf = NULL;
+    seg += db->ino_block_size;
+    next_segment();
+}
+
+void kv_value_gc_t::delete_segment()
+{
+    if (buf)
+        free(buf);
+    buf = NULL;
+    cluster_op_t *op = new cluster_op_t;
+    op->opcode = OSD_OP_DELETE;
+    op->inode = db->inode_id;
+    op->offset = seg;
+    // Deletes the whole object
+    op->len = 0;
+    op->callback = [this](cluster_op_t *op)
+    {
+        int res = op->retval == op->len ? 0 : (op->retval > 0 ? -EIO : op->retval);
+        delete op;
+        if (res < 0)
+        {
+            skip_segment(res);
+            return;
+        }
+        db->stats.value_gc_segments++;
+        free_segment();
+    };
+    db->cli->execute(op);
+}
+
+void kv_value_gc_t::free_segment()
+{
+    kv_value_segment_t hdr = {
+        .magic = KV_VALUE_SEGMENT_MAGIC,
+        .block_size = db->kv_block_size,
+        .sealed = KV_SEGMENT_FREED,
+        .used = db->kv_block_size,
+    };
+    cluster_op_t *op = new cluster_op_t;
+    op->opcode = OSD_OP_WRITE;
+    op->inode = db->inode_id;
+    op->offset = seg;
+    // Deleted objects have version 0, -EINTR means that the block is already reused
+    op->version = 1;
+    op->len = db->kv_block_size;
+    op->iov.push_back(calloc_or_die(1, op->len), op->len);
+    memcpy(op->iov.buf[0].iov_base, &hdr, sizeof(hdr));
+    op->callback = [this](cluster_op_t *op)
+    {
+        int res = op->retval == op->len ? 0 : (op->retval > 0 ? -EIO : op->retval);
+        free(op->iov.buf[0].iov_base);
+        delete op;
+        if (res < 0 && res != -EINTR)
+        {
+            // The hole may only make the index look smaller on open. Then new
+            // blocks are allocated from the hole, their CAS writes just fail
+            // until they reach the real end of the index
+            fprintf(stderr, "K/V: Failed to write header of freed value segment %ju: %s (code %d)\n",
+                seg, strerror(-res), res);
+        }
+        seg += db->ino_block_size;
+        next_segment();
+    };
+    db->cli->execute(op);
+}
+
+void kv_value_gc_t::complete(int res)
+{
+    auto db = this->db;
+    auto cb = std::move(this->cb);
+    delete this;
+    db->active_ops--;
+    cb(res);
+    if (!db->active_ops && db->closing)
+        db->close(db->on_close);
+}
+
+// Merges adjacent underfull leaves with the same parent and shrinks the root when it only has one child.
+// A merge freezes the parent and the right leaf, copies items of the right leaf into the left one,
+// marks the right leaf as merged into the left one and only then removes it from the parent.
+// Frozen blocks may be read, but writers wait until they're unfrozen, so merges should only be done
+// by one client at a time. Frozen blocks of an interrupted merge are taken over by a full compaction
+// if they stay frozen for KV_MERGE_RECOVERY_MS, background compaction just skips them.
+// Merged blocks stay referenced by outdated cached parents of other clients, so they aren't reused.
+struct kv_compact_t
+{
+    kv_db_t *db;
+    std::function<void(int)> cb;
+    // full pass over all leaves or only over leaves hinted by deletes
+    bool full = false;
+    std::string key;
+    int restarts = 0;
+    uint64_t waited = UINT64_MAX;
+
+    // current descent
+    uint64_t cur = 0;
+    int cur_level = 0;
+    bool parent_ok = false;
+    std::string this_sep, next_sep;
+    uint64_t prev_child = UINT64_MAX, next_child = UINT64_MAX;
+
+    // merged pair: <right> with keys starting at <separator> is merged into <left>
+    uint64_t parent = UINT64_MAX, left = 0, right = 0;
+    int parent_level = 0;
+    std::string separator, right_lt;
+    std::vector<kv_change_t> right_items;
+    std::vector<std::pair<std::string, uint64_t>> refs;
+
+    void next_position();
+    void advance(const std::string & key_lt);
+    void descend();
+    void step();
+    void frozen_block(kv_block_t *blk);
+    void visit_leaf(kv_block_t *blk);
+    void check_pair(uint64_t left, uint64_t right, const std::string & separator, const std::string & leaf_lt);
+    void freeze_parent();
+    void freeze_right();
+    void absorb();
+    void mark_merged();
+    void remove_ref();
+    void merged();
+    void rollback(int res, bool retry);
+    void unfreeze(uint64_t offset, int level, std::function<void(int)> next);
+    void shrink_root(uint64_t child);
+    void copy_root(uint64_t child);
+    void mark_root_child(uint64_t child);
+    void recover(uint64_t offset, bool root_child);
+    void recover_child(int i, bool root_child);
+    void complete(int res);
+};
+
+static uint64_t child_ref(const kv_item_t & item)
+{
+    return item.second.size() == sizeof(uint64_t) ? *(uint64_t*)item.second.data() : UINT64_MAX;
+}
+
+// Write prepared changes of a block and apply them on success
+static void write_changes(kv_db_t *db, kv_block_t *blk, std::function<void(int)> cb)
+{
+    blk->updating++;
+    write_block(db, blk, [=](int res)
+    {
+        if (res < 0)
+        {
+            auto blk_offset = blk->offset;
+            cache_del_block(db, blk);
+            db->block_cache.erase(blk_offset);
+            db->run_continue_update(blk_offset);
+        }
+        else
+        {
+            blk->apply_change();
+            db->stop_updating(blk);
+        }
+        cb(res);
+    });
+}
+
+void kv_compact_t::next_position()
+{
+    if (db->closing)
+    {
+        complete(0);
+        return;
+    }
+    if (!full)
+    {
+        if (!db->compact_hints.size())
+        {
+            complete(0);
+            return;
+        }
+        key = *db->compact_hints.begin();
+        db->compact_hints.erase(db->compact_hints.begin());
+    }
+    restarts = 0;
+    descend();
+}
+
+void kv_compact_t::advance(const std::string & key_lt)
+{
+    if (full)
+    {
+        if (key_lt == "")
+        {
+            complete(0);
+            return;
+        }
+        key = key_lt;
+    }
+    next_position();
+}
+
+void kv_compact_t::descend()
+{
+    cur = 0;
+    cur_level = -db->base_block_level;
+    parent = UINT64_MAX;
+    parent_ok = false;
+    step();
+}
+
+void kv_compact_t::step()
+{
+    get_block(db, cur, cur_level, KV_RECHECK_ALL, [this](int res, int refresh)
+    {
+        if (res == -ENOTBLK && !cur)
+        {
+            // Empty DB
+            complete(0);
+            return;
+        }
+        if (res < 0)
+        {
+            complete(res);
+            return;
+        }
+        auto blk = &db->block_cache.at(cur);
+        if (key < blk->key_ge || blk->key_lt != "" && key >= blk->key_lt || is_merged(blk))
+        {
+            // Outdated reference, start from the root
+            if (++restarts > 16)
+            {
+                fprintf(stderr, "K/V: compaction got unrelated block %ju too many times: key=%s range=[%s, %s)\n",
+                    cur, key.c_str(), blk->key_ge.c_str(), blk->key_lt.c_str());
+                complete(-EILSEQ);
+                return;
+            }
+            descend();
+            return;
+        }
+        if (is_frozen(blk))
+        {
+            frozen_block(blk);
+            return;
+        }
+        if ((blk->type == KV_LEAF_SPLIT || blk->type == KV_INT_SPLIT) && key >= blk->right_half)
+        {
+            cur = blk->right_half_block;
+            step();
+            return;
+        }
+        if (blk->type == KV_LEAF || blk->type == KV_LEAF_SPLIT)
+        {
+            visit_leaf(blk);
+            return;
+        }
+        if (!cur && blk->type == KV_INT && blk->data.size() == 1 && restarts < 16)
+        {
+            shrink_root(child_ref(*blk->data.begin()));
+            return;
+        }
+        auto child_it = blk->data.upper_bound(key);
+        if (child_it == blk->data.begin() || child_ref(*std::prev(child_it)) == UINT64_MAX)
+        {
+            fprintf(stderr, "K/V: Internal block %ju misses boundary for %s or has an invalid reference\n", cur, key.c_str());
+            complete(-EILSEQ);
+            return;
+        }
+        child_it--;
+        // Only remember neighbours from the same parent which isn't being split
+        parent = cur;
+        parent_level = cur_level;
+        parent_ok = blk->type == KV_INT;
+        this_sep = child_it->first.str();
+        prev_child = child_it != blk->data.begin() ? child_ref(*std::prev(child_it)) : UINT64_MAX;
+        next_child = std::next(child_it) != blk->data.end() ? child_ref(*std::next(child_it)) : UINT64_MAX;
+        next_sep = next_child != UINT64_MAX ? std::next(child_it)->first.str() : "";
+        cur = child_ref(*child_it);
+        cur_level++;
+        step();
+    });
+}
+
+void kv_compact_t::frozen_block(kv_block_t *blk)
+{
+    if (!full)
+    {
+        // Background compaction doesn't wait for merges of other clients
+        advance("");
+        return;
+    }
+    if (waited != cur)
+    {
+        // Another client may still be merging, recheck later
+        waited = cur;
+        db->cli->msgr.tfd->set_timer(KV_MERGE_RECOVERY_MS, false, [this](int)
+        {
+            restarts = 0;
+            descend();
+        });
+        return;
+    }
+    fprintf(stderr, "K/V: Block %ju stays frozen, finishing or rolling back its merge\n", cur);
+    waited = UINT64_MAX;
+    if (blk->type == KV_INT_SPLIT)
+    {
+        recover(cur, false);
+    }
+    else
+    {
+        // Frozen leaves always have frozen parents, except for the only child of the root
+        fprintf(stderr, "K/V: Frozen leaf %ju is referenced by a regular block\n", cur);
+        complete(-EILSEQ);
+    }
+}
+
+void kv_compact_t::visit_leaf(kv_block_t *blk)
+{
+    auto leaf = cur;
+    auto leaf_lt = blk->key_lt;
+    if (parent == UINT64_MAX || !parent_ok || blk->type != KV_LEAF)
+    {
+        // Root leaf or a split in progress
+        advance(leaf_lt);
+    }
+    else if (next_child != UINT64_MAX && leaf_lt == next_sep)
+    {
+        check_pair(leaf, next_child, next_sep, leaf_lt);
+    }
+    else if (!full && prev_child != UINT64_MAX && blk->key_ge == this_sep)
+    {
+        // The last leaf of the parent may only be merged into the previous one
+        check_pair(prev_child, leaf, this_sep, leaf_lt);
+    }
+    else
+    {
+        advance(leaf_lt);
+    }
+}
+
+void kv_compact_t::check_pair(uint64_t left, uint64_t right, const std::string & separator, const std::string & leaf_lt)
+{
+    get_block(db, left, parent_level+1, KV_RECHECK_ALL, [=](int res, int refresh)
+    {
+        if (res < 0)
+        {
+            complete(res);
+            return;
+        }
+        auto left_blk = &db->block_cache.at(left);
+        if (left_blk->type != KV_LEAF || left_blk->key_lt != separator)
+        {
+            advance(leaf_lt);
+            return;
+        }
+        uint64_t left_size = left_blk->data_size;
+        get_block(db, right, parent_level+1, KV_RECHECK_ALL, [=](int res, int refresh)
+        {
+            if (res < 0)
+            {
+                complete(res);
+                return;
+            }
+            auto right_blk = &db->block_cache.at(right);
+            if (right_blk->type != KV_LEAF || right_blk->key_ge != separator ||
+                left_size + right_blk->data_size > (uint64_t)db->kv_block_size*db->merge_fill/100)
+            {
+                advance(leaf_lt);
+                return;
+            }
+            this->left = left;
+            this->right = right;
+            this->separator = separator;
+            freeze_parent();
+        });
+    });
+}
+
+void kv_compact_t::freeze_parent()
+{
+    get_block(db, parent, parent_level, KV_RECHECK_WAIT, [this](int res, int refresh)
+    {
+        if (res < 0)
+        {
+            complete(res);
+            return;
+        }
+        auto blk = &db->block_cache.at(parent);
+        auto it = blk->data.find(separator);
+        if (blk->type != KV_INT || it == blk->data.end() || it == blk->data.begin() ||
+            child_ref(*it) != right || child_ref(*std::prev(it)) != left)
+        {
+            // Parent changed, check the same position again
+            descend();
+            return;
+        }
+        blk->change_type = KV_CH_FREEZE;
+        write_changes(db, blk, [this](int res)
+        {
+            if (res == -EINTR)
+                descend();
+            else if (res < 0)
+                complete(res);
+            else
+                freeze_right();
+        });
+    });
+}
+
+void kv_compact_t::freeze_right()
+{
+    get_block(db, right, parent_level+1, KV_RECHECK_WAIT, [this](int res, int refresh)
+    {
+        if (res < 0)
+        {
+            rollback(res, false);
+            return;
+        }
+        auto blk = &db->block_cache.at(right);
+        if (blk->type != KV_LEAF || blk->key_ge != separator)
+        {
+            rollback(0, true);
+            return;
+        }
+        right_lt = blk->key_lt;
+        right_items.clear();
+        for (auto & kv: blk->data)
+        {
+            right_items.push_back((kv_change_t){
+                .type = KV_CH_ADD,
+                .key = kv.first.str(),
+                .value = kv.second.str(),
+                .value_ref = kv.value_ref,
+            });
+        }
+        blk->change_type = KV_CH_FREEZE;
+        write_changes(db, blk, [this](int res)
+        {
+            if (res < 0)
+                rollback(res == -EINTR ? 0 : res, true);
+            else
+                absorb();
+        });
+    });
+}
+
+void kv_compact_t::absorb()
+{
+    get_block(db, left, parent_level+1, KV_RECHECK_WAIT, [this](int res, int refresh)
+    {
+        if (res < 0)
+        {
+            rollback(res, false);
+            return;
+        }
+        auto blk = &db->block_cache.at(left);
+        if (blk->type != KV_LEAF || blk->key_lt != separator)
+        {
+            rollback(0, false);
+            return;
+        }
+        // The left leaf isn't frozen and may change, but keys of the right leaf
+        // are routed into it only after the right leaf is marked as merged
+        for (auto & ch: right_items)
+            blk->add_change(KV_CH_ADD, ch.key, ch.value, ch.value_ref);
+        blk->change_type |= KV_CH_EXTEND;
+        blk->change_rh = right_lt;
+        if (blk->encode(NULL, INT_MAX, true) >= db->kv_block_size)
+        {
+            // Left leaf grew in the meantime
+            blk->cancel_change();
+            rollback(0, false);
+            return;
+        }
+        write_changes(db, blk, [this](int res)
+        {
+            if (res == -EINTR)
+                absorb();
+            else if (res < 0)
+                complete(res);
+            else
+                mark_merged();
+        });
+    });
+}
+
+void kv_compact_t::mark_merged()
+{
+    get_block(db, right, parent_level+1, KV_RECHECK_WAIT, [this](int res, int refresh)
+    {
+        if (res < 0)
+        {
+            complete(res);
+            return;
+        }
+        auto blk = &db->block_cache.at(right);
+        if (!is_frozen(blk))
+        {
+            fprintf(stderr, "K/V: Block %ju was unfrozen during the merge\n", right);
+            complete(-EILSEQ);
+            return;
+        }
+        blk->change_type = KV_CH_MERGED;
+        blk->change_rh_block = left;
+        write_changes(db, blk, [this](int res)
+        {
+            if (res == -EINTR)
+                mark_merged();
+            else if (res < 0)
+                complete(res);
+            else
+                remove_ref();
+        });
+    });
+}
+
+void kv_compact_t::remove_ref()
+{
+    get_block(db, parent, parent_level, KV_RECHECK_WAIT, [this](int res, int refresh)
+    {
+        if (res < 0)
+        {
+            complete(res);
+            return;
+        }
+        auto blk = &db->block_cache.at(parent);
+        auto it = blk->data.find(separator);
+        if (it != blk->data.end() && child_ref(*it) == right)
+            blk->add_change(KV_CH_DEL, separator, "");
+        if (is_frozen(blk))
+            blk->change_type |= KV_CH_CLEAR_RIGHT;
+        if (!blk->change_type)
+        {
+            merged();
+            return;
+        }
+        write_changes(db, blk, [this](int res)
+        {
+            if (res == -EINTR)
+                remove_ref();
+            else if (res < 0)
+                complete(res);
+            else
+                merged();
+        });
+    });
+}
+
+void kv_compact_t::merged()
+{
+    db->stats.leaf_merges++;
+    if (full)
+    {
+        // Try to merge the same leaf with the next one
+        restarts = 0;
+        descend();
+    }
+    else
+        next_position();
+}
+
+// Unfreeze the right leaf, then the parent
+void kv_compact_t::rollback(int res, bool retry)
+{
+    unfreeze(right, parent_level+1, [=](int right_res)
+    {
+        unfreeze(parent, parent_level, [=](int parent_res)
+        {
+            int r = res < 0 ? res : (right_res < 0 ? right_res : parent_res);
+            if (r < 0)
+                complete(r);
+            else if (retry)
+                descend();
+            else
+            {
+                // Try the next leaf
+                auto leaf = db->block_cache.find(left);
+                advance(leaf != db->block_cache.end() ? leaf->second.key_lt : separator);
+            }
+        });
+    });
+}
+
+void kv_compact_t::unfreeze(uint64_t offset, int level, std::function<void(int)> next)
+{
+    get_block(db, offset, level, KV_RECHECK_WAIT, [=](int res, int refresh)
+    {
+        if (res < 0)
+        {
+            next(res);
+            return;
+        }
+        auto blk = &db->block_cache.at(offset);
+        if (!is_frozen(blk))
+        {
+            next(0);
+            return;
+        }
+        blk->change_type = KV_CH_CLEAR_RIGHT;
+        write_changes(db, blk, [=](int res)
+        {
+            if (res == -EINTR)
+                unfreeze(offset, level, next);
+            else
+                next(res);
+        });
+    });
+}
+
+// The root has only one child. Freeze it, copy it into the root and mark it as merged.
+// Nothing else changes the root while its only child is frozen
+void kv_compact_t::shrink_root(uint64_t child)
+{
+    get_block(db, child, cur_level+1, KV_RECHECK_WAIT, [=](int res, int refresh)
+    {
+        if (res < 0)
+        {
+            complete(res);
+            return;
+        }
+        auto blk = &db->block_cache.at(child);
+        if (is_frozen(blk))
+        {
+            if (!full)
+            {
+                advance("");
+            }
+            else if (waited != child)
+            {
+                waited = child;
+                db->cli->msgr.tfd->set_timer(KV_MERGE_RECOVERY_MS, false, [this](int)
+                {
+                    restarts = 0;
+                    descend();
+                });
+            }
+            else
+            {
+                fprintf(stderr, "K/V: Block %ju stays frozen, finishing or rolling back its merge\n", child);
+                waited = UINT64_MAX;
+                parent = child;
+                parent_level = cur_level+1;
+                if (blk->type == KV_INT_SPLIT)
+                    recover(child, true);
+                else
+                    copy_root(child);
+            }
+            return;
+        }
+        if (blk->type != KV_LEAF && blk->type != KV_INT || blk->key_ge != "" || blk->key_lt != "")
+        {
+            // Child is being split or the root has changed, skip shrinking
+            restarts = 16;
+            descend();
+            return;
+        }
+        blk->change_type = KV_CH_FREEZE;
+        write_changes(db, blk, [=](int res)
+        {
+            if (res == -EINTR)
+                descend();
+            else if (res < 0)
+                complete(res);
+            else
+                copy_root(child);
+        });
+    });
+}
+
+void kv_compact_t::copy_root(uint64_t child)
+{
+    int child_level = -db->base_block_level+1;
+    get_block(db, child, child_level, KV_RECHECK_WAIT, [=](int res, int refresh)
+    {
+        if (res < 0)
+        {
+            complete(res);
+            return;
+        }
+        auto blk = &db->block_cache.at(child);
+        if (!is_frozen(blk))
+        {
+            descend();
+            return;
+        }
+        get_block(db, 0, child_level-1, KV_RECHECK_WAIT, [=](int res, int refresh)
+        {
+            if (res < 0)
+            {
+                complete(res);
+                return;
+            }
+            auto blk = &db->block_cache.at(child);
+            auto root = &db->block_cache.at(0);
+            if (root->type != KV_INT || root->data.size() != 1 || child_ref(*root->data.begin()) != child)
+            {
+                if (root->data.size() == blk->data.size() && (!root->data.size() ||
+                    root->data.begin()->first == blk->data.begin()->first &&
+                    root->data.begin()->second == blk->data.begin()->second))
+                {
+                    // Already copied
+                    mark_root_child(child);
+                }
+                else
+                {
+                    // The root can't change while its only child is frozen
+                    fprintf(stderr, "K/V: Root block changed while its child %ju was frozen\n", child);
+                    complete(-EILSEQ);
+                }
+                return;
+            }
+            auto new_root = new kv_block_t;
+            new_root->offset = 0;
+            new_root->type = blk->type == KV_LEAF_SPLIT ? KV_LEAF : KV_INT;
+            new_root->format = db->block_format;
+            new_root->level = child_level;
+            new_root->change_type = 0;
+            new_root->data.assign(blk->data.begin(), blk->data.end());
+            new_root->set_data_size();
+            new_root->updating++;
+            new_root->invalidated = root->invalidated;
+            root->updating++;
+            write_block(db, new_root, [=](int res)
+            {
+                if (res < 0)
+                {
+                    cache_del_block(db, root);
+                    db->block_cache.erase(0);
+                    db->run_continue_update(0);
+                    delete new_root;
+                    if (res == -EINTR)
+                        copy_root(child);
+                    else
+                        complete(res);
+                    return;
+                }
+                cache_del_block(db, root);
+                std::swap(*root, *new_root);
+                cache_add_block(db, root);
+                db->base_block_level = -root->level;
+                db->stop_updating(root);
+                delete new_root;
+                mark_root_child(child);
+            });
+        });
+    });
+}
+
+void kv_compact_t::mark_root_child(uint64_t child)
+{
+    get_block(db, child, -db->base_block_level, KV_RECHECK_WAIT, [=](int res, int refresh)
+    {
+        if (res < 0)
+        {
+            complete(res);
+            return;
+        }
+        auto blk = &db->block_cache.at(child);
+        if (!is_frozen(blk))
+        {
+            descend();
+            return;
+        }
+        // Outdated references to the old child lead to the root
+        blk->change_type = KV_CH_MERGED;
+        blk->change_rh_block = 0;
+        write_changes(db, blk, [=](int res)
+        {
+            if (res == -EINTR)
+                mark_root_child(child);
+            else if (res < 0)
+                complete(res);
+            else
+            {
+                db->stats.root_shrinks++;
+                restarts = 0;
+                descend();
+            }
+        });
+    });
+}
+
+// Finish or roll back an interrupted merge of children of a frozen internal block
+void kv_compact_t::recover(uint64_t offset, bool root_child)
+{
+    auto blk = &db->block_cache.at(offset);
+    parent = offset;
+    parent_level = root_child ? -db->base_block_level+1 : cur_level;
+    refs.clear();
+    for (auto & kv: blk->data)
+        refs.push_back({ kv.first.str(), child_ref(kv) });
+    recover_child(0, root_child);
+}
+
+void kv_compact_t::recover_child(int i, bool root_child)
+{
+    if (i >= refs.size())
+    {
+        // No merged children, it's either the last child of the root or the merge didn't start
+        if (root_child)
+            copy_root(parent);
+        else
+        {
+            unfreeze(parent, parent_level, [this](int res)
+            {
+                if (res < 0)
+                    complete(res);
+                else
+                    descend();
+            });
+        }
+        return;
+    }
+    get_block(db, refs[i].second, parent_level+1, KV_RECHECK_WAIT, [=](int res, int refresh)
+    {
+        if (res < 0)
+        {
+            complete(res);
+            return;
+        }
+        auto blk = &db->block_cache.at(refs[i].second);
+        if (!is_frozen(blk) && !is_merged(blk))
+        {
+            recover_child(i+1, root_child);
+            return;
+        }
+        separator = refs[i].first;
+        right = refs[i].second;
+        left = i > 0 ? refs[i-1].second : UINT64_MAX;
+        if (is_merged(blk))
+        {
+            remove_ref();
+            return;
+        }
+        right_lt = blk->key_lt;
+        if (!i)
+        {
+            rollback(0, true);
+            return;
+        }
+        // Right leaf is frozen, check if its items were already copied
+        get_block(db, left, parent_level+1, KV_RECHECK_ALL, [=](int res, int refresh)
+        {
+            if (res < 0)
+            {
+                complete(res);
+                return;
+            }
+            auto left_blk = &db->block_cache.at(left);
+            if (left_blk->key_lt == right_lt && left_blk->key_ge < separator)
+                mark_merged();
+            else
+                rollback(0, true);
+        });
+    });
+}
+
+void kv_compact_t::complete(int res)
+{
+    auto db = this->db;
+    auto cb = std::move(this->cb);
+    db->compacting = false;
+    delete this;
+    db->active_ops--;
+    cb(res);
+    if (!db->active_ops && db->closing)
+        db->close(db->on_close);
+}
+
+// Remember leaves left underfull by deletes and merge them in background
+static void hint_compaction(kv_db_t *db, kv_block_t *blk)
+{
+    if (!db->auto_compact || blk->type != KV_LEAF || db->closing ||
+        blk->data_size > (uint64_t)db->kv_block_size*db->merge_fill/200)
+    {
+        return;
+    }
+    db->compact_hints.insert(blk->key_ge);
+    if (db->compacting || db->compact_armed)
+    {
+        return;
+    }
+    db->compact_armed = true;
+    db->active_ops++;
+    db->cli->msgr.tfd->set_timer(KV_MERGE_WAIT_MS, false, [db](int)
+    {
+        db->compact_armed = false;
+        if (db->compacting || db->closing)
+        {
+            db->active_ops--;
+            if (!db->active_ops && db->closing)
+                db->close(db->on_close);
+            return;
+        }
+        db->compacting = true;
+        auto c = new kv_compact_t;
+        c->db = db;
+        c->cb = [](int res)
+        {
+            if (res < 0)
+                fprintf(stderr, "K/V: Background compaction failed: %s (code %d)\n", strerror(-res), res);
+        };
+        c->next_position();
+    });
+}
+
+kv_dbw_t::kv_dbw_t(cluster_client_t *cli)
+{
+    db = new kv_db_t();
+    db->cli = cli;
+}
+
+kv_dbw_t::~kv_dbw_t()
+{
+    delete db;
+}
+
+void kv_dbw_t::open(uint64_t inode_id, std::map<std::string, std::string> cfg, std::function<void(int)> cb)
+{
+    db->open(inode_id, cfg, cb);
+}
+
+void kv_dbw_t::set_config(std::map<std::string, std::string> cfg)
+{
+    db->set_config(cfg);
+}
+
+uint64_t kv_dbw_t::get_size()
+{
+    return db->next_free;
+}
+
+kv_stats_t kv_dbw_t::get_stats()
+{
+    kv_stats_t stats = db->stats;
+    stats.cache_blocks = db->block_cache.size();
+    stats.cache_bytes = db->cache_bytes;
+    stats.cache_hot_bytes = db->cache_hot_bytes;
+    return stats;
+}
+
+void kv_dbw_t::close(std::function<void()> cb)
+{
+    db->close(cb);
+}
+
+void kv_dbw_t::get(const std::string & key, std::function<void(int res, const std::string & value)> cb, bool cached)
+{
+    auto *op = new kv_op_t;
+    op->db = db;
+    op->opcode = cached ? KV_GET_CACHED : KV_GET;
+    op->key = key;
+    op->callback = [cb](kv_op_t *op)
+    {
+        cb(op->res, op->value);
+        delete op;
+    };
+    op->exec();
+}
+
+void kv_dbw_t::set(const std::string & key, const std::string & value, std::function<void(int res)> cb,
+    std::function<bool(int res, const std::string & value)> cas_compare)
+{
+    auto *op = new kv_op_t;
+    op->db = db;
+    op->opcode = KV_SET;
+    op->key = key;
+    op->value = value;
+    if (cas_compare)
+    {
+        op->cas_cb = cas_compare;
+    }
+    op->callback = [cb](kv_op_t *op)
+    {
+        cb(op->res);
+        delete op;
+    };
+    op->exec();
+}
+
+void kv_dbw_t::del(const std::string & key, std::function<void(int res)> cb,
+    std::function<bool(int res, const std::string & value)> cas_compare)
+{
+    auto *op = new kv_op_t;
+    op->db = db;
+    op->opcode = KV_DEL;
+    op->key = key;
+    if (cas_compare)
+    {
+        op->cas_cb = cas_compare;
+    }
+    op->callback = [cb](kv_op_t *op)
+    {
+        cb(op->res);
+        delete op;
+    };
+    op->exec();
+}
+
+void kv_dbw_t::write_batch(const std::vector<kv_write_t> & batch,
+    std::function<void(int res, const std::vector<int> & results)> cb)
+{
+    auto *op = new kv_op_t;
+    op->db = db;
+    op->opcode = KV_BATCH;
+    op->batch = batch;
+    op->batch_res.resize(batch.size(), -EINPROGRESS);
+    op->callback = [cb](kv_op_t *op)
+    {
+        for (auto & r: op->batch_res)
+            if (r == -EINPROGRESS)
+                r = -ECANCELED;
+        cb(op->res, op->batch_res);
+        delete op;
+    };
+    op->exec();
+}
+
+void kv_dbw_t::multi_get(const std::vector<std::string> & keys,
+    std::function<void(int res, std::vector<kv_read_t> & results)> cb, bool cached)
+{
+    if (!keys.size())
+    {
+        std::vector<kv_read_t> empty;
+        cb(0, empty);
+        return;
+    }
+    auto *op = new kv_op_t;
+    op->db = db;
+    op->opcode = cached ? KV_GET_CACHED : KV_GET;
+    op->reads.resize(keys.size());
+    for (int i = 0; i < keys.size(); i++)
+        op->reads[i].key = keys[i];
+    op->callback = [cb](kv_op_t *op)
+    {
+        cb(op->res, op->reads);
+        delete op;
+    };
+    op->exec();
+}
+
+void* kv_dbw_t::list_start(const std::string & start)
+{
+    if (!db->inode_id || db->closing)
+        return NULL;
+    auto *op = new kv_op_t;
+    op->db = db;
+    op->opcode = KV_LIST;
+    op->key = start;
+    op->callback = [](kv_op_t *){};
+    op->exec();
+    return op;
+}
+
+void kv_dbw_t::list_next(void *handle, std::function<void(int res, const std::string & key, const std::string & value)> cb)
+{
+    kv_op_t *op = (kv_op_t*)handle;
+    if (cb)
+    {
+        op->callback = [cb](kv_op_t *op)
+        {
+            cb(op->res, op->key, op->value);
+        };
+    }
+    op->next();
+}
+
+void kv_dbw_t::list_close(void *handle)
+{
+    kv_op_t *op = (kv_op_t*)handle;
     delete op;
 }
+
+void* kv_dbw_t::bulk_load_start(int parallel)
+{
+    if (!db->inode_id || db->closing || db->next_free != 0)
+        return NULL;
+    // Reserve the root block
+    auto root_offset = db->alloc_block();
+    assert(root_offset == 0);
+    db->active_ops++;
+    auto bl = new kv_bulk_load_t;
+    bl->db = db;
+    bl->parallel = parallel > 0 ? parallel : 1;
+    return bl;
+}
+
+void kv_dbw_t::bulk_load_add(void *handle, const std::string & key, const std::string & value, std::function<void(int res)> cb)
+{
+    auto bl = (kv_bulk_load_t*)handle;
+    int res = bl->add(key, value);
+    if (res < 0 || bl->in_flight < bl->parallel && !bl->waiting.size())
+        cb(res);
+    else
+        bl->waiting.push_back(cb);
+}
+
+void kv_dbw_t::bulk_load_finish(void *handle, std::function<void(int res)> cb)
+{
+    auto bl = (kv_bulk_load_t*)handle;
+    bl->finish_cb = cb;
+    bl->finish();
+}
+
+void kv_dbw_t::gc_values(std::function<void(int res)> cb)
+{
+    if (!db->inode_id || db->closing)
+    {
+        cb(-EINVAL);
+        return;
+    }
+    db->active_ops++;
+    auto gc = new kv_value_gc_t;
+    gc->db = db;
+    gc->cb = cb;
+    gc->end = db->next_free;
+    gc->next_segment();
+}
+
+void kv_dbw_t::compact(std::function<void(int res)> cb)
+{
+    if (!db->inode_id || db->closing)
+    {
+        cb(-EINVAL);
+        return;
+    }
+    if (db->compacting)
+    {
+        cb(-EBUSY);
+        return;
+    }
+    db->compacting = true;
+    db->active_ops++;
+    auto c = new kv_compact_t;
+    c->db = db;
+    c->cb = cb;
+    c->full = true;
+    c->next_position();
+}
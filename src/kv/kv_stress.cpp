@@ -5,6 +5,7 @@
 
 #define _XOPEN_SOURCE
 #include <limits.h>
+#include <math.h>
 
 #include <netinet/tcp.h>
 #include <sys/epoll.h>
@@ -29,18 +30,36 @@ struct kv_test_listing_t
     bool error = false;
 };
 
+// Log-linear latency histogram: 32 buckets per power of 2, ~3% precision
+#define KV_TEST_HIST_SUB 32
+#define KV_TEST_HIST_SIZE (KV_TEST_HIST_SUB*40)
+
 struct kv_test_lat_t
 {
     const char *name = NULL;
-    uint64_t usec = 0, count = 0;
+    uint64_t usec = 0, count = 0, max_usec = 0;
+    uint64_t hist[KV_TEST_HIST_SIZE] = { 0 };
 };
 
 struct kv_test_stat_t
 {
-    kv_test_lat_t get, add, update, del, list;
+    kv_test_lat_t get, add, update, del, list, rmw;
     uint64_t list_keys = 0;
 };
 
+// YCSB-like zipfian generator (Gray et al., "Quickly generating billion-record
+// synthetic databases"), item count may grow incrementally
+struct kv_test_zipf_t
+{
+    double theta = 0.99;
+    double zeta2 = 0, zetan = 0, alpha = 0, eta = 0;
+    uint64_t n = 0;
+
+    void init(double theta);
+    void grow(uint64_t new_n);
+    uint64_t next();
+};
+
 class kv_test_t
 {
 public:
@@ -63,6 +82,12 @@ public:
     uint64_t max_value_len = 300;
     uint64_t min_list_count = 10;
     uint64_t max_list_count = 1000;
+    uint64_t rmw_prob = 0;
+    uint64_t record_count = 0;
+    uint64_t rate = 0;
+    uint64_t seed = 0;
+    std::string distribution;
+    double zipf_theta = 0.99;
     uint64_t print_stats_interval = 1;
     bool json_output = false;
     uint64_t log_level = 1;
@@ -82,8 +107,14 @@ public:
     uint64_t total_prob = 0;
     uint64_t ops_sent = 0, ops_done = 0;
     int stat_timer_id = -1;
+    int rate_timer_id = -1;
     int in_progress = 0;
     bool reopening = false;
+    bool loading = false;
+    uint64_t load_sent = 0, load_done = 0;
+    // Number of generated keys in the indexed (YCSB-like) mode
+    uint64_t key_count = 0;
+    kv_test_zipf_t zipf;
     std::set<kv_test_listing_t*> listings;
     std::set<std::string> changing_keys;
     std::map<std::string, std::string> values;
@@ -94,6 +125,14 @@ public:
     void parse_config(json11::Json cfg);
     void run(json11::Json cfg);
     void loop();
+    void load();
+    void start_run();
+    bool indexed_keys();
+    std::string make_key(uint64_t idx);
+    std::string new_key();
+    bool pick_key(std::string & key);
+    void check_get(const std::string & key, int res, const std::string & value);
+    void op_start_time(timespec & tv_begin);
     void print_stats(kv_test_stat_t & prev_stat, timespec & prev_stat_time);
     void print_total_stats();
     void start_change(const std::string & key);
@@ -128,6 +167,27 @@ json11::Json::object kv_test_t::parse_args(int narg, const char *args[])
                 "(c) Vitaliy Filippov, 2023+ (VNPL-1.1)\n"
                 "\n"
                 "USAGE: %s --pool_id POOL_ID --inode_id INODE_ID [OPTIONS]\n"
+                "  --workload a|b|c|d|e|f\n"
+                "    Use a YCSB core workload preset:\n"
+                "      a = 50%% get, 50%% update, zipfian\n"
+                "      b = 95%% get, 5%% update, zipfian\n"
+                "      c = 100%% get, zipfian\n"
+                "      d = 95%% get, 5%% add, latest\n"
+                "      e = 95%% list of 1-100 keys, 5%% add, zipfian\n"
+                "      f = 50%% get, 50%% read-modify-write, zipfian\n"
+                "    Options below override preset values\n"
+                "  --record_count 0\n"
+                "    Add this number of keys before starting the test (100000 with --workload)\n"
+                "  --distribution uniform|zipfian|latest\n"
+                "    Use generated keys (\"user<hash>\") and pick them with this distribution.\n"
+                "    Default is to use random keys of random length (uniform with --record_count)\n"
+                "  --zipf_theta 0.99\n"
+                "    Zipfian distribution skew\n"
+                "  --rate 0\n"
+                "    Start operations at this fixed rate per second (open loop). Latency\n"
+                "    is then counted from the scheduled start time. 0 = closed loop\n"
+                "  --seed 0\n"
+                "    Random seed, 0 = use current time\n"
                 "  --op_count 1000000\n"
                 "    Total operations to run during test. 0 means unlimited\n"
                 "  --key_prefix \"\"\n"
@@ -137,7 +197,7 @@ json11::Json::object kv_test_t::parse_args(int narg, const char *args[])
                 "  --runtime 0\n"
                 "    Run for this number of seconds. 0 means unlimited\n"
                 "  --parallelism 4\n"
-                "    Run this number of operations in parallel\n"
+                "    Run this number of operations in parallel (maximum with --rate)\n"
                 "  --get_prob 30000\n"
                 "    Fraction of key retrieve operations\n"
                 "  --add_prob 20000\n"
@@ -148,6 +208,8 @@ json11::Json::object kv_test_t::parse_args(int narg, const char *args[])
                 "    Fraction of key delete operations\n"
                 "  --list_prob 300\n"
                 "    Fraction of listing operations\n"
+                "  --rmw_prob 0\n"
+                "    Fraction of read-modify-write operations\n"
                 "  --reopen_prob 1\n"
                 "    Fraction of database reopens\n"
                 "  --min_key_len 10\n"
@@ -165,7 +227,7 @@ json11::Json::object kv_test_t::parse_args(int narg, const char *args[])
                 "  --print_stats 1\n"
                 "    Print operation statistics every this number of seconds\n"
                 "  --json\n"
-                "    JSON output\n"
+                "    JSON output. Total statistics include p50-p99.99 latency percentiles\n"
                 "  --stop_on_error 0\n"
                 "    Stop on first execution error, mismatch, lost key or extra key during listing\n"
                 "  --kv_block_size 4k\n"
@@ -174,14 +236,16 @@ json11::Json::object kv_test_t::parse_args(int narg, const char *args[])
                 "    Maximum memory to use for vitastor-kv index cache\n"
                 "  --kv_allocate_blocks 4\n"
                 "    Number of PG blocks used for new tree block allocation in parallel\n"
-                "  --kv_evict_max_misses 10\n"
-                "    Eviction algorithm parameter: retry eviction from another random spot\n"
-                "    if this number of keys is used currently or was used recently\n"
-                "  --kv_evict_attempts_per_level 3\n"
-                "    Retry eviction at most this number of times per tree level, starting\n"
-                "    with bottom-most levels\n"
-                "  --kv_evict_unused_age 1000\n"
-                "    Evict only keys unused during this number of last operations\n"
+                "  --kv_block_format 2\n"
+                "    Block format for new writes. 2 = prefix-compressed, 1 = old format\n"
+                "  --kv_value_separation 0\n"
+                "    Store values of at least this size outside of the tree. 0 = disabled\n"
+                "  --kv_value_seal_timeout 600\n"
+                "    Collect value segments of crashed clients after this number of seconds without writes\n"
+                "  --kv_merge_fill 50\n"
+                "    Merge adjacent leaves if they fit into this percentage of a block together\n"
+                "  --kv_auto_compact 0\n"
+                "    Merge leaves left underfull by deletes in background\n"
                 "  --kv_log_level 1\n"
                 "    Log level. 0 = errors, 1 = warnings, 10 = trace operations\n",
                 exe_name
@@ -200,6 +264,54 @@ json11::Json::object kv_test_t::parse_args(int narg, const char *args[])
 void kv_test_t::parse_config(json11::Json cfg)
 {
     inode_id = INODE_WITH_POOL(cfg["pool_id"].uint64_value(), cfg["inode_id"].uint64_value());
+    if (!cfg["workload"].is_null())
+    {
+        auto wl = cfg["workload"].string_value();
+        if (wl.size() != 1 || wl[0] < 'a' || wl[0] > 'f')
+        {
+            fprintf(stderr, "Unknown workload: %s, supported workloads are a-f\n", wl.c_str());
+            exit(1);
+        }
+        reopen_prob = add_prob = update_prob = del_prob = list_prob = rmw_prob = 0;
+        record_count = 100000;
+        distribution = wl[0] == 'd' ? "latest" : "zipfian";
+        if (wl[0] == 'a')
+            get_prob = update_prob = 50;
+        else if (wl[0] == 'b')
+            get_prob = 95, update_prob = 5;
+        else if (wl[0] == 'c')
+            get_prob = 100;
+        else if (wl[0] == 'd')
+            get_prob = 95, add_prob = 5;
+        else if (wl[0] == 'e')
+            get_prob = 0, list_prob = 95, add_prob = 5, min_list_count = 1, max_list_count = 101;
+        else if (wl[0] == 'f')
+            get_prob = rmw_prob = 50;
+    }
+    if (!cfg["record_count"].is_null())
+        record_count = cfg["record_count"].uint64_value();
+    if (!cfg["distribution"].is_null())
+        distribution = cfg["distribution"].string_value();
+    else if (record_count > 0 && distribution == "")
+        distribution = "uniform";
+    if (distribution != "" && distribution != "uniform" && distribution != "zipfian" && distribution != "latest")
+    {
+        fprintf(stderr, "Unknown key distribution: %s\n", distribution.c_str());
+        exit(1);
+    }
+    if (!cfg["zipf_theta"].is_null())
+    {
+        zipf_theta = atof(cfg["zipf_theta"].as_string().c_str());
+        if (zipf_theta <= 0 || zipf_theta >= 1)
+        {
+            fprintf(stderr, "zipf_theta must be between 0 and 1\n");
+            exit(1);
+        }
+    }
+    if (!cfg["rate"].is_null())
+        rate = cfg["rate"].uint64_value();
+    if (!cfg["seed"].is_null())
+        seed = cfg["seed"].uint64_value();
     if (cfg["op_count"].uint64_value() > 0)
         op_count = cfg["op_count"].uint64_value();
     key_prefix = cfg["key_prefix"].string_value();
@@ -220,6 +332,8 @@ void kv_test_t::parse_config(json11::Json cfg)
         del_prob = cfg["del_prob"].uint64_value();
     if (!cfg["list_prob"].is_null())
         list_prob = cfg["list_prob"].uint64_value();
+    if (!cfg["rmw_prob"].is_null())
+        rmw_prob = cfg["rmw_prob"].uint64_value();
     if (!cfg["min_key_len"].is_null())
         min_key_len = cfg["min_key_len"].uint64_value();
     if (cfg["max_key_len"].uint64_value() > 0)
@@ -244,30 +358,42 @@ void kv_test_t::parse_config(json11::Json cfg)
         kv_cfg["kv_memory_limit"] = cfg["kv_memory_limit"].as_string();
     if (!cfg["kv_allocate_blocks"].is_null())
         kv_cfg["kv_allocate_blocks"] = cfg["kv_allocate_blocks"].as_string();
-    if (!cfg["kv_evict_max_misses"].is_null())
-        kv_cfg["kv_evict_max_misses"] = cfg["kv_evict_max_misses"].as_string();
-    if (!cfg["kv_evict_attempts_per_level"].is_null())
-        kv_cfg["kv_evict_attempts_per_level"] = cfg["kv_evict_attempts_per_level"].as_string();
-    if (!cfg["kv_evict_unused_age"].is_null())
-        kv_cfg["kv_evict_unused_age"] = cfg["kv_evict_unused_age"].as_string();
+    if (!cfg["kv_block_format"].is_null())
+        kv_cfg["kv_block_format"] = cfg["kv_block_format"].as_string();
+    if (!cfg["kv_value_separation"].is_null())
+        kv_cfg["kv_value_separation"] = cfg["kv_value_separation"].as_string();
+    if (!cfg["kv_value_seal_timeout"].is_null())
+        kv_cfg["kv_value_seal_timeout"] = cfg["kv_value_seal_timeout"].as_string();
+    if (!cfg["kv_merge_fill"].is_null())
+        kv_cfg["kv_merge_fill"] = cfg["kv_merge_fill"].as_string();
+    if (!cfg["kv_auto_compact"].is_null())
+        kv_cfg["kv_auto_compact"] = cfg["kv_auto_compact"].as_string();
     if (!cfg["kv_log_level"].is_null())
     {
         log_level = cfg["kv_log_level"].uint64_value();
         trace = log_level >= 10;
         kv_cfg["kv_log_level"] = std::to_string(log_level);
     }
-    total_prob = reopen_prob+get_prob+add_prob+update_prob+del_prob+list_prob;
+    total_prob = reopen_prob+get_prob+add_prob+update_prob+del_prob+list_prob+rmw_prob;
+    if (!total_prob)
+    {
+        fprintf(stderr, "At least one operation probability must be non-zero\n");
+        exit(1);
+    }
     stat.get.name = "get";
     stat.add.name = "add";
     stat.update.name = "update";
     stat.del.name = "del";
     stat.list.name = "list";
+    stat.rmw.name = "rmw";
 }
 
 void kv_test_t::run(json11::Json cfg)
 {
-    srand48(time(NULL));
     parse_config(cfg);
+    srand48(seed ? seed : time(NULL));
+    if (indexed_keys() && distribution != "uniform")
+        zipf.init(zipf_theta);
     // Create client
     ringloop = new ring_loop_t(512);
     epmgr = new epoll_manager_t(ringloop);
@@ -297,10 +423,14 @@ void kv_test_t::run(json11::Json cfg)
     });
     consumer.loop = [this]() { loop(); };
     ringloop->register_consumer(&consumer);
-    if (print_stats_interval)
-        stat_timer_id = epmgr->tfd->set_timer(print_stats_interval*1000, true, [this](int) { print_stats(prev_stat, prev_stat_time); });
-    clock_gettime(CLOCK_REALTIME, &start_stat_time);
-    prev_stat_time = start_stat_time;
+    if (record_count > 0)
+    {
+        // Fill the DB before starting the timed run
+        loading = true;
+        clock_gettime(CLOCK_REALTIME, &start_stat_time);
+    }
+    else
+        start_run();
     while (!finished)
     {
         ringloop->loop();
@@ -309,6 +439,8 @@ void kv_test_t::run(json11::Json cfg)
     }
     if (stat_timer_id >= 0)
         epmgr->tfd->clear_timer(stat_timer_id);
+    if (rate_timer_id >= 0)
+        epmgr->tfd->clear_timer(rate_timer_id);
     ringloop->unregister_consumer(&consumer);
     // Print total stats
     print_total_stats();
@@ -337,17 +469,209 @@ std::string random_str(int len)
     return str;
 }
 
+static uint64_t random_u64()
+{
+    return ((uint64_t)lrand48() << 31) ^ (uint64_t)lrand48() ^ ((uint64_t)lrand48() << 62);
+}
+
+// FNV-1a hash of a 64-bit number, used like in YCSB to scatter key indexes
+static uint64_t fnv_hash64(uint64_t val)
+{
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (int i = 0; i < 8; i++)
+    {
+        hash = (hash ^ (val & 0xFF)) * 0x100000001B3ull;
+        val >>= 8;
+    }
+    return hash;
+}
+
+void kv_test_zipf_t::init(double theta)
+{
+    this->theta = theta;
+    zeta2 = 1.0 + 1.0/pow(2.0, theta);
+    alpha = 1.0/(1.0-theta);
+    zetan = 0;
+    n = 0;
+}
+
+void kv_test_zipf_t::grow(uint64_t new_n)
+{
+    if (new_n <= n)
+        return;
+    for (uint64_t i = n; i < new_n; i++)
+        zetan += 1.0/pow(i+1, theta);
+    n = new_n;
+    eta = n > 2 ? (1.0 - pow(2.0/n, 1.0-theta)) / (1.0 - zeta2/zetan) : 0;
+}
+
+uint64_t kv_test_zipf_t::next()
+{
+    double u = drand48();
+    double uz = u*zetan;
+    if (uz < 1.0 || n < 2)
+        return 0;
+    if (uz < zeta2 || n < 3)
+        return 1;
+    uint64_t r = (uint64_t)(n * pow(eta*u - eta + 1.0, alpha));
+    return r >= n ? n-1 : r;
+}
+
+bool kv_test_t::indexed_keys()
+{
+    return distribution != "";
+}
+
+std::string kv_test_t::make_key(uint64_t idx)
+{
+    return key_prefix + "user" + std::to_string(fnv_hash64(idx)) + key_suffix;
+}
+
+std::string kv_test_t::new_key()
+{
+    if (indexed_keys())
+        return make_key(key_count++);
+    uint64_t key_len = min_key_len + (max_key_len > min_key_len ? lrand48() % (max_key_len-min_key_len) : 0);
+    return key_prefix + random_str(key_len) + key_suffix;
+}
+
+// Pick an existing key according to the selected distribution
+bool kv_test_t::pick_key(std::string & key)
+{
+    if (!indexed_keys())
+    {
+        auto k_it = values.lower_bound(random_str(max_key_len));
+        if (k_it == values.end())
+            return false;
+        key = k_it->first;
+        return true;
+    }
+    if (!key_count)
+        return false;
+    uint64_t idx;
+    if (distribution == "uniform")
+        idx = random_u64() % key_count;
+    else
+    {
+        zipf.grow(key_count);
+        idx = zipf.next();
+        idx = distribution == "latest" ? key_count-1-idx : fnv_hash64(idx) % key_count;
+    }
+    key = make_key(idx);
+    return values.find(key) != values.end();
+}
+
+void kv_test_t::load()
+{
+    while (load_sent < record_count && in_progress < parallelism)
+    {
+        auto key = new_key();
+        uint64_t value_len = min_value_len + (max_value_len > min_value_len ? lrand48() % (max_value_len-min_value_len) : 0);
+        auto value = random_str(value_len);
+        start_change(key);
+        load_sent++;
+        in_progress++;
+        if (trace)
+            printf("load %s = %s\n", key.c_str(), value.c_str());
+        db->set(key, value, [this, key, value](int res)
+        {
+            stop_change(key);
+            load_done++;
+            in_progress--;
+            if (res != 0)
+            {
+                fprintf(stderr, "ERROR: load %s = %s: %d (%s)\n", key.c_str(), value.c_str(), res, strerror(-res));
+                exit(1);
+            }
+            values[key] = value;
+            ringloop->wakeup();
+        }, NULL);
+    }
+    if (load_done >= record_count)
+    {
+        timespec tv_end;
+        clock_gettime(CLOCK_REALTIME, &tv_end);
+        if (!json_output)
+        {
+            printf("Loaded %ju keys in %.1f s\n", record_count, (tv_end.tv_sec - start_stat_time.tv_sec) +
+                (tv_end.tv_nsec - start_stat_time.tv_nsec)/1000000000.0);
+        }
+        loading = false;
+        start_run();
+        ringloop->wakeup();
+    }
+}
+
+void kv_test_t::start_run()
+{
+    if (print_stats_interval)
+        stat_timer_id = epmgr->tfd->set_timer(print_stats_interval*1000, true, [this](int) { print_stats(prev_stat, prev_stat_time); });
+    if (rate)
+        rate_timer_id = epmgr->tfd->set_timer(1, true, [this](int) { ringloop->wakeup(); });
+    clock_gettime(CLOCK_REALTIME, &start_stat_time);
+    prev_stat_time = start_stat_time;
+}
+
+void kv_test_t::check_get(const std::string & key, int res, const std::string & value)
+{
+    auto it = values.find(key);
+    if (res != (it == values.end() ? -ENOENT : 0))
+    {
+        fprintf(stderr, "ERROR: get %s: %d (%s)\n", key.c_str(), res, strerror(-res));
+        if (stop_on_error)
+            exit(1);
+    }
+    else if (it != values.end() && value != it->second)
+    {
+        fprintf(stderr, "ERROR: get %s: mismatch: %s vs %s\n", key.c_str(), value.c_str(), it->second.c_str());
+        if (stop_on_error)
+            exit(1);
+    }
+}
+
+void kv_test_t::op_start_time(timespec & tv_begin)
+{
+    if (!rate)
+    {
+        clock_gettime(CLOCK_REALTIME, &tv_begin);
+        return;
+    }
+    // Open loop: latency is counted from the moment when the operation was
+    // scheduled to start, so that stalls are not hidden by the queue
+    uint64_t nsec = start_stat_time.tv_nsec + (uint64_t)(ops_sent*1000000000.0/rate);
+    tv_begin.tv_sec = start_stat_time.tv_sec + nsec/1000000000;
+    tv_begin.tv_nsec = nsec % 1000000000;
+}
+
 void kv_test_t::loop()
 {
     if (reopening)
     {
         return;
     }
+    if (loading)
+    {
+        load();
+        return;
+    }
+    uint64_t max_sent = op_count;
+    if (rate || runtime_sec)
+    {
+        timespec tv_now;
+        clock_gettime(CLOCK_REALTIME, &tv_now);
+        double elapsed = (tv_now.tv_sec - start_stat_time.tv_sec) + (tv_now.tv_nsec - start_stat_time.tv_nsec)/1000000000.0;
+        if (runtime_sec && elapsed >= runtime_sec)
+            max_sent = ops_sent;
+        else if (rate && elapsed*rate+1 < max_sent)
+            max_sent = (uint64_t)(elapsed*rate)+1;
+        if (runtime_sec && elapsed >= runtime_sec && !in_progress)
+            finished = true;
+    }
     if (ops_done >= op_count)
     {
         finished = true;
     }
-    while (!finished && ops_sent < op_count && in_progress < parallelism)
+    while (!finished && ops_sent < max_sent && in_progress < parallelism)
     {
         uint64_t dice = (lrand48() % total_prob);
         if (dice < reopen_prob)
@@ -376,37 +700,23 @@ void kv_test_t::loop()
         else if (dice < reopen_prob+get_prob)
         {
             // get existing
-            auto key = random_str(max_key_len);
-            auto k_it = values.lower_bound(key);
-            if (k_it == values.end())
+            std::string key;
+            if (!pick_key(key))
                 continue;
-            key = k_it->first;
             if (changing_keys.find(key) != changing_keys.end())
                 continue;
+            timespec tv_begin;
+            op_start_time(tv_begin);
             in_progress++;
             ops_sent++;
             if (trace)
                 printf("get %s\n", key.c_str());
-            timespec tv_begin;
-            clock_gettime(CLOCK_REALTIME, &tv_begin);
             db->get(key, [this, key, tv_begin](int res, const std::string & value)
             {
                 add_stat(stat.get, tv_begin);
                 ops_done++;
                 in_progress--;
-                auto it = values.find(key);
-                if (res != (it == values.end() ? -ENOENT : 0))
-                {
-                    fprintf(stderr, "ERROR: get %s: %d (%s)\n", key.c_str(), res, strerror(-res));
-                    if (stop_on_error)
-                        exit(1);
-                }
-                else if (it != values.end() && value != it->second)
-                {
-                    fprintf(stderr, "ERROR: get %s: mismatch: %s vs %s\n", key.c_str(), value.c_str(), it->second.c_str());
-                    if (stop_on_error)
-                        exit(1);
-                }
+                check_get(key, res, value);
                 ringloop->wakeup();
             });
         }
@@ -418,29 +728,25 @@ void kv_test_t::loop()
             {
                 // add
                 is_add = true;
-                uint64_t key_len = min_key_len + (max_key_len > min_key_len ? lrand48() % (max_key_len-min_key_len) : 0);
-                key = key_prefix + random_str(key_len) + key_suffix;
+                key = new_key();
             }
             else
             {
                 // update
-                key = random_str(max_key_len);
-                auto k_it = values.lower_bound(key);
-                if (k_it == values.end())
+                if (!pick_key(key))
                     continue;
-                key = k_it->first;
             }
             if (changing_keys.find(key) != changing_keys.end())
                 continue;
             uint64_t value_len = min_value_len + (max_value_len > min_value_len ? lrand48() % (max_value_len-min_value_len) : 0);
             auto value = random_str(value_len);
+            timespec tv_begin;
+            op_start_time(tv_begin);
             start_change(key);
             ops_sent++;
             in_progress++;
             if (trace)
                 printf("set %s = %s\n", key.c_str(), value.c_str());
-            timespec tv_begin;
-            clock_gettime(CLOCK_REALTIME, &tv_begin);
             db->set(key, value, [this, key, value, tv_begin, is_add](int res)
             {
                 add_stat(is_add ? stat.add : stat.update, tv_begin);
@@ -463,20 +769,18 @@ void kv_test_t::loop()
         else if (dice < reopen_prob+get_prob+add_prob+update_prob+del_prob)
         {
             // delete
-            auto key = random_str(max_key_len);
-            auto k_it = values.lower_bound(key);
-            if (k_it == values.end())
+            std::string key;
+            if (!pick_key(key))
                 continue;
-            key = k_it->first;
             if (changing_keys.find(key) != changing_keys.end())
                 continue;
+            timespec tv_begin;
+            op_start_time(tv_begin);
             start_change(key);
             ops_sent++;
             in_progress++;
             if (trace)
                 printf("del %s\n", key.c_str());
-            timespec tv_begin;
-            clock_gettime(CLOCK_REALTIME, &tv_begin);
             db->del(key, [this, key, tv_begin](int res)
             {
                 add_stat(stat.del, tv_begin);
@@ -499,19 +803,25 @@ void kv_test_t::loop()
         else if (dice < reopen_prob+get_prob+add_prob+update_prob+del_prob+list_prob)
         {
             // list
+            std::string key;
+            if (!indexed_keys())
+                key = random_str(max_key_len);
+            else if (!pick_key(key))
+                continue;
+            timespec tv_begin;
+            op_start_time(tv_begin);
             ops_sent++;
             in_progress++;
-            auto key = random_str(max_key_len);
             auto lst = new kv_test_listing_t;
             auto k_it = values.lower_bound(key);
             lst->count = min_list_count + (max_list_count > min_list_count ? lrand48() % (max_list_count-min_list_count) : 0);
             lst->handle = db->list_start(k_it == values.begin() ? key_prefix : key);
-            lst->next_after = k_it == values.begin() ? key_prefix : key;
+            lst->next_after = k_it == values.begin() ? key_prefix : std::prev(k_it)->first;
             lst->inflights = changing_keys;
+            lst->tv_begin = tv_begin;
             listings.insert(lst);
             if (trace)
                 printf("list from %s\n", key.c_str());
-            clock_gettime(CLOCK_REALTIME, &lst->tv_begin);
             db->list_next(lst->handle, [this, lst](int res, const std::string & key, const std::string & value)
             {
                 if (log_level >= 11)
@@ -604,17 +914,97 @@ void kv_test_t::loop()
                 }
             });
         }
+        else
+        {
+            // read-modify-write
+            std::string key;
+            if (!pick_key(key))
+                continue;
+            if (changing_keys.find(key) != changing_keys.end())
+                continue;
+            uint64_t value_len = min_value_len + (max_value_len > min_value_len ? lrand48() % (max_value_len-min_value_len) : 0);
+            auto value = random_str(value_len);
+            timespec tv_begin;
+            op_start_time(tv_begin);
+            start_change(key);
+            ops_sent++;
+            in_progress++;
+            if (trace)
+                printf("rmw %s = %s\n", key.c_str(), value.c_str());
+            db->get(key, [this, key, value, tv_begin](int res, const std::string & old_value)
+            {
+                check_get(key, res, old_value);
+                db->set(key, value, [this, key, value, tv_begin](int res)
+                {
+                    add_stat(stat.rmw, tv_begin);
+                    stop_change(key);
+                    ops_done++;
+                    in_progress--;
+                    if (res != 0)
+                    {
+                        fprintf(stderr, "ERROR: rmw %s = %s: %d (%s)\n", key.c_str(), value.c_str(), res, strerror(-res));
+                        if (stop_on_error)
+                            exit(1);
+                    }
+                    else
+                    {
+                        values[key] = value;
+                    }
+                    ringloop->wakeup();
+                }, NULL);
+            });
+        }
     }
 }
 
+static int lat_bucket(uint64_t usec)
+{
+    // 2*SUB buckets of 1us, then SUB buckets per each next power of 2
+    int e = usec < 2*KV_TEST_HIST_SUB ? 0 : 64-__builtin_clzll(usec)-6;
+    int idx = e*KV_TEST_HIST_SUB + (usec >> e);
+    return idx < KV_TEST_HIST_SIZE ? idx : KV_TEST_HIST_SIZE-1;
+}
+
+static uint64_t bucket_usec(int idx)
+{
+    int e = idx < 2*KV_TEST_HIST_SUB ? 0 : idx/KV_TEST_HIST_SUB-1;
+    return ((uint64_t)(idx - e*KV_TEST_HIST_SUB) << e) + ((1ull << e) >> 1);
+}
+
+static const double lat_percentiles[] = { 50, 90, 99, 99.9, 99.99 };
+static const char *lat_percentile_names[] = { "p50", "p90", "p99", "p99.9", "p99.99" };
+
+// Calculate latency percentiles (and max) of operations done between <prev> and <cur>
+static void calc_percentiles(kv_test_lat_t *cur, kv_test_lat_t *prev, uint64_t *out)
+{
+    const int n = sizeof(lat_percentiles)/sizeof(lat_percentiles[0]);
+    uint64_t total = cur->count - prev->count, sum = 0;
+    int p = 0;
+    out[n] = 0;
+    for (int i = 0; i < KV_TEST_HIST_SIZE; i++)
+    {
+        uint64_t c = cur->hist[i] - prev->hist[i];
+        if (!c)
+            continue;
+        sum += c;
+        while (p < n && sum >= total*lat_percentiles[p]/100)
+            out[p++] = bucket_usec(i);
+        out[n] = bucket_usec(i);
+    }
+    for (; p < n; p++)
+        out[p] = 0;
+}
+
 void kv_test_t::add_stat(kv_test_lat_t & stat, timespec tv_begin)
 {
     timespec tv_end;
     clock_gettime(CLOCK_REALTIME, &tv_end);
     int64_t usec = (tv_end.tv_sec - tv_begin.tv_sec)*1000000 +
         (tv_end.tv_nsec - tv_begin.tv_nsec)/1000;
-    if (usec > 0)
-        stat.usec += usec;
+    if (usec < 0)
+        usec = 0;
+    stat.usec += usec;
+    stat.hist[lat_bucket(usec)]++;
     stat.count++;
 }
 
@@ -626,13 +1016,15 @@ void kv_test_t::print_stats(kv_test_stat_t & prev_stat, timespec & prev_stat_tim
         (cur_stat_time.tv_nsec - prev_stat_time.tv_nsec)/1000;
     if (usec > 0)
     {
-        kv_test_lat_t *lats[] = { &stat.get, &stat.add, &stat.update, &stat.del, &stat.list };
-        kv_test_lat_t *prev[] = { &prev_stat.get, &prev_stat.add, &prev_stat.update, &prev_stat.del, &prev_stat.list };
+        kv_test_lat_t *lats[] = { &stat.get, &stat.add, &stat.update, &stat.del, &stat.list, &stat.rmw };
+        kv_test_lat_t *prev[] = { &prev_stat.get, &prev_stat.add, &prev_stat.update, &prev_stat.del, &prev_stat.list, &prev_stat.rmw };
         if (!json_output)
         {
             char buf[128] = { 0 };
             for (int i = 0; i < sizeof(lats)/sizeof(lats[0]); i++)
             {
+                if (lats[i] == &stat.rmw && !rmw_prob)
+                    continue;
                 snprintf(buf, sizeof(buf)-1, "%.1f %s/s (%ju us)", (lats[i]->count-prev[i]->count)*1000000.0/usec,
                     lats[i]->name, (lats[i]->usec-prev[i]->usec)/(lats[i]->count-prev[i]->count > 0 ? lats[i]->count-prev[i]->count : 1));
                 int k;
@@ -653,11 +1045,17 @@ void kv_test_t::print_stats(kv_test_stat_t & prev_stat, timespec & prev_stat_tim
                 if (lats[i]->count > prev[i]->count)
                 {
                     printf(
-                        ",\"%s\":{\"avg\":{\"iops\":%.1f,\"usec\":%ju},\"total\":{\"count\":%ju,\"usec\":%ju}}",
+                        ",\"%s\":{\"avg\":{\"iops\":%.1f,\"usec\":%ju},\"total\":{\"count\":%ju,\"usec\":%ju},\"lat\":{",
                         lats[i]->name, (lats[i]->count-prev[i]->count)*1000000.0/usec,
                         (lats[i]->usec-prev[i]->usec)/(lats[i]->count-prev[i]->count),
                         lats[i]->count, lats[i]->usec
                     );
+                    const int n = sizeof(lat_percentiles)/sizeof(lat_percentiles[0]);
+                    uint64_t pct[n+1];
+                    calc_percentiles(lats[i], prev[i], pct);
+                    for (int j = 0; j < n; j++)
+                        printf("\"%s\":%ju,", lat_percentile_names[j], pct[j]);
+                    printf("\"max\":%ju}}", pct[n]);
                 }
             }
             printf("}\n");
@@ -674,6 +1072,28 @@ void kv_test_t::print_total_stats()
     kv_test_stat_t start_stats;
     timespec start_stat_time = this->start_stat_time;
     print_stats(start_stats, start_stat_time);
+    if (!json_output)
+    {
+        // Latency percentiles, in microseconds
+        const int n = sizeof(lat_percentiles)/sizeof(lat_percentiles[0]);
+        kv_test_lat_t *lats[] = { &stat.get, &stat.add, &stat.update, &stat.del, &stat.list, &stat.rmw };
+        kv_test_lat_t zero;
+        printf("%-8s %10s %8s", "op", "count", "avg");
+        for (int j = 0; j < n; j++)
+            printf(" %8s", lat_percentile_names[j]);
+        printf(" %8s\n", "max");
+        for (int i = 0; i < sizeof(lats)/sizeof(lats[0]); i++)
+        {
+            if (!lats[i]->count)
+                continue;
+            uint64_t pct[n+1];
+            calc_percentiles(lats[i], &zero, pct);
+            printf("%-8s %10ju %8ju", lats[i]->name, lats[i]->count, lats[i]->usec/lats[i]->count);
+            for (int j = 0; j <= n; j++)
+                printf(" %8ju", pct[j]);
+            printf("\n");
+        }
+    }
 }
 
 void kv_test_t::start_change(const std::string & key)
@@ -10,15 +10,62 @@
 #include <sys/uio.h>
 
 #include <string>
+#include <vector>
 #include <map>
 #include <functional>
 
-#define VITASTOR_KV_API_VERSION 1
+#define VITASTOR_KV_API_VERSION 7
 
 class cluster_client_t;
 
 struct kv_db_t;
 
+struct kv_write_t
+{
+    std::string key, value;
+    bool del = false;
+    std::function<bool(int res, const std::string & value)> cas_compare;
+};
+
+struct kv_read_t
+{
+    std::string key;
+    int res = 0;
+    std::string value;
+};
+
+struct kv_op_stat_t
+{
+    uint64_t count = 0;
+    // total latency in microseconds
+    uint64_t usec = 0;
+};
+
+struct kv_stats_t
+{
+    // blocks found in cache (possibly after a version check)
+    uint64_t cache_hits = 0;
+    // blocks read from the cluster
+    uint64_t cache_misses = 0;
+    uint64_t cache_evictions = 0;
+    // evicted blocks read again soon after eviction
+    uint64_t cache_ghost_hits = 0;
+    // current cache size
+    uint64_t cache_blocks = 0;
+    uint64_t cache_bytes = 0;
+    uint64_t cache_hot_bytes = 0;
+    // separately stored values (kv_value_separation)
+    uint64_t value_reads = 0;
+    uint64_t value_writes = 0;
+    uint64_t value_gc_moved = 0;
+    uint64_t value_gc_segments = 0;
+    // merged underfull leaves and removed root levels
+    uint64_t leaf_merges = 0;
+    uint64_t root_shrinks = 0;
+    // completed operations, multi-key reads are counted as one get
+    kv_op_stat_t get_ops, set_ops, del_ops, batch_ops;
+};
+
 struct kv_dbw_t
 {
     // cli = vitastor_c_get_internal_client(client)
@@ -30,6 +77,7 @@ struct kv_dbw_t
     void close(std::function<void()> cb);
 
     uint64_t get_size();
+    kv_stats_t get_stats();
 
     void get(const std::string & key, std::function<void(int res, const std::string & value)> cb,
         bool allow_old_cached = false);
@@ -38,9 +86,53 @@ struct kv_dbw_t
     void del(const std::string & key, std::function<void(int res)> cb,
         std::function<bool(int res, const std::string & value)> cas_compare = NULL);
 
+    // Apply multiple changes. Changes are committed in batch order, but all changes
+    // of keys residing in the same leaf block are committed together with the first
+    // of them, atomically, using a single block write, after checking all their CAS
+    // callbacks. Changes in different leaf blocks are not atomic: if a CAS check fails
+    // the batch stops with -EAGAIN, but changes in previously written blocks stay applied.
+    // results[i] is 0 for committed changes, -EAGAIN for the change which failed CAS
+    // check and -ECANCELED for changes not applied because of another error.
+    // Keys in a batch must be unique.
+    void write_batch(const std::vector<kv_write_t> & batch,
+        std::function<void(int res, const std::vector<int> & results)> cb);
+    // Get multiple keys, each leaf block is read only once for all keys in it.
+    // results[i].res is 0 or -ENOENT for each key, <res> is set on other errors.
+    void multi_get(const std::vector<std::string> & keys,
+        std::function<void(int res, std::vector<kv_read_t> & results)> cb,
+        bool allow_old_cached = false);
+
     void* list_start(const std::string & start);
     void list_next(void *handle, std::function<void(int res, const std::string & key, const std::string & value)> cb);
     void list_close(void *handle);
 
+    // Build the tree from scratch from items added in ascending key order. Blocks are filled
+    // completely and written in parallel (at most <parallel> writes are in flight, bulk_load_add()
+    // callback is delayed when this limit is reached), internal levels are built bottom-up,
+    // and the root block is written last, so the DB stays empty if the load isn't finished.
+    // Only works for an empty DB not modified by other clients during the load,
+    // bulk_load_start() returns NULL if the DB is not empty.
+    // bulk_load_add() returns -EINVAL for keys out of order or too large. Other errors are
+    // sticky and reported by all subsequent calls. bulk_load_finish() frees the handle.
+    void* bulk_load_start(int parallel);
+    void bulk_load_add(void *handle, const std::string & key, const std::string & value, std::function<void(int res)> cb);
+    void bulk_load_finish(void *handle, std::function<void(int res)> cb);
+
+    // Values of at least <kv_value_separation> bytes are stored outside of leaves,
+    // in segments appended by each client. Overwritten and deleted values stay there
+    // until gc_values() moves live values out of segments sealed by their writers
+    // and deletes these segments. It runs in parallel with other operations.
+    // Segments of crashed writers are collected when a gc_values() run finds them
+    // unchanged for <kv_value_seal_timeout> seconds since an earlier run.
+    void gc_values(std::function<void(int res)> cb);
+
+    // Merge adjacent leaves which fit into <kv_merge_fill> percent of a block together
+    // and remove root levels with only one child. Also finishes or rolls back merges
+    // interrupted by other clients. Other operations continue during compaction, but
+    // only one client should compact the DB at a time. Returns -EBUSY if a compaction
+    // is already running in this client. With <kv_auto_compact>, leaves left underfull
+    // by deletes are merged in background.
+    void compact(std::function<void(int res)> cb);
+
     kv_db_t *db;
 };
@@ -3,7 +3,7 @@
 //
 // NFS proxy over Vitastor block images
 // Presents all images as files
-// Keeps image/file list in memory and is thus unsuitable for a large number of files
+// Keeps a sorted image name index in memory, updated incrementally from etcd watch events
 
 #include <sys/time.h>
 
@@ -218,24 +218,21 @@ static int block_nfs3_lookup_proc(void *opaque, rpc_op_t *rop)
     std::string full_name = get_inode_name(self, args->what);
     if (full_name != "")
     {
-        std::string fh = "S"+base64_encode(sha256(full_name));
-        for (auto & ic: self->parent->cli->st_cli.inode_config)
+        auto file_it = self->parent->blockfs->file_by_name.find(full_name);
+        if (file_it != self->parent->blockfs->file_by_name.end())
         {
-            if (ic.second.name == full_name)
-            {
-                *reply = (LOOKUP3res){
-                    .status = NFS3_OK,
-                    .resok = (LOOKUP3resok){
-                        .object = xdr_copy_string(rop->xdrs, fh),
-                        .obj_attributes = {
-                            .attributes_follow = 1,
-                            .attributes = get_file_attributes(self, ic.first),
-                        },
+            *reply = (LOOKUP3res){
+                .status = NFS3_OK,
+                .resok = (LOOKUP3resok){
+                    .object = xdr_copy_string(rop->xdrs, file_it->second.fh),
+                    .obj_attributes = {
+                        .attributes_follow = 1,
+                        .attributes = get_file_attributes(self, file_it->second.inode),
                     },
-                };
-                rpc_queue_reply(rop);
-                return 0;
-            }
+                },
+            };
+            rpc_queue_reply(rop);
+            return 0;
         }
         auto dir_it = self->parent->blockfs->dir_info.find(full_name);
         if (dir_it != self->parent->blockfs->dir_info.end())
@@ -243,7 +240,7 @@ static int block_nfs3_lookup_proc(void *opaque, rpc_op_t *rop)
             *reply = (LOOKUP3res){
                 .status = NFS3_OK,
                 .resok = (LOOKUP3resok){
-                    .object = xdr_copy_string(rop->xdrs, fh),
+                    .object = xdr_copy_string(rop->xdrs, dir_it->second.fh),
                     .obj_attributes = {
                         .attributes_follow = 1,
                         .attributes = get_dir_attributes(self, full_name),
@@ -343,11 +340,28 @@ static int block_nfs3_read_proc(void *opaque, rpc_op_t *rop)
         rpc_queue_reply(rop);
         delete op;
     };
-    self->parent->cli->execute(op);
+    self->parent->execute_io(op);
     return 1;
 }
 
-static void nfs_resize_write(nfs_client_t *self, rpc_op_t *rop, uint64_t inode, uint64_t new_size, uint64_t offset, uint64_t count, void *buf);
+static void nfs_resize_write(nfs_client_t *self, rpc_op_t *rop, uint64_t inode, uint64_t new_size, uint64_t offset, uint64_t count, const std::vector<iovec> & iov);
+
+struct block_rmw_write_t
+{
+    nfs_client_t *self = NULL;
+    rpc_op_t *rop = NULL;
+    inode_t inode = 0;
+    uint64_t alignment = 0;
+    uint64_t count = 0;
+    // Head and tail blocks, alignment bytes each
+    uint8_t *part_buf = NULL;
+    int waiting = 0;
+    int res = 0;
+};
+
+static void block_rmw_read_part(block_rmw_write_t *rmw, uint64_t offset, uint8_t *buf);
+static void block_rmw_write(block_rmw_write_t *rmw);
+static void complete_extend_write(nfs_client_t *self, rpc_op_t *rop, inode_t inode, int res);
 
 static int block_nfs3_write_proc(void *opaque, rpc_op_t *rop)
 {
@@ -383,47 +397,102 @@ static int block_nfs3_write_proc(void *opaque, rpc_op_t *rop)
             .count = (unsigned)count,
         },
     };
-    if ((args->offset % alignment) != 0 || (count % alignment) != 0)
-    {
-        // Unaligned write, requires read-modify-write
-        uint64_t aligned_offset = args->offset - (args->offset % alignment);
-        uint64_t aligned_count = args->offset + args->count;
-        if (aligned_count % alignment)
-            aligned_count = aligned_count + alignment - (aligned_count % alignment);
-        aligned_count -= aligned_offset;
-        void *buf = malloc_or_die(aligned_count);
-        xdr_add_malloc(rop->xdrs, buf);
-        // Read
-        cluster_op_t *op = new cluster_op_t;
-        op->opcode = OSD_OP_READ;
-        op->inode = ino_it->second;
-        op->offset = aligned_offset;
-        op->len = aligned_count;
-        op->iov.push_back(buf, aligned_count);
-        op->callback = [self, rop, count](cluster_op_t *op)
+    if (!count)
+    {
+        complete_extend_write(self, rop, ino_it->second, 0);
+    }
+    else if ((args->offset % alignment) != 0 || (count % alignment) != 0)
+    {
+        // Unaligned write, requires read-modify-write of the first and the last block.
+        // Data itself is written directly from the RPC receive buffer
+        auto rmw = new block_rmw_write_t;
+        rmw->self = self;
+        rmw->rop = rop;
+        rmw->inode = ino_it->second;
+        rmw->alignment = alignment;
+        rmw->count = count;
+        rmw->part_buf = (uint8_t*)malloc_or_die(2*alignment);
+        xdr_add_malloc(rop->xdrs, rmw->part_buf);
+        uint64_t head_block = args->offset - (args->offset % alignment);
+        uint64_t tail_block = (args->offset+count-1) - ((args->offset+count-1) % alignment);
+        rmw->waiting = 1;
+        if ((args->offset % alignment) != 0 || head_block == tail_block)
         {
-            if (op->retval != op->len)
-            {
-                WRITE3res *reply = (WRITE3res*)rop->reply;
-                *reply = (WRITE3res){ .status = vitastor_nfs_map_err(-op->retval) };
-                rpc_queue_reply(rop);
-                return;
-            }
-            void *buf = op->iov.buf[0].iov_base;
-            WRITE3args *args = (WRITE3args*)rop->request;
-            memcpy((uint8_t*)buf + args->offset - op->offset, args->data.data, count);
-            nfs_resize_write(self, rop, op->inode, args->offset+count, op->offset, op->len, buf);
-            delete op;
-        };
-        self->parent->cli->execute(op);
+            block_rmw_read_part(rmw, head_block, rmw->part_buf);
+        }
+        if (((args->offset+count) % alignment) != 0 && head_block != tail_block)
+        {
+            block_rmw_read_part(rmw, tail_block, rmw->part_buf+alignment);
+        }
+        rmw->waiting--;
+        if (!rmw->waiting)
+        {
+            block_rmw_write(rmw);
+        }
     }
     else
     {
-        nfs_resize_write(self, rop, ino_it->second, args->offset+count, args->offset, count, args->data.data);
+        nfs_resize_write(self, rop, ino_it->second, args->offset+count, args->offset, count,
+            std::vector<iovec>{ { .iov_base = args->data.data, .iov_len = count } });
     }
     return 1;
 }
 
+static void block_rmw_read_part(block_rmw_write_t *rmw, uint64_t offset, uint8_t *buf)
+{
+    cluster_op_t *op = new cluster_op_t;
+    op->opcode = OSD_OP_READ;
+    op->inode = rmw->inode;
+    op->offset = offset;
+    op->len = rmw->alignment;
+    op->iov.push_back(buf, rmw->alignment);
+    op->callback = [rmw](cluster_op_t *op)
+    {
+        if (op->retval != op->len)
+        {
+            rmw->res = op->retval < 0 ? op->retval : -EIO;
+        }
+        delete op;
+        rmw->waiting--;
+        if (!rmw->waiting)
+        {
+            block_rmw_write(rmw);
+        }
+    };
+    rmw->waiting++;
+    rmw->self->parent->execute_io(op);
+}
+
+static void block_rmw_write(block_rmw_write_t *rmw)
+{
+    auto self = rmw->self;
+    auto rop = rmw->rop;
+    if (rmw->res < 0)
+    {
+        WRITE3res *reply = (WRITE3res*)rop->reply;
+        *reply = (WRITE3res){ .status = vitastor_nfs_map_err(rmw->res) };
+        rpc_queue_reply(rop);
+        delete rmw;
+        return;
+    }
+    WRITE3args *args = (WRITE3args*)rop->request;
+    uint64_t alignment = rmw->alignment;
+    uint64_t head = args->offset % alignment;
+    uint64_t end = args->offset + rmw->count;
+    uint64_t aligned_offset = args->offset - head;
+    uint64_t aligned_end = (end % alignment) ? end + alignment - (end % alignment) : end;
+    // If the write is inside a single block, the tail is also taken from the head block
+    uint8_t *tail_buf = aligned_end-aligned_offset == alignment ? rmw->part_buf : rmw->part_buf+alignment;
+    std::vector<iovec> iov;
+    if (head)
+        iov.push_back((iovec){ .iov_base = rmw->part_buf, .iov_len = head });
+    iov.push_back((iovec){ .iov_base = args->data.data, .iov_len = rmw->count });
+    if (aligned_end > end)
+        iov.push_back((iovec){ .iov_base = tail_buf + alignment - (aligned_end-end), .iov_len = aligned_end-end });
+    nfs_resize_write(self, rop, rmw->inode, end, aligned_offset, aligned_end-aligned_offset, iov);
+    delete rmw;
+}
+
 static void complete_extend_write(nfs_client_t *self, rpc_op_t *rop, inode_t inode, int res)
 {
     WRITE3args *args = (WRITE3args*)rop->request;
@@ -437,22 +506,24 @@ static void complete_extend_write(nfs_client_t *self, rpc_op_t *rop, inode_t ino
     bool imm = self->parent->cli->get_immediate_commit(inode);
     reply->resok.committed = args->stable != UNSTABLE || imm ? FILE_SYNC : UNSTABLE;
     *(uint64_t*)reply->resok.verf = self->parent->server_id;
-    if (args->stable != UNSTABLE && !imm)
+    if (imm)
     {
-        // Client requested a stable write. Add an fsync
-        auto op = new cluster_op_t;
-        op->opcode = OSD_OP_SYNC;
-        op->callback = [rop](cluster_op_t *op)
+        rpc_queue_reply(rop);
+        return;
+    }
+    self->parent->mark_unstable(args->file);
+    if (args->stable != UNSTABLE)
+    {
+        // Client requested a stable write. Add an fsync, shared with concurrent writes and COMMITs
+        self->parent->sync_unstable(args->file, [rop](int res)
         {
-            if (op->retval != 0)
+            if (res != 0)
             {
                 WRITE3res *reply = (WRITE3res*)rop->reply;
-                *reply = (WRITE3res){ .status = vitastor_nfs_map_err(-op->retval) };
+                *reply = (WRITE3res){ .status = vitastor_nfs_map_err(res) };
             }
-            delete op;
             rpc_queue_reply(rop);
-        };
-        self->parent->cli->execute(op);
+        });
     }
     else
     {
@@ -518,14 +589,15 @@ static void extend_inode(nfs_client_t *self, uint64_t inode, uint64_t new_size)
 }
 
 static void nfs_do_write(nfs_client_t *self, std::multimap<extend_size_t, extend_write_t>::iterator ewr_it,
-    rpc_op_t *rop, uint64_t inode, uint64_t offset, uint64_t count, void *buf)
+    rpc_op_t *rop, uint64_t inode, uint64_t offset, uint64_t count, const std::vector<iovec> & iov)
 {
     cluster_op_t *op = new cluster_op_t;
     op->opcode = OSD_OP_WRITE;
     op->inode = inode;
     op->offset = offset;
     op->len = count;
-    op->iov.push_back(buf, count);
+    for (auto & v: iov)
+        op->iov.push_back(v.iov_base, v.iov_len);
     op->callback = [self, ewr_it, rop](cluster_op_t *op)
     {
         auto inode = op->inode;
@@ -544,10 +616,10 @@ static void nfs_do_write(nfs_client_t *self, std::multimap<extend_size_t, extend
             }
         }
     };
-    self->parent->cli->execute(op);
+    self->parent->execute_io(op);
 }
 
-static void nfs_resize_write(nfs_client_t *self, rpc_op_t *rop, uint64_t inode, uint64_t new_size, uint64_t offset, uint64_t count, void *buf)
+static void nfs_resize_write(nfs_client_t *self, rpc_op_t *rop, uint64_t inode, uint64_t new_size, uint64_t offset, uint64_t count, const std::vector<iovec> & iov)
 {
     // Check if we have to resize the inode during write
     auto inode_it = self->parent->cli->st_cli.inode_config.find(inode);
@@ -573,11 +645,11 @@ static void nfs_resize_write(nfs_client_t *self, rpc_op_t *rop, uint64_t inode,
         {
             extend_inode(self, inode, new_size);
         }
-        nfs_do_write(self, ewr_it, rop, inode, offset, count, buf);
+        nfs_do_write(self, ewr_it, rop, inode, offset, count, iov);
     }
     else
     {
-        nfs_do_write(self, self->parent->blockfs->extend_writes.end(), rop, inode, offset, count, buf);
+        nfs_do_write(self, self->parent->blockfs->extend_writes.end(), rop, inode, offset, count, iov);
     }
 }
 
@@ -659,17 +731,13 @@ static int block_nfs3_mkdir_proc(void *opaque, rpc_op_t *rop)
         return 0;
     }
     // FIXME: Persist empty directories in some etcd keys, like /vitastor/dir/...
-    self->parent->blockfs->dir_info[full_name] = (nfs_dir_t){
-        .id = self->parent->blockfs->next_dir_id++,
-        .mod_rev = 0,
-    };
-    self->parent->blockfs->dir_by_hash["S"+base64_encode(sha256(full_name))] = full_name;
+    auto & dinf = self->parent->blockfs->add_dir(full_name);
     *reply = (MKDIR3res){
         .status = NFS3_OK,
         .resok = (MKDIR3resok){
             .obj = {
                 .handle_follows = 1,
-                .handle = xdr_copy_string(rop->xdrs, "S"+base64_encode(sha256(full_name))),
+                .handle = xdr_copy_string(rop->xdrs, dinf.fh),
             },
             .obj_attributes = {
                 .attributes_follow = 1,
@@ -754,16 +822,16 @@ static int block_nfs3_rmdir_proc(void *opaque, rpc_op_t *rop)
         return 0;
     }
     std::string prefix = full_name+"/";
-    for (auto & ic: self->parent->cli->st_cli.inode_config)
+    auto file_it = self->parent->blockfs->file_by_name.lower_bound(prefix);
+    if (file_it != self->parent->blockfs->file_by_name.end() &&
+        file_it->first.substr(0, prefix.size()) == prefix)
     {
-        if (prefix != "" && ic.second.name.substr(0, prefix.size()) == prefix)
-        {
-            *reply = (RMDIR3res){ .status = NFS3ERR_NOTEMPTY };
-            rpc_queue_reply(rop);
-            return 0;
-        }
+        *reply = (RMDIR3res){ .status = NFS3ERR_NOTEMPTY };
+        rpc_queue_reply(rop);
+        return 0;
     }
-    self->parent->blockfs->dir_by_hash.erase("S"+base64_encode(sha256(full_name)));
+    self->parent->blockfs->clear_cookies(dir_it->second.id, 0);
+    self->parent->blockfs->dir_by_hash.erase(dir_it->second.fh);
     self->parent->blockfs->dir_info.erase(dir_it);
     *reply = (RMDIR3res){ .status = NFS3_OK };
     rpc_queue_reply(rop);
@@ -784,10 +852,11 @@ static int continue_dir_rename(nfs_dir_rename_state *rename_st)
     if (!rename_st->items.size())
     {
         std::string old_prefix = rename_st->old_name+"/";
-        for (auto & ic: self->parent->cli->st_cli.inode_config)
+        auto & files = self->parent->blockfs->file_by_name;
+        for (auto file_it = files.lower_bound(old_prefix); file_it != files.end() &&
+            file_it->first.substr(0, old_prefix.size()) == old_prefix; file_it++)
         {
-            if (ic.second.name.substr(0, old_prefix.size()) == old_prefix)
-                rename_st->items.push_back(ic.second.name);
+            rename_st->items.push_back(file_it->first);
         }
     }
     if (!rename_st->items.size())
@@ -795,10 +864,11 @@ static int continue_dir_rename(nfs_dir_rename_state *rename_st)
         // old dir
         auto old_info = self->parent->blockfs->dir_info.at(rename_st->old_name);
         self->parent->blockfs->dir_info.erase(rename_st->old_name);
-        self->parent->blockfs->dir_by_hash.erase("S"+base64_encode(sha256(rename_st->old_name)));
+        self->parent->blockfs->dir_by_hash.erase(old_info.fh);
         // new dir
+        old_info.fh = "S"+base64_encode(sha256(rename_st->new_name));
         self->parent->blockfs->dir_info[rename_st->new_name] = old_info;
-        self->parent->blockfs->dir_by_hash["S"+base64_encode(sha256(rename_st->new_name))] = rename_st->new_name;
+        self->parent->blockfs->dir_by_hash[old_info.fh] = rename_st->new_name;
         RENAME3res *reply = (RENAME3res*)rename_st->rop->reply;
         *reply = (RENAME3res){
             .status = NFS3_OK,
@@ -850,16 +920,9 @@ static int block_nfs3_rename_proc(void *opaque, rpc_op_t *rop)
     }
     bool old_is_dir = self->parent->blockfs->dir_info.find(old_name) != self->parent->blockfs->dir_info.end();
     bool new_is_dir = self->parent->blockfs->dir_info.find(new_name) != self->parent->blockfs->dir_info.end();
-    bool old_is_file = false, new_is_file = false;
-    for (auto & ic: self->parent->cli->st_cli.inode_config)
-    {
-        if (ic.second.name == new_name)
-            new_is_file = true;
-        if (ic.second.name == old_name)
-            old_is_file = true;
-        if (new_is_file && old_is_file)
-            break;
-    }
+    auto & files = self->parent->blockfs->file_by_name;
+    bool old_is_file = files.find(old_name) != files.end();
+    bool new_is_file = files.find(new_name) != files.end();
     if (old_is_dir)
     {
         // Check that destination is not a file
@@ -941,25 +1004,81 @@ static int block_nfs3_link_proc(void *opaque, rpc_op_t *rop)
     return 0;
 }
 
-static void fill_dir_entry(nfs_client_t *self, rpc_op_t *rop,
-    std::map<std::string, nfs_dir_t>::iterator dir_id_it, struct entryplus3 *entry, bool is_plus)
+struct block_readdir_state_t
+{
+    nfs_client_t *self;
+    rpc_op_t *rop;
+    bool is_plus;
+    uint64_t maxcount;
+    int reply_size = 0;
+    uint64_t cookie = 0;
+    std::vector<entryplus3> entries;
+};
+
+static entryplus3 *add_dir_entry(block_readdir_state_t & st, const std::string & name, uint64_t fileid, const std::string & fh)
 {
-    if (dir_id_it == self->parent->blockfs->dir_info.end())
+    // 1 entry3 is (8+4+(filename_len+3)/4*4+8) bytes
+    // 1 entryplus3 is (8+4+(filename_len+3)/4*4+8
+    //   + 4+(name_attributes ? (sizeof(fattr3) = 84) : 0)
+    //   + 4+(name_handle ? 4+(handle_len+3)/4*4 : 0)) bytes
+    int entry_size = 20+len_pad4(name.size())+(st.is_plus ? 8+88+len_pad4(fh.size()) : 0);
+    if (st.reply_size + entry_size > st.maxcount)
     {
-        return;
+        return NULL;
     }
-    entry->fileid = dir_id_it->second.id;
-    if (is_plus)
+    st.reply_size += entry_size;
+    st.entries.push_back((entryplus3){});
+    entryplus3 *entry = &st.entries.back();
+    // First fields of entry3 and entryplus3 are the same: fileid, name, cookie
+    entry->name = xdr_copy_string(st.rop->xdrs, name);
+    entry->fileid = fileid;
+    entry->cookie = ++st.cookie;
+    if (st.is_plus)
     {
-        entry->name_attributes = (post_op_attr){
-            .attributes_follow = 1,
-            .attributes = get_dir_attributes(self, dir_id_it->first),
-        };
         entry->name_handle = (post_op_fh3){
             .handle_follows = 1,
-            .handle = xdr_copy_string(rop->xdrs, "S"+base64_encode(sha256(dir_id_it->first))),
+            .handle = xdr_copy_string(st.rop->xdrs, fh),
+        };
+    }
+    return entry;
+}
+
+static bool add_dir_dir_entry(block_readdir_state_t & st, const std::string & name, const std::string & dir)
+{
+    auto & dinf = st.self->parent->blockfs->dir_info.at(dir);
+    auto entry = add_dir_entry(st, name, dinf.id, dinf.fh);
+    if (entry && st.is_plus)
+    {
+        entry->name_attributes = (post_op_attr){
+            .attributes_follow = 1,
+            .attributes = get_dir_attributes(st.self, dir),
         };
     }
+    return entry != NULL;
+}
+
+// Skip names which are not direct children of <prefix>
+template<class T> static void skip_nested(std::map<std::string, T> & index, typename std::map<std::string, T>::iterator & it,
+    const std::string & prefix)
+{
+    while (it != index.end())
+    {
+        if (it->first.substr(0, prefix.size()) != prefix)
+        {
+            it = index.end();
+            break;
+        }
+        auto sl = it->first.find('/', prefix.size());
+        if (sl == std::string::npos)
+        {
+            if (it->first.size() > prefix.size())
+                break;
+            it++;
+            continue;
+        }
+        // '0' follows '/', so it skips the whole subtree
+        it = index.lower_bound(it->first.substr(0, sl)+"0");
+    }
 }
 
 static void block_nfs3_readdir_common(void *opaque, rpc_op_t *rop, bool is_plus)
@@ -979,106 +1098,22 @@ static void block_nfs3_readdir_common(void *opaque, rpc_op_t *rop, bool is_plus)
         args->dircount = 512;
         args->maxcount = in_args->count;
     }
+    auto blockfs = self->parent->blockfs;
     std::string dirhash = args->dir;
     std::string dir;
     if (dirhash != NFS_ROOT_HANDLE)
     {
-        auto dir_it = self->parent->blockfs->dir_by_hash.find(dirhash);
-        if (dir_it != self->parent->blockfs->dir_by_hash.end())
+        auto dir_it = blockfs->dir_by_hash.find(dirhash);
+        if (dir_it != blockfs->dir_by_hash.end())
             dir = dir_it->second;
     }
-    std::string prefix = dir.size() ? dir+"/" : self->parent->blockfs->name_prefix;
-    std::map<std::string, struct entryplus3> entries;
-    for (auto & ic: self->parent->cli->st_cli.inode_config)
-    {
-        auto & inode_cfg = ic.second;
-        if (prefix != "" && inode_cfg.name.substr(0, prefix.size()) != prefix)
-            continue;
-        std::string subname = inode_cfg.name.substr(prefix.size());
-        int p = 0;
-        while (p < subname.size() && subname[p] == '/')
-            p++;
-        if (p > 0)
-            subname = subname.substr(p);
-        if (subname.size() == 0)
-            continue;
-        p = 0;
-        while (p < subname.size() && subname[p] != '/')
-            p++;
-        if (p >= subname.size())
-        {
-            // fileid will change when the user creates snapshots
-            // however, we hope that clients tolerate it well
-            // Linux does, even though it complains about "fileid changed" in dmesg
-            entries[subname].fileid = ic.first;
-            if (is_plus)
-            {
-                entries[subname].name_attributes = (post_op_attr){
-                    .attributes_follow = 1,
-                    .attributes = get_file_attributes(self, ic.first),
-                };
-                entries[subname].name_handle = (post_op_fh3){
-                    .handle_follows = 1,
-                    .handle = xdr_copy_string(rop->xdrs, "S"+base64_encode(sha256(inode_cfg.name))),
-                };
-            }
-        }
-        else
-        {
-            // skip directories, they will be added from blockfs->dir_info
-        }
-    }
-    // Add directories from blockfs->dir_info
-    for (auto dir_id_it = self->parent->blockfs->dir_info.lower_bound(prefix);
-        dir_id_it != self->parent->blockfs->dir_info.end(); dir_id_it++)
-    {
-        if (prefix != "" && dir_id_it->first.substr(0, prefix.size()) != prefix)
-            break;
-        if (dir_id_it->first.size() == prefix.size() ||
-            dir_id_it->first.find("/", prefix.size()) != std::string::npos)
-            continue;
-        std::string subname = dir_id_it->first.substr(prefix.size());
-        // for directories, fileid changes when the user restarts proxy
-        fill_dir_entry(self, rop, dir_id_it, &entries[subname], is_plus);
-    }
-    // Add . and ..
-    {
-        auto dir_id_it = self->parent->blockfs->dir_info.find(dir);
-        fill_dir_entry(self, rop, dir_id_it, &entries["."], is_plus);
-        auto sl = dir.rfind("/");
-        if (sl != std::string::npos)
-        {
-            auto dir_id_it = self->parent->blockfs->dir_info.find(dir.substr(0, sl));
-            fill_dir_entry(self, rop, dir_id_it, &entries[".."], is_plus);
-        }
-    }
-    // Offset results by the continuation cookie (equal to index in the listing)
-    uint64_t idx = 1;
-    void *prev = NULL;
-    for (auto it = entries.begin(); it != entries.end();)
-    {
-        entryplus3 *entry = &it->second;
-        // First fields of entry3 and entryplus3 are the same: fileid, name, cookie
-        entry->name = xdr_copy_string(rop->xdrs, it->first);
-        entry->cookie = idx++;
-        if (prev)
-        {
-            if (is_plus)
-                ((entryplus3*)prev)->nextentry = entry;
-            else
-                ((entry3*)prev)->nextentry = (entry3*)entry;
-        }
-        prev = entry;
-        if (args->cookie > 0 && entry->cookie == args->cookie)
-            entries.erase(entries.begin(), ++it);
-        else
-            it++;
-    }
+    auto & dinf = blockfs->dir_info.at(dir);
+    std::string prefix = dir.size() ? dir+"/" : blockfs->name_prefix;
     // Now limit results based on maximum reply size
     // Sadly we have to calculate reply size by hand
     // reply without entries is 4+4+(dir_attributes ? sizeof(fattr3) : 0)+8+4 bytes
-    int reply_size = 20;
-    if (reply_size > args->maxcount)
+    block_readdir_state_t st = { .self = self, .rop = rop, .is_plus = is_plus, .maxcount = args->maxcount, .reply_size = 20 };
+    if (st.reply_size > st.maxcount)
     {
         // Error, too small max reply size
         if (is_plus)
@@ -1095,50 +1130,128 @@ static void block_nfs3_readdir_common(void *opaque, rpc_op_t *rop, bool is_plus)
         }
         return;
     }
-    // 1 entry3 is (8+4+(filename_len+3)/4*4+8) bytes
-    // 1 entryplus3 is (8+4+(filename_len+3)/4*4+8
-    //   + 4+(name_attributes ? (sizeof(fattr3) = 84) : 0)
-    //   + 4+(name_handle ? 4+(handle_len+3)/4*4 : 0)) bytes
+    // Cookies are entry numbers in the listing: 1 is ".", 2 is ".." if the directory has a parent.
+    // The cookie of the last entry of each reply is remembered so that listings continue from
+    // the entry name using the sorted index, and only fall back to skipping entries if it's unknown
+    auto sl = dir.rfind("/");
+    std::string parent_dir = sl != std::string::npos ? dir.substr(0, sl) : "";
+    bool has_parent = sl != std::string::npos && blockfs->dir_info.find(parent_dir) != blockfs->dir_info.end();
+    uint64_t first_cookie = has_parent ? 3 : 2;
+    std::string start, last_name;
+    uint64_t to_skip = 0, last_cookie = 0;
     bool eof = true;
-    for (auto it = entries.begin(); it != entries.end(); it++)
+    if (args->cookie == 0)
     {
-        reply_size += 20+len_pad4(it->first.size())+(is_plus
-            ? 8+88+len_pad4(it->second.name_handle.handle.size) : 0);
-        if (reply_size > args->maxcount)
+        blockfs->clear_cookies(dinf.id, dinf.mod_rev);
+    }
+    if (args->cookie >= first_cookie)
+    {
+        auto lc_it = blockfs->list_cookies.find((block_list_cookie_t){ dinf.id, *(uint64_t*)args->cookieverf, args->cookie });
+        if (lc_it != blockfs->list_cookies.end())
+        {
+            start = lc_it->second;
+            st.cookie = args->cookie;
+        }
+        else
         {
-            // Stop
-            entries.erase(it, entries.end());
+            to_skip = args->cookie-first_cookie+1;
+            st.cookie = first_cookie-1;
+        }
+    }
+    else
+    {
+        st.cookie = 0;
+        if (args->cookie < 1 && !add_dir_dir_entry(st, ".", dir))
+            eof = false;
+        st.cookie = 1;
+        if (has_parent && eof && args->cookie < 2 && !add_dir_dir_entry(st, "..", parent_dir))
             eof = false;
+        st.cookie = first_cookie-1;
+    }
+    // Merge files and directories, both are sorted by name
+    auto & files = blockfs->file_by_name;
+    auto & dirs = blockfs->dir_info;
+    auto file_it = files.lower_bound(prefix+start);
+    auto dir_it = dirs.lower_bound(prefix+start);
+    while (eof)
+    {
+        skip_nested(files, file_it, prefix);
+        skip_nested(dirs, dir_it, prefix);
+        if (file_it == files.end() && dir_it == dirs.end())
             break;
+        // Directory wins if there's a file with the same name
+        bool is_dir = dir_it != dirs.end() && (file_it == files.end() || dir_it->first <= file_it->first);
+        std::string subname = (is_dir ? dir_it->first : file_it->first).substr(prefix.size());
+        auto cur_file_it = file_it;
+        if (file_it != files.end() && (!is_dir || file_it->first == dir_it->first))
+            file_it++;
+        auto cur_dir_it = dir_it;
+        if (is_dir)
+            dir_it++;
+        if (start != "" && subname == start)
+        {
+            continue;
+        }
+        if (to_skip > 0)
+        {
+            to_skip--;
+            st.cookie++;
+            continue;
         }
+        if (is_dir)
+        {
+            if (!add_dir_dir_entry(st, subname, cur_dir_it->first))
+                eof = false;
+        }
+        else
+        {
+            // fileid will change when the user creates snapshots
+            // however, we hope that clients tolerate it well
+            // Linux does, even though it complains about "fileid changed" in dmesg
+            auto entry = add_dir_entry(st, subname, cur_file_it->second.inode, cur_file_it->second.fh);
+            if (!entry)
+                eof = false;
+            else if (is_plus)
+            {
+                entry->name_attributes = (post_op_attr){
+                    .attributes_follow = 1,
+                    .attributes = get_file_attributes(self, cur_file_it->second.inode),
+                };
+            }
+        }
+        if (eof)
+        {
+            last_name = subname;
+            last_cookie = st.cookie;
+        }
+    }
+    if (!eof && last_name != "")
+    {
+        blockfs->list_cookies[(block_list_cookie_t){ dinf.id, dinf.mod_rev, last_cookie }] = last_name;
     }
-    if (entries.end() != entries.begin())
+    for (size_t i = 0; i+1 < st.entries.size(); i++)
     {
-        auto last_it = entries.end();
-        last_it--;
         if (is_plus)
-            ((entryplus3*)&last_it->second)->nextentry = NULL;
+            st.entries[i].nextentry = &st.entries[i+1];
         else
-        {
-            entry3* e = ((entry3*)&last_it->second);
-            e->nextentry = NULL;
-        }
+            ((entry3*)&st.entries[i])->nextentry = (entry3*)&st.entries[i+1];
     }
     // Send reply
+    entryplus3 *entries = st.entries.size() ? st.entries.data() : NULL;
     if (is_plus)
     {
         READDIRPLUS3res *reply = (READDIRPLUS3res*)rop->reply;
         *reply = { .status = NFS3_OK };
-        *(uint64_t*)(reply->resok.cookieverf) = self->parent->blockfs->dir_info.at(dir).mod_rev;
-        reply->resok.reply.entries = entries.size() ? &entries.begin()->second : NULL;
+        *(uint64_t*)(reply->resok.cookieverf) = dinf.mod_rev;
+        reply->resok.reply.entries = entries;
         reply->resok.reply.eof = eof;
     }
     else
     {
         READDIR3res *reply = (READDIR3res*)rop->reply;
         *reply = { .status = NFS3_OK };
-        *(uint64_t*)(reply->resok.cookieverf) = self->parent->blockfs->dir_info.at(dir).mod_rev;
-        reply->resok.reply.entries = entries.size() ? (entry3*)&entries.begin()->second : NULL;
+        *(uint64_t*)(reply->resok.cookieverf) = dinf.mod_rev;
+        reply->resok.reply.entries = (entry3*)entries;
         reply->resok.reply.eof = eof;
     }
     rpc_queue_reply(rop);
@@ -1174,19 +1287,45 @@ void block_fs_state_t::init(nfs_proxy_t *proxy, json11::Json cfg)
     dir_info[""] = (nfs_dir_t){
         .id = 1,
         .mod_rev = 0,
+        .fh = "S"+base64_encode(sha256("")),
     };
     clock_gettime(CLOCK_REALTIME, &dir_info[""].mtime);
     assert(proxy->cli->st_cli.on_inode_change_hook == NULL);
     proxy->cli->st_cli.on_inode_change_hook = [this, proxy](inode_t changed_inode, bool removed)
     {
         auto inode_cfg_it = proxy->cli->st_cli.inode_config.find(changed_inode);
+        std::string full_name;
+        if (!removed && inode_cfg_it != proxy->cli->st_cli.inode_config.end() &&
+            (name_prefix == "" || inode_cfg_it->second.name.substr(0, name_prefix.size()) == name_prefix))
+        {
+            full_name = inode_cfg_it->second.name;
+        }
+        // Alter the name index, only when the image is added, removed or renamed
+        auto nbi_it = name_by_inode.find(changed_inode);
+        if (nbi_it != name_by_inode.end() && nbi_it->second != full_name)
+        {
+            auto file_it = file_by_name.find(nbi_it->second);
+            if (file_it != file_by_name.end() && file_it->second.inode == changed_inode)
+            {
+                inode_by_hash.erase(file_it->second.fh);
+                file_by_name.erase(file_it);
+            }
+            name_by_inode.erase(nbi_it);
+            nbi_it = name_by_inode.end();
+        }
+        if (full_name != "" && nbi_it == name_by_inode.end())
+        {
+            std::string fh = "S"+base64_encode(sha256(full_name));
+            inode_by_hash[fh] = changed_inode;
+            file_by_name[full_name] = (nfs_file_t){ .inode = changed_inode, .fh = fh };
+            name_by_inode[changed_inode] = full_name;
+        }
         if (inode_cfg_it == proxy->cli->st_cli.inode_config.end())
         {
             return;
         }
         auto & inode_cfg = inode_cfg_it->second;
-        std::string full_name = inode_cfg.name;
-        if (proxy->blockfs->name_prefix != "" && full_name.substr(0, proxy->blockfs->name_prefix.size()) != proxy->blockfs->name_prefix)
+        if (name_prefix != "" && inode_cfg.name.substr(0, name_prefix.size()) != name_prefix)
         {
             return;
         }
@@ -1195,43 +1334,42 @@ void block_fs_state_t::init(nfs_proxy_t *proxy, json11::Json cfg)
         clock_gettime(CLOCK_REALTIME, &now);
         dir_info[""].mod_rev = dir_info[""].mod_rev < inode_cfg.mod_revision ? inode_cfg.mod_revision : dir_info[""].mod_rev;
         dir_info[""].mtime = now;
-        int pos = full_name.find('/', proxy->blockfs->name_prefix.size());
+        int pos = inode_cfg.name.find('/', name_prefix.size());
         while (pos >= 0)
         {
-            std::string dir = full_name.substr(0, pos);
-            auto & dinf = dir_info[dir];
-            if (!dinf.id)
-                dinf.id = next_dir_id++;
+            auto & dinf = add_dir(inode_cfg.name.substr(0, pos));
             dinf.mod_rev = dinf.mod_rev < inode_cfg.mod_revision ? inode_cfg.mod_revision : dinf.mod_rev;
             dinf.mtime = now;
-            dir_by_hash["S"+base64_encode(sha256(dir))] = dir;
-            pos = full_name.find('/', pos+1);
-        }
-        // Alter inode_by_hash
-        if (removed)
-        {
-            auto ino_it = hash_by_inode.find(changed_inode);
-            if (ino_it != hash_by_inode.end())
-            {
-                inode_by_hash.erase(ino_it->second);
-                hash_by_inode.erase(ino_it);
-            }
-        }
-        else
-        {
-            std::string hash = "S"+base64_encode(sha256(full_name));
-            auto hbi_it = hash_by_inode.find(changed_inode);
-            if (hbi_it != hash_by_inode.end() && hbi_it->second != hash)
-            {
-                // inode had a different name, remove old hash=>inode pointer
-                inode_by_hash.erase(hbi_it->second);
-            }
-            inode_by_hash[hash] = changed_inode;
-            hash_by_inode[changed_inode] = hash;
+            pos = inode_cfg.name.find('/', pos+1);
         }
     };
 }
 
+nfs_dir_t & block_fs_state_t::add_dir(const std::string & dir)
+{
+    auto & dinf = dir_info[dir];
+    if (!dinf.id)
+    {
+        dinf.id = next_dir_id++;
+        dinf.fh = "S"+base64_encode(sha256(dir));
+        dir_by_hash[dinf.fh] = dir;
+    }
+    return dinf;
+}
+
+// Forget cookies of old listings of the directory
+void block_fs_state_t::clear_cookies(uint64_t dir_id, uint64_t keep_verf)
+{
+    auto lc_it = list_cookies.lower_bound((block_list_cookie_t){ dir_id, 0, 0 });
+    while (lc_it != list_cookies.end() && lc_it->first.dir_id == dir_id)
+    {
+        if (lc_it->first.cookieverf != keep_verf || !keep_verf)
+            list_cookies.erase(lc_it++);
+        else
+            lc_it++;
+    }
+}
+
 void nfs_block_procs(nfs_client_t *self)
 {
     struct rpc_service_proc_t pt[] = {
@@ -3,7 +3,7 @@
 //
 // NFS proxy over Vitastor block images - header
 // Presents all images as files
-// Keeps image/file list in memory and is thus unsuitable for a large number of files
+// Keeps a sorted image name index in memory, updated incrementally from etcd watch events
 
 #pragma once
 
@@ -12,8 +12,26 @@ struct nfs_dir_t
     uint64_t id;
     uint64_t mod_rev;
     timespec mtime;
+    std::string fh;
 };
 
+struct nfs_file_t
+{
+    inode_t inode;
+    std::string fh;
+};
+
+struct block_list_cookie_t
+{
+    uint64_t dir_id, cookieverf, cookie;
+};
+
+inline bool operator < (const block_list_cookie_t & a, const block_list_cookie_t & b)
+{
+    return a.dir_id < b.dir_id || a.dir_id == b.dir_id &&
+        (a.cookieverf < b.cookieverf || a.cookieverf == b.cookieverf && a.cookie < b.cookie);
+}
+
 struct extend_size_t
 {
     inode_t inode;
@@ -48,14 +66,20 @@ struct block_fs_state_t
     std::map<std::string, nfs_dir_t> dir_info;
     // filehandle => inode ID
     std::map<std::string, inode_t> inode_by_hash;
-    // inode ID => filehandle
-    std::map<inode_t, std::string> hash_by_inode;
+    // full image name with name_prefix => inode ID and filehandle, sorted for listings
+    std::map<std::string, nfs_file_t> file_by_name;
+    // inode ID => full image name
+    std::map<inode_t, std::string> name_by_inode;
+    // listing continuation cookie => name of the entry in the directory
+    std::map<block_list_cookie_t, std::string> list_cookies;
 
     // inode extend requests in progress
     std::map<inode_t, extend_inode_t> extends;
     std::multimap<extend_size_t, extend_write_t> extend_writes;
 
     void init(nfs_proxy_t *proxy, json11::Json cfg);
+    nfs_dir_t & add_dir(const std::string & dir);
+    void clear_cookies(uint64_t dir_id, uint64_t keep_verf);
 };
 
 nfsstat3 vitastor_nfs_map_err(int err);
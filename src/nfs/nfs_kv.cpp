@@ -6,6 +6,7 @@
 #include <sys/time.h>
 
 #include "str_util.h"
+#include "http_client.h"
 #include "nfs_proxy.h"
 #include "nfs_common.h"
 #include "nfs_kv.h"
@@ -47,11 +48,11 @@ std::string nfstime_to_str(nfstime3 t)
     return timespec_to_str((timespec){ .tv_sec = t.seconds, .tv_nsec = t.nseconds });
 }
 
-std::string nfstime_now_str()
+nfstime3 nfstime_now()
 {
     timespec t;
     clock_gettime(CLOCK_REALTIME, &t);
-    return timespec_to_str(t);
+    return (nfstime3){ .seconds = (u_int)t.tv_sec, .nseconds = (u_int)t.tv_nsec };
 }
 
 int kv_map_type(const std::string & type)
@@ -65,26 +66,23 @@ int kv_map_type(const std::string & type)
         (type == "fifo" ? NF3FIFO : -1)))))));
 }
 
-fattr3 get_kv_attributes(nfs_client_t *self, uint64_t ino, json11::Json attrs)
+fattr3 get_kv_attributes(nfs_client_t *self, uint64_t ino, const kv_inode_t & ientry)
 {
-    auto type = kv_map_type(attrs["type"].string_value());
-    auto mode = attrs["mode"].uint64_value();
-    auto nlink = attrs["nlink"].uint64_value();
-    nfstime3 mtime = nfstime_from_str(attrs["mtime"].string_value());
-    nfstime3 atime = attrs["atime"].is_null() ? mtime : nfstime_from_str(attrs["atime"].string_value());
-    nfstime3 ctime = attrs["ctime"].is_null() ? mtime : nfstime_from_str(attrs["ctime"].string_value());
-    // In theory we could store the binary structure itself, but JSON is simpler :-)
+    auto type = ientry.file_type();
+    nfstime3 mtime = ientry.mtime;
+    nfstime3 atime = ientry.has(KV_INODE_ATIME) ? ientry.atime : mtime;
+    nfstime3 ctime = ientry.has(KV_INODE_CTIME) ? ientry.ctime : mtime;
     return (fattr3){
-        .type = (type == 0 ? NF3REG : (ftype3)type),
-        .mode = (attrs["mode"].is_null() ? (type == NF3DIR ? 0755 : 0644) : (uint32_t)mode),
-        .nlink = (nlink == 0 ? 1 : (uint32_t)nlink),
-        .uid = (uint32_t)attrs["uid"].uint64_value(),
-        .gid = (uint32_t)attrs["gid"].uint64_value(),
-        .size = (type == NF3DIR ? 4096 : attrs["size"].uint64_value()),
+        .type = (type <= 0 ? NF3REG : (ftype3)type),
+        .mode = (!ientry.has(KV_INODE_MODE) ? (type == NF3DIR ? 0755 : 0644) : ientry.mode),
+        .nlink = (ientry.nlink == 0 ? 1 : ientry.nlink),
+        .uid = ientry.uid,
+        .gid = ientry.gid,
+        .size = (type == NF3DIR ? 4096 : ientry.size),
         // FIXME Counting actual used file size would require reworking statistics
-        .used = (type == NF3DIR ? 4096 : attrs["size"].uint64_value()),
+        .used = (type == NF3DIR ? 4096 : ientry.size),
         .rdev = (type == NF3BLK || type == NF3CHR
-            ? (specdata3){ (uint32_t)attrs["major"].uint64_value(), (uint32_t)attrs["minor"].uint64_value() }
+            ? (specdata3){ ientry.major, ientry.minor }
             : (specdata3){}),
         .fsid = self->parent->fsid,
         .fileid = ino,
@@ -127,6 +125,26 @@ std::string kv_inode_key(uint64_t ino)
     return std::string(key);
 }
 
+uint64_t kv_inode_key_ino(const std::string & key)
+{
+    // inverse of kv_inode_key: i <hex pool> <G+length> <hex number>
+    if (key.size() < 3 || key[0] != 'i')
+        return 0;
+    size_t sep = 1;
+    while (sep < key.size() && !(key[sep] >= 'G' && key[sep] <= 'Z'))
+        sep++;
+    if (sep == 1 || sep >= key.size() || key.size()-sep-1 != key[sep]-'G')
+        return 0;
+    char *end = NULL;
+    uint64_t pool_id = strtoull(key.substr(1, sep-1).c_str(), &end, 16);
+    if (*end)
+        return 0;
+    uint64_t num = strtoull(key.c_str()+sep+1, &end, 16);
+    if (*end)
+        return 0;
+    return INODE_WITH_POOL(pool_id, num);
+}
+
 std::string kv_fh(uint64_t ino)
 {
     char key[32] = { 0 };
@@ -250,6 +268,19 @@ void kv_fs_state_t::init(nfs_proxy_t *proxy, json11::Json cfg)
     touch_interval = cfg["touch_interval"].uint64_value();
     if (touch_interval < 100) // ms
         touch_interval = 100;
+    if (!cfg["attr_cache_time"].is_null())
+        attr_cache_time = cfg["attr_cache_time"].uint64_value(); // ms
+    if (!cfg["negative_cache_time"].is_null())
+        negative_cache_time = cfg["negative_cache_time"].uint64_value(); // ms
+    if (!cfg["attr_cache_size"].is_null())
+        attr_cache_size = cfg["attr_cache_size"].uint64_value();
+    close_to_open = !json_is_false(cfg["close_to_open"]);
+    readdir_inline_attrs = json_is_true(cfg["readdir_inline_attrs"]);
+    shared_pack_delay = cfg["shared_pack_delay"].uint64_value(); // us
+    if (!cfg["shared_read_cache_time"].is_null())
+        shared_read_cache_time = cfg["shared_read_cache_time"].uint64_value(); // ms
+    if (!cfg["shared_read_cache_size"].is_null())
+        shared_read_cache_size = cfg["shared_read_cache_size"].uint64_value();
     pool_block_size = pool_cfg.pg_stripe_size;
     pool_alignment = pool_cfg.bitmap_granularity;
     // Open DB and wait
@@ -287,7 +318,11 @@ void kv_fs_state_t::init(nfs_proxy_t *proxy, json11::Json cfg)
     }
     zero_block.resize(pool_block_size < 1048576 ? 1048576 : pool_block_size);
     scrap_block.resize(pool_block_size < 1048576 ? 1048576 : pool_block_size);
-    touch_timer_id = proxy->epmgr->tfd->set_timer(touch_interval, true, [this](int){ touch_inodes(); });
+    touch_timer_id = proxy->epmgr->tfd->set_timer(touch_interval, true, [this](int)
+    {
+        touch_inodes();
+        update_dentries();
+    });
 }
 
 kv_fs_state_t::~kv_fs_state_t()
@@ -297,21 +332,26 @@ kv_fs_state_t::~kv_fs_state_t()
         proxy->epmgr->tfd->clear_timer(touch_timer_id);
         touch_timer_id = -1;
     }
+    if (proxy && pack_timer_id >= 0)
+    {
+        proxy->epmgr->tfd->clear_timer(pack_timer_id);
+        pack_timer_id = -1;
+    }
 }
 
 static void touch_inode(nfs_proxy_t *proxy, inode_t ino, bool allow_cache)
 {
-    kv_read_inode(proxy, ino, [proxy, ino](int res, const std::string & value, json11::Json attrs)
+    kv_read_inode(proxy, ino, [proxy, ino](int res, const std::string & value, const kv_inode_t & attrs)
     {
         if (!res)
         {
-            auto ientry = attrs.object_items();
-            ientry["mtime"] = ientry["ctime"] = nfstime_now_str();
-            ientry.erase("verf");
+            auto ientry = attrs;
+            ientry.mtime = ientry.ctime = nfstime_now();
+            ientry.fields = (ientry.fields | KV_INODE_MTIME | KV_INODE_CTIME) & ~KV_INODE_VERF;
             // FIXME: Use "update" query
             bool *found = new bool;
             *found = true;
-            proxy->db->set(kv_inode_key(ino), json11::Json(ientry).dump(), [proxy, ino, found](int res)
+            kv_db_set(proxy, kv_inode_key(ino), ientry.encode(), [proxy, ino, found](int res)
             {
                 if (!*found)
                     res = -ENOENT;
@@ -335,3 +375,90 @@ void kv_fs_state_t::touch_inodes()
         touch_inode(proxy, ino, true);
     }
 }
+
+void kv_queue_dentry_update(nfs_proxy_t *proxy, const std::string & key, const std::string & value)
+{
+    auto kvfs = proxy->kvfs;
+    if (!kvfs->readdir_inline_attrs || !value.size() || (uint8_t)value[0] != KV_INODE_MAGIC)
+        return;
+    uint64_t ino = kv_inode_key_ino(key);
+    if (!ino)
+        return;
+    kv_inode_t ientry;
+    kv_dentry_update_t upd;
+    std::string err;
+    if (!ientry.decode(value, err) || !ientry.get_dentry(upd.dir_ino, upd.name))
+        return;
+    // Hard links don't have a single entry to keep their attributes in
+    if (ientry.file_type() == NF3DIR || ientry.nlink <= 1)
+        upd.attrs = ientry.encode_attrs();
+    kvfs->dentry_queue[ino] = std::move(upd);
+}
+
+// Inline attributes are updated in batches: entries are read together and then
+// written with a CAS check, entries removed or renamed in between are skipped
+void kv_fs_state_t::update_dentries()
+{
+    if (dentry_flushing.size() || !dentry_queue.size())
+        return;
+    dentry_flushing = std::move(dentry_queue);
+    dentry_queue.clear();
+    std::vector<std::string> keys;
+    for (auto & p: dentry_flushing)
+        keys.push_back(kv_direntry_key(p.second.dir_ino, p.second.name));
+    proxy->db->multi_get(keys, [this](int res, std::vector<kv_read_t> & reads)
+    {
+        std::vector<kv_write_t> batch;
+        std::vector<inode_t> batch_inos;
+        size_t i = 0;
+        for (auto & p: dentry_flushing)
+        {
+            auto & rd = reads[i++];
+            if (res != 0 || rd.res != 0)
+                continue;
+            std::string err;
+            auto direntry = json11::Json::parse(rd.value, err).object_items();
+            if (err != "" || direntry["ino"].uint64_value() != p.first)
+                continue;
+            if (p.second.attrs != "")
+                direntry["attrs"] = p.second.attrs;
+            else
+                direntry.erase("attrs");
+            auto new_text = json11::Json(direntry).dump();
+            if (new_text == rd.value)
+                continue;
+            std::string old_text = rd.value;
+            batch.push_back((kv_write_t){
+                .key = rd.key,
+                .value = new_text,
+                .cas_compare = [old_text](int res, const std::string & value)
+                {
+                    return res == 0 && value == old_text;
+                },
+            });
+            batch_inos.push_back(p.first);
+        }
+        if (res != 0)
+        {
+            fprintf(stderr, "Failed to read directory entries to update inline attributes: %s (code %d)\n", strerror(-res), res);
+        }
+        if (!batch.size())
+        {
+            dentry_flushing.clear();
+            return;
+        }
+        kv_db_write_batch(proxy, batch, [this, batch_inos](int res, const std::vector<int> & results)
+        {
+            // Retry changes not applied because of a concurrent modification
+            for (size_t i = 0; i < batch_inos.size() && i < results.size(); i++)
+            {
+                if ((results[i] == -EAGAIN || results[i] == -ECANCELED) &&
+                    dentry_queue.find(batch_inos[i]) == dentry_queue.end())
+                {
+                    dentry_queue[batch_inos[i]] = dentry_flushing.at(batch_inos[i]);
+                }
+            }
+            dentry_flushing.clear();
+        });
+    });
+}
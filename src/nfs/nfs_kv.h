@@ -5,11 +5,47 @@
 
 #pragma once
 
+#include <list>
+#include <memory>
+
 #include "proto/nfs.h"
 
 #define KV_ROOT_INODE 1
 #define SHARED_FILE_MAGIC_V1 0x711A5158A6EDF17E
 
+// Binary inode record: magic, version, field mask, then fields present in the mask
+// in the order of their bits, then the extension area (tagged entries)
+// Old records are JSON objects and always start with '{'
+#define KV_INODE_MAGIC 0xA7
+#define KV_INODE_VERSION 1
+
+#define KV_INODE_TYPE 0x0001
+#define KV_INODE_MODE 0x0002
+#define KV_INODE_NLINK 0x0004
+#define KV_INODE_UID 0x0008
+#define KV_INODE_GID 0x0010
+#define KV_INODE_SIZE 0x0020
+#define KV_INODE_MTIME 0x0040
+#define KV_INODE_ATIME 0x0080
+#define KV_INODE_CTIME 0x0100
+#define KV_INODE_RDEV 0x0200
+#define KV_INODE_PARENT 0x0400
+#define KV_INODE_VERF 0x0800
+#define KV_INODE_SHARED 0x1000
+#define KV_INODE_SHARED_VER 0x2000
+#define KV_INODE_EMPTY 0x4000
+#define KV_INODE_EXT 0x8000
+
+// Extension area entry tags. Unknown tags are skipped and preserved
+#define KV_INODE_EXT_SYMLINK 1
+#define KV_INODE_EXT_JSON 2
+// Back-reference to the directory entry holding inline attributes
+#define KV_INODE_EXT_DENTRY 3
+
+// Type of shared inode placeholder records, not a file type
+#define KV_INODE_TYPE_SHARED 0x80
+#define KV_INODE_TYPE_UNKNOWN 0xFF
+
 struct nfs_kv_write_state;
 
 struct list_cookie_t
@@ -48,10 +84,89 @@ struct kv_idgen_t
     std::vector<uint64_t> unallocated_ids;
 };
 
+struct kv_inode_t
+{
+    uint32_t fields = 0;
+    uint8_t type = 0;
+    uint32_t mode = 0, nlink = 0, uid = 0, gid = 0;
+    uint64_t size = 0;
+    nfstime3 mtime = {}, atime = {}, ctime = {};
+    uint32_t major = 0, minor = 0;
+    uint64_t parent_ino = 0;
+    uint64_t verf = 0;
+    uint64_t shared_ino = 0, shared_offset = 0, shared_alloc = 0;
+    uint64_t shared_ver = 0;
+    // Raw extension area, decoded only when required
+    std::string ext;
+
+    bool has(uint32_t field) const { return (fields & field) != 0; }
+    // File type (NF3*) or -1 for non-file records
+    int file_type() const;
+    std::string get_symlink() const;
+    void set_symlink(const std::string & target);
+    json11::Json::object get_extra() const;
+    bool get_dentry(uint64_t & dir_ino, std::string & name) const;
+    // Empty <name> removes the back-reference
+    void set_dentry(uint64_t dir_ino, const std::string & name);
+    // Copy fields present in <src>
+    void update(const kv_inode_t & src);
+    bool decode(const std::string & value, std::string & err);
+    std::string encode() const;
+    // Base64-encoded attributes without the extension area, inlined into direntries
+    std::string encode_attrs() const;
+    // JSON representation for logs
+    json11::Json to_json() const;
+};
+
+struct kv_cache_entry_t
+{
+    // 0 or -ENOENT for negative entries, invalid entries are kept to reject
+    // stale results of reads started before the last local change
+    bool valid = false;
+    int res = 0;
+    std::string value;
+    // decoded value for inode entries
+    kv_inode_t ientry;
+    uint64_t loaded_ms = 0;
+    uint64_t invalidated_gen = 0;
+    std::list<std::string>::iterator lru_it;
+};
+
+struct kv_cache_stats_t
+{
+    uint64_t attr_hits = 0, attr_misses = 0;
+    uint64_t dentry_hits = 0, dentry_misses = 0, negative_hits = 0;
+    uint64_t shared_hits = 0, shared_misses = 0;
+    uint64_t invalidations = 0, evictions = 0;
+};
+
+// Block of a shared inode kept in memory to serve reads of neighbouring small files
+struct kv_shared_block_t
+{
+    std::vector<uint8_t> data;
+    uint64_t loaded_ms = 0;
+};
+
+struct kv_shared_load_t
+{
+    uint64_t gen = 0;
+    std::vector<uint8_t> data;
+    std::vector<std::function<void(int res, const uint8_t *data)>> waiters;
+};
+
+struct kv_dentry_update_t
+{
+    uint64_t dir_ino = 0;
+    std::string name;
+    // empty to remove inline attributes from the entry
+    std::string attrs;
+};
+
 struct kv_fs_state_t
 {
     nfs_proxy_t *proxy = NULL;
     int touch_timer_id = -1;
+    int pack_timer_id = -1;
 
     uint64_t fs_kv_inode = 0;
     uint64_t fs_inode_count = 0;
@@ -60,19 +175,40 @@ struct kv_fs_state_t
     uint64_t pool_alignment = 0;
     uint64_t shared_inode_threshold = 0;
     uint64_t touch_interval = 1000;
+    // attribute and directory entry cache
+    uint64_t attr_cache_time = 1000, negative_cache_time = 0;
+    uint64_t attr_cache_size = 65536;
+    bool close_to_open = true;
+    bool readdir_inline_attrs = false;
+    // small file packing and shared block read cache
+    uint64_t shared_pack_delay = 0;
+    uint64_t shared_read_cache_time = 1000, shared_read_cache_size = 256;
 
     std::map<list_cookie_t, list_cookie_val_t> list_cookies;
     std::map<pool_id_t, kv_idgen_t> idgen;
     std::vector<shared_alloc_queue_t> allocating_shared;
     uint64_t cur_shared_inode = 0, cur_shared_offset = 0;
+    std::vector<nfs_kv_write_state*> pack_queue;
+    uint64_t pack_queue_bytes = 0;
+    bool pack_writing = false;
+    std::map<std::pair<inode_t, uint64_t>, kv_shared_block_t> shared_blocks;
+    std::map<std::pair<inode_t, uint64_t>, std::shared_ptr<kv_shared_load_t>> shared_loading;
+    uint64_t shared_blocks_gen = 0;
     std::map<inode_t, kv_inode_extend_t> extends;
     std::set<inode_t> touch_queue;
+    std::map<std::string, kv_cache_entry_t> cache;
+    std::list<std::string> cache_lru;
+    uint64_t cache_gen = 0, cache_evicted_gen = 0;
+    kv_cache_stats_t cache_stats, cache_stats_prev;
+    std::map<inode_t, kv_dentry_update_t> dentry_queue, dentry_flushing;
 
     std::vector<uint8_t> zero_block;
     std::vector<uint8_t> scrap_block;
 
     void init(nfs_proxy_t *proxy, json11::Json cfg);
     void touch_inodes();
+    void update_dentries();
+    void print_stats(uint64_t interval);
     ~kv_fs_state_t();
 };
 
@@ -100,19 +236,40 @@ struct nfs_rmw_t
 nfsstat3 vitastor_nfs_map_err(int err);
 nfstime3 nfstime_from_str(const std::string & s);
 std::string nfstime_to_str(nfstime3 t);
-std::string nfstime_now_str();
+nfstime3 nfstime_now();
 int kv_map_type(const std::string & type);
-fattr3 get_kv_attributes(nfs_client_t *self, uint64_t ino, json11::Json attrs);
+fattr3 get_kv_attributes(nfs_client_t *self, uint64_t ino, const kv_inode_t & ientry);
 std::string kv_direntry_key(uint64_t dir_ino, const std::string & filename);
 std::string kv_direntry_filename(const std::string & key);
 std::string kv_inode_key(uint64_t ino);
+// Inode number from an inode key or 0 for other keys
+uint64_t kv_inode_key_ino(const std::string & key);
 std::string kv_fh(uint64_t ino);
 uint64_t kv_fh_inode(const std::string & fh);
 bool kv_fh_valid(const std::string & fh);
 void allocate_new_id(nfs_client_t *self, pool_id_t pool_id, std::function<void(int res, uint64_t new_id)> cb);
 void kv_read_inode(nfs_proxy_t *proxy, uint64_t ino,
-    std::function<void(int res, const std::string & value, json11::Json ientry)> cb,
+    std::function<void(int res, const std::string & value, const kv_inode_t & ientry)> cb,
     bool allow_cache = false);
+// Read inode or directory entry using the attribute cache. <revalidate> skips
+// the cached value but still refreshes it
+void kv_read_inode_cached(nfs_proxy_t *proxy, uint64_t ino,
+    std::function<void(int res, const std::string & value, const kv_inode_t & ientry)> cb,
+    bool revalidate = false);
+void kv_read_direntry_cached(nfs_proxy_t *proxy, uint64_t dir_ino, const std::string & filename,
+    std::function<void(int res, const std::string & value)> cb);
+void kv_cache_invalidate(nfs_proxy_t *proxy, const std::string & key);
+// Queue an update of attributes inlined into the direntry of a modified inode
+void kv_queue_dentry_update(nfs_proxy_t *proxy, const std::string & key, const std::string & value);
+// DB modifications which keep the attribute cache consistent
+void kv_db_set(nfs_proxy_t *proxy, const std::string & key, const std::string & value, std::function<void(int res)> cb,
+    std::function<bool(int res, const std::string & value)> cas_compare = NULL);
+void kv_db_del(nfs_proxy_t *proxy, const std::string & key, std::function<void(int res)> cb,
+    std::function<bool(int res, const std::string & value)> cas_compare = NULL);
+void kv_db_write_batch(nfs_proxy_t *proxy, const std::vector<kv_write_t> & batch,
+    std::function<void(int res, const std::vector<int> & results)> cb);
+// Drop cached shared inode blocks overlapping a local write
+void kv_shared_cache_invalidate(kv_fs_state_t *kvfs, inode_t ino, uint64_t offset, uint64_t len);
 uint64_t align_shared_size(nfs_client_t *self, uint64_t size);
 void nfs_do_rmw(nfs_rmw_t *rmw);
 
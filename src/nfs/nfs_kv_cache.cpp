@@ -0,0 +1,222 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+//
+// NFS proxy over VitastorKV database - attribute and directory entry cache
+//
+// Cached values are used for attr_cache_time ms (negative_cache_time for missing
+// entries), after that they're re-read from the DB which only re-reads the leaf
+// block if its version changed. Local changes invalidate cached keys before and
+// after the modification, and reads started before an invalidation don't fill
+// the cache, so a single proxy always sees its own changes. Changes made by other
+// proxies become visible after the cache time.
+
+#include <sys/time.h>
+
+#include "nfs_proxy.h"
+#include "nfs_kv.h"
+
+static uint64_t kv_cache_now_ms()
+{
+    timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec*1000 + tv.tv_nsec/1000000;
+}
+
+static kv_cache_entry_t *kv_cache_find(kv_fs_state_t *kvfs, const std::string & key)
+{
+    auto it = kvfs->cache.find(key);
+    if (it == kvfs->cache.end() || !it->second.valid)
+    {
+        return NULL;
+    }
+    auto & ce = it->second;
+    uint64_t max_age = ce.res == 0 ? kvfs->attr_cache_time : kvfs->negative_cache_time;
+    if (kv_cache_now_ms() - ce.loaded_ms >= max_age)
+    {
+        return NULL;
+    }
+    kvfs->cache_lru.splice(kvfs->cache_lru.begin(), kvfs->cache_lru, ce.lru_it);
+    return &ce;
+}
+
+static kv_cache_entry_t *kv_cache_alloc(kv_fs_state_t *kvfs, const std::string & key)
+{
+    auto it = kvfs->cache.find(key);
+    if (it != kvfs->cache.end())
+    {
+        kvfs->cache_lru.splice(kvfs->cache_lru.begin(), kvfs->cache_lru, it->second.lru_it);
+        return &it->second;
+    }
+    while (kvfs->cache.size() >= kvfs->attr_cache_size && kvfs->cache_lru.size())
+    {
+        auto old_it = kvfs->cache.find(kvfs->cache_lru.back());
+        if (kvfs->cache_evicted_gen < old_it->second.invalidated_gen)
+            kvfs->cache_evicted_gen = old_it->second.invalidated_gen;
+        kvfs->cache.erase(old_it);
+        kvfs->cache_lru.pop_back();
+        kvfs->cache_stats.evictions++;
+    }
+    auto & ce = kvfs->cache[key];
+    kvfs->cache_lru.push_front(key);
+    ce.lru_it = kvfs->cache_lru.begin();
+    return &ce;
+}
+
+static void kv_cache_put(kv_fs_state_t *kvfs, const std::string & key, uint64_t start_gen,
+    int res, const std::string & value, const kv_inode_t *ientry)
+{
+    if (!kvfs->attr_cache_size || res != 0 && (res != -ENOENT || !kvfs->negative_cache_time))
+    {
+        return;
+    }
+    auto it = kvfs->cache.find(key);
+    if (it != kvfs->cache.end() ? it->second.invalidated_gen > start_gen : kvfs->cache_evicted_gen > start_gen)
+    {
+        // Key was changed locally after the read started
+        return;
+    }
+    auto ce = kv_cache_alloc(kvfs, key);
+    ce->valid = true;
+    ce->res = res;
+    ce->value = value;
+    ce->ientry = ientry ? *ientry : kv_inode_t();
+    ce->loaded_ms = kv_cache_now_ms();
+}
+
+void kv_cache_invalidate(nfs_proxy_t *proxy, const std::string & key)
+{
+    auto kvfs = proxy->kvfs;
+    if (!kvfs->attr_cache_size)
+    {
+        return;
+    }
+    kvfs->cache_gen++;
+    kvfs->cache_stats.invalidations++;
+    auto ce = kv_cache_alloc(kvfs, key);
+    ce->valid = false;
+    ce->value = "";
+    ce->ientry = kv_inode_t();
+    ce->invalidated_gen = kvfs->cache_gen;
+}
+
+void kv_read_inode_cached(nfs_proxy_t *proxy, uint64_t ino,
+    std::function<void(int res, const std::string & value, const kv_inode_t & ientry)> cb,
+    bool revalidate)
+{
+    auto kvfs = proxy->kvfs;
+    auto key = kv_inode_key(ino);
+    auto ce = revalidate ? NULL : kv_cache_find(kvfs, key);
+    if (ce)
+    {
+        kvfs->cache_stats.attr_hits++;
+        // Copy so that the callback may modify the cache
+        int res = ce->res;
+        std::string value = ce->value;
+        kv_inode_t ientry = ce->ientry;
+        cb(res, value, ientry);
+        return;
+    }
+    kvfs->cache_stats.attr_misses++;
+    uint64_t start_gen = kvfs->cache_gen;
+    kv_read_inode(proxy, ino, [kvfs, key, start_gen, cb](int res, const std::string & value, const kv_inode_t & ientry)
+    {
+        kv_cache_put(kvfs, key, start_gen, res, value, &ientry);
+        cb(res, value, ientry);
+    });
+}
+
+void kv_read_direntry_cached(nfs_proxy_t *proxy, uint64_t dir_ino, const std::string & filename,
+    std::function<void(int res, const std::string & value)> cb)
+{
+    auto kvfs = proxy->kvfs;
+    auto key = kv_direntry_key(dir_ino, filename);
+    auto ce = kv_cache_find(kvfs, key);
+    if (ce)
+    {
+        if (ce->res == -ENOENT)
+            kvfs->cache_stats.negative_hits++;
+        else
+            kvfs->cache_stats.dentry_hits++;
+        int res = ce->res;
+        std::string value = ce->value;
+        cb(res, value);
+        return;
+    }
+    kvfs->cache_stats.dentry_misses++;
+    uint64_t start_gen = kvfs->cache_gen;
+    proxy->db->get(key, [kvfs, key, start_gen, cb](int res, const std::string & value)
+    {
+        kv_cache_put(kvfs, key, start_gen, res, value, NULL);
+        cb(res, value);
+    });
+}
+
+void kv_db_set(nfs_proxy_t *proxy, const std::string & key, const std::string & value, std::function<void(int res)> cb,
+    std::function<bool(int res, const std::string & value)> cas_compare)
+{
+    kv_cache_invalidate(proxy, key);
+    proxy->db->set(key, value, [proxy, key, value, cb](int res)
+    {
+        kv_cache_invalidate(proxy, key);
+        if (res == 0)
+            kv_queue_dentry_update(proxy, key, value);
+        cb(res);
+    }, cas_compare);
+}
+
+void kv_db_del(nfs_proxy_t *proxy, const std::string & key, std::function<void(int res)> cb,
+    std::function<bool(int res, const std::string & value)> cas_compare)
+{
+    kv_cache_invalidate(proxy, key);
+    proxy->db->del(key, [proxy, key, cb](int res)
+    {
+        kv_cache_invalidate(proxy, key);
+        cb(res);
+    }, cas_compare);
+}
+
+void kv_db_write_batch(nfs_proxy_t *proxy, const std::vector<kv_write_t> & batch,
+    std::function<void(int res, const std::vector<int> & results)> cb)
+{
+    std::vector<std::string> keys;
+    for (auto & w: batch)
+    {
+        kv_cache_invalidate(proxy, w.key);
+        keys.push_back(w.key);
+    }
+    proxy->db->write_batch(batch, [proxy, keys, cb](int res, const std::vector<int> & results)
+    {
+        for (auto & key: keys)
+            kv_cache_invalidate(proxy, key);
+        cb(res, results);
+    });
+}
+
+static void print_ratio(const char *name, uint64_t hits, uint64_t misses)
+{
+    if (hits+misses > 0)
+        printf(", %s hits %.1f%% of %ju", name, 100.0*hits/(hits+misses), hits+misses);
+}
+
+void kv_fs_state_t::print_stats(uint64_t interval)
+{
+    auto & cur = cache_stats;
+    auto & prev = cache_stats_prev;
+    if (cur.attr_hits == prev.attr_hits && cur.attr_misses == prev.attr_misses &&
+        cur.dentry_hits == prev.dentry_hits && cur.dentry_misses == prev.dentry_misses &&
+        cur.negative_hits == prev.negative_hits && cur.invalidations == prev.invalidations &&
+        cur.shared_hits == prev.shared_hits && cur.shared_misses == prev.shared_misses)
+    {
+        return;
+    }
+    printf("[NFS] attribute cache: %zu entries", cache.size());
+    print_ratio("attribute", cur.attr_hits-prev.attr_hits, cur.attr_misses-prev.attr_misses);
+    print_ratio("dentry", cur.dentry_hits+cur.negative_hits-prev.dentry_hits-prev.negative_hits,
+        cur.dentry_misses-prev.dentry_misses);
+    if (cur.negative_hits > prev.negative_hits)
+        printf(" (%ju negative)", cur.negative_hits-prev.negative_hits);
+    print_ratio("shared block", cur.shared_hits-prev.shared_hits, cur.shared_misses-prev.shared_misses);
+    printf(", %ju invalidations, %ju evictions in %ju s\n",
+        cur.invalidations-prev.invalidations, cur.evictions-prev.evictions, interval);
+    prev = cur;
+}
@@ -54,7 +54,7 @@ void allocate_new_id(nfs_client_t *self, pool_id_t pool_id, std::function<void(i
         {
             new_val = self->parent->kvfs->fs_inode_count;
         }
-        self->parent->db->set((pool_id ? "id"+std::to_string(pool_id) : "id"), std::to_string(new_val), [=](int res)
+        kv_db_set(self->parent, (pool_id ? "id"+std::to_string(pool_id) : "id"), std::to_string(new_val), [=](int res)
         {
             if (res == -EAGAIN)
             {
@@ -92,9 +92,9 @@ struct kv_create_state
     int res = 0;
     pool_id_t pool_id = 0;
     uint64_t new_id = 0;
-    json11::Json::object attrobj;
-    json11::Json attrs;
+    kv_inode_t attrs;
     std::string direntry_text;
+    int inode_res = 0;
     uint64_t dup_ino = 0;
     std::function<void(int res)> cb;
 };
@@ -106,23 +106,22 @@ static void kv_continue_create(kv_create_state *st, int state)
     else if (state == 2) goto resume_2;
     else if (state == 3) goto resume_3;
     else if (state == 4) goto resume_4;
-    else if (state == 5) goto resume_5;
     if (st->self->parent->trace)
-        fprintf(stderr, "[%d] CREATE %ju/%s ATTRS %s\n", st->self->nfs_fd, st->dir_ino, st->filename.c_str(), json11::Json(st->attrobj).dump().c_str());
+        fprintf(stderr, "[%d] CREATE %ju/%s ATTRS %s\n", st->self->nfs_fd, st->dir_ino, st->filename.c_str(), st->attrs.to_json().dump().c_str());
     if (st->filename == "" || st->filename.find("/") != std::string::npos)
     {
         auto cb = std::move(st->cb);
         cb(-EINVAL);
         return;
     }
-    st->attrobj["ctime"] = nfstime_now_str();
-    if (st->attrobj.find("mtime") == st->attrobj.end())
-        st->attrobj["mtime"] = st->attrobj["ctime"];
-    st->attrs = std::move(st->attrobj);
+    st->attrs.ctime = nfstime_now();
+    if (!st->attrs.has(KV_INODE_MTIME))
+        st->attrs.mtime = st->attrs.ctime;
+    st->attrs.fields |= KV_INODE_CTIME | KV_INODE_MTIME;
 resume_1:
     // Generate inode ID
     // Directories and special files don't need pool
-    st->pool_id = kv_map_type(st->attrs["type"].string_value()) == NF3REG
+    st->pool_id = st->attrs.file_type() == NF3REG
         ? st->self->parent->default_pool_id
         : 0;
     allocate_new_id(st->self, st->pool_id, [st](int res, uint64_t new_id)
@@ -139,74 +138,91 @@ resume_2:
         cb(st->res);
         return;
     }
-    st->self->parent->db->set(kv_inode_key(st->new_id), st->attrs.dump().c_str(), [st](int res)
+    {
+        auto direntry = json11::Json::object{ { "ino", st->new_id } };
+        if (st->attrs.file_type() == NF3DIR)
+        {
+            direntry["type"] = "dir";
+        }
+        if (st->self->parent->kvfs->readdir_inline_attrs)
+        {
+            st->attrs.set_dentry(st->dir_ino, st->filename);
+            direntry["attrs"] = st->attrs.encode_attrs();
+        }
+        st->direntry_text = json11::Json(direntry).dump().c_str();
+    }
+    // Set inode and direntry. They are written atomically if they're in the same
+    // K/V block, and in the order of the batch otherwise
+    st->dup_ino = 0;
+    kv_db_write_batch(st->self->parent, {
+        (kv_write_t){
+            .key = kv_inode_key(st->new_id),
+            .value = st->attrs.encode(),
+            .cas_compare = [st](int res, const std::string & value)
+            {
+                return res == -ENOENT;
+            },
+        },
+        (kv_write_t){
+            .key = kv_direntry_key(st->dir_ino, st->filename),
+            .value = st->direntry_text,
+            .cas_compare = [st](int res, const std::string & value)
+            {
+                // CAS compare - check that the key doesn't exist
+                if (res == 0)
+                {
+                    std::string err;
+                    auto direntry = json11::Json::parse(value, err);
+                    if (err != "")
+                    {
+                        fprintf(stderr, "Invalid JSON in direntry %s = %s: %s, overwriting\n",
+                            kv_direntry_key(st->dir_ino, st->filename).c_str(), value.c_str(), err.c_str());
+                        return true;
+                    }
+                    if (st->exclusive && direntry["verf"].uint64_value() == st->verf)
+                    {
+                        st->dup_ino = direntry["ino"].uint64_value();
+                        return false;
+                    }
+                    return false;
+                }
+                return true;
+            },
+        },
+    }, [st](int res, const std::vector<int> & results)
     {
         st->res = res;
+        st->inode_res = results[0];
         kv_continue_create(st, 3);
-    }, [st](int res, const std::string & value)
-    {
-        return res == -ENOENT;
     });
     return;
 resume_3:
-    if (st->res == -EAGAIN)
+    if (st->inode_res == -EAGAIN)
     {
         // Inode ID generator failure - retry
         goto resume_1;
     }
-    if (st->res < 0)
+    if (st->res < 0 && st->res != -EAGAIN)
     {
         auto cb = std::move(st->cb);
         cb(st->res);
         return;
     }
+    if (st->res == -EAGAIN)
     {
-        auto direntry = json11::Json::object{ { "ino", st->new_id } };
-        if (st->attrs["type"].string_value() == "dir")
-        {
-            direntry["type"] = "dir";
-        }
-        st->direntry_text = json11::Json(direntry).dump().c_str();
-    }
-    // Set direntry
-    st->dup_ino = 0;
-    st->self->parent->db->set(kv_direntry_key(st->dir_ino, st->filename), st->direntry_text, [st](int res)
-    {
-        st->res = res;
-        kv_continue_create(st, 4);
-    }, [st](int res, const std::string & value)
-    {
-        // CAS compare - check that the key doesn't exist
-        if (res == 0)
+        // Direntry already exists
+        if (st->inode_res == 0)
         {
-            std::string err;
-            auto direntry = json11::Json::parse(value, err);
-            if (err != "")
+            // Inode was written into another block
+            kv_db_del(st->self->parent, kv_inode_key(st->new_id), [st](int res)
             {
-                fprintf(stderr, "Invalid JSON in direntry %s = %s: %s, overwriting\n",
-                    kv_direntry_key(st->dir_ino, st->filename).c_str(), value.c_str(), err.c_str());
-                return true;
-            }
-            if (st->exclusive && direntry["verf"].uint64_value() == st->verf)
-            {
-                st->dup_ino = direntry["ino"].uint64_value();
-                return false;
-            }
-            return false;
+                st->res = res;
+                kv_continue_create(st, 4);
+            });
+            return;
         }
-        return true;
-    });
-    return;
+        st->res = 0;
 resume_4:
-    if (st->res == -EAGAIN)
-    {
-        // Direntry already exists
-        st->self->parent->db->del(kv_inode_key(st->new_id), [st](int res)
-        {
-            st->res = res;
-            kv_continue_create(st, 5);
-        });
-resume_5:
         if (st->res < 0)
         {
             fprintf(stderr, "failed to delete duplicate inode %ju left from create %s (code %d)\n", st->new_id, strerror(-st->res), st->res);
@@ -231,18 +247,18 @@ resume_5:
     cb(st->res);
 }
 
-static void kv_create_setattr(json11::Json::object & attrobj, sattr3 & sattr)
+static void kv_create_setattr(kv_inode_t & attrs, sattr3 & sattr)
 {
     if (sattr.mode.set_it)
-        attrobj["mode"] = (uint64_t)sattr.mode.mode;
+        attrs.mode = sattr.mode.mode, attrs.fields |= KV_INODE_MODE;
     if (sattr.uid.set_it)
-        attrobj["uid"] = (uint64_t)sattr.uid.uid;
+        attrs.uid = sattr.uid.uid, attrs.fields |= KV_INODE_UID;
     if (sattr.gid.set_it)
-        attrobj["gid"] = (uint64_t)sattr.gid.gid;
+        attrs.gid = sattr.gid.gid, attrs.fields |= KV_INODE_GID;
     if (sattr.atime.set_it)
-        attrobj["atime"] = nfstime_to_str(sattr.atime.atime);
+        attrs.atime = sattr.atime.atime, attrs.fields |= KV_INODE_ATIME;
     if (sattr.mtime.set_it)
-        attrobj["mtime"] = nfstime_to_str(sattr.mtime.mtime);
+        attrs.mtime = sattr.mtime.mtime, attrs.fields |= KV_INODE_MTIME;
 }
 
 template<class T, class Tok> static void kv_create_reply(kv_create_state *st, int res)
@@ -284,15 +300,16 @@ int kv_nfs3_create_proc(void *opaque, rpc_op_t *rop)
     st->filename = args->where.name;
     if (args->how.mode == NFS_EXCLUSIVE)
     {
-        st->attrobj["verf"] = *(uint64_t*)&args->how.verf;
+        st->attrs.verf = *(uint64_t*)&args->how.verf;
+        st->attrs.fields |= KV_INODE_VERF;
     }
     else if (args->how.mode == NFS_UNCHECKED)
     {
-        kv_create_setattr(st->attrobj, args->how.obj_attributes);
+        kv_create_setattr(st->attrs, args->how.obj_attributes);
         if (args->how.obj_attributes.size.set_it)
         {
-            st->attrobj["size"] = (uint64_t)args->how.obj_attributes.size.size;
-            st->attrobj["empty"] = true;
+            st->attrs.size = args->how.obj_attributes.size.size;
+            st->attrs.fields |= KV_INODE_SIZE | KV_INODE_EMPTY;
         }
     }
     st->cb = [st](int res) { kv_create_reply<CREATE3res, CREATE3resok>(st, res); };
@@ -308,9 +325,10 @@ int kv_nfs3_mkdir_proc(void *opaque, rpc_op_t *rop)
     auto args = (MKDIR3args*)rop->request;
     st->dir_ino = kv_fh_inode(args->where.dir);
     st->filename = args->where.name;
-    st->attrobj["type"] = "dir";
-    st->attrobj["parent_ino"] = st->dir_ino;
-    kv_create_setattr(st->attrobj, args->attributes);
+    st->attrs.type = NF3DIR;
+    st->attrs.parent_ino = st->dir_ino;
+    st->attrs.fields |= KV_INODE_TYPE | KV_INODE_PARENT;
+    kv_create_setattr(st->attrs, args->attributes);
     st->cb = [st](int res) { kv_create_reply<MKDIR3res, MKDIR3resok>(st, res); };
     kv_continue_create(st, 0);
     return 1;
@@ -324,9 +342,10 @@ int kv_nfs3_symlink_proc(void *opaque, rpc_op_t *rop)
     auto args = (SYMLINK3args*)rop->request;
     st->dir_ino = kv_fh_inode(args->where.dir);
     st->filename = args->where.name;
-    st->attrobj["type"] = "link";
-    st->attrobj["symlink"] = (std::string)args->symlink.symlink_data;
-    kv_create_setattr(st->attrobj, args->symlink.symlink_attributes);
+    st->attrs.type = NF3LNK;
+    st->attrs.fields |= KV_INODE_TYPE;
+    st->attrs.set_symlink(args->symlink.symlink_data);
+    kv_create_setattr(st->attrs, args->symlink.symlink_attributes);
     st->cb = [st](int res) { kv_create_reply<SYMLINK3res, SYMLINK3resok>(st, res); };
     kv_continue_create(st, 0);
     return 1;
@@ -342,15 +361,17 @@ int kv_nfs3_mknod_proc(void *opaque, rpc_op_t *rop)
     st->filename = args->where.name;
     if (args->what.type == NF3CHR || args->what.type == NF3BLK)
     {
-        st->attrobj["type"] = (args->what.type == NF3CHR ? "chr" : "blk");
-        st->attrobj["major"] = (uint64_t)args->what.chr_device.spec.specdata1;
-        st->attrobj["minor"] = (uint64_t)args->what.chr_device.spec.specdata2;
-        kv_create_setattr(st->attrobj, args->what.chr_device.dev_attributes);
+        st->attrs.type = args->what.type;
+        st->attrs.major = args->what.chr_device.spec.specdata1;
+        st->attrs.minor = args->what.chr_device.spec.specdata2;
+        st->attrs.fields |= KV_INODE_TYPE | KV_INODE_RDEV;
+        kv_create_setattr(st->attrs, args->what.chr_device.dev_attributes);
     }
     else if (args->what.type == NF3SOCK || args->what.type == NF3FIFO)
     {
-        st->attrobj["type"] = (args->what.type == NF3SOCK ? "sock" : "fifo");
-        kv_create_setattr(st->attrobj, args->what.sock_attributes);
+        st->attrs.type = args->what.type;
+        st->attrs.fields |= KV_INODE_TYPE;
+        kv_create_setattr(st->attrs, args->what.sock_attributes);
     }
     else
     {
@@ -10,7 +10,7 @@
 
 // Attributes are always stored in the inode
 void kv_read_inode(nfs_proxy_t *proxy, uint64_t ino,
-    std::function<void(int res, const std::string & value, json11::Json ientry)> cb,
+    std::function<void(int res, const std::string & value, const kv_inode_t & ientry)> cb,
     bool allow_cache)
 {
     auto key = kv_inode_key(ino);
@@ -19,21 +19,24 @@ void kv_read_inode(nfs_proxy_t *proxy, uint64_t ino,
         if (ino == KV_ROOT_INODE && res == -ENOENT)
         {
             // Allow root inode to not exist
-            cb(0, "", json11::Json(json11::Json::object{ { "type", "dir" } }));
+            kv_inode_t root;
+            root.type = NF3DIR;
+            root.fields = KV_INODE_TYPE;
+            cb(0, "", root);
             return;
         }
         if (res < 0)
         {
             if (res != -ENOENT)
                 fprintf(stderr, "Error reading inode %s: %s (code %d)\n", kv_inode_key(ino).c_str(), strerror(-res), res);
-            cb(res, "", json11::Json());
+            cb(res, "", kv_inode_t());
             return;
         }
         std::string err;
-        auto attrs = json11::Json::parse(value, err);
-        if (err != "")
+        kv_inode_t attrs;
+        if (!attrs.decode(value, err))
         {
-            fprintf(stderr, "Invalid JSON in inode %s = %s: %s\n", kv_inode_key(ino).c_str(), value.c_str(), err.c_str());
+            fprintf(stderr, "Invalid inode %s: %s\n", kv_inode_key(ino).c_str(), err.c_str());
             res = -EIO;
         }
         cb(res, value, attrs);
@@ -55,10 +58,12 @@ int kv_nfs3_getattr_proc(void *opaque, rpc_op_t *rop)
         rpc_queue_reply(rop);
         return 0;
     }
-    kv_read_inode(self->parent, ino, [=](int res, const std::string & value, json11::Json attrs)
+    // GETATTR is used by clients to revalidate files on open, so with close-to-open
+    // consistency it always re-reads the inode
+    kv_read_inode_cached(self->parent, ino, [=](int res, const std::string & value, const kv_inode_t & attrs)
     {
         if (self->parent->trace)
-            fprintf(stderr, "[%d] GETATTR %ju -> %s\n", self->nfs_fd, ino, value.c_str());
+            fprintf(stderr, "[%d] GETATTR %ju -> %s\n", self->nfs_fd, ino, attrs.to_json().dump().c_str());
         if (res < 0)
         {
             *reply = (GETATTR3res){ .status = vitastor_nfs_map_err(-res) };
@@ -73,6 +78,6 @@ int kv_nfs3_getattr_proc(void *opaque, rpc_op_t *rop)
             };
         }
         rpc_queue_reply(rop);
-    });
+    }, self->parent->kvfs->close_to_open);
     return 1;
 }
@@ -0,0 +1,415 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+//
+// NFS proxy over VitastorKV database - inode record format
+
+#include <string.h>
+
+#include "str_util.h"
+#include "nfs_proxy.h"
+#include "nfs_kv.h"
+
+// Fixed field sizes, in the order of field bits
+static const struct
+{
+    uint32_t field;
+    unsigned size;
+} kv_inode_layout[] = {
+    { KV_INODE_TYPE, 1 },
+    { KV_INODE_MODE, 4 },
+    { KV_INODE_NLINK, 4 },
+    { KV_INODE_UID, 4 },
+    { KV_INODE_GID, 4 },
+    { KV_INODE_SIZE, 8 },
+    { KV_INODE_MTIME, 8 },
+    { KV_INODE_ATIME, 8 },
+    { KV_INODE_CTIME, 8 },
+    { KV_INODE_RDEV, 8 },
+    { KV_INODE_PARENT, 8 },
+    { KV_INODE_VERF, 8 },
+    { KV_INODE_SHARED, 24 },
+    { KV_INODE_SHARED_VER, 8 },
+    { KV_INODE_EMPTY, 0 },
+};
+
+#define KV_INODE_HEADER_SIZE 6
+#define KV_INODE_KNOWN_FIELDS (2*KV_INODE_EXT-1)
+
+int kv_inode_t::file_type() const
+{
+    if (!has(KV_INODE_TYPE) || !type)
+        return NF3REG;
+    return type <= NF3FIFO ? type : -1;
+}
+
+static bool next_ext_entry(const std::string & ext, size_t & pos, uint8_t & tag, size_t & start, size_t & len)
+{
+    if (pos+5 > ext.size())
+        return false;
+    uint32_t l;
+    tag = ext[pos];
+    memcpy(&l, ext.data()+pos+1, 4);
+    if (pos+5+l > ext.size())
+        return false;
+    start = pos+5;
+    len = l;
+    pos = start+len;
+    return true;
+}
+
+static std::string get_ext_entry(const std::string & ext, uint8_t want_tag)
+{
+    size_t pos = 0, start, len;
+    uint8_t tag;
+    while (next_ext_entry(ext, pos, tag, start, len))
+    {
+        if (tag == want_tag)
+            return ext.substr(start, len);
+    }
+    return "";
+}
+
+static void set_ext_entry(std::string & ext, uint8_t set_tag, const std::string & data)
+{
+    std::string new_ext;
+    size_t pos = 0, start, len;
+    uint8_t tag;
+    while (next_ext_entry(ext, pos, tag, start, len))
+    {
+        if (tag != set_tag)
+            new_ext.append(ext, start-5, len+5);
+    }
+    if (data.size())
+    {
+        uint32_t l = data.size();
+        new_ext.push_back((char)set_tag);
+        new_ext.append((char*)&l, 4);
+        new_ext.append(data);
+    }
+    ext = std::move(new_ext);
+}
+
+std::string kv_inode_t::get_symlink() const
+{
+    return ext.size() ? get_ext_entry(ext, KV_INODE_EXT_SYMLINK) : "";
+}
+
+void kv_inode_t::set_symlink(const std::string & target)
+{
+    set_ext_entry(ext, KV_INODE_EXT_SYMLINK, target);
+}
+
+bool kv_inode_t::get_dentry(uint64_t & dir_ino, std::string & name) const
+{
+    std::string data = ext.size() ? get_ext_entry(ext, KV_INODE_EXT_DENTRY) : "";
+    if (data.size() < 8)
+        return false;
+    memcpy(&dir_ino, data.data(), 8);
+    name = data.substr(8);
+    return true;
+}
+
+void kv_inode_t::set_dentry(uint64_t dir_ino, const std::string & name)
+{
+    std::string data;
+    if (name.size())
+    {
+        data.append((char*)&dir_ino, 8);
+        data.append(name);
+    }
+    set_ext_entry(ext, KV_INODE_EXT_DENTRY, data);
+}
+
+json11::Json::object kv_inode_t::get_extra() const
+{
+    if (!ext.size())
+        return json11::Json::object();
+    std::string err;
+    return json11::Json::parse(get_ext_entry(ext, KV_INODE_EXT_JSON), err).object_items();
+}
+
+void kv_inode_t::update(const kv_inode_t & src)
+{
+    if (src.has(KV_INODE_TYPE))
+        type = src.type;
+    if (src.has(KV_INODE_MODE))
+        mode = src.mode;
+    if (src.has(KV_INODE_NLINK))
+        nlink = src.nlink;
+    if (src.has(KV_INODE_UID))
+        uid = src.uid;
+    if (src.has(KV_INODE_GID))
+        gid = src.gid;
+    if (src.has(KV_INODE_SIZE))
+        size = src.size;
+    if (src.has(KV_INODE_MTIME))
+        mtime = src.mtime;
+    if (src.has(KV_INODE_ATIME))
+        atime = src.atime;
+    if (src.has(KV_INODE_CTIME))
+        ctime = src.ctime;
+    if (src.has(KV_INODE_RDEV))
+        major = src.major, minor = src.minor;
+    if (src.has(KV_INODE_PARENT))
+        parent_ino = src.parent_ino;
+    if (src.has(KV_INODE_VERF))
+        verf = src.verf;
+    if (src.has(KV_INODE_SHARED))
+        shared_ino = src.shared_ino, shared_offset = src.shared_offset, shared_alloc = src.shared_alloc;
+    if (src.has(KV_INODE_SHARED_VER))
+        shared_ver = src.shared_ver;
+    fields |= (src.fields & ~KV_INODE_EXT);
+}
+
+static void put_time(uint8_t *p, nfstime3 t)
+{
+    memcpy(p, &t.seconds, 4);
+    memcpy(p+4, &t.nseconds, 4);
+}
+
+static nfstime3 get_time(const uint8_t *p)
+{
+    nfstime3 t;
+    memcpy(&t.seconds, p, 4);
+    memcpy(&t.nseconds, p+4, 4);
+    return t;
+}
+
+std::string kv_inode_t::encode() const
+{
+    uint32_t enc_fields = (fields & ~KV_INODE_EXT) | (ext.size() ? KV_INODE_EXT : 0);
+    uint8_t buf[KV_INODE_HEADER_SIZE + 128];
+    buf[0] = KV_INODE_MAGIC;
+    buf[1] = KV_INODE_VERSION;
+    memcpy(buf+2, &enc_fields, 4);
+    uint8_t *p = buf+KV_INODE_HEADER_SIZE;
+    if (enc_fields & KV_INODE_TYPE)
+        *p++ = type;
+    if (enc_fields & KV_INODE_MODE)
+        memcpy(p, &mode, 4), p += 4;
+    if (enc_fields & KV_INODE_NLINK)
+        memcpy(p, &nlink, 4), p += 4;
+    if (enc_fields & KV_INODE_UID)
+        memcpy(p, &uid, 4), p += 4;
+    if (enc_fields & KV_INODE_GID)
+        memcpy(p, &gid, 4), p += 4;
+    if (enc_fields & KV_INODE_SIZE)
+        memcpy(p, &size, 8), p += 8;
+    if (enc_fields & KV_INODE_MTIME)
+        put_time(p, mtime), p += 8;
+    if (enc_fields & KV_INODE_ATIME)
+        put_time(p, atime), p += 8;
+    if (enc_fields & KV_INODE_CTIME)
+        put_time(p, ctime), p += 8;
+    if (enc_fields & KV_INODE_RDEV)
+        memcpy(p, &major, 4), memcpy(p+4, &minor, 4), p += 8;
+    if (enc_fields & KV_INODE_PARENT)
+        memcpy(p, &parent_ino, 8), p += 8;
+    if (enc_fields & KV_INODE_VERF)
+        memcpy(p, &verf, 8), p += 8;
+    if (enc_fields & KV_INODE_SHARED)
+        memcpy(p, &shared_ino, 8), memcpy(p+8, &shared_offset, 8), memcpy(p+16, &shared_alloc, 8), p += 24;
+    if (enc_fields & KV_INODE_SHARED_VER)
+        memcpy(p, &shared_ver, 8), p += 8;
+    std::string res((char*)buf, p-buf);
+    if (ext.size())
+        res.append(ext);
+    return res;
+}
+
+std::string kv_inode_t::encode_attrs() const
+{
+    kv_inode_t attrs = *this;
+    attrs.ext = "";
+    return base64_encode(attrs.encode());
+}
+
+static bool decode_json_inode(kv_inode_t & ientry, const std::string & value, std::string & err)
+{
+    auto attrs = json11::Json::parse(value, err);
+    if (err != "")
+        return false;
+    ientry = kv_inode_t();
+    json11::Json::object extra;
+    for (auto & kv: attrs.object_items())
+    {
+        auto & k = kv.first;
+        auto & v = kv.second;
+        if (k == "type")
+        {
+            int type = kv_map_type(v.string_value());
+            if (type == NF3REG && v.string_value() == "")
+                continue;
+            ientry.type = (type > 0 ? type : (v.string_value() == "shared" ? KV_INODE_TYPE_SHARED : KV_INODE_TYPE_UNKNOWN));
+            ientry.fields |= KV_INODE_TYPE;
+            if (ientry.type == KV_INODE_TYPE_UNKNOWN)
+                extra[k] = v;
+        }
+        else if (k == "mode")
+            ientry.mode = v.uint64_value(), ientry.fields |= KV_INODE_MODE;
+        else if (k == "nlink")
+            ientry.nlink = v.uint64_value(), ientry.fields |= KV_INODE_NLINK;
+        else if (k == "uid")
+            ientry.uid = v.uint64_value(), ientry.fields |= KV_INODE_UID;
+        else if (k == "gid")
+            ientry.gid = v.uint64_value(), ientry.fields |= KV_INODE_GID;
+        else if (k == "size")
+            ientry.size = v.uint64_value(), ientry.fields |= KV_INODE_SIZE;
+        else if (k == "mtime")
+            ientry.mtime = nfstime_from_str(v.string_value()), ientry.fields |= KV_INODE_MTIME;
+        else if (k == "atime")
+            ientry.atime = nfstime_from_str(v.string_value()), ientry.fields |= KV_INODE_ATIME;
+        else if (k == "ctime")
+            ientry.ctime = nfstime_from_str(v.string_value()), ientry.fields |= KV_INODE_CTIME;
+        else if (k == "major")
+            ientry.major = v.uint64_value(), ientry.fields |= KV_INODE_RDEV;
+        else if (k == "minor")
+            ientry.minor = v.uint64_value(), ientry.fields |= KV_INODE_RDEV;
+        else if (k == "parent_ino")
+            ientry.parent_ino = v.uint64_value(), ientry.fields |= KV_INODE_PARENT;
+        else if (k == "verf")
+            ientry.verf = v.uint64_value(), ientry.fields |= KV_INODE_VERF;
+        else if (k == "shared_ino")
+            ientry.shared_ino = v.uint64_value(), ientry.fields |= KV_INODE_SHARED;
+        else if (k == "shared_offset")
+            ientry.shared_offset = v.uint64_value(), ientry.fields |= KV_INODE_SHARED;
+        else if (k == "shared_alloc")
+            ientry.shared_alloc = v.uint64_value(), ientry.fields |= KV_INODE_SHARED;
+        else if (k == "shared_ver")
+            ientry.shared_ver = v.uint64_value(), ientry.fields |= KV_INODE_SHARED_VER;
+        else if (k == "empty")
+        {
+            if (v.bool_value())
+                ientry.fields |= KV_INODE_EMPTY;
+        }
+        else if (k == "symlink")
+            ientry.set_symlink(v.string_value());
+        else
+            extra[k] = v;
+    }
+    if (extra.size())
+        set_ext_entry(ientry.ext, KV_INODE_EXT_JSON, json11::Json(extra).dump());
+    return true;
+}
+
+bool kv_inode_t::decode(const std::string & value, std::string & err)
+{
+    if (value.size() && value[0] == '{')
+        return decode_json_inode(*this, value, err);
+    const uint8_t *p = (const uint8_t*)value.data();
+    const uint8_t *end = p+value.size();
+    uint32_t enc_fields;
+    if (value.size() < KV_INODE_HEADER_SIZE || p[0] != KV_INODE_MAGIC)
+    {
+        err = "invalid inode record";
+        return false;
+    }
+    if (p[1] > KV_INODE_VERSION)
+    {
+        err = "unsupported inode record version "+std::to_string(p[1]);
+        return false;
+    }
+    memcpy(&enc_fields, p+2, 4);
+    if (enc_fields & ~KV_INODE_KNOWN_FIELDS)
+    {
+        err = "unknown inode record fields";
+        return false;
+    }
+    unsigned need = KV_INODE_HEADER_SIZE;
+    for (auto & f: kv_inode_layout)
+    {
+        if (enc_fields & f.field)
+            need += f.size;
+    }
+    if (value.size() < need)
+    {
+        err = "inode record is too short";
+        return false;
+    }
+    *this = kv_inode_t();
+    fields = enc_fields & ~KV_INODE_EXT;
+    p += KV_INODE_HEADER_SIZE;
+    if (enc_fields & KV_INODE_TYPE)
+        type = *p++;
+    if (enc_fields & KV_INODE_MODE)
+        memcpy(&mode, p, 4), p += 4;
+    if (enc_fields & KV_INODE_NLINK)
+        memcpy(&nlink, p, 4), p += 4;
+    if (enc_fields & KV_INODE_UID)
+        memcpy(&uid, p, 4), p += 4;
+    if (enc_fields & KV_INODE_GID)
+        memcpy(&gid, p, 4), p += 4;
+    if (enc_fields & KV_INODE_SIZE)
+        memcpy(&size, p, 8), p += 8;
+    if (enc_fields & KV_INODE_MTIME)
+        mtime = get_time(p), p += 8;
+    if (enc_fields & KV_INODE_ATIME)
+        atime = get_time(p), p += 8;
+    if (enc_fields & KV_INODE_CTIME)
+        ctime = get_time(p), p += 8;
+    if (enc_fields & KV_INODE_RDEV)
+        memcpy(&major, p, 4), memcpy(&minor, p+4, 4), p += 8;
+    if (enc_fields & KV_INODE_PARENT)
+        memcpy(&parent_ino, p, 8), p += 8;
+    if (enc_fields & KV_INODE_VERF)
+        memcpy(&verf, p, 8), p += 8;
+    if (enc_fields & KV_INODE_SHARED)
+        memcpy(&shared_ino, p, 8), memcpy(&shared_offset, p+8, 8), memcpy(&shared_alloc, p+16, 8), p += 24;
+    if (enc_fields & KV_INODE_SHARED_VER)
+        memcpy(&shared_ver, p, 8), p += 8;
+    if ((enc_fields & KV_INODE_EXT) && p < end)
+        ext.assign((const char*)p, end-p);
+    return true;
+}
+
+json11::Json kv_inode_t::to_json() const
+{
+    static const char *type_names[] = { "", "file", "dir", "blk", "chr", "link", "sock", "fifo" };
+    json11::Json::object res = get_extra();
+    if (has(KV_INODE_TYPE))
+    {
+        if (type <= NF3FIFO)
+            res["type"] = type_names[type];
+        else if (type == KV_INODE_TYPE_SHARED)
+            res["type"] = "shared";
+    }
+    if (has(KV_INODE_MODE))
+        res["mode"] = (uint64_t)mode;
+    if (has(KV_INODE_NLINK))
+        res["nlink"] = (uint64_t)nlink;
+    if (has(KV_INODE_UID))
+        res["uid"] = (uint64_t)uid;
+    if (has(KV_INODE_GID))
+        res["gid"] = (uint64_t)gid;
+    if (has(KV_INODE_SIZE))
+        res["size"] = size;
+    if (has(KV_INODE_MTIME))
+        res["mtime"] = nfstime_to_str(mtime);
+    if (has(KV_INODE_ATIME))
+        res["atime"] = nfstime_to_str(atime);
+    if (has(KV_INODE_CTIME))
+        res["ctime"] = nfstime_to_str(ctime);
+    if (has(KV_INODE_RDEV))
+    {
+        res["major"] = (uint64_t)major;
+        res["minor"] = (uint64_t)minor;
+    }
+    if (has(KV_INODE_PARENT))
+        res["parent_ino"] = parent_ino;
+    if (has(KV_INODE_VERF))
+        res["verf"] = verf;
+    if (has(KV_INODE_SHARED))
+    {
+        res["shared_ino"] = shared_ino;
+        res["shared_offset"] = shared_offset;
+        res["shared_alloc"] = shared_alloc;
+    }
+    if (has(KV_INODE_SHARED_VER))
+        res["shared_ver"] = shared_ver;
+    if (has(KV_INODE_EMPTY))
+        res["empty"] = true;
+    auto symlink = get_symlink();
+    if (symlink != "")
+        res["symlink"] = symlink;
+    return res;
+}
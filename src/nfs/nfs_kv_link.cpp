@@ -16,7 +16,7 @@ struct nfs_kv_link_state
     uint64_t dir_ino = 0;
     std::string filename;
     std::string ientry_text;
-    json11::Json ientry;
+    kv_inode_t ientry;
     bool retrying = false;
     int wait = 0;
     int res = 0, res2 = 0;
@@ -47,9 +47,9 @@ resume_0:
     // Check that the source inode exists and is not a directory
     st->wait = st->retrying ? 1 : 2;
     st->res2 = 0;
-    kv_read_inode(st->self->parent, st->ino, [st](int res, const std::string & value, json11::Json attrs)
+    kv_read_inode(st->self->parent, st->ino, [st](int res, const std::string & value, const kv_inode_t & attrs)
     {
-        st->res = res == 0 ? (attrs["type"].string_value() == "dir" ? -EISDIR : 0) : res;
+        st->res = res == 0 ? (attrs.file_type() == NF3DIR ? -EISDIR : 0) : res;
         st->ientry_text = value;
         st->ientry = attrs;
         if (!--st->wait)
@@ -58,9 +58,9 @@ resume_0:
     if (!st->retrying)
     {
         // Check that the new directory exists
-        kv_read_inode(st->self->parent, st->dir_ino, [st](int res, const std::string & value, json11::Json attrs)
+        kv_read_inode(st->self->parent, st->dir_ino, [st](int res, const std::string & value, const kv_inode_t & attrs)
         {
-            st->res2 = res == 0 ? (attrs["type"].string_value() == "dir" ? 0 : -ENOTDIR) : res;
+            st->res2 = res == 0 ? (attrs.file_type() == NF3DIR ? 0 : -ENOTDIR) : res;
             if (!--st->wait)
                 nfs_kv_continue_link(st, 1);
         });
@@ -76,7 +76,7 @@ resume_1:
     // Write the new direntry
     if (!st->retrying)
     {
-        st->self->parent->db->set(kv_direntry_key(st->dir_ino, st->filename),
+        kv_db_set(st->self->parent, kv_direntry_key(st->dir_ino, st->filename),
             json11::Json(json11::Json::object{ { "ino", st->ino } }).dump(), [st](int res)
         {
             st->res = res;
@@ -95,14 +95,10 @@ resume_2:
         }
     }
     // Increase inode refcount
-    {
-        auto new_ientry = st->ientry.object_items();
-        auto nlink = new_ientry["nlink"].uint64_value();
-        new_ientry["nlink"] = nlink ? nlink+1 : 2;
-        new_ientry["ctime"] = nfstime_now_str();
-        st->ientry = new_ientry;
-    }
-    st->self->parent->db->set(kv_inode_key(st->ino), st->ientry.dump(), [st](int res)
+    st->ientry.nlink = st->ientry.nlink ? st->ientry.nlink+1 : 2;
+    st->ientry.ctime = nfstime_now();
+    st->ientry.fields |= KV_INODE_NLINK | KV_INODE_CTIME;
+    kv_db_set(st->self->parent, kv_inode_key(st->ino), st->ientry.encode(), [st](int res)
     {
         st->res = res;
         nfs_kv_continue_link(st, 3);
@@ -126,7 +122,7 @@ resume_3:
     if (st->res < 0)
     {
         // Maybe inode was deleted in the meantime, delete our direntry
-        st->self->parent->db->del(kv_direntry_key(st->dir_ino, st->filename), [st](int res)
+        kv_db_del(st->self->parent, kv_direntry_key(st->dir_ino, st->filename), [st](int res)
         {
             st->res2 = res;
             nfs_kv_continue_link(st, 4);
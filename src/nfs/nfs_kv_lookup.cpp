@@ -23,7 +23,7 @@ int kv_nfs3_lookup_proc(void *opaque, rpc_op_t *rop)
         rpc_queue_reply(rop);
         return 0;
     }
-    self->parent->db->get(kv_direntry_key(dir_ino, filename), [=](int res, const std::string & value)
+    kv_read_direntry_cached(self->parent, dir_ino, filename, [=](int res, const std::string & value)
     {
         if (res < 0)
         {
@@ -41,7 +41,7 @@ int kv_nfs3_lookup_proc(void *opaque, rpc_op_t *rop)
             return;
         }
         uint64_t ino = direntry["ino"].uint64_value();
-        kv_read_inode(self->parent, ino, [=](int res, const std::string & value, json11::Json ientry)
+        kv_read_inode_cached(self->parent, ino, [=](int res, const std::string & value, const kv_inode_t & ientry)
         {
             if (res < 0)
             {
@@ -60,7 +60,7 @@ int kv_nfs3_lookup_proc(void *opaque, rpc_op_t *rop)
                 },
             };
             rpc_queue_reply(rop);
-        });
+        }, self->parent->kvfs->close_to_open);
     });
     return 1;
 }
@@ -79,13 +79,13 @@ int kv_nfs3_readlink_proc(void *opaque, rpc_op_t *rop)
         rpc_queue_reply(rop);
         return 0;
     }
-    kv_read_inode(self->parent, kv_fh_inode(args->symlink), [=](int res, const std::string & value, json11::Json attrs)
+    kv_read_inode_cached(self->parent, kv_fh_inode(args->symlink), [=](int res, const std::string & value, const kv_inode_t & attrs)
     {
         if (res < 0)
         {
             *reply = (READLINK3res){ .status = vitastor_nfs_map_err(-res) };
         }
-        else if (attrs["type"] != "link")
+        else if (attrs.file_type() != NF3LNK)
         {
             *reply = (READLINK3res){ .status = NFS3ERR_INVAL };
         }
@@ -94,7 +94,7 @@ int kv_nfs3_readlink_proc(void *opaque, rpc_op_t *rop)
             *reply = (READLINK3res){
                 .status = NFS3_OK,
                 .resok = (READLINK3resok){
-                    .data = xdr_copy_string(rop->xdrs, attrs["symlink"].string_value()),
+                    .data = xdr_copy_string(rop->xdrs, attrs.get_symlink()),
                 },
             };
         }
@@ -19,7 +19,7 @@ struct nfs_kv_read_state
     // state
     int res = 0;
     int eof = 0;
-    json11::Json ientry;
+    kv_inode_t ientry;
     uint64_t aligned_size = 0, aligned_offset = 0;
     uint8_t *aligned_buf = NULL;
     cluster_op_t *op = NULL;
@@ -29,6 +29,108 @@ struct nfs_kv_read_state
 #define align_down(size) ((size) & ~(st->self->parent->kvfs->pool_alignment-1))
 #define align_up(size) (((size) + st->self->parent->kvfs->pool_alignment-1) & ~(st->self->parent->kvfs->pool_alignment-1))
 
+static uint64_t shared_cache_now_ms()
+{
+    timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec*1000 + tv.tv_nsec/1000000;
+}
+
+void kv_shared_cache_invalidate(kv_fs_state_t *kvfs, inode_t ino, uint64_t offset, uint64_t len)
+{
+    if (!kvfs->shared_read_cache_size || !len)
+    {
+        return;
+    }
+    // Loads started before the invalidation don't fill the cache
+    kvfs->shared_blocks_gen++;
+    auto it = kvfs->shared_blocks.lower_bound({ ino, offset - offset % kvfs->pool_block_size });
+    while (it != kvfs->shared_blocks.end() && it->first.first == ino && it->first.second < offset+len)
+    {
+        kvfs->shared_blocks.erase(it++);
+    }
+}
+
+static void kv_shared_cache_put(kv_fs_state_t *kvfs, std::pair<inode_t, uint64_t> key, std::vector<uint8_t> & data)
+{
+    auto now = shared_cache_now_ms();
+    if (kvfs->shared_blocks.size() >= kvfs->shared_read_cache_size)
+    {
+        // Evict expired blocks, then the oldest one if still full
+        auto oldest = kvfs->shared_blocks.end();
+        for (auto it = kvfs->shared_blocks.begin(); it != kvfs->shared_blocks.end(); )
+        {
+            if (now - it->second.loaded_ms >= kvfs->shared_read_cache_time)
+                kvfs->shared_blocks.erase(it++);
+            else
+            {
+                if (oldest == kvfs->shared_blocks.end() || oldest->second.loaded_ms > it->second.loaded_ms)
+                    oldest = it;
+                it++;
+            }
+        }
+        if (kvfs->shared_blocks.size() >= kvfs->shared_read_cache_size)
+            kvfs->shared_blocks.erase(oldest);
+    }
+    auto & blk = kvfs->shared_blocks[key];
+    blk.data.swap(data);
+    blk.loaded_ms = now;
+}
+
+// Read a whole block of a shared inode, from the cache if <allow_cache> and it's fresh enough.
+// Concurrent loads of the same block are merged.
+static void kv_shared_cache_read(nfs_proxy_t *proxy, inode_t ino, uint64_t block_offset, bool allow_cache,
+    std::function<void(int res, const uint8_t *data)> cb)
+{
+    auto kvfs = proxy->kvfs;
+    std::pair<inode_t, uint64_t> key = { ino, block_offset };
+    if (allow_cache)
+    {
+        auto blk_it = kvfs->shared_blocks.find(key);
+        if (blk_it != kvfs->shared_blocks.end() &&
+            shared_cache_now_ms() - blk_it->second.loaded_ms < kvfs->shared_read_cache_time)
+        {
+            kvfs->cache_stats.shared_hits++;
+            cb(0, blk_it->second.data.data());
+            return;
+        }
+        auto load_it = kvfs->shared_loading.find(key);
+        if (load_it != kvfs->shared_loading.end() && load_it->second->gen == kvfs->shared_blocks_gen)
+        {
+            kvfs->cache_stats.shared_hits++;
+            load_it->second->waiters.push_back(cb);
+            return;
+        }
+    }
+    kvfs->cache_stats.shared_misses++;
+    auto load = std::make_shared<kv_shared_load_t>();
+    load->gen = kvfs->shared_blocks_gen;
+    load->data.resize(kvfs->pool_block_size);
+    load->waiters.push_back(cb);
+    kvfs->shared_loading[key] = load;
+    auto op = new cluster_op_t;
+    op->opcode = OSD_OP_READ;
+    op->inode = ino;
+    op->offset = block_offset;
+    op->len = kvfs->pool_block_size;
+    op->iov.push_back(load->data.data(), op->len);
+    op->callback = [proxy, key, load](cluster_op_t *op)
+    {
+        auto kvfs = proxy->kvfs;
+        int res = op->retval == op->len ? 0 : (op->retval >= 0 ? -EIO : op->retval);
+        delete op;
+        auto load_it = kvfs->shared_loading.find(key);
+        if (load_it != kvfs->shared_loading.end() && load_it->second == load)
+            kvfs->shared_loading.erase(load_it);
+        auto waiters = std::move(load->waiters);
+        for (auto & w: waiters)
+            w(res, load->data.data());
+        if (res == 0 && load->gen == kvfs->shared_blocks_gen)
+            kv_shared_cache_put(kvfs, key, load->data);
+    };
+    proxy->execute_io(op);
+}
+
 static void nfs_kv_continue_read(nfs_kv_read_state *st, int state)
 {
     if (state == 0)      {}
@@ -43,7 +145,7 @@ static void nfs_kv_continue_read(nfs_kv_read_state *st, int state)
 resume_0:
     if (st->offset + sizeof(shared_file_header_t) < st->self->parent->kvfs->shared_inode_threshold)
     {
-        kv_read_inode(st->self->parent, st->ino, [st](int res, const std::string & value, json11::Json attrs)
+        kv_read_inode(st->self->parent, st->ino, [st](int res, const std::string & value, const kv_inode_t & attrs)
         {
             st->res = res;
             st->ientry = attrs;
@@ -51,15 +153,15 @@ resume_0:
         }, st->allow_cache);
         return;
 resume_1:
-        if (st->res < 0 || kv_map_type(st->ientry["type"].string_value()) != NF3REG)
+        if (st->res < 0 || st->ientry.file_type() != NF3REG)
         {
             auto cb = std::move(st->cb);
             cb(st->res < 0 ? st->res : -EINVAL);
             return;
         }
-        if (st->ientry["shared_ino"].uint64_value() != 0)
+        if (st->ientry.shared_ino != 0)
         {
-            if (st->offset >= st->ientry["size"].uint64_value())
+            if (st->offset >= st->ientry.size)
             {
                 st->size = 0;
                 st->eof = 1;
@@ -67,34 +169,52 @@ resume_1:
                 cb(0);
                 return;
             }
-            st->op = new cluster_op_t;
             {
-                st->op->opcode = OSD_OP_READ;
-                st->op->inode = st->ientry["shared_ino"].uint64_value();
+                auto kvfs = st->self->parent->kvfs;
                 // Always read including header to react if the file was possibly moved away
-                auto read_offset = st->ientry["shared_offset"].uint64_value();
-                st->op->offset = align_down(read_offset);
-                if (st->op->offset < read_offset)
-                {
-                    st->op->iov.push_back(st->self->parent->kvfs->scrap_block.data(),
-                        read_offset-st->op->offset);
-                }
+                auto read_offset = st->ientry.shared_offset;
                 auto read_size = st->offset+st->size;
-                if (read_size > st->ientry["size"].uint64_value())
+                if (read_size > st->ientry.size)
                 {
                     st->eof = 1;
-                    st->size = st->ientry["size"].uint64_value()-st->offset;
-                    read_size = st->ientry["size"].uint64_value();
+                    st->size = st->ientry.size-st->offset;
+                    read_size = st->ientry.size;
                 }
                 read_size += sizeof(shared_file_header_t);
                 assert(!st->aligned_buf);
                 st->aligned_buf = (uint8_t*)malloc_or_die(read_size);
                 st->buf = st->aligned_buf + sizeof(shared_file_header_t) + st->offset;
+                uint64_t block_offset = read_offset - read_offset % kvfs->pool_block_size;
+                if (kvfs->shared_read_cache_size && !kvfs->close_to_open &&
+                    read_offset+read_size <= block_offset+kvfs->pool_block_size)
+                {
+                    // Small files are packed together, so read the whole block and keep it
+                    // for a short time to serve neighbouring files without extra reads.
+                    // The cache is only invalidated by local writes, so it's only used
+                    // without close-to-open consistency, like cached attributes
+                    kv_shared_cache_read(st->self->parent, st->ientry.shared_ino, block_offset, st->allow_cache,
+                        [st, read_offset, read_size, block_offset](int res, const uint8_t *data)
+                    {
+                        st->res = res;
+                        if (res == 0)
+                            memcpy(st->aligned_buf, data + read_offset - block_offset, read_size);
+                        nfs_kv_continue_read(st, 2);
+                    });
+                    return;
+                }
+                st->op = new cluster_op_t;
+                st->op->opcode = OSD_OP_READ;
+                st->op->inode = st->ientry.shared_ino;
+                st->op->offset = align_down(read_offset);
+                if (st->op->offset < read_offset)
+                {
+                    st->op->iov.push_back(kvfs->scrap_block.data(), read_offset-st->op->offset);
+                }
                 st->op->iov.push_back(st->aligned_buf, read_size);
                 st->op->len = align_up(read_offset+read_size) - st->op->offset;
                 if (read_offset+read_size < st->op->offset+st->op->len)
                 {
-                    st->op->iov.push_back(st->self->parent->kvfs->scrap_block.data(),
+                    st->op->iov.push_back(kvfs->scrap_block.data(),
                         st->op->offset+st->op->len - (read_offset+read_size));
                 }
             }
@@ -104,7 +224,7 @@ resume_1:
                 delete op;
                 nfs_kv_continue_read(st, 2);
             };
-            st->self->parent->cli->execute(st->op);
+            st->self->parent->execute_io(st->op);
             return;
 resume_2:
             if (st->res < 0)
@@ -119,6 +239,8 @@ resume_2:
             if (hdr->magic != SHARED_FILE_MAGIC_V1 || hdr->inode != st->ino)
             {
                 // Got unrelated data - retry from the beginning
+                kv_shared_cache_invalidate(st->self->parent->kvfs, st->ientry.shared_ino,
+                    st->ientry.shared_offset, sizeof(shared_file_header_t));
                 free(st->aligned_buf);
                 st->aligned_buf = NULL;
                 st->allow_cache = false;
@@ -146,7 +268,7 @@ resume_2:
         delete op;
         nfs_kv_continue_read(st, 3);
     };
-    st->self->parent->cli->execute(st->op);
+    st->self->parent->execute_io(st->op);
     return;
 resume_3:
     if (st->res < 0)
@@ -5,6 +5,7 @@
 
 #include <sys/time.h>
 
+#include "str_util.h"
 #include "nfs_proxy.h"
 #include "nfs_kv.h"
 
@@ -30,12 +31,13 @@ struct nfs_kv_readdir_state
     void *list_handle;
     uint64_t parent_ino = 0;
     std::string ientry_text, parent_ientry_text;
-    json11::Json ientry, parent_ientry;
+    kv_inode_t ientry, parent_ientry;
     std::string cur_key, cur_value;
     int reply_size = 0;
     int to_skip = 0;
     uint64_t offset = 0;
     int getattr_running = 0, getattr_cur = 0;
+    bool getattr_looping = false;
     // Result:
     bool eof = false;
     //uint64_t cookieverf = 0; // same field
@@ -46,11 +48,22 @@ static void nfs_kv_continue_readdir(nfs_kv_readdir_state *st, int state);
 
 static void kv_getattr_next(nfs_kv_readdir_state *st)
 {
+    // Cached attributes are returned synchronously, don't recurse in that case
+    if (st->getattr_looping)
+    {
+        return;
+    }
+    st->getattr_looping = true;
     while (st->is_plus && st->getattr_cur < st->entries.size() && st->getattr_running < st->self->parent->kvfs->readdir_getattr_parallel)
     {
         auto idx = st->getattr_cur++;
+        if (st->entries[idx].name_attributes.attributes_follow)
+        {
+            // Taken from inline attributes
+            continue;
+        }
         st->getattr_running++;
-        kv_read_inode(st->self->parent, st->entries[idx].fileid, [st, idx](int res, const std::string & value, json11::Json ientry)
+        kv_read_inode_cached(st->self->parent, st->entries[idx].fileid, [st, idx](int res, const std::string & value, const kv_inode_t & ientry)
         {
             if (res == 0)
             {
@@ -61,13 +74,17 @@ static void kv_getattr_next(nfs_kv_readdir_state *st)
                 };
             }
             st->getattr_running--;
-            kv_getattr_next(st);
-            if (st->getattr_running == 0 && !st->list_handle)
+            if (!st->getattr_looping)
             {
-                nfs_kv_continue_readdir(st, 4);
+                kv_getattr_next(st);
+                if (st->getattr_running == 0 && !st->list_handle)
+                {
+                    nfs_kv_continue_readdir(st, 4);
+                }
             }
         });
     }
+    st->getattr_looping = false;
 }
 
 static void nfs_kv_continue_readdir(nfs_kv_readdir_state *st, int state)
@@ -96,7 +113,7 @@ static void nfs_kv_continue_readdir(nfs_kv_readdir_state *st, int state)
     // Add . and ..
     if (st->cookie <= 1)
     {
-        kv_read_inode(st->self->parent, st->dir_ino, [st](int res, const std::string & value, json11::Json ientry)
+        kv_read_inode(st->self->parent, st->dir_ino, [st](int res, const std::string & value, const kv_inode_t & ientry)
         {
             st->res = res;
             st->ientry_text = value;
@@ -135,10 +152,10 @@ resume_1:
             st->entries.push_back(dot);
             st->reply_size += entry_size;
         }
-        st->parent_ino = st->ientry["parent_ino"].uint64_value();
+        st->parent_ino = st->ientry.parent_ino;
         if (st->parent_ino)
         {
-            kv_read_inode(st->self->parent, st->ientry["parent_ino"].uint64_value(), [st](int res, const std::string & value, json11::Json ientry)
+            kv_read_inode(st->self->parent, st->parent_ino, [st](int res, const std::string & value, const kv_inode_t & ientry)
             {
                 st->res = res;
                 st->parent_ientry_text = value;
@@ -288,6 +305,21 @@ resume_3:
                 .handle_follows = 1,
                 .handle = xdr_copy_string(st->rop->xdrs, fh),
             };
+            auto kvfs = st->self->parent->kvfs;
+            if (direntry["attrs"].is_string() &&
+                kvfs->dentry_queue.find(ino) == kvfs->dentry_queue.end() &&
+                kvfs->dentry_flushing.find(ino) == kvfs->dentry_flushing.end())
+            {
+                // Inline attributes are up to date unless they're still waiting to be updated
+                kv_inode_t ientry;
+                if (ientry.decode(base64_decode(direntry["attrs"].string_value()), err))
+                {
+                    entry->name_attributes = (post_op_attr){
+                        .attributes_follow = 1,
+                        .attributes = get_kv_attributes(st->self, ino, ientry),
+                    };
+                }
+            }
             kv_getattr_next(st);
         }
     }
@@ -18,7 +18,8 @@ struct kv_del_state
     uint64_t ino = 0;
     void *list_handle = NULL;
     std::string prefix, list_key, direntry_text, ientry_text;
-    json11::Json direntry, ientry;
+    json11::Json direntry;
+    kv_inode_t ientry;
     int type = 0;
     bool is_rmdir = false;
     bool rm_data = false;
@@ -97,15 +98,15 @@ resume_2:
     }
     {
         std::string err;
-        st->ientry = json11::Json::parse(st->ientry_text, err);
-        if (err != "")
+        if (!st->ientry.decode(st->ientry_text, err))
         {
-            fprintf(stderr, "Invalid JSON in inode %s = %s: %s, treating as a regular file\n",
-                kv_inode_key(st->ino).c_str(), st->ientry_text.c_str(), err.c_str());
+            fprintf(stderr, "Invalid inode %s: %s, treating as a regular file\n",
+                kv_inode_key(st->ino).c_str(), err.c_str());
+            st->ientry = kv_inode_t();
         }
     }
     // (1-2) Check type
-    st->type = kv_map_type(st->ientry["type"].string_value());
+    st->type = st->ientry.file_type();
     if (st->type == -1 || st->is_rmdir != (st->type == NF3DIR))
     {
         auto cb = std::move(st->cb);
@@ -113,7 +114,7 @@ resume_2:
         return;
     }
     // (3) Delete direntry with CAS
-    st->self->parent->db->del(kv_direntry_key(st->dir_ino, st->filename), [st](int res)
+    kv_db_del(st->self->parent, kv_direntry_key(st->dir_ino, st->filename), [st](int res)
     {
         st->res = res;
         nfs_kv_continue_delete(st, 3);
@@ -165,7 +166,7 @@ resume_4:
         else
         {
             // Not OK, restore direntry
-            st->self->parent->db->del(kv_direntry_key(st->dir_ino, st->filename), [st](int res)
+            kv_db_del(st->self->parent, kv_direntry_key(st->dir_ino, st->filename), [st](int res)
             {
                 st->res2 = res;
                 nfs_kv_continue_delete(st, 5);
@@ -192,12 +193,13 @@ resume_5:
         }
     }
     // (5) Reduce inode refcount by 1 or delete inode
-    if (st->ientry["nlink"].uint64_value() > 1)
+    if (st->ientry.nlink > 1)
     {
-        auto copy = st->ientry.object_items();
-        copy["nlink"] = st->ientry["nlink"].uint64_value()-1;
-        copy["ctime"] = nfstime_now_str();
-        st->self->parent->db->set(kv_inode_key(st->ino), json11::Json(copy).dump(), [st](int res)
+        auto copy = st->ientry;
+        copy.nlink--;
+        copy.ctime = nfstime_now();
+        copy.fields |= KV_INODE_CTIME;
+        kv_db_set(st->self->parent, kv_inode_key(st->ino), copy.encode(), [st](int res)
         {
             st->res = res;
             nfs_kv_continue_delete(st, 6);
@@ -209,7 +211,7 @@ resume_5:
     else
     {
         st->self->parent->kvfs->touch_queue.erase(st->ino);
-        st->self->parent->db->del(kv_inode_key(st->ino), [st](int res)
+        kv_db_del(st->self->parent, kv_inode_key(st->ino), [st](int res)
         {
             st->res = res;
             nfs_kv_continue_delete(st, 6);
@@ -228,8 +230,7 @@ resume_6:
         return;
     }
     // (6) If regular file and inode is deleted: delete data
-    if ((!st->type || st->type == NF3REG) && st->ientry["nlink"].uint64_value() <= 1 &&
-        !st->ientry["shared_ino"].uint64_value())
+    if (st->type == NF3REG && st->ientry.nlink <= 1 && !st->ientry.shared_ino)
     {
         // Remove data
         st->self->parent->cmd->loop_and_wait(st->self->parent->cmd->start_rm_data(json11::Json::object {
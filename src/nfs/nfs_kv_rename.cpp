@@ -19,7 +19,8 @@ struct nfs_kv_rename_state
     // state:
     bool allow_cache = true;
     std::string old_direntry_text, old_ientry_text, new_direntry_text, new_ientry_text;
-    json11::Json old_direntry, old_ientry, new_direntry, new_ientry;
+    json11::Json old_direntry, new_direntry;
+    kv_inode_t old_ientry, new_ientry;
     std::string new_dir_prefix;
     void *list_handle = NULL;
     bool new_exists = false;
@@ -31,29 +32,27 @@ struct nfs_kv_rename_state
 static void nfs_kv_continue_rename(nfs_kv_rename_state *st, int state)
 {
     // Algorithm (non-atomic of course):
-    // 1) Read source direntry
-    // 2) Read destination direntry
-    // 3) If destination exists:
-    // 3.1) Check file/folder compatibility (EISDIR/ENOTDIR)
-    // 3.2) Check if destination is empty if it's a folder
-    // 4) If not:
-    // 4.1) Check that the destination directory is actually a directory
-    // 5) Overwrite destination direntry, restart from beginning if CAS failure
-    // 6) Delete source direntry, restart from beginning if CAS failure
-    // 7) If the moved direntry was a regular file:
-    // 7.1) Read inode
-    // 7.2) Delete inode if its link count <= 1
-    // 7.3) Delete inode data if its link count <= 1 and it's a regular non-shared file
-    // 7.4) Reduce link count by 1 if it's > 1
-    // 8) If the moved direntry is a directory:
-    // 8.1) Change parent_ino reference in its inode
+    // 1) Read source and destination direntries
+    // 2) If destination exists:
+    // 2.1) Check file/folder compatibility (EISDIR/ENOTDIR)
+    // 2.2) Check if destination is empty if it's a folder
+    // 3) If not:
+    // 3.1) Check that the destination directory is actually a directory
+    // 4) Overwrite destination direntry and delete source direntry in one batch,
+    //    restart from beginning if CAS failure. This is atomic if both direntries
+    //    are in the same K/V block, which is usually true for renames inside a directory
+    // 5) If the moved direntry was a regular file:
+    // 5.1) Read inode
+    // 5.2) Delete inode if its link count <= 1
+    // 5.3) Delete inode data if its link count <= 1 and it's a regular non-shared file
+    // 5.4) Reduce link count by 1 if it's > 1
+    // 6) If the moved direntry is a directory:
+    // 6.1) Change parent_ino reference in its inode
     if (state == 0)      {}
     else if (state == 1) goto resume_1;
-    else if (state == 2) goto resume_2;
     else if (state == 3) goto resume_3;
     else if (state == 4) goto resume_4;
     else if (state == 5) goto resume_5;
-    else if (state == 6) goto resume_6;
     else if (state == 7) goto resume_7;
     else if (state == 8) goto resume_8;
     else if (state == 9) goto resume_9;
@@ -66,11 +65,16 @@ static void nfs_kv_continue_rename(nfs_kv_rename_state *st, int state)
         abort();
     }
 resume_0:
-    // Read the old direntry
-    st->self->parent->db->get(kv_direntry_key(st->old_dir_ino, st->old_name), [=](int res, const std::string & value)
+    // Read the old and the new direntry
+    st->self->parent->db->multi_get({
+        kv_direntry_key(st->old_dir_ino, st->old_name),
+        kv_direntry_key(st->new_dir_ino, st->new_name),
+    }, [=](int res, std::vector<kv_read_t> & results)
     {
-        st->res = res;
-        st->old_direntry_text = value;
+        st->res = res < 0 ? res : results[0].res;
+        st->res2 = res < 0 ? res : results[1].res;
+        st->old_direntry_text = std::move(results[0].value);
+        st->new_direntry_text = std::move(results[1].value);
         nfs_kv_continue_rename(st, 1);
     }, st->allow_cache);
     return;
@@ -94,15 +98,7 @@ resume_1:
             return;
         }
     }
-    // Read the new direntry
-    st->self->parent->db->get(kv_direntry_key(st->new_dir_ino, st->new_name), [=](int res, const std::string & value)
-    {
-        st->res = res;
-        st->new_direntry_text = value;
-        nfs_kv_continue_rename(st, 2);
-    }, st->allow_cache);
-    return;
-resume_2:
+    st->res = st->res2;
     if (st->res < 0 && st->res != -ENOENT)
     {
         auto cb = std::move(st->cb);
@@ -157,9 +153,9 @@ resume_3:
     else
     {
         // Check that the new directory is actually a directory
-        kv_read_inode(st->self->parent, st->new_dir_ino, [st](int res, const std::string & value, json11::Json attrs)
+        kv_read_inode(st->self->parent, st->new_dir_ino, [st](int res, const std::string & value, const kv_inode_t & attrs)
         {
-            st->res = res == 0 ? (attrs["type"].string_value() == "dir" ? 0 : -ENOTDIR) : res;
+            st->res = res == 0 ? (attrs.file_type() == NF3DIR ? 0 : -ENOTDIR) : res;
             nfs_kv_continue_rename(st, 4);
         });
         return;
@@ -171,40 +167,31 @@ resume_4:
             return;
         }
     }
-    // Write the new direntry
-    st->self->parent->db->set(kv_direntry_key(st->new_dir_ino, st->new_name), st->old_direntry_text, [st](int res)
+    // Write the new direntry and delete the old one
+    kv_db_write_batch(st->self->parent, {
+        (kv_write_t){
+            .key = kv_direntry_key(st->new_dir_ino, st->new_name),
+            .value = st->old_direntry_text,
+            .cas_compare = [st](int res, const std::string & old_value)
+            {
+                return st->new_exists ? (old_value == st->new_direntry_text) : (res == -ENOENT);
+            },
+        },
+        (kv_write_t){
+            .key = kv_direntry_key(st->old_dir_ino, st->old_name),
+            .del = true,
+            .cas_compare = [st](int res, const std::string & old_value)
+            {
+                return res == 0 && old_value == st->old_direntry_text;
+            },
+        },
+    }, [st](int res, const std::vector<int> & results)
     {
         st->res = res;
         nfs_kv_continue_rename(st, 5);
-    }, [st](int res, const std::string & old_value)
-    {
-        return st->new_exists ? (old_value == st->new_direntry_text) : (res == -ENOENT);
     });
     return;
 resume_5:
-    if (st->res == -EAGAIN)
-    {
-        // CAS failure
-        st->allow_cache = false;
-        goto resume_0;
-    }
-    if (st->res < 0)
-    {
-        auto cb = std::move(st->cb);
-        cb(st->res);
-        return;
-    }
-    // Delete the old direntry
-    st->self->parent->db->del(kv_direntry_key(st->old_dir_ino, st->old_name), [st](int res)
-    {
-        st->res = res;
-        nfs_kv_continue_rename(st, 6);
-    }, [=](int res, const std::string & old_value)
-    {
-        return res == 0 && old_value == st->old_direntry_text;
-    });
-    return;
-resume_6:
     if (st->res == -EAGAIN)
     {
         // CAS failure
@@ -222,7 +209,7 @@ resume_7again:
     if (st->new_exists && st->new_direntry["type"].string_value() != "dir")
     {
         // (Maybe) delete old destination file data
-        kv_read_inode(st->self->parent, st->new_direntry["ino"].uint64_value(), [st](int res, const std::string & value, json11::Json attrs)
+        kv_read_inode(st->self->parent, st->new_direntry["ino"].uint64_value(), [st](int res, const std::string & value, const kv_inode_t & attrs)
         {
             st->res = res;
             st->new_ientry_text = value;
@@ -234,13 +221,13 @@ resume_7:
         if (st->res == 0)
         {
             // (5) Reduce inode refcount by 1 or delete inode
-            if (st->new_ientry["nlink"].uint64_value() > 1)
+            if (st->new_ientry.nlink > 1)
             {
-                auto copy = st->new_ientry.object_items();
-                copy["nlink"] = st->new_ientry["nlink"].uint64_value()-1;
-                copy["ctime"] = nfstime_now_str();
-                copy.erase("verf");
-                st->self->parent->db->set(kv_inode_key(st->new_direntry["ino"].uint64_value()), json11::Json(copy).dump(), [st](int res)
+                auto copy = st->new_ientry;
+                copy.nlink--;
+                copy.ctime = nfstime_now();
+                copy.fields = (copy.fields | KV_INODE_CTIME) & ~KV_INODE_VERF;
+                kv_db_set(st->self->parent, kv_inode_key(st->new_direntry["ino"].uint64_value()), copy.encode(), [st](int res)
                 {
                     st->res = res;
                     nfs_kv_continue_rename(st, 8);
@@ -251,9 +238,8 @@ resume_7:
             }
             else
             {
-                st->rm_dest_data = kv_map_type(st->new_ientry["type"].string_value()) == NF3REG
-                    && !st->new_ientry["shared_ino"].uint64_value();
-                st->self->parent->db->del(kv_inode_key(st->new_direntry["ino"].uint64_value()), [st](int res)
+                st->rm_dest_data = st->new_ientry.file_type() == NF3REG && !st->new_ientry.shared_ino;
+                kv_db_del(st->self->parent, kv_inode_key(st->new_direntry["ino"].uint64_value()), [st](int res)
                 {
                     st->res = res;
                     nfs_kv_continue_rename(st, 8);
@@ -303,12 +289,13 @@ resume_9:
             }
         }
     }
-    if (st->old_direntry["type"].string_value() == "dir" && st->new_dir_ino != st->old_dir_ino)
+    if (st->old_direntry["type"].string_value() == "dir" && st->new_dir_ino != st->old_dir_ino ||
+        !st->old_direntry["attrs"].is_null())
     {
-        // Change parent_ino in old ientry
+        // Change parent_ino and the inline attribute direntry reference in old ientry
         st->allow_cache = true;
 resume_10:
-        kv_read_inode(st->self->parent, st->old_direntry["ino"].uint64_value(), [st](int res, const std::string & value, json11::Json ientry)
+        kv_read_inode(st->self->parent, st->old_direntry["ino"].uint64_value(), [st](int res, const std::string & value, const kv_inode_t & ientry)
         {
             st->res = res;
             st->old_ientry_text = value;
@@ -324,11 +311,30 @@ resume_11:
             return;
         }
         {
-            auto ientry_new = st->old_ientry.object_items();
-            ientry_new["parent_ino"] = st->new_dir_ino;
-            ientry_new["ctime"] = nfstime_now_str();
-            ientry_new.erase("verf");
-            st->self->parent->db->set(kv_inode_key(st->old_direntry["ino"].uint64_value()), json11::Json(ientry_new).dump(), [st](int res)
+            auto ientry_new = st->old_ientry;
+            bool changed = false;
+            if (st->old_direntry["type"].string_value() == "dir" && st->new_dir_ino != st->old_dir_ino)
+            {
+                ientry_new.parent_ino = st->new_dir_ino;
+                ientry_new.fields |= KV_INODE_PARENT;
+                changed = true;
+            }
+            uint64_t dentry_dir = 0;
+            std::string dentry_name;
+            if (ientry_new.get_dentry(dentry_dir, dentry_name) &&
+                dentry_dir == st->old_dir_ino && dentry_name == st->old_name)
+            {
+                ientry_new.set_dentry(st->new_dir_ino, st->new_name);
+                changed = true;
+            }
+            if (!changed)
+            {
+                st->res = 0;
+                goto resume_12;
+            }
+            ientry_new.ctime = nfstime_now();
+            ientry_new.fields = (ientry_new.fields | KV_INODE_CTIME) & ~KV_INODE_VERF;
+            kv_db_set(st->self->parent, kv_inode_key(st->old_direntry["ino"].uint64_value()), ientry_new.encode(), [st](int res)
             {
                 st->res = res;
                 nfs_kv_continue_rename(st, 12);
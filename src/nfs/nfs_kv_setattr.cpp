@@ -15,12 +15,13 @@ struct nfs_kv_setattr_state
     rpc_op_t *rop = NULL;
     uint64_t ino = 0;
     uint64_t old_size = 0, new_size = 0;
-    std::string expected_ctime;
-    json11::Json::object set_attrs;
+    bool check_ctime = false;
+    nfstime3 expected_ctime = {};
+    kv_inode_t set_attrs;
     int res = 0, cas_res = 0;
     std::string ientry_text;
-    json11::Json ientry;
-    json11::Json::object new_attrs;
+    kv_inode_t ientry;
+    kv_inode_t new_attrs;
     std::function<void(int)> cb;
 };
 
@@ -38,7 +39,7 @@ static void nfs_kv_continue_setattr(nfs_kv_setattr_state *st, int state)
     }
     st->self->parent->kvfs->touch_queue.erase(st->ino);
 resume_0:
-    kv_read_inode(st->self->parent, st->ino, [st](int res, const std::string & value, json11::Json attrs)
+    kv_read_inode(st->self->parent, st->ino, [st](int res, const std::string & value, const kv_inode_t & attrs)
     {
         st->res = res;
         st->ientry_text = value;
@@ -53,18 +54,17 @@ resume_1:
         cb(st->res);
         return;
     }
-    if (st->ientry["type"].string_value() != "file" &&
-        st->ientry["type"].string_value() != "" &&
-        !st->set_attrs["size"].is_null())
+    if (st->ientry.file_type() != NF3REG && st->set_attrs.has(KV_INODE_SIZE))
     {
         auto cb = std::move(st->cb);
         cb(-EINVAL);
         return;
     }
-    if (st->expected_ctime != "")
+    if (st->check_ctime)
     {
-        auto actual_ctime = (st->ientry["ctime"].is_null() ? st->ientry["mtime"] : st->ientry["ctime"]);
-        if (actual_ctime != st->expected_ctime)
+        auto actual_ctime = (st->ientry.has(KV_INODE_CTIME) ? st->ientry.ctime : st->ientry.mtime);
+        if (actual_ctime.seconds != st->expected_ctime.seconds ||
+            actual_ctime.nseconds != st->expected_ctime.nseconds)
         {
             auto cb = std::move(st->cb);
             cb(NFS3ERR_NOT_SYNC);
@@ -72,19 +72,16 @@ resume_1:
         }
     }
     // Now we can update it
-    st->new_attrs = st->ientry.object_items();
-    st->old_size = st->ientry["size"].uint64_value();
-    for (auto & kv: st->set_attrs)
+    st->new_attrs = st->ientry;
+    st->old_size = st->ientry.size;
+    if (st->set_attrs.has(KV_INODE_SIZE))
     {
-        if (kv.first == "size")
-        {
-            st->new_size = kv.second.uint64_value();
-        }
-        st->new_attrs[kv.first] = kv.second;
+        st->new_size = st->set_attrs.size;
     }
-    st->new_attrs.erase("verf");
-    st->new_attrs["ctime"] = nfstime_now_str();
-    st->self->parent->db->set(kv_inode_key(st->ino), json11::Json(st->new_attrs).dump(), [st](int res)
+    st->new_attrs.update(st->set_attrs);
+    st->new_attrs.ctime = nfstime_now();
+    st->new_attrs.fields = (st->new_attrs.fields | KV_INODE_CTIME) & ~KV_INODE_VERF;
+    kv_db_set(st->self->parent, kv_inode_key(st->ino), st->new_attrs.encode(), [st](int res)
     {
         st->res = res;
         nfs_kv_continue_setattr(st, 2);
@@ -111,15 +108,15 @@ resume_2:
         cb(st->res);
         return;
     }
-    if (!st->set_attrs["size"].is_null() &&
-        st->ientry["size"].uint64_value() > st->set_attrs["size"].uint64_value() &&
-        !st->ientry["shared_ino"].uint64_value())
+    if (st->set_attrs.has(KV_INODE_SIZE) &&
+        st->ientry.size > st->set_attrs.size &&
+        !st->ientry.shared_ino)
     {
         // Delete extra data when downsizing
         st->self->parent->cmd->loop_and_wait(st->self->parent->cmd->start_rm_data(json11::Json::object {
             { "inode", INODE_NO_POOL(st->ino) },
             { "pool", (uint64_t)INODE_POOL(st->ino) },
-            { "min_offset", st->set_attrs["size"].uint64_value() },
+            { "min_offset", st->set_attrs.size },
         }), [st](const cli_result_t & r)
         {
             if (r.err)
@@ -154,25 +151,29 @@ int kv_nfs3_setattr_proc(void *opaque, rpc_op_t *rop)
     }
     st->ino = kv_fh_inode(fh);
     if (args->guard.check)
-        st->expected_ctime = nfstime_to_str(args->guard.obj_ctime);
+    {
+        st->check_ctime = true;
+        st->expected_ctime = args->guard.obj_ctime;
+    }
+    auto & sa = st->set_attrs;
     if (args->new_attributes.size.set_it)
-        st->set_attrs["size"] = args->new_attributes.size.size;
+        sa.size = args->new_attributes.size.size, sa.fields |= KV_INODE_SIZE;
     if (args->new_attributes.mode.set_it)
-        st->set_attrs["mode"] = (uint64_t)args->new_attributes.mode.mode;
+        sa.mode = args->new_attributes.mode.mode, sa.fields |= KV_INODE_MODE;
     if (args->new_attributes.uid.set_it)
-        st->set_attrs["uid"] = (uint64_t)args->new_attributes.uid.uid;
+        sa.uid = args->new_attributes.uid.uid, sa.fields |= KV_INODE_UID;
     if (args->new_attributes.gid.set_it)
-        st->set_attrs["gid"] = (uint64_t)args->new_attributes.gid.gid;
+        sa.gid = args->new_attributes.gid.gid, sa.fields |= KV_INODE_GID;
     if (args->new_attributes.atime.set_it == SET_TO_SERVER_TIME)
-        st->set_attrs["atime"] = nfstime_now_str();
+        sa.atime = nfstime_now(), sa.fields |= KV_INODE_ATIME;
     else if (args->new_attributes.atime.set_it == SET_TO_CLIENT_TIME)
-        st->set_attrs["atime"] = nfstime_to_str(args->new_attributes.atime.atime);
+        sa.atime = args->new_attributes.atime.atime, sa.fields |= KV_INODE_ATIME;
     if (args->new_attributes.mtime.set_it == SET_TO_SERVER_TIME)
-        st->set_attrs["mtime"] = nfstime_now_str();
+        sa.mtime = nfstime_now(), sa.fields |= KV_INODE_MTIME;
     else if (args->new_attributes.mtime.set_it == SET_TO_CLIENT_TIME)
-        st->set_attrs["mtime"] = nfstime_to_str(args->new_attributes.mtime.mtime);
+        sa.mtime = args->new_attributes.mtime.mtime, sa.fields |= KV_INODE_MTIME;
     if (st->self->parent->trace)
-        fprintf(stderr, "[%d] SETATTR %ju ATTRS %s\n", st->self->nfs_fd, st->ino, json11::Json(st->set_attrs).dump().c_str());
+        fprintf(stderr, "[%d] SETATTR %ju ATTRS %s\n", st->self->nfs_fd, st->ino, sa.to_json().dump().c_str());
     st->cb = [st](int res)
     {
         auto reply = (SETATTR3res*)st->rop->reply;
@@ -5,6 +5,8 @@
 
 #include <sys/time.h>
 
+#include <algorithm>
+
 #include "nfs_proxy.h"
 #include "nfs_kv.h"
 
@@ -25,7 +27,7 @@ struct nfs_kv_write_state
     int res = 0, res2 = 0;
     int waiting = 0;
     std::string ientry_text;
-    json11::Json ientry;
+    kv_inode_t ientry;
     uint64_t new_size = 0;
     uint64_t aligned_size = 0;
     uint8_t *aligned_buf = NULL;
@@ -86,6 +88,14 @@ static void finish_allocate_shared(nfs_client_t *self, int res)
     }
 }
 
+static std::string shared_placeholder_ientry()
+{
+    kv_inode_t ientry;
+    ientry.type = KV_INODE_TYPE_SHARED;
+    ientry.fields = KV_INODE_TYPE;
+    return ientry.encode();
+}
+
 static void allocate_shared_inode(nfs_kv_write_state *st, int state)
 {
     if (st->self->parent->kvfs->cur_shared_inode == 0)
@@ -104,8 +114,7 @@ static void allocate_shared_inode(nfs_kv_write_state *st, int state)
             }
             st->self->parent->kvfs->cur_shared_inode = new_id;
             st->self->parent->kvfs->cur_shared_offset = 0;
-            st->self->parent->db->set(
-                kv_inode_key(new_id), json11::Json(json11::Json::object{ { "type", "shared" } }).dump(),
+            kv_db_set(st->self->parent, kv_inode_key(new_id), shared_placeholder_ientry(),
                 [st](int res)
                 {
                     if (res < 0)
@@ -151,12 +160,12 @@ static void nfs_do_write(uint64_t ino, uint64_t offset, uint64_t size, std::func
             nfs_kv_continue_write(st, state);
         }
     };
-    st->self->parent->cli->execute(op);
+    st->self->parent->execute_io(op);
 }
 
 static void nfs_do_unshare_write(nfs_kv_write_state *st, int state)
 {
-    uint64_t size = st->ientry["size"].uint64_value();
+    uint64_t size = st->ientry.size;
     uint64_t aligned_size = align_up(size);
     nfs_do_write(st->ino, 0, aligned_size, [&](cluster_op_t *op)
     {
@@ -243,16 +252,16 @@ void nfs_do_rmw(nfs_rmw_t *rmw)
                 }
                 delete op;
             };
-            parent->cli->execute(op);
+            parent->execute_io(op);
         }
         delete rd_op;
     };
-    parent->cli->execute(op);
+    parent->execute_io(op);
 }
 
 static void nfs_do_shared_read(nfs_kv_write_state *st, int state)
 {
-    uint64_t data_size = st->ientry["size"].uint64_value();
+    uint64_t data_size = st->ientry.size;
     if (!data_size)
     {
         nfs_kv_continue_write(st, state);
@@ -260,10 +269,10 @@ static void nfs_do_shared_read(nfs_kv_write_state *st, int state)
     }
     assert(!st->aligned_buf);
     st->aligned_buf = (uint8_t*)malloc_or_die(data_size);
-    uint64_t shared_offset = st->ientry["shared_offset"].uint64_value();
+    uint64_t shared_offset = st->ientry.shared_offset;
     auto op = new cluster_op_t;
     op->opcode = OSD_OP_READ;
-    op->inode = st->ientry["shared_ino"].uint64_value();
+    op->inode = st->ientry.shared_ino;
     op->offset = align_down(shared_offset);
     // Allow unaligned shared reads
     auto pre = shared_offset-align_down(shared_offset);
@@ -302,20 +311,20 @@ static void nfs_do_shared_read(nfs_kv_write_state *st, int state)
             nfs_kv_continue_write(st, state);
         }
     };
-    st->self->parent->cli->execute(op);
+    st->self->parent->execute_io(op);
 }
 
 static void nfs_do_fsync(nfs_kv_write_state *st, int state)
 {
-    // Client requested a stable write. Add an fsync
-    auto op = new cluster_op_t;
-    op->opcode = OSD_OP_SYNC;
-    op->callback = [st, state](cluster_op_t *op)
+    // Client requested a stable write. Add an fsync, shared with concurrent writes and COMMITs
+    WRITE3args *args = (WRITE3args*)st->rop->request;
+    st->self->parent->mark_unstable(args->file);
+    st->self->parent->sync_unstable(args->file, [st, state](int res)
     {
-        delete op;
+        if (res < 0)
+            st->res = res;
         nfs_kv_continue_write(st, state);
-    };
-    st->self->parent->cli->execute(op);
+    });
 }
 
 static bool nfs_do_shared_readmodify(nfs_kv_write_state *st, int base_state, int state, bool unshare)
@@ -324,8 +333,8 @@ static bool nfs_do_shared_readmodify(nfs_kv_write_state *st, int base_state, int
     if (state < base_state)       goto resume_0;
     else if (state == base_state) goto resume_1;
 resume_0:
-    if (st->ientry["shared_ino"].uint64_value() != 0 &&
-        st->ientry["size"].uint64_value() != 0 &&
+    if (st->ientry.shared_ino != 0 &&
+        st->ientry.size != 0 &&
         (st->offset > 0 || (st->offset+st->size) < st->new_size))
     {
         // Read old data if shared non-empty and not fully overwritten
@@ -356,7 +365,8 @@ static void add_zero(cluster_op_t *op, uint64_t count, std::vector<uint8_t> & ze
     }
 }
 
-static void nfs_do_shared_write(nfs_kv_write_state *st, int state)
+// Add header, data and zero padding of a file moved to the new shared location to <op>
+static void nfs_add_shared_write(nfs_kv_write_state *st, cluster_op_t *op)
 {
     st->shdr = {
         .magic = SHARED_FILE_MAGIC_V1,
@@ -375,45 +385,43 @@ static void nfs_do_shared_write(nfs_kv_write_state *st, int state)
         aligned_size = align_up(write_offset+write_size) - aligned_offset;
     }
     // FIXME: Do RMW if unaligned_is_free == false i.e. if we want tighter packing
-    bool has_old = st->ientry["shared_ino"].uint64_value() != 0 &&
-        st->ientry["size"].uint64_value() != 0;
-    nfs_do_write(st->shared_inode, aligned_offset, aligned_size, [&](cluster_op_t *op)
+    bool has_old = st->ientry.shared_ino != 0 &&
+        st->ientry.size != 0;
+    if (unaligned_is_free && aligned_offset < write_offset)
     {
-        if (unaligned_is_free && aligned_offset < write_offset)
-        {
-            // zero padding
-            op->iov.push_back(st->self->parent->kvfs->zero_block.data(), write_offset-aligned_offset);
-        }
-        // header
-        op->iov.push_back(&st->shdr, sizeof(shared_file_header_t));
-        if (st->offset > 0)
-        {
-            if (has_old)
-            {
-                // old data
-                op->iov.push_back(st->aligned_buf, st->offset);
-            }
-            else
-                add_zero(op, st->offset, st->self->parent->kvfs->zero_block);
-        }
-        // new data
-        op->iov.push_back(st->buf, st->size);
-        if (st->offset+st->size < st->new_size)
+        // zero padding
+        op->iov.push_back(st->self->parent->kvfs->zero_block.data(), write_offset-aligned_offset);
+    }
+    // header
+    op->iov.push_back(&st->shdr, sizeof(shared_file_header_t));
+    if (st->offset > 0)
+    {
+        if (has_old)
         {
-            if (has_old)
-            {
-                // old data
-                op->iov.push_back(st->aligned_buf+st->offset+st->size, st->new_size-(st->offset+st->size));
-            }
-            else
-                add_zero(op, st->offset, st->self->parent->kvfs->zero_block);
+            // old data
+            op->iov.push_back(st->aligned_buf, st->offset);
         }
-        if (unaligned_is_free && (aligned_size+aligned_offset) > (write_size+write_offset))
+        else
+            add_zero(op, st->offset, st->self->parent->kvfs->zero_block);
+    }
+    // new data
+    op->iov.push_back(st->buf, st->size);
+    if (st->offset+st->size < st->new_size)
+    {
+        if (has_old)
         {
-            // zero padding
-            op->iov.push_back(st->self->parent->kvfs->zero_block.data(), aligned_size+aligned_offset - (write_size+write_offset));
+            // old data
+            op->iov.push_back(st->aligned_buf+st->offset+st->size, st->new_size-(st->offset+st->size));
         }
-    }, st, state);
+        else
+            add_zero(op, st->offset, st->self->parent->kvfs->zero_block);
+    }
+    if (unaligned_is_free && (aligned_size+aligned_offset) > (write_size+write_offset))
+    {
+        // zero padding
+        op->iov.push_back(st->self->parent->kvfs->zero_block.data(), aligned_size+aligned_offset - (write_size+write_offset));
+    }
+    op->len += aligned_size;
 }
 
 static void nfs_do_align_write(nfs_kv_write_state *st, uint64_t ino, uint64_t offset, uint64_t shared_alloc, int state)
@@ -531,56 +539,245 @@ static void nfs_do_align_write(nfs_kv_write_state *st, uint64_t ino, uint64_t of
     }
 }
 
+static void touch_ientry(kv_inode_t & ni)
+{
+    ni.ctime = ni.mtime = nfstime_now();
+    ni.fields = (ni.fields | KV_INODE_CTIME | KV_INODE_MTIME) & ~(KV_INODE_EMPTY | KV_INODE_VERF);
+}
+
 static std::string new_normal_ientry(nfs_kv_write_state *st)
 {
-    auto ni = st->ientry.object_items();
-    ni.erase("empty");
-    ni.erase("shared_ino");
-    ni.erase("shared_offset");
-    ni.erase("shared_alloc");
-    ni.erase("shared_ver");
-    ni["size"] = st->ext->cur_extend;
-    ni["ctime"] = ni["mtime"] = nfstime_now_str();
-    ni.erase("verf");
-    return json11::Json(ni).dump();
+    auto ni = st->ientry;
+    ni.fields &= ~(KV_INODE_SHARED | KV_INODE_SHARED_VER);
+    ni.shared_ino = ni.shared_offset = ni.shared_alloc = ni.shared_ver = 0;
+    ni.size = st->ext->cur_extend;
+    ni.fields |= KV_INODE_SIZE;
+    touch_ientry(ni);
+    return ni.encode();
 }
 
 static std::string new_moved_ientry(nfs_kv_write_state *st)
 {
-    auto ni = st->ientry.object_items();
-    ni.erase("empty");
-    ni["shared_ino"] = st->shared_inode;
-    ni["shared_offset"] = st->shared_offset;
-    ni["shared_alloc"] = st->shared_alloc;
-    ni.erase("shared_ver");
-    ni["size"] = st->new_size;
-    ni["ctime"] = ni["mtime"] = nfstime_now_str();
-    ni.erase("verf");
-    return json11::Json(ni).dump();
+    auto ni = st->ientry;
+    ni.shared_ino = st->shared_inode;
+    ni.shared_offset = st->shared_offset;
+    ni.shared_alloc = st->shared_alloc;
+    ni.shared_ver = 0;
+    ni.size = st->new_size;
+    ni.fields = (ni.fields | KV_INODE_SHARED | KV_INODE_SIZE) & ~KV_INODE_SHARED_VER;
+    touch_ientry(ni);
+    return ni.encode();
 }
 
 static std::string new_shared_ientry(nfs_kv_write_state *st)
 {
-    auto ni = st->ientry.object_items();
-    ni.erase("empty");
-    ni["size"] = st->new_size;
-    ni["ctime"] = ni["mtime"] = nfstime_now_str();
-    ni["shared_ver"] = ni["shared_ver"].uint64_value()+1;
-    ni.erase("verf");
-    return json11::Json(ni).dump();
+    auto ni = st->ientry;
+    ni.size = st->new_size;
+    ni.shared_ver++;
+    ni.fields |= KV_INODE_SIZE | KV_INODE_SHARED_VER;
+    touch_ientry(ni);
+    return ni.encode();
 }
 
 static std::string new_unshared_ientry(nfs_kv_write_state *st)
 {
-    auto ni = st->ientry.object_items();
-    ni.erase("empty");
-    ni.erase("shared_ino");
-    ni.erase("shared_offset");
-    ni.erase("shared_alloc");
-    ni.erase("shared_ver");
-    ni["ctime"] = ni["mtime"] = nfstime_now_str();
-    ni.erase("verf");
-    return json11::Json(ni).dump();
+    auto ni = st->ientry;
+    ni.fields &= ~(KV_INODE_SHARED | KV_INODE_SHARED_VER);
+    ni.shared_ino = ni.shared_offset = ni.shared_alloc = ni.shared_ver = 0;
+    touch_ientry(ni);
+    return ni.encode();
+}
+
+// Encode inode without the size for comparison
+static std::string ientry_without_size(kv_inode_t ientry)
+{
+    ientry.size = 0;
+    ientry.fields &= ~KV_INODE_SIZE;
+    return ientry.encode();
+}
+
+// Files moved to new shared locations are written in packs: contiguous files are
+// written into the shared inode with one request and their inode entries are
+// updated with one KV batch. Files queued while a pack is being written form the
+// next pack, so that parallel small file writes (tar extraction, restores) are
+// merged without additional latency for single writes. shared_pack_delay allows
+// to also wait a bit for more files before starting the first pack.
+struct nfs_kv_pack_t
+{
+    std::vector<nfs_kv_write_state*> items;
+    int waiting = 0;
+};
+
+static void nfs_kv_flush_pack(nfs_proxy_t *proxy);
+
+static void nfs_kv_pack_written(nfs_kv_pack_t *pack)
+{
+    pack->waiting--;
+    if (pack->waiting > 0)
+    {
+        return;
+    }
+    auto proxy = pack->items[0]->self->parent;
+    std::vector<kv_write_t> batch;
+    std::vector<nfs_kv_write_state*> batch_items;
+    std::set<inode_t> batch_inodes;
+    for (auto st: pack->items)
+    {
+        if (st->aligned_buf)
+        {
+            free(st->aligned_buf);
+            st->aligned_buf = NULL;
+        }
+        if (st->res == 0 && !batch_inodes.insert(st->ino).second)
+        {
+            // Two writes of the same file in one pack - restart the second one like after a CAS failure
+            st->res = -EAGAIN;
+        }
+        if (st->res == 0)
+        {
+            std::string old_text = st->ientry_text;
+            batch.push_back((kv_write_t){
+                .key = kv_inode_key(st->ino),
+                .value = new_moved_ientry(st),
+                .cas_compare = [old_text](int res, const std::string & old_value)
+                {
+                    return res == 0 && old_value == old_text;
+                },
+            });
+            batch_items.push_back(st);
+        }
+    }
+    auto finish = [proxy, pack]()
+    {
+        auto kvfs = proxy->kvfs;
+        auto items = std::move(pack->items);
+        delete pack;
+        kvfs->pack_writing = false;
+        for (auto st: items)
+        {
+            nfs_kv_continue_write(st, 5);
+        }
+        if (kvfs->pack_queue.size() && !kvfs->pack_writing)
+        {
+            nfs_kv_flush_pack(proxy);
+        }
+    };
+    if (!batch.size())
+    {
+        finish();
+        return;
+    }
+    kv_db_write_batch(proxy, batch, [proxy, batch, batch_items, finish](int res, const std::vector<int> & results)
+    {
+        for (size_t i = 0; i < batch_items.size(); i++)
+        {
+            int r = i < results.size() ? results[i] : res;
+            if (r == -ECANCELED)
+            {
+                // Not applied because of a failure of another item
+                r = res == 0 || res == -EAGAIN ? -EAGAIN : res;
+            }
+            batch_items[i]->res = r;
+            if (r == 0)
+            {
+                kv_queue_dentry_update(proxy, batch[i].key, batch[i].value);
+            }
+        }
+        finish();
+    });
+}
+
+static void nfs_kv_submit_pack(nfs_kv_pack_t *pack, cluster_op_t *op, size_t from, size_t to)
+{
+    auto proxy = pack->items[from]->self->parent;
+    kv_shared_cache_invalidate(proxy->kvfs, op->inode, op->offset, op->len);
+    pack->waiting++;
+    op->callback = [proxy, pack, from, to](cluster_op_t *op)
+    {
+        if (op->retval != op->len)
+        {
+            for (size_t i = from; i < to; i++)
+            {
+                pack->items[i]->res = op->retval >= 0 ? -EIO : op->retval;
+            }
+        }
+        kv_shared_cache_invalidate(proxy->kvfs, op->inode, op->offset, op->len);
+        delete op;
+        nfs_kv_pack_written(pack);
+    };
+    proxy->execute_io(op);
+}
+
+static void nfs_kv_flush_pack(nfs_proxy_t *proxy)
+{
+    auto kvfs = proxy->kvfs;
+    if (kvfs->pack_timer_id >= 0)
+    {
+        proxy->epmgr->tfd->clear_timer(kvfs->pack_timer_id);
+        kvfs->pack_timer_id = -1;
+    }
+    auto pack = new nfs_kv_pack_t;
+    pack->items.swap(kvfs->pack_queue);
+    kvfs->pack_queue_bytes = 0;
+    kvfs->pack_writing = true;
+    std::sort(pack->items.begin(), pack->items.end(), [](nfs_kv_write_state *a, nfs_kv_write_state *b)
+    {
+        return a->shared_inode < b->shared_inode ||
+            a->shared_inode == b->shared_inode && a->shared_offset < b->shared_offset;
+    });
+    pack->waiting = 1;
+    cluster_op_t *op = NULL;
+    size_t first = 0;
+    for (size_t i = 0; i < pack->items.size(); i++)
+    {
+        auto st = pack->items[i];
+        if (op && (op->inode != st->shared_inode || op->offset+op->len != align_down(st->shared_offset)))
+        {
+            nfs_kv_submit_pack(pack, op, first, i);
+            op = NULL;
+        }
+        if (!op)
+        {
+            op = new cluster_op_t;
+            op->opcode = OSD_OP_WRITE;
+            op->inode = st->shared_inode;
+            op->offset = align_down(st->shared_offset);
+            op->len = 0;
+            first = i;
+        }
+        nfs_add_shared_write(st, op);
+    }
+    if (op)
+    {
+        nfs_kv_submit_pack(pack, op, first, pack->items.size());
+    }
+    nfs_kv_pack_written(pack);
+}
+
+static void nfs_do_packed_write(nfs_kv_write_state *st)
+{
+    auto proxy = st->self->parent;
+    auto kvfs = proxy->kvfs;
+    kvfs->pack_queue.push_back(st);
+    kvfs->pack_queue_bytes += st->shared_alloc;
+    if (kvfs->pack_writing)
+    {
+        // Will be written with the next pack
+        return;
+    }
+    if (!kvfs->shared_pack_delay || kvfs->pack_queue_bytes >= kvfs->pool_block_size)
+    {
+        nfs_kv_flush_pack(proxy);
+    }
+    else if (kvfs->pack_timer_id < 0)
+    {
+        kvfs->pack_timer_id = proxy->epmgr->tfd->set_timer_us(kvfs->shared_pack_delay, false, [proxy](int)
+        {
+            proxy->kvfs->pack_timer_id = -1;
+            if (!proxy->kvfs->pack_writing && proxy->kvfs->pack_queue.size())
+                nfs_kv_flush_pack(proxy);
+        });
+    }
 }
 
 static void nfs_kv_extend_inode(nfs_kv_write_state *st, int state, int base_state)
@@ -590,7 +787,7 @@ static void nfs_kv_extend_inode(nfs_kv_write_state *st, int state, int base_stat
     st->ext->cur_extend = st->ext->next_extend;
     st->ext->next_extend = 0;
     st->res2 = -EAGAIN;
-    st->self->parent->db->set(kv_inode_key(st->ino), new_normal_ientry(st), [st, base_state](int res)
+    kv_db_set(st->self->parent, kv_inode_key(st->ino), new_normal_ientry(st), [st, base_state](int res)
     {
         st->res = res;
         nfs_kv_continue_write(st, base_state+1);
@@ -605,25 +802,17 @@ static void nfs_kv_extend_inode(nfs_kv_write_state *st, int state, int base_stat
             return true;
         }
         std::string err;
-        auto ientry = json11::Json::parse(old_value, err).object_items();
-        if (err != "")
+        kv_inode_t ientry;
+        if (!ientry.decode(old_value, err))
         {
-            fprintf(stderr, "Invalid JSON in inode %ju = %s: %s\n", st->ino, old_value.c_str(), err.c_str());
+            fprintf(stderr, "Invalid inode %ju: %s\n", st->ino, err.c_str());
             st->res2 = -EINVAL;
             return false;
         }
-        else if (ientry.size() == st->ientry.object_items().size())
+        else if (ientry_without_size(ientry) == ientry_without_size(st->ientry))
         {
-            for (auto & kv: st->ientry.object_items())
-            {
-                if (kv.first != "size" && ientry[kv.first] != kv.second)
-                {
-                    // Something except size changed
-                    return false;
-                }
-            }
             // OK, only size changed
-            if (ientry["size"] >= st->new_size)
+            if (ientry.size >= st->new_size)
             {
                 // Already extended
                 st->res2 = 0;
@@ -720,7 +909,6 @@ static void nfs_kv_continue_write(nfs_kv_write_state *st, int state)
     else if (state == 1) goto resume_1;
     else if (state == 2) goto resume_2;
     else if (state == 3) goto resume_3;
-    else if (state == 4) goto resume_4;
     else if (state == 5) goto resume_5;
     else if (state == 7) goto resume_7;
     else if (state == 8) goto resume_8;
@@ -744,7 +932,7 @@ resume_0:
         cb(0);
         return;
     }
-    kv_read_inode(st->self->parent, st->ino, [st](int res, const std::string & value, json11::Json attrs)
+    kv_read_inode(st->self->parent, st->ino, [st](int res, const std::string & value, const kv_inode_t & attrs)
     {
         st->res = res;
         st->ientry_text = value;
@@ -753,26 +941,26 @@ resume_0:
     }, st->allow_cache);
     return;
 resume_1:
-    if (st->res < 0 || kv_map_type(st->ientry["type"].string_value()) != NF3REG)
+    if (st->res < 0 || st->ientry.file_type() != NF3REG)
     {
         auto cb = std::move(st->cb);
         cb(st->res == 0 ? -EINVAL : st->res);
         return;
     }
     st->was_immediate = st->self->parent->cli->get_immediate_commit(st->ino);
-    st->new_size = st->ientry["size"].uint64_value();
+    st->new_size = st->ientry.size;
     if (st->new_size < st->offset + st->size)
     {
         st->new_size = st->offset + st->size;
     }
     if (st->offset + st->size + sizeof(shared_file_header_t) < st->self->parent->kvfs->shared_inode_threshold)
     {
-        if (st->ientry["size"].uint64_value() == 0 &&
-            st->ientry["shared_ino"].uint64_value() == 0 ||
-            st->ientry["empty"].bool_value() &&
-            (st->ientry["size"].uint64_value() + sizeof(shared_file_header_t)) < st->self->parent->kvfs->shared_inode_threshold ||
-            st->ientry["shared_ino"].uint64_value() != 0 &&
-            st->ientry["shared_alloc"].uint64_value() < sizeof(shared_file_header_t)+st->offset+st->size)
+        if (st->ientry.size == 0 &&
+            st->ientry.shared_ino == 0 ||
+            st->ientry.has(KV_INODE_EMPTY) &&
+            (st->ientry.size + sizeof(shared_file_header_t)) < st->self->parent->kvfs->shared_inode_threshold ||
+            st->ientry.shared_ino != 0 &&
+            st->ientry.shared_alloc < sizeof(shared_file_header_t)+st->offset+st->size)
         {
             // Either empty, or shared and requires moving into a larger place (redirect-write)
             allocate_shared_inode(st, 2);
@@ -789,28 +977,7 @@ resume_3:
             {
                 return;
             }
-            nfs_do_shared_write(st, 4);
-            return;
-resume_4:
-            if (st->aligned_buf)
-            {
-                free(st->aligned_buf);
-                st->aligned_buf = NULL;
-            }
-            if (st->res < 0)
-            {
-                auto cb = std::move(st->cb);
-                cb(st->res);
-                return;
-            }
-            st->self->parent->db->set(kv_inode_key(st->ino), new_moved_ientry(st), [st](int res)
-            {
-                st->res = res;
-                nfs_kv_continue_write(st, 5);
-            }, [st](int res, const std::string & old_value)
-            {
-                return res == 0 && old_value == st->ientry_text;
-            });
+            nfs_do_packed_write(st);
             return;
 resume_5:
             if (st->res < 0)
@@ -831,14 +998,18 @@ resume_5:
             cb(0);
             return;
         }
-        else if (st->ientry["shared_ino"].uint64_value() != 0)
+        else if (st->ientry.shared_ino != 0)
         {
             // Non-empty, shared, can be updated in-place
-            nfs_do_align_write(st, st->ientry["shared_ino"].uint64_value(),
-                st->ientry["shared_offset"].uint64_value() + sizeof(shared_file_header_t) + st->offset,
-                st->ientry["shared_alloc"].uint64_value(), 7);
+            kv_shared_cache_invalidate(st->self->parent->kvfs, st->ientry.shared_ino,
+                st->ientry.shared_offset, st->ientry.shared_alloc);
+            nfs_do_align_write(st, st->ientry.shared_ino,
+                st->ientry.shared_offset + sizeof(shared_file_header_t) + st->offset,
+                st->ientry.shared_alloc, 7);
             return;
 resume_7:
+            kv_shared_cache_invalidate(st->self->parent->kvfs, st->ientry.shared_ino,
+                st->ientry.shared_offset, st->ientry.shared_alloc);
             if (st->res == 0 && st->stable && !st->was_immediate)
             {
                 nfs_do_fsync(st, 8);
@@ -846,7 +1017,7 @@ resume_7:
             }
 resume_8:
             // We always have to change inode entry on shared writes
-            st->self->parent->db->set(kv_inode_key(st->ino), new_shared_ientry(st), [st](int res)
+            kv_db_set(st->self->parent, kv_inode_key(st->ino), new_shared_ientry(st), [st](int res)
             {
                 st->res = res;
                 nfs_kv_continue_write(st, 9);
@@ -867,9 +1038,9 @@ resume_9:
         // Fall through for non-shared
     }
     // Unshare?
-    if (st->ientry["shared_ino"].uint64_value() != 0)
+    if (st->ientry.shared_ino != 0)
     {
-        if (st->ientry["size"].uint64_value() != 0)
+        if (st->ientry.size != 0)
         {
             nfs_do_shared_read(st, 10);
             return;
@@ -889,7 +1060,7 @@ resume_11:
                 return;
             }
         }
-        st->self->parent->db->set(kv_inode_key(st->ino), new_unshared_ientry(st), [st](int res)
+        kv_db_set(st->self->parent, kv_inode_key(st->ino), new_unshared_ientry(st), [st](int res)
         {
             st->res = res;
             nfs_kv_continue_write(st, 12);
@@ -928,9 +1099,9 @@ resume_14:
         cb(st->res);
         return;
     }
-    if (st->ientry["empty"].bool_value() ||
-        st->ientry["size"].uint64_value() < st->new_size ||
-        st->ientry["shared_ino"].uint64_value() != 0)
+    if (st->ientry.has(KV_INODE_EMPTY) ||
+        st->ientry.size < st->new_size ||
+        st->ientry.shared_ino != 0)
     {
         st->ext = &st->self->parent->kvfs->extends[st->ino];
         st->ext->refcnt++;
@@ -1003,6 +1174,8 @@ int kv_nfs3_write_proc(void *opaque, rpc_op_t *rop)
             reply->resok.count = (unsigned)st->size;
             reply->resok.committed = st->stable || st->was_immediate ? FILE_SYNC : UNSTABLE;
             *(uint64_t*)reply->resok.verf = st->self->parent->server_id;
+            if (reply->resok.committed == UNSTABLE)
+                st->self->parent->mark_unstable(((WRITE3args*)st->rop->request)->file);
         }
         rpc_queue_reply(st->rop);
         delete st;
@@ -45,21 +45,85 @@ int nfs3_access_proc(void *opaque, rpc_op_t *rop)
     return 0;
 }
 
-int nfs3_commit_proc(void *opaque, rpc_op_t *rop)
+void nfs_proxy_t::mark_unstable(const std::string & fh)
 {
-    nfs_client_t *self = (nfs_client_t*)opaque;
-    //COMMIT3args *args = (COMMIT3args*)rop->request;
+    unstable_writes[fh] = ++unstable_seq;
+}
+
+// We can't fsync a single inode, so SYNC is still global, but files without
+// unstable writes don't need it at all, and concurrent COMMITs and stable
+// writes share SYNCs: everyone waits for the first SYNC started after their write
+void nfs_proxy_t::sync_unstable(const std::string & fh, std::function<void(int res)> cb)
+{
+    auto it = unstable_writes.find(fh);
+    if (it == unstable_writes.end())
+    {
+        cb(0);
+        return;
+    }
+    sync_waiters.push_back({ it->second, cb });
+    if (!sync_running)
+    {
+        start_sync();
+    }
+}
+
+void nfs_proxy_t::start_sync()
+{
+    sync_running = true;
+    uint64_t sync_seq = unstable_seq;
     cluster_op_t *op = new cluster_op_t;
-    // fsync. we don't know how to fsync a single inode, so just fsync everything
     op->opcode = OSD_OP_SYNC;
-    op->callback = [self, rop](cluster_op_t *op)
+    op->callback = [this, sync_seq](cluster_op_t *op)
+    {
+        int res = op->retval;
+        delete op;
+        sync_running = false;
+        if (res == 0)
+        {
+            synced_seq = sync_seq;
+            for (auto it = unstable_writes.begin(); it != unstable_writes.end(); )
+            {
+                if (it->second <= sync_seq)
+                    unstable_writes.erase(it++);
+                else
+                    it++;
+            }
+        }
+        std::vector<std::function<void(int)>> done;
+        for (size_t i = 0; i < sync_waiters.size(); )
+        {
+            if (sync_waiters[i].first <= sync_seq)
+            {
+                done.push_back(std::move(sync_waiters[i].second));
+                sync_waiters.erase(sync_waiters.begin()+i);
+            }
+            else
+                i++;
+        }
+        if (sync_waiters.size())
+        {
+            start_sync();
+        }
+        for (auto & cb: done)
+        {
+            cb(res);
+        }
+    };
+    execute_io(op);
+}
+
+int nfs3_commit_proc(void *opaque, rpc_op_t *rop)
+{
+    nfs_client_t *self = (nfs_client_t*)opaque;
+    COMMIT3args *args = (COMMIT3args*)rop->request;
+    self->parent->sync_unstable(args->file, [self, rop](int res)
     {
         COMMIT3res *reply = (COMMIT3res*)rop->reply;
-        *reply = (COMMIT3res){ .status = vitastor_nfs_map_err(op->retval) };
+        *reply = (COMMIT3res){ .status = vitastor_nfs_map_err(res) };
         *(uint64_t*)reply->resok.verf = self->parent->server_id;
         rpc_queue_reply(rop);
-    };
-    self->parent->cli->execute(op);
+    });
     return 1;
 }
 
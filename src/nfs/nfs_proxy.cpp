@@ -6,8 +6,10 @@
 #define _XOPEN_SOURCE
 #include <limits.h>
 
+#include <linux/filter.h>
 #include <netinet/tcp.h>
 #include <sys/epoll.h>
+#include <sys/prctl.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -31,6 +33,36 @@
 
 const char *exe_name = NULL;
 
+static const char *nfs3_proc_names[] = {
+    "null", "getattr", "setattr", "lookup", "access", "readlink", "read", "write", "create", "mkdir",
+    "symlink", "mknod", "remove", "rmdir", "rename", "link", "readdir", "readdirplus", "fsstat",
+    "fsinfo", "pathconf", "commit",
+};
+
+static const char *mount3_proc_names[] = {
+    "null", "mnt", "dump", "umnt", "umntall", "export",
+};
+
+static const char *nfs_io_stat_names[] = { "read", "write", "sync" };
+
+static uint64_t nfs_now_usec()
+{
+    timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec*1000000 + tv.tv_nsec/1000;
+}
+
+static std::string nfs_proc_name(uint32_t prog, uint32_t proc)
+{
+    if (prog == NFS_PROGRAM && proc < sizeof(nfs3_proc_names)/sizeof(nfs3_proc_names[0]))
+        return std::string("nfs3_")+nfs3_proc_names[proc];
+    if (prog == MOUNT_PROGRAM && proc < sizeof(mount3_proc_names)/sizeof(mount3_proc_names[0]))
+        return std::string("mount3_")+mount3_proc_names[proc];
+    if (prog == PMAP_PROGRAM)
+        return "portmap_"+std::to_string(proc);
+    return std::to_string(prog)+"_"+std::to_string(proc);
+}
+
 nfs_proxy_t::~nfs_proxy_t()
 {
     if (kvfs)
@@ -67,6 +99,7 @@ static const char* help_text =
     "  --bind <IP>       bind service to <IP> address (default 0.0.0.0)\n"
     "  --port <PORT>     use port <PORT> for NFS services (default is 2049)\n"
     "  --portmap 0       do not listen on port 111 (portmap/rpcbind, requires root)\n"
+    "  --workers <N>     serve clients from N worker processes sharing the same port\n"
     "\n"
     "OPTIONS:\n"
     "  --fs <NAME>       use VitastorFS with metadata in image <NAME>\n"
@@ -77,6 +110,11 @@ static const char* help_text =
     "  --pidfile <FILE>  write process ID to the specified file\n"
     "  --logfile <FILE>  log to the specified file\n"
     "  --foreground 1    stay in foreground, do not daemonize\n"
+    "  --print_stats_interval <SEC>\n"
+    "                    print statistics to the log every <SEC> seconds\n"
+    "  --stats_file <FILE>\n"
+    "                    dump request statistics in JSON to <FILE> every <SEC>\n"
+    "                    seconds (10 by default), workers add .<PID> to the name\n"
     "\n"
     "NFS proxy is stateless if you use immediate_commit=all in your cluster and if\n"
     "you do not use client_enable_writeback=true, so you can freely use multiple\n"
@@ -140,16 +178,43 @@ json11::Json::object nfs_proxy_t::parse_args(int narg, const char *args[])
     return cfg;
 }
 
+// Workers have separate write verifiers and unstable write tables, so all connections
+// of one NFS client must go to the same worker, otherwise its COMMITs may reach a worker
+// which hasn't received its WRITEs. So the worker is selected by the client address
+// instead of the default connection hash
+static void attach_worker_selector(int listen_fd, int worker_count)
+{
+    // The program gets the TCP payload, IP header is available at SKF_NET_OFF.
+    // It returns the index of the socket in the SO_REUSEPORT group
+    sock_filter code[] = {
+        // A = IP version
+        BPF_STMT(BPF_LD|BPF_B|BPF_ABS, (uint32_t)SKF_NET_OFF),
+        BPF_STMT(BPF_ALU|BPF_RSH|BPF_K, 4),
+        BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 6, 0, 2),
+        // IPv6: A = last 32 bits of the source address
+        BPF_STMT(BPF_LD|BPF_W|BPF_ABS, (uint32_t)(SKF_NET_OFF+20)),
+        BPF_STMT(BPF_JMP|BPF_JA, 1),
+        // IPv4: A = source address
+        BPF_STMT(BPF_LD|BPF_W|BPF_ABS, (uint32_t)(SKF_NET_OFF+12)),
+        BPF_STMT(BPF_ALU|BPF_MOD|BPF_K, (uint32_t)worker_count),
+        BPF_STMT(BPF_RET|BPF_A, 0),
+    };
+    sock_fprog prog = { .len = sizeof(code)/sizeof(code[0]), .filter = code };
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0)
+    {
+        fprintf(stderr, "Failed to attach worker selection program to the listening socket: %s (code %d)\n", strerror(errno), errno);
+        exit(1);
+    }
+}
+
 void nfs_proxy_t::run(json11::Json cfg)
 {
-    timespec tv;
-    clock_gettime(CLOCK_REALTIME, &tv);
-    srand48(tv.tv_sec*1000000000 + tv.tv_nsec);
-    server_id = (uint64_t)lrand48() | ((uint64_t)lrand48() << 31) | ((uint64_t)lrand48() << 62);
     // Parse options
     if (cfg["logfile"].string_value() != "")
         logfile = cfg["logfile"].string_value();
     pidfile = cfg["pidfile"].string_value();
+    print_stats_interval = cfg["print_stats_interval"].uint64_value();
+    stats_file = cfg["stats_file"].string_value();
     trace = cfg["log_level"].uint64_value() > 5 || cfg["trace"].uint64_value() > 0;
     bind_address = cfg["bind"].string_value();
     if (bind_address == "")
@@ -180,6 +245,24 @@ void nfs_proxy_t::run(json11::Json cfg)
     }
     mountopts = cfg["options"].string_value();
     fsname = cfg["fs"].string_value();
+    worker_count = cfg["workers"].uint64_value();
+    if (!worker_count)
+        worker_count = 1;
+    if (worker_count > 1)
+    {
+        if (mountpoint != "")
+        {
+            fprintf(stderr, "--workers is only supported with `vitastor-nfs start`\n");
+            exit(1);
+        }
+        // Only returns in worker processes
+        run_workers(cfg["foreground"].is_null());
+    }
+    // Seed after forking workers so that every worker gets its own write verifier
+    timespec tv;
+    clock_gettime(CLOCK_REALTIME, &tv);
+    srand48(tv.tv_sec*1000000000 + tv.tv_nsec + getpid());
+    server_id = (uint64_t)lrand48() | ((uint64_t)lrand48() << 31) | ((uint64_t)lrand48() << 62);
     // Create client
     ringloop = new ring_loop_t(RINGLOOP_DEFAULT_SIZE);
     epmgr = new epoll_manager_t(ringloop);
@@ -210,6 +293,18 @@ void nfs_proxy_t::run(json11::Json cfg)
         kvfs = new kv_fs_state_t();
         kvfs->init(this, cfg);
     }
+    if (print_stats_interval || stats_file != "")
+    {
+        if (is_worker && stats_file != "")
+            stats_file += "."+std::to_string(getpid());
+        print_stats_timer_id = epmgr->tfd->set_timer((print_stats_interval ? print_stats_interval : 10)*1000, true, [this](int timer_id)
+        {
+            if (print_stats_interval)
+                print_stats();
+            if (stats_file != "")
+                write_stats_file();
+        });
+    }
     // Self-register portmap and NFS
     pmap.reg_ports.insert((portmap_id_t){
         .prog = PMAP_PROGRAM,
@@ -240,7 +335,11 @@ void nfs_proxy_t::run(json11::Json cfg)
         .addr = "0.0.0.0.0."+std::to_string(nfs_port),
     });
     // Create NFS socket and add it to epoll
-    int nfs_socket = create_and_bind_socket(bind_address, nfs_port, 128, &listening_port);
+    int nfs_socket = create_and_bind_socket(bind_address, nfs_port, 128, &listening_port, worker_count > 1);
+    if (worker_count > 1)
+    {
+        attach_worker_selector(nfs_socket, worker_count);
+    }
     fcntl(nfs_socket, F_SETFL, fcntl(nfs_socket, F_GETFL, 0) | O_NONBLOCK);
     epmgr->tfd->set_fd_handler(nfs_socket, false, [this](int nfs_socket, int epoll_events)
     {
@@ -257,7 +356,7 @@ void nfs_proxy_t::run(json11::Json cfg)
     if (portmap_enabled)
     {
         // Create portmap socket and add it to epoll
-        int portmap_socket = create_and_bind_socket(bind_address, 111, 128, NULL);
+        int portmap_socket = create_and_bind_socket(bind_address, 111, 128, NULL, worker_count > 1);
         fcntl(portmap_socket, F_SETFL, fcntl(portmap_socket, F_GETFL, 0) | O_NONBLOCK);
         epmgr->tfd->set_fd_handler(portmap_socket, false, [this](int portmap_socket, int epoll_events)
         {
@@ -276,11 +375,11 @@ void nfs_proxy_t::run(json11::Json cfg)
     {
         mount_fs();
     }
-    if (cfg["foreground"].is_null())
+    if (!is_worker && cfg["foreground"].is_null())
     {
         daemonize();
     }
-    if (pidfile != "")
+    if (!is_worker && pidfile != "")
     {
         write_pid();
     }
@@ -290,6 +389,11 @@ void nfs_proxy_t::run(json11::Json cfg)
         ringloop->wait();
     }
     // Destroy the client
+    if (print_stats_timer_id >= 0)
+    {
+        epmgr->tfd->clear_timer(print_stats_timer_id);
+        print_stats_timer_id = -1;
+    }
     cli->flush();
     if (kvfs)
     {
@@ -407,6 +511,178 @@ void nfs_proxy_t::parse_stats(etcd_kv_t & kv)
     }
 }
 
+void nfs_proxy_t::account_reply(rpc_op_t *rop)
+{
+    uint64_t usec = nfs_now_usec() - rop->start_usec;
+    uint32_t prog = rop->in_msg.body.cbody.prog, proc = rop->in_msg.body.cbody.proc;
+    auto & st = proc_stats[std::make_pair(prog, proc)];
+    st.count++;
+    st.usec += usec;
+    int bucket = 0;
+    while (bucket < NFS_LAT_HIST_SIZE-1 && usec >= (2ull << bucket))
+        bucket++;
+    st.lat_hist[bucket]++;
+    if (rop->out_msg.body.rbody.stat != RPC_MSG_ACCEPTED ||
+        rop->out_msg.body.rbody.areply.reply_data.stat != RPC_SUCCESS)
+    {
+        st.errors++;
+    }
+    else if (prog == NFS_PROGRAM && proc != NFS3_NULL)
+    {
+        // All NFS 3 results start with the status
+        if (*(nfsstat3*)rop->reply != NFS3_OK)
+            st.errors++;
+        else if (proc == NFS3_READ)
+            st.bytes += ((READ3res*)rop->reply)->resok.count;
+        else if (proc == NFS3_WRITE)
+            st.bytes += ((WRITE3res*)rop->reply)->resok.count;
+    }
+}
+
+void nfs_proxy_t::execute_io(cluster_op_t *op)
+{
+    uint64_t start_usec = nfs_now_usec();
+    auto cb = std::move(op->callback);
+    op->callback = [this, start_usec, cb](cluster_op_t *op)
+    {
+        auto & st = io_stats[op->opcode == OSD_OP_READ ? 0 : (op->opcode == OSD_OP_WRITE ? 1 : 2)];
+        st.count++;
+        st.usec += nfs_now_usec() - start_usec;
+        if (op->opcode != OSD_OP_SYNC && op->retval > 0)
+            st.bytes += op->retval;
+        cb(op);
+    };
+    cli->execute(op);
+}
+
+static void print_rate(const char *name, uint64_t count, uint64_t usec, uint64_t bytes, uint64_t interval)
+{
+    printf("[NFS] %s: %.1f op/s, avg latency %ju us", name, (double)count/interval, usec/count);
+    if (bytes > 0)
+    {
+        uint64_t bw = bytes/interval;
+        printf(", B/W: %.2f %s", (bw > 1024*1024*1024 ? bw/1024.0/1024/1024 : (bw > 1024*1024 ? bw/1024.0/1024 : bw/1024.0)),
+            (bw > 1024*1024*1024 ? "GB/s" : (bw > 1024*1024 ? "MB/s" : "KB/s")));
+    }
+}
+
+void nfs_proxy_t::print_stats()
+{
+    for (auto & p: proc_stats)
+    {
+        auto & prev = proc_stats_prev[p.first];
+        if (p.second.count == prev.count)
+            continue;
+        auto name = nfs_proc_name(p.first.first, p.first.second);
+        print_rate(name.c_str(), p.second.count-prev.count, p.second.usec-prev.usec, p.second.bytes-prev.bytes, print_stats_interval);
+        if (p.second.errors > prev.errors)
+            printf(", %ju errors", p.second.errors-prev.errors);
+        printf("\n");
+        prev = p.second;
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        auto & cur = io_stats[i], & prev = io_stats_prev[i];
+        if (cur.count == prev.count)
+            continue;
+        auto name = std::string("data ")+nfs_io_stat_names[i];
+        print_rate(name.c_str(), cur.count-prev.count, cur.usec-prev.usec, cur.bytes-prev.bytes, print_stats_interval);
+        printf("\n");
+        prev = cur;
+    }
+    if (db)
+    {
+        auto kv_stats = db->get_stats();
+        kv_op_stat_t *cur[] = { &kv_stats.get_ops, &kv_stats.set_ops, &kv_stats.del_ops, &kv_stats.batch_ops };
+        kv_op_stat_t *prev[] = { &kv_stats_prev.get_ops, &kv_stats_prev.set_ops, &kv_stats_prev.del_ops, &kv_stats_prev.batch_ops };
+        const char *names[] = { "metadata get", "metadata set", "metadata delete", "metadata batch" };
+        for (int i = 0; i < 4; i++)
+        {
+            if (cur[i]->count == prev[i]->count)
+                continue;
+            print_rate(names[i], cur[i]->count-prev[i]->count, cur[i]->usec-prev[i]->usec, 0, print_stats_interval);
+            printf("\n");
+        }
+        kv_stats_prev = kv_stats;
+    }
+    if (kvfs)
+    {
+        kvfs->print_stats(print_stats_interval);
+    }
+}
+
+// Cumulative counters in the same format as OSD op_stats, so that statistics of
+// multiple proxies and workers may be summed and turned into rates the same way
+json11::Json nfs_proxy_t::get_stats()
+{
+    json11::Json::object st, op_stats, io, kv;
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    char time_str[50] = { 0 };
+    sprintf(time_str, "%jd.%03ld", (uint64_t)ts.tv_sec, ts.tv_nsec/1000000);
+    st["time"] = time_str;
+    st["pid"] = (uint64_t)getpid();
+    for (auto & p: proc_stats)
+    {
+        json11::Json::array hist;
+        int last = NFS_LAT_HIST_SIZE-1;
+        while (last > 0 && !p.second.lat_hist[last])
+            last--;
+        for (int i = 0; i <= last; i++)
+            hist.push_back(p.second.lat_hist[i]);
+        op_stats[nfs_proc_name(p.first.first, p.first.second)] = json11::Json::object {
+            { "count", p.second.count },
+            { "usec", p.second.usec },
+            { "bytes", p.second.bytes },
+            { "errors", p.second.errors },
+            { "lat_hist", hist },
+        };
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        io[nfs_io_stat_names[i]] = json11::Json::object {
+            { "count", io_stats[i].count },
+            { "usec", io_stats[i].usec },
+            { "bytes", io_stats[i].bytes },
+        };
+    }
+    st["op_stats"] = op_stats;
+    st["io_stats"] = io;
+    if (db)
+    {
+        auto kv_stats = db->get_stats();
+        st["kv_stats"] = json11::Json::object {
+            { "get", json11::Json::object { { "count", kv_stats.get_ops.count }, { "usec", kv_stats.get_ops.usec } } },
+            { "set", json11::Json::object { { "count", kv_stats.set_ops.count }, { "usec", kv_stats.set_ops.usec } } },
+            { "delete", json11::Json::object { { "count", kv_stats.del_ops.count }, { "usec", kv_stats.del_ops.usec } } },
+            { "batch", json11::Json::object { { "count", kv_stats.batch_ops.count }, { "usec", kv_stats.batch_ops.usec } } },
+            { "cache_hits", kv_stats.cache_hits },
+            { "cache_misses", kv_stats.cache_misses },
+        };
+    }
+    return st;
+}
+
+void nfs_proxy_t::write_stats_file()
+{
+    // Write to a temporary file and rename it so that readers never see partial data
+    std::string tmp_file = stats_file+".tmp";
+    std::string data = get_stats().dump()+"\n";
+    int fd = open(tmp_file.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Failed to write statistics to %s: %s\n", tmp_file.c_str(), strerror(errno));
+        return;
+    }
+    ssize_t r = write(fd, data.data(), data.size());
+    close(fd);
+    if (r != data.size() || rename(tmp_file.c_str(), stats_file.c_str()) < 0)
+    {
+        fprintf(stderr, "Failed to write statistics to %s: %s\n", stats_file.c_str(), strerror(errno));
+        unlink(tmp_file.c_str());
+    }
+}
+
 void nfs_proxy_t::check_default_pool()
 {
     if (default_pool == "")
@@ -812,6 +1088,10 @@ void rpc_queue_reply(rpc_op_t *rop)
     nfs_client_t *self = (nfs_client_t*)rop->client;
     iovec *iov_list = NULL;
     unsigned iov_count = 0;
+    if (rop->start_usec)
+    {
+        self->parent->account_reply(rop);
+    }
     int r = xdr_encode(rop->xdrs, (xdrproc_t)xdr_rpc_msg, &rop->out_msg);
     assert(r);
     if (rop->reply_fn != NULL)
@@ -980,6 +1260,7 @@ int nfs_client_t::handle_rpc_message(void *base_buf, void *msg_buf, uint32_t msg
         .reply = ((uint8_t*)rop) + sizeof(rpc_op_t) + proc_it->req_size,
     };
     memcpy(&rop->in_msg, inmsg, sizeof(rpc_msg));
+    rop->start_usec = nfs_now_usec();
     // Try to decode the request
     // req_fn may be NULL, that means function has no arguments
     if (proc_it->req_fn && !proc_it->req_fn(xdrs, rop->request))
@@ -1030,6 +1311,97 @@ void nfs_proxy_t::write_pid()
     close(fd);
 }
 
+static bool workers_stopping = false;
+
+static void stop_workers_handler(int signal)
+{
+    workers_stopping = true;
+}
+
+void nfs_proxy_t::run_workers(bool need_daemonize)
+{
+    if (need_daemonize)
+    {
+        daemonize();
+    }
+    if (pidfile != "")
+    {
+        write_pid();
+    }
+    // Workers are plain independent proxies listening on the same port with SO_REUSEPORT.
+    // Each of them has its own ring loop, cluster client and KV database cache, and they
+    // coordinate through CAS in the KV database exactly like proxies on different hosts.
+    struct sigaction sa = {};
+    sa.sa_handler = stop_workers_handler;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    std::map<pid_t, time_t> workers;
+    int status = 0;
+    while (true)
+    {
+        while (!workers_stopping && workers.size() < worker_count)
+        {
+            pid_t pid = fork();
+            if (pid < 0)
+            {
+                fprintf(stderr, "Failed to fork: %s (code %d)\n", strerror(errno), errno);
+                workers_stopping = true;
+                status = 1;
+                break;
+            }
+            if (pid == 0)
+            {
+                // Worker
+                signal(SIGTERM, SIG_DFL);
+                signal(SIGINT, SIG_DFL);
+                prctl(PR_SET_PDEATHSIG, SIGTERM);
+                is_worker = true;
+                return;
+            }
+            workers[pid] = time(NULL);
+        }
+        if (workers_stopping)
+        {
+            break;
+        }
+        int wstatus = 0;
+        pid_t pid = waitpid(-1, &wstatus, 0);
+        if (pid < 0)
+        {
+            if (errno != EINTR)
+                break;
+            continue;
+        }
+        auto w_it = workers.find(pid);
+        if (w_it == workers.end())
+        {
+            continue;
+        }
+        fprintf(stderr, "Worker %d exited with %s %d\n", pid, WIFSIGNALED(wstatus) ? "signal" : "code",
+            WIFSIGNALED(wstatus) ? WTERMSIG(wstatus) : WEXITSTATUS(wstatus));
+        if (time(NULL) - w_it->second < 5)
+        {
+            // Worker failed during startup, restarting it again is pointless
+            fprintf(stderr, "Worker failed right after start, stopping\n");
+            workers_stopping = true;
+            status = 1;
+        }
+        workers.erase(w_it);
+    }
+    for (auto & w: workers)
+    {
+        kill(w.first, SIGTERM);
+    }
+    while (workers.size())
+    {
+        pid_t pid = waitpid(-1, NULL, 0);
+        if (pid < 0 && errno != EINTR)
+            break;
+        workers.erase(pid);
+    }
+    exit(status);
+}
+
 static pid_t wanted_pid = 0;
 static bool child_finished = false;
 static int child_status = -1;
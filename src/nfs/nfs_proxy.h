@@ -17,11 +17,25 @@
 #define TRUE 1
 #define FALSE 0
 
+// Request latency histogram: bucket N counts requests which took [2^N, 2^(N+1)) us
+#define NFS_LAT_HIST_SIZE 32
+
 class cli_tool_t;
 
 struct kv_fs_state_t;
 struct block_fs_state_t;
 
+struct nfs_proc_stat_t
+{
+    uint64_t count = 0, usec = 0, bytes = 0, errors = 0;
+    uint64_t lat_hist[NFS_LAT_HIST_SIZE] = { 0 };
+};
+
+struct nfs_io_stat_t
+{
+    uint64_t count = 0, usec = 0, bytes = 0;
+};
+
 class nfs_proxy_t
 {
 public:
@@ -37,6 +51,11 @@ public:
     std::string logfile = "/dev/null";
     std::string pidfile;
     bool exit_on_umount = false;
+    unsigned worker_count = 1;
+    uint64_t print_stats_interval = 0;
+    int print_stats_timer_id = -1;
+    std::string stats_file;
+    bool is_worker = false;
     std::string mountpoint;
     std::string mountopts;
     std::string fsname;
@@ -62,6 +81,18 @@ public:
     // pool ID => statistics
     std::map<pool_id_t, json11::Json> pool_stats;
 
+    // (program, procedure) => request statistics
+    std::map<std::pair<uint32_t, uint32_t>, nfs_proc_stat_t> proc_stats, proc_stats_prev;
+    // data reads, writes and syncs sent to the cluster (not including metadata DB)
+    nfs_io_stat_t io_stats[3], io_stats_prev[3];
+    kv_stats_t kv_stats_prev;
+
+    // File handle => sequence number of its last UNSTABLE write not covered by a SYNC yet
+    std::map<std::string, uint64_t> unstable_writes;
+    uint64_t unstable_seq = 0, synced_seq = 0;
+    bool sync_running = false;
+    std::vector<std::pair<uint64_t, std::function<void(int)>>> sync_waiters;
+
     ~nfs_proxy_t();
 
     static json11::Json::object parse_args(int narg, const char *args[]);
@@ -69,7 +100,16 @@ public:
     void watch_stats();
     void parse_stats(etcd_kv_t & kv);
     void check_default_pool();
+    void print_stats();
+    json11::Json get_stats();
+    void write_stats_file();
+    void account_reply(rpc_op_t *rop);
+    void execute_io(cluster_op_t *op);
+    void mark_unstable(const std::string & fh);
+    void sync_unstable(const std::string & fh, std::function<void(int res)> cb);
+    void start_sync();
     void do_accept(int listen_fd);
+    void run_workers(bool need_daemonize);
     void daemonize();
     void write_pid();
     void mount_fs();
@@ -0,0 +1,720 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+//
+// NFS proxy load generator: replays a mix of NFS 3 operations against a server
+
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+
+#include <map>
+#include <vector>
+
+#include "json11/json11.hpp"
+#include "addr_util.h"
+#include "str_util.h"
+#include "proto/nfs.h"
+#include "proto/rpc.h"
+#include "proto/xdr_impl.h"
+
+const char *exe_name = NULL;
+
+#define NFS_STRESS_GETATTR 0
+#define NFS_STRESS_LOOKUP 1
+#define NFS_STRESS_READ 2
+#define NFS_STRESS_WRITE 3
+#define NFS_STRESS_COMMIT 4
+#define NFS_STRESS_READDIRPLUS 5
+#define NFS_STRESS_CREATE 6
+#define NFS_STRESS_REMOVE 7
+#define NFS_STRESS_OPS 8
+
+static const char *op_names[NFS_STRESS_OPS] = {
+    "getattr", "lookup", "read", "write", "commit", "readdirplus", "create", "remove",
+};
+
+static const uint64_t default_mix[NFS_STRESS_OPS] = { 30, 30, 15, 10, 0, 5, 5, 5 };
+
+// Log-linear latency histogram: 32 buckets per power of 2, ~3% precision
+#define NFS_STRESS_HIST_SUB 32
+#define NFS_STRESS_HIST_SIZE (NFS_STRESS_HIST_SUB*40)
+
+struct nfs_stress_lat_t
+{
+    uint64_t usec = 0, count = 0, errors = 0, bytes = 0;
+    uint64_t hist[NFS_STRESS_HIST_SIZE] = { 0 };
+};
+
+struct nfs_stress_file_t
+{
+    std::string name, fh;
+};
+
+struct nfs_stress_op_t
+{
+    int op = 0;
+    timespec tv_begin;
+    std::string name, fh;
+    uint64_t bytes = 0;
+};
+
+class nfs_stress_t
+{
+public:
+    // Config
+    std::string host = "127.0.0.1";
+    int port = 2049;
+    std::string export_path = "/";
+    std::string dir_name = "nfs-stress";
+    uint64_t file_count = 100;
+    uint64_t file_size = 65536;
+    uint64_t io_size = 4096;
+    uint64_t parallelism = 4;
+    uint64_t op_count = 100000;
+    uint64_t runtime_sec = 0;
+    uint64_t mix[NFS_STRESS_OPS];
+    uint64_t seed = 0;
+    uint64_t print_stats_interval = 1;
+    bool stable_writes = false;
+    bool json_output = false;
+
+    // State
+    int fd = -1;
+    XDR *send_xdrs = NULL, *recv_xdrs = NULL;
+    uint32_t last_xid = 0;
+    std::string root_fh, dir_fh;
+    std::vector<nfs_stress_file_t> files;
+    uint64_t create_seq = 0;
+    std::map<uint32_t, nfs_stress_op_t> inflight;
+    std::vector<uint8_t> write_buf, recv_buf;
+    uint64_t total_mix = 0, ops_sent = 0;
+    nfs_stress_lat_t stat[NFS_STRESS_OPS], prev_stat[NFS_STRESS_OPS];
+    timespec start_time, prev_stat_time;
+
+    ~nfs_stress_t();
+
+    static json11::Json::object parse_args(int narg, const char *args[]);
+    void parse_config(json11::Json cfg);
+    void run(json11::Json cfg);
+    void connect_server();
+    uint32_t send_call(uint32_t prog, uint32_t proc, xdrproc_t args_fn, void *args);
+    uint32_t recv_reply(xdrproc_t res_fn, void *res, bool *ok);
+    void call(uint32_t prog, uint32_t proc, xdrproc_t args_fn, void *args, xdrproc_t res_fn, void *res);
+    void prepare();
+    void start_op();
+    void handle_reply();
+    void print_stats(nfs_stress_lat_t *prev, timespec & prev_time, bool total);
+};
+
+nfs_stress_t::~nfs_stress_t()
+{
+    if (send_xdrs)
+        xdr_destroy(send_xdrs);
+    if (recv_xdrs)
+        xdr_destroy(recv_xdrs);
+    if (fd >= 0)
+        close(fd);
+}
+
+json11::Json::object nfs_stress_t::parse_args(int narg, const char *args[])
+{
+    json11::Json::object cfg;
+    for (int i = 1; i < narg; i++)
+    {
+        if (!strcmp(args[i], "-h") || !strcmp(args[i], "--help"))
+        {
+            printf(
+                "Vitastor NFS proxy load generator\n"
+                "(c) Vitaliy Filippov, 2024+ (VNPL-1.1)\n"
+                "\n"
+                "USAGE: %s [OPTIONS]\n"
+                "  --host 127.0.0.1\n"
+                "    NFS server address\n"
+                "  --port 2049\n"
+                "    NFS server port (MOUNT service is expected on the same port)\n"
+                "  --export /\n"
+                "    Export path to mount\n"
+                "  --dir nfs-stress\n"
+                "    Directory in the export root used for test files, created if missing\n"
+                "  --file_count 100\n"
+                "    Create this number of files before starting the test\n"
+                "  --file_size 64k\n"
+                "    Initial size of test files\n"
+                "  --io_size 4k\n"
+                "    Read and write request size\n"
+                "  --mix getattr=30,lookup=30,read=15,write=10,commit=0,readdirplus=5,create=5,remove=5\n"
+                "    Operation mix. Unlisted operations keep their default weights\n"
+                "  --stable 0\n"
+                "    Send FILE_SYNC writes instead of UNSTABLE\n"
+                "  --parallelism 4\n"
+                "    Run this number of requests in parallel\n"
+                "  --op_count 100000\n"
+                "    Total operations to run during test. 0 means unlimited\n"
+                "  --runtime 0\n"
+                "    Run for this number of seconds. 0 means unlimited\n"
+                "  --seed 0\n"
+                "    Random seed, 0 = use current time\n"
+                "  --print_stats 1\n"
+                "    Print operation statistics every this number of seconds\n"
+                "  --json\n"
+                "    JSON output. Total statistics include p50-p99.99 latency percentiles\n",
+                exe_name
+            );
+            exit(0);
+        }
+        else if (args[i][0] == '-' && args[i][1] == '-')
+        {
+            const char *opt = args[i]+2;
+            cfg[opt] = !strcmp(opt, "json") || i == narg-1 ? "1" : args[++i];
+        }
+    }
+    return cfg;
+}
+
+void nfs_stress_t::parse_config(json11::Json cfg)
+{
+    if (cfg["host"].string_value() != "")
+        host = cfg["host"].string_value();
+    if (cfg["port"].uint64_value() > 0)
+        port = cfg["port"].uint64_value();
+    if (cfg["export"].string_value() != "")
+        export_path = cfg["export"].string_value();
+    if (cfg["dir"].string_value() != "")
+        dir_name = cfg["dir"].string_value();
+    if (!cfg["file_count"].is_null())
+        file_count = cfg["file_count"].uint64_value();
+    if (!cfg["file_size"].is_null())
+        file_size = parse_size(cfg["file_size"].as_string());
+    if (!cfg["io_size"].is_null())
+        io_size = parse_size(cfg["io_size"].as_string());
+    if (!io_size)
+        io_size = 4096;
+    if (cfg["parallelism"].uint64_value() > 0)
+        parallelism = cfg["parallelism"].uint64_value();
+    if (!cfg["op_count"].is_null())
+        op_count = cfg["op_count"].uint64_value();
+    runtime_sec = cfg["runtime"].uint64_value();
+    seed = cfg["seed"].uint64_value();
+    if (!cfg["print_stats"].is_null())
+        print_stats_interval = cfg["print_stats"].uint64_value();
+    stable_writes = cfg["stable"].string_value() == "1" || cfg["stable"].string_value() == "true";
+    json_output = !cfg["json"].is_null();
+    for (int i = 0; i < NFS_STRESS_OPS; i++)
+        mix[i] = default_mix[i];
+    for (auto & item: explode(",", cfg["mix"].string_value(), true))
+    {
+        auto eq = item.find('=');
+        int i = 0;
+        for (; i < NFS_STRESS_OPS; i++)
+            if (item.substr(0, eq) == op_names[i])
+                break;
+        if (eq == std::string::npos || i >= NFS_STRESS_OPS)
+        {
+            fprintf(stderr, "Invalid operation mix item: %s\n", item.c_str());
+            exit(1);
+        }
+        mix[i] = stoull_full(item.substr(eq+1));
+    }
+    total_mix = 0;
+    for (int i = 0; i < NFS_STRESS_OPS; i++)
+        total_mix += mix[i];
+    if (!total_mix)
+    {
+        fprintf(stderr, "Operation mix is empty\n");
+        exit(1);
+    }
+}
+
+void nfs_stress_t::connect_server()
+{
+    sockaddr_storage addr;
+    if (!string_to_addr(host, false, port, &addr))
+    {
+        fprintf(stderr, "Server address %s is not valid\n", host.c_str());
+        exit(1);
+    }
+    fd = socket(addr.ss_family, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        perror("socket");
+        exit(1);
+    }
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        fprintf(stderr, "Failed to connect to %s:%d: %s\n", host.c_str(), port, strerror(errno));
+        exit(1);
+    }
+    int one = 1;
+    setsockopt(fd, SOL_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static void write_all(int fd, std::vector<iovec> & iov)
+{
+    size_t pos = 0;
+    while (pos < iov.size())
+    {
+        ssize_t r = writev(fd, iov.data()+pos, iov.size()-pos > IOV_MAX ? IOV_MAX : iov.size()-pos);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+        {
+            fprintf(stderr, "Failed to send request: %s\n", r < 0 ? strerror(errno) : "connection closed");
+            exit(1);
+        }
+        while (pos < iov.size() && r >= (ssize_t)iov[pos].iov_len)
+            r -= iov[pos++].iov_len;
+        if (r > 0)
+        {
+            iov[pos].iov_base = (uint8_t*)iov[pos].iov_base + r;
+            iov[pos].iov_len -= r;
+        }
+    }
+}
+
+static void read_all(int fd, void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t r = read(fd, (uint8_t*)buf + done, len - done);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+        {
+            fprintf(stderr, "Failed to receive reply: %s\n", r < 0 ? strerror(errno) : "connection closed");
+            exit(1);
+        }
+        done += r;
+    }
+}
+
+uint32_t nfs_stress_t::send_call(uint32_t prog, uint32_t proc, xdrproc_t args_fn, void *args)
+{
+    rpc_msg msg = {};
+    msg.xid = ++last_xid;
+    msg.body.dir = RPC_CALL;
+    msg.body.cbody = (rpc_call_body){
+        .rpcvers = RPC_MSG_VERSION,
+        .prog = prog,
+        .vers = prog == NFS_PROGRAM ? NFS_V3 : MOUNT_V3,
+        .proc = proc,
+        .cred = { .flavor = RPC_AUTH_NONE },
+        .verf = { .flavor = RPC_AUTH_NONE },
+    };
+    int r = xdr_encode(send_xdrs, (xdrproc_t)xdr_rpc_msg, &msg);
+    if (r && args_fn)
+        r = xdr_encode(send_xdrs, args_fn, args);
+    if (!r)
+    {
+        fprintf(stderr, "Failed to encode request\n");
+        exit(1);
+    }
+    iovec *iov_list = NULL;
+    unsigned iov_count = 0;
+    xdr_encode_finish(send_xdrs, &iov_list, &iov_count);
+    uint32_t marker = 0;
+    std::vector<iovec> iov;
+    iov.push_back((iovec){ .iov_base = &marker, .iov_len = 4 });
+    for (unsigned i = 0; i < iov_count; i++)
+    {
+        marker += iov_list[i].iov_len;
+        iov.push_back(iov_list[i]);
+    }
+    marker = htobe32(marker | 0x80000000);
+    write_all(fd, iov);
+    xdr_reset(send_xdrs);
+    return msg.xid;
+}
+
+// Receive the next reply and decode its result with <res_fn> into <res>.
+// Decoded data is valid until the next call
+uint32_t nfs_stress_t::recv_reply(xdrproc_t res_fn, void *res, bool *ok)
+{
+    recv_buf.clear();
+    uint32_t marker = 0;
+    do
+    {
+        read_all(fd, &marker, 4);
+        marker = be32toh(marker);
+        size_t pos = recv_buf.size();
+        recv_buf.resize(pos + (marker & 0x7fffffff));
+        read_all(fd, recv_buf.data()+pos, marker & 0x7fffffff);
+    } while (!(marker & 0x80000000));
+    rpc_msg msg = {};
+    *ok = xdr_decode(recv_xdrs, recv_buf.data(), recv_buf.size(), (xdrproc_t)xdr_rpc_msg, &msg) &&
+        msg.body.dir == RPC_REPLY &&
+        msg.body.rbody.stat == RPC_MSG_ACCEPTED &&
+        msg.body.rbody.areply.reply_data.stat == RPC_SUCCESS;
+    if (*ok && res_fn)
+    {
+        *ok = res_fn(recv_xdrs, res);
+    }
+    return msg.xid;
+}
+
+void nfs_stress_t::call(uint32_t prog, uint32_t proc, xdrproc_t args_fn, void *args, xdrproc_t res_fn, void *res)
+{
+    uint32_t xid = send_call(prog, proc, args_fn, args);
+    bool ok = false;
+    if (recv_reply(res_fn, res, &ok) != xid || !ok)
+    {
+        fprintf(stderr, "RPC call %u/%u failed\n", prog, proc);
+        exit(1);
+    }
+}
+
+static xdr_string_t xdr_str(const std::string & str)
+{
+    return (xdr_string_t){ .size = str.size(), .data = (char*)str.data() };
+}
+
+void nfs_stress_t::prepare()
+{
+    // Mount
+    nfs_dirpath path = xdr_str(export_path);
+    nfs_mountres3 mnt = {};
+    call(MOUNT_PROGRAM, MOUNT3_MNT, (xdrproc_t)xdr_nfs_dirpath, &path, (xdrproc_t)xdr_nfs_mountres3, &mnt);
+    if (mnt.fhs_status != MNT3_OK)
+    {
+        fprintf(stderr, "Failed to mount %s: status %d\n", export_path.c_str(), mnt.fhs_status);
+        exit(1);
+    }
+    root_fh = mnt.mountinfo.fhandle;
+    // Find or create the test directory
+    LOOKUP3args lookup_args = { .what = { .dir = xdr_str(root_fh), .name = xdr_str(dir_name) } };
+    LOOKUP3res lookup_res = {};
+    call(NFS_PROGRAM, NFS3_LOOKUP, (xdrproc_t)xdr_LOOKUP3args, &lookup_args, (xdrproc_t)xdr_LOOKUP3res, &lookup_res);
+    if (lookup_res.status == NFS3_OK)
+    {
+        dir_fh = lookup_res.resok.object;
+    }
+    else
+    {
+        MKDIR3args mkdir_args = { .where = { .dir = xdr_str(root_fh), .name = xdr_str(dir_name) } };
+        mkdir_args.attributes.mode.set_it = 1;
+        mkdir_args.attributes.mode.mode = 0755;
+        MKDIR3res mkdir_res = {};
+        call(NFS_PROGRAM, NFS3_MKDIR, (xdrproc_t)xdr_MKDIR3args, &mkdir_args, (xdrproc_t)xdr_MKDIR3res, &mkdir_res);
+        if (mkdir_res.status != NFS3_OK || !mkdir_res.resok.obj.handle_follows)
+        {
+            fprintf(stderr, "Failed to create directory %s: status %d\n", dir_name.c_str(), mkdir_res.status);
+            exit(1);
+        }
+        dir_fh = mkdir_res.resok.obj.handle;
+    }
+    // Create and fill test files
+    for (uint64_t i = 0; i < file_count; i++)
+    {
+        std::string name = "f"+std::to_string(i);
+        CREATE3args create_args = { .where = { .dir = xdr_str(dir_fh), .name = xdr_str(name) } };
+        create_args.how.mode = NFS_UNCHECKED;
+        create_args.how.obj_attributes.mode.set_it = 1;
+        create_args.how.obj_attributes.mode.mode = 0644;
+        CREATE3res create_res = {};
+        call(NFS_PROGRAM, NFS3_CREATE, (xdrproc_t)xdr_CREATE3args, &create_args, (xdrproc_t)xdr_CREATE3res, &create_res);
+        if (create_res.status != NFS3_OK || !create_res.resok.obj.handle_follows)
+        {
+            fprintf(stderr, "Failed to create file %s: status %d\n", name.c_str(), create_res.status);
+            exit(1);
+        }
+        files.push_back((nfs_stress_file_t){ .name = name, .fh = create_res.resok.obj.handle });
+        for (uint64_t offset = 0; offset < file_size; offset += io_size)
+        {
+            uint64_t len = file_size-offset < io_size ? file_size-offset : io_size;
+            WRITE3args write_args = {
+                .file = xdr_str(files.back().fh),
+                .offset = offset,
+                .count = (count3)len,
+                .stable = FILE_SYNC,
+                .data = (xdr_string_t){ .size = len, .data = (char*)write_buf.data() },
+            };
+            WRITE3res write_res = {};
+            call(NFS_PROGRAM, NFS3_WRITE, (xdrproc_t)xdr_WRITE3args, &write_args, (xdrproc_t)xdr_WRITE3res, &write_res);
+            if (write_res.status != NFS3_OK)
+            {
+                fprintf(stderr, "Failed to write file %s: status %d\n", name.c_str(), write_res.status);
+                exit(1);
+            }
+        }
+    }
+}
+
+void nfs_stress_t::start_op()
+{
+    uint64_t r = lrand48() % total_mix;
+    int op = 0;
+    while (r >= mix[op])
+        r -= mix[op++];
+    if (!files.size() && op != NFS_STRESS_CREATE && op != NFS_STRESS_READDIRPLUS)
+        op = NFS_STRESS_CREATE;
+    nfs_stress_op_t st;
+    st.op = op;
+    if (files.size())
+    {
+        auto & f = files[lrand48() % files.size()];
+        st.name = f.name;
+        st.fh = f.fh;
+    }
+    uint64_t offset = file_size > io_size ? (lrand48() % (file_size/io_size)) * io_size : 0;
+    clock_gettime(CLOCK_MONOTONIC, &st.tv_begin);
+    uint32_t xid = 0;
+    if (op == NFS_STRESS_GETATTR)
+    {
+        GETATTR3args args = { .object = xdr_str(st.fh) };
+        xid = send_call(NFS_PROGRAM, NFS3_GETATTR, (xdrproc_t)xdr_GETATTR3args, &args);
+    }
+    else if (op == NFS_STRESS_LOOKUP)
+    {
+        LOOKUP3args args = { .what = { .dir = xdr_str(dir_fh), .name = xdr_str(st.name) } };
+        xid = send_call(NFS_PROGRAM, NFS3_LOOKUP, (xdrproc_t)xdr_LOOKUP3args, &args);
+    }
+    else if (op == NFS_STRESS_READ)
+    {
+        READ3args args = { .file = xdr_str(st.fh), .offset = offset, .count = (count3)io_size };
+        xid = send_call(NFS_PROGRAM, NFS3_READ, (xdrproc_t)xdr_READ3args, &args);
+    }
+    else if (op == NFS_STRESS_WRITE)
+    {
+        WRITE3args args = {
+            .file = xdr_str(st.fh),
+            .offset = offset,
+            .count = (count3)io_size,
+            .stable = stable_writes ? FILE_SYNC : UNSTABLE,
+            .data = (xdr_string_t){ .size = io_size, .data = (char*)write_buf.data() },
+        };
+        xid = send_call(NFS_PROGRAM, NFS3_WRITE, (xdrproc_t)xdr_WRITE3args, &args);
+    }
+    else if (op == NFS_STRESS_COMMIT)
+    {
+        COMMIT3args args = { .file = xdr_str(st.fh) };
+        xid = send_call(NFS_PROGRAM, NFS3_COMMIT, (xdrproc_t)xdr_COMMIT3args, &args);
+    }
+    else if (op == NFS_STRESS_READDIRPLUS)
+    {
+        READDIRPLUS3args args = { .dir = xdr_str(dir_fh), .dircount = 4096, .maxcount = 32768 };
+        xid = send_call(NFS_PROGRAM, NFS3_READDIRPLUS, (xdrproc_t)xdr_READDIRPLUS3args, &args);
+    }
+    else if (op == NFS_STRESS_CREATE)
+    {
+        st.name = "n"+std::to_string(++create_seq)+"-"+std::to_string(getpid());
+        CREATE3args args = { .where = { .dir = xdr_str(dir_fh), .name = xdr_str(st.name) } };
+        args.how.mode = NFS_UNCHECKED;
+        args.how.obj_attributes.mode.set_it = 1;
+        args.how.obj_attributes.mode.mode = 0644;
+        xid = send_call(NFS_PROGRAM, NFS3_CREATE, (xdrproc_t)xdr_CREATE3args, &args);
+    }
+    else if (op == NFS_STRESS_REMOVE)
+    {
+        // Forget the file immediately so that new requests don't use it
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            if (files[i].name == st.name)
+            {
+                files[i] = files.back();
+                files.pop_back();
+                break;
+            }
+        }
+        REMOVE3args args = { .object = { .dir = xdr_str(dir_fh), .name = xdr_str(st.name) } };
+        xid = send_call(NFS_PROGRAM, NFS3_REMOVE, (xdrproc_t)xdr_REMOVE3args, &args);
+    }
+    inflight[xid] = st;
+    ops_sent++;
+}
+
+static int lat_bucket(uint64_t usec)
+{
+    // 2*SUB buckets of 1us, then SUB buckets per each next power of 2
+    int e = usec < 2*NFS_STRESS_HIST_SUB ? 0 : 64-__builtin_clzll(usec)-6;
+    int idx = e*NFS_STRESS_HIST_SUB + (usec >> e);
+    return idx < NFS_STRESS_HIST_SIZE ? idx : NFS_STRESS_HIST_SIZE-1;
+}
+
+static uint64_t bucket_usec(int idx)
+{
+    int e = idx < 2*NFS_STRESS_HIST_SUB ? 0 : idx/NFS_STRESS_HIST_SUB-1;
+    return ((uint64_t)(idx - e*NFS_STRESS_HIST_SUB) << e) + ((1ull << e) >> 1);
+}
+
+void nfs_stress_t::handle_reply()
+{
+    // Every NFS 3 result starts with the status, and only CREATE results are used
+    // further, so decode replies either as CREATE3res or just take the status
+    CREATE3res res = {};
+    bool ok = false;
+    uint32_t xid = recv_reply(NULL, NULL, &ok);
+    auto it = inflight.find(xid);
+    if (it == inflight.end())
+    {
+        fprintf(stderr, "Received a reply with unknown xid %u\n", xid);
+        exit(1);
+    }
+    auto st = std::move(it->second);
+    inflight.erase(it);
+    if (ok)
+    {
+        if (st.op == NFS_STRESS_CREATE)
+            ok = xdr_CREATE3res(recv_xdrs, &res) && res.status == NFS3_OK;
+        else
+            ok = xdr_nfsstat3(recv_xdrs, &res.status) && res.status == NFS3_OK;
+    }
+    timespec tv_end;
+    clock_gettime(CLOCK_MONOTONIC, &tv_end);
+    int64_t usec = (tv_end.tv_sec - st.tv_begin.tv_sec)*1000000 + (tv_end.tv_nsec - st.tv_begin.tv_nsec)/1000;
+    auto & s = stat[st.op];
+    s.count++;
+    s.usec += usec;
+    s.hist[lat_bucket(usec)]++;
+    if (!ok)
+        s.errors++;
+    else if (st.op == NFS_STRESS_READ || st.op == NFS_STRESS_WRITE)
+        s.bytes += io_size;
+    if (ok && st.op == NFS_STRESS_CREATE && res.resok.obj.handle_follows)
+        files.push_back((nfs_stress_file_t){ .name = st.name, .fh = res.resok.obj.handle });
+}
+
+static const double lat_percentiles[] = { 50, 90, 99, 99.9, 99.99 };
+static const char *lat_percentile_names[] = { "p50", "p90", "p99", "p99.9", "p99.99" };
+
+// Calculate latency percentiles (and max) of operations done between <prev> and <cur>
+static void calc_percentiles(nfs_stress_lat_t *cur, nfs_stress_lat_t *prev, uint64_t *out)
+{
+    const int n = sizeof(lat_percentiles)/sizeof(lat_percentiles[0]);
+    uint64_t total = cur->count - prev->count, sum = 0;
+    int p = 0;
+    out[n] = 0;
+    for (int i = 0; i < NFS_STRESS_HIST_SIZE; i++)
+    {
+        uint64_t c = cur->hist[i] - prev->hist[i];
+        if (!c)
+            continue;
+        sum += c;
+        while (p < n && sum >= total*lat_percentiles[p]/100)
+            out[p++] = bucket_usec(i);
+        out[n] = bucket_usec(i);
+    }
+    for (; p < n; p++)
+        out[p] = 0;
+}
+
+void nfs_stress_t::print_stats(nfs_stress_lat_t *prev, timespec & prev_time, bool total)
+{
+    timespec cur_time;
+    clock_gettime(CLOCK_MONOTONIC, &cur_time);
+    int64_t usec = (cur_time.tv_sec - prev_time.tv_sec)*1000000 + (cur_time.tv_nsec - prev_time.tv_nsec)/1000;
+    if (usec <= 0)
+        usec = 1;
+    const int n = sizeof(lat_percentiles)/sizeof(lat_percentiles[0]);
+    if (json_output)
+    {
+        int64_t runtime = (cur_time.tv_sec - start_time.tv_sec)*1000000 + (cur_time.tv_nsec - start_time.tv_nsec)/1000;
+        printf("{\"runtime\":%.1f", (double)runtime/1000000.0);
+        for (int i = 0; i < NFS_STRESS_OPS; i++)
+        {
+            if (stat[i].count <= prev[i].count)
+                continue;
+            uint64_t count = stat[i].count-prev[i].count;
+            printf(
+                ",\"%s\":{\"avg\":{\"iops\":%.1f,\"usec\":%ju},\"total\":{\"count\":%ju,\"usec\":%ju,\"bytes\":%ju,\"errors\":%ju}",
+                op_names[i], count*1000000.0/usec, (stat[i].usec-prev[i].usec)/count,
+                stat[i].count, stat[i].usec, stat[i].bytes, stat[i].errors
+            );
+            if (total)
+            {
+                uint64_t pct[n+1];
+                calc_percentiles(&stat[i], &prev[i], pct);
+                printf(",\"lat\":{");
+                for (int j = 0; j < n; j++)
+                    printf("\"%s\":%ju,", lat_percentile_names[j], pct[j]);
+                printf("\"max\":%ju}", pct[n]);
+            }
+            printf("}");
+        }
+        printf("}\n");
+    }
+    else if (!total)
+    {
+        for (int i = 0; i < NFS_STRESS_OPS; i++)
+        {
+            if (stat[i].count <= prev[i].count)
+                continue;
+            uint64_t count = stat[i].count-prev[i].count;
+            printf("%.1f %s/s (%ju us)  ", count*1000000.0/usec, op_names[i], (stat[i].usec-prev[i].usec)/count);
+        }
+        printf("\n");
+    }
+    else
+    {
+        printf("Total: %.1f s\n", usec/1000000.0);
+        printf("%-12s %10s %10s %8s %8s", "op", "count", "op/s", "errors", "avg");
+        for (int j = 0; j < n; j++)
+            printf(" %8s", lat_percentile_names[j]);
+        printf(" %8s\n", "max");
+        for (int i = 0; i < NFS_STRESS_OPS; i++)
+        {
+            if (!stat[i].count)
+                continue;
+            uint64_t pct[n+1];
+            calc_percentiles(&stat[i], &prev[i], pct);
+            printf("%-12s %10ju %10.1f %8ju %8ju", op_names[i], stat[i].count, stat[i].count*1000000.0/usec,
+                stat[i].errors, stat[i].usec/stat[i].count);
+            for (int j = 0; j <= n; j++)
+                printf(" %8ju", pct[j]);
+            printf("\n");
+        }
+    }
+    if (!total)
+    {
+        for (int i = 0; i < NFS_STRESS_OPS; i++)
+            prev[i] = stat[i];
+        prev_time = cur_time;
+    }
+}
+
+void nfs_stress_t::run(json11::Json cfg)
+{
+    parse_config(cfg);
+    srand48(seed ? seed : time(NULL));
+    write_buf.resize(io_size > file_size ? io_size : file_size);
+    for (size_t i = 0; i < write_buf.size(); i++)
+        write_buf[i] = lrand48();
+    send_xdrs = xdr_create();
+    recv_xdrs = xdr_create();
+    connect_server();
+    prepare();
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    prev_stat_time = start_time;
+    while (true)
+    {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        bool stop = op_count && ops_sent >= op_count ||
+            runtime_sec && (uint64_t)(now.tv_sec - start_time.tv_sec) >= runtime_sec;
+        while (!stop && inflight.size() < parallelism && (!op_count || ops_sent < op_count))
+            start_op();
+        if (!inflight.size())
+            break;
+        handle_reply();
+        if (print_stats_interval && (uint64_t)(now.tv_sec - prev_stat_time.tv_sec) >= print_stats_interval)
+            print_stats(prev_stat, prev_stat_time, false);
+    }
+    nfs_stress_lat_t zero[NFS_STRESS_OPS];
+    timespec begin = start_time;
+    print_stats(zero, begin, true);
+}
+
+int main(int narg, const char *args[])
+{
+    setvbuf(stdout, NULL, _IONBF, 0);
+    setvbuf(stderr, NULL, _IONBF, 0);
+    exe_name = args[0];
+    nfs_stress_t *p = new nfs_stress_t();
+    p->run(nfs_stress_t::parse_args(narg, args));
+    delete p;
+    return 0;
+}
@@ -38,6 +38,8 @@ struct rpc_op_t
     xdrproc_t reply_fn;
     uint32_t reply_marker;
     bool referenced;
+    // request receive time for statistics, 0 for protocol error replies
+    uint64_t start_usec;
 };
 
 void rpc_queue_reply(rpc_op_t *rop);
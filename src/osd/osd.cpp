@@ -467,6 +467,14 @@ void osd_t::exec_op(osd_op_t *cur_op)
     {
         continue_primary_describe(cur_op);
     }
+    else if (cur_op->req.hdr.opcode == OSD_OP_DELETE_RANGE)
+    {
+        continue_primary_delete_range(cur_op);
+    }
+    else if (cur_op->req.hdr.opcode == OSD_OP_COPY)
+    {
+        continue_primary_copy(cur_op);
+    }
     else
     {
         exec_secondary(cur_op);
@@ -37,6 +37,8 @@
 #define DEFAULT_RECOVERY_QUEUE 1
 #define DEFAULT_RECOVERY_PG_SWITCH 128
 #define DEFAULT_RECOVERY_BATCH 16
+#define DEFAULT_DELETE_RANGE_PARALLEL 32
+#define MAX_DELETE_RANGE_PARALLEL 1024
 
 //#define OSD_STUB
 
@@ -54,6 +56,40 @@ struct osd_recovery_op_t
     osd_op_t *osd_op = NULL;
 };
 
+// State of a primary OSD_OP_DELETE_RANGE operation
+struct osd_delete_range_t
+{
+    osd_op_t *cur_op = NULL;
+    pool_pg_num_t pg_id;
+    object_id min_oid = {}, max_oid = {};
+    // objects of the current listing page, next page starts from list_last
+    // and unclean objects missing on this OSD are taken from unclean_next
+    std::set<object_id> objects;
+    std::set<object_id>::iterator pos;
+    object_id list_last = {}, unclean_next = {};
+    bool listing = false, list_done = false, submitting = false;
+    uint32_t parallel = 0;
+    int in_flight = 0;
+    uint64_t deleted = 0, errors = 0;
+    int errcode = 0;
+};
+
+// State of a primary OSD_OP_COPY operation
+struct osd_copy_t
+{
+    osd_op_t *cur_op = NULL;
+    pool_pg_num_t pg_id;
+    // internal read of the source, its data is copied into <data>
+    osd_op_t *read_op = NULL;
+    uint8_t *data = NULL;
+    // copied range and current position in bitmap granules, relative to the object start
+    uint32_t start = 0, pos = 0, end = 0;
+    uint64_t version = 0, written = 0;
+    int in_flight = 0;
+    bool cas = false, reread = false, submitting = false;
+    int errcode = 0;
+};
+
 // Posted as /osd/inodestats/$osd, then accumulated by the monitor
 #define INODE_STATS_READ 0
 #define INODE_STATS_WRITE 1
@@ -293,6 +329,12 @@ class osd_t
     void continue_primary_read(osd_op_t *cur_op);
     void continue_primary_scrub(osd_op_t *cur_op);
     void continue_primary_describe(osd_op_t *cur_op);
+    void continue_primary_delete_range(osd_op_t *cur_op);
+    void delete_range_list(osd_delete_range_t *dr);
+    void continue_delete_range(osd_delete_range_t *dr);
+    void continue_primary_copy(osd_op_t *cur_op);
+    void copy_read(osd_copy_t *cp);
+    void continue_copy(osd_copy_t *cp);
     void continue_primary_write(osd_op_t *cur_op);
     void cancel_primary_write(osd_op_t *cur_op);
     void continue_primary_sync(osd_op_t *cur_op);
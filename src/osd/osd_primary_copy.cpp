@@ -0,0 +1,205 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#include "osd_primary.h"
+
+#define SELF_FD -1
+
+// Copy data of an inode, read through its parents from the same pool, to another
+// inode at the same offset. All inodes of a pool map the same offset to the same
+// PG, so everything is done by this primary OSD with internal primary reads and
+// writes and data doesn't have to go to the client and back. Used by merge and
+// flatten instead of client-side read + write.
+void osd_t::continue_primary_copy(osd_op_t *cur_op)
+{
+    auto & req = cur_op->req.copy;
+    if (!req.len || req.len > OSD_RW_MAX ||
+        (req.offset % bs_bitmap_granularity) != 0 ||
+        (req.len % bs_bitmap_granularity) != 0 ||
+        INODE_POOL(req.src_inode) != INODE_POOL(req.inode))
+    {
+        finish_op(cur_op, -EINVAL);
+        return;
+    }
+    pool_id_t pool_id = INODE_POOL(req.inode);
+    auto pool_cfg_it = st_cli.pool_config.find(pool_id);
+    if (pool_cfg_it == st_cli.pool_config.end() ||
+        req.meta_revision && st_cli.inode_config.find(req.src_inode) == st_cli.inode_config.end())
+    {
+        // Pool or inode config is not loaded yet
+        finish_op(cur_op, -EPIPE);
+        return;
+    }
+    auto & pool_cfg = pool_cfg_it->second;
+    uint64_t pg_data_size = (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
+    uint64_t pg_block_size = bs_block_size * pg_data_size;
+    uint64_t stripe = (req.offset/pg_block_size)*pg_block_size;
+    if (req.offset+req.len > stripe+pg_block_size)
+    {
+        finish_op(cur_op, -EINVAL);
+        return;
+    }
+    auto cp = new osd_copy_t;
+    cp->cur_op = cur_op;
+    cp->pg_id = { .pool_id = pool_id, .pg_num = (pg_num_t)((stripe/pool_cfg.pg_stripe_size) % pg_counts[pool_id] + 1) };
+    cp->cas = (req.flags & OSD_COPY_CAS) && req.src_inode == req.inode;
+    copy_read(cp);
+}
+
+void osd_t::copy_read(osd_copy_t *cp)
+{
+    auto & req = cp->cur_op->req.copy;
+    osd_op_t *op = new osd_op_t();
+    op->op_type = OSD_OP_OUT;
+    op->peer_fd = SELF_FD;
+    op->req = (osd_any_op_t){
+        .rw = {
+            .header = {
+                .magic = SECONDARY_OSD_OP_MAGIC,
+                .id = 1,
+                .opcode = OSD_OP_READ,
+            },
+            .inode = req.src_inode,
+            .offset = req.offset,
+            .len = req.len,
+            // Non-zero metadata revision enables chained reads through parents
+            .meta_revision = req.meta_revision,
+        },
+    };
+    op->callback = [this, cp](osd_op_t *op)
+    {
+        if (op->reply.hdr.retval != op->req.rw.len)
+        {
+            cp->errcode = op->reply.hdr.retval < 0 ? op->reply.hdr.retval : -EIO;
+            delete op;
+            continue_copy(cp);
+            return;
+        }
+        // Bitmap is sent first, data follows it in possibly multiple buffers
+        uint32_t len = op->req.rw.len;
+        if (!cp->data)
+            cp->data = (uint8_t*)malloc_or_die(len);
+        uint64_t skip = op->reply.rw.bitmap_len, done = 0;
+        for (int i = 0; i < op->iov.count && done < len; i++)
+        {
+            uint64_t iov_len = op->iov.buf[i].iov_len;
+            if (skip >= iov_len)
+            {
+                skip -= iov_len;
+                continue;
+            }
+            uint64_t cur = iov_len-skip > len-done ? len-done : iov_len-skip;
+            memcpy(cp->data + done, (uint8_t*)op->iov.buf[i].iov_base + skip, cur);
+            done += cur;
+            skip = 0;
+        }
+        assert(done == len);
+        cp->read_op = op;
+        cp->version = op->reply.rw.version;
+        // Bitmap bits are relative to the object start
+        auto & pool_cfg = st_cli.pool_config.at(cp->pg_id.pool_id);
+        uint64_t pg_block_size = bs_block_size * (pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks);
+        cp->start = cp->pos = (op->req.rw.offset % pg_block_size) / bs_bitmap_granularity;
+        cp->end = cp->start + len/bs_bitmap_granularity;
+        continue_copy(cp);
+    };
+    exec_op(op);
+}
+
+void osd_t::continue_copy(osd_copy_t *cp)
+{
+    auto & req = cp->cur_op->req.copy;
+    while (cp->read_op && !cp->errcode && cp->pos < cp->end && (!cp->cas || !cp->in_flight))
+    {
+        // Write each non-empty range using an individual operation
+        uint8_t *bitmap = (uint8_t*)cp->read_op->bitmap_buf;
+        uint32_t start = cp->pos;
+        while (start < cp->end && !((bitmap[start >> 3] >> (start & 7)) & 1))
+            start++;
+        uint32_t end = start;
+        while (end < cp->end && ((bitmap[end >> 3] >> (end & 7)) & 1))
+            end++;
+        cp->pos = end;
+        if (start >= end)
+            break;
+        uint32_t data_start = (start - cp->start) * bs_bitmap_granularity;
+        uint32_t len = (end-start) * bs_bitmap_granularity;
+        osd_op_t *op = new osd_op_t();
+        op->op_type = OSD_OP_OUT;
+        op->peer_fd = SELF_FD;
+        op->req = (osd_any_op_t){
+            .rw = {
+                .header = {
+                    .magic = SECONDARY_OSD_OP_MAGIC,
+                    .id = 1,
+                    .opcode = OSD_OP_WRITE,
+                },
+                .inode = req.inode,
+                .offset = req.offset + data_start,
+                .len = len,
+                .version = cp->cas ? cp->version+1 : 0,
+            },
+        };
+        op->buf = memalign_or_die(MEM_ALIGNMENT, len);
+        memcpy(op->buf, cp->data + data_start, len);
+        op->callback = [this, cp](osd_op_t *op)
+        {
+            cp->in_flight--;
+            if (op->reply.hdr.retval == -EINTR && cp->cas)
+            {
+                // CAS failure - the object was modified after reading, read it again
+                delete cp->read_op;
+                cp->read_op = NULL;
+                cp->reread = true;
+                delete op;
+                if (!cp->submitting)
+                    continue_copy(cp);
+                return;
+            }
+            if (op->reply.hdr.retval != op->req.rw.len)
+                cp->errcode = op->reply.hdr.retval < 0 ? op->reply.hdr.retval : -EIO;
+            else
+            {
+                cp->written += op->req.rw.len;
+                cp->version = op->reply.rw.version;
+            }
+            delete op;
+            if (!cp->submitting)
+                continue_copy(cp);
+        };
+        cp->in_flight++;
+        // Writes may complete synchronously, don't let them finish the operation under us
+        cp->submitting = true;
+        exec_op(op);
+        cp->submitting = false;
+    }
+    if (cp->in_flight > 0 || cp->read_op && !cp->errcode && cp->pos < cp->end)
+    {
+        return;
+    }
+    if (cp->reread && !cp->errcode)
+    {
+        cp->reread = false;
+        copy_read(cp);
+        return;
+    }
+    // Done. Writes are unstable until the client syncs them, like its own writes
+    auto cur_op = cp->cur_op;
+    if (cp->written > 0)
+    {
+        auto cl_it = msgr.clients.find(cur_op->peer_fd);
+        if (cl_it != msgr.clients.end())
+        {
+            cl_it->second->dirty_pgs.insert(cp->pg_id);
+        }
+    }
+    cur_op->reply.copy.written = cp->written;
+    cur_op->reply.copy.version = cp->version;
+    int retval = cp->errcode ? cp->errcode : cur_op->req.copy.len;
+    if (cp->read_op)
+        delete cp->read_op;
+    if (cp->data)
+        free(cp->data);
+    delete cp;
+    finish_op(cur_op, retval);
+}
@@ -0,0 +1,206 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#include "osd_primary.h"
+
+#define SELF_FD -1
+
+// Maximum number of stable object versions in one local listing page
+#define DELETE_RANGE_LIST_LIMIT 4096
+
+// Delete all objects of an inode (or of its offset range) within one PG.
+// The primary OSD lists its own objects of the PG, adds objects missing on it
+// from the PG's degraded/misplaced/incomplete lists and deletes them with
+// normal internal primary deletes, so clients don't have to list objects
+// and send a separate request per object.
+void osd_t::continue_primary_delete_range(osd_op_t *cur_op)
+{
+    auto & req = cur_op->req.delete_range;
+    pool_id_t pool_id = INODE_POOL(req.inode);
+    auto pool_cfg_it = st_cli.pool_config.find(pool_id);
+    if (pool_cfg_it == st_cli.pool_config.end())
+    {
+        finish_op(cur_op, -EPIPE);
+        return;
+    }
+    auto pg_it = pgs.find({ .pool_id = pool_id, .pg_num = req.pg_num });
+    if (pg_it == pgs.end() || !(pg_it->second.state & PG_ACTIVE))
+    {
+        // This OSD is not primary for this PG or the PG is inactive
+        finish_op(cur_op, -EPIPE);
+        return;
+    }
+    if (req.max_offset && req.max_offset <= req.min_offset)
+    {
+        finish_op(cur_op, 0);
+        return;
+    }
+    auto dr = new osd_delete_range_t;
+    dr->cur_op = cur_op;
+    dr->pg_id = pg_it->first;
+    dr->min_oid = (object_id){ .inode = req.inode, .stripe = req.min_offset };
+    // Listing includes EC part numbers in the lowest bits of stripe
+    dr->max_oid = (object_id){ .inode = req.inode, .stripe = req.max_offset ? ((req.max_offset-1) | STRIPE_MASK) : UINT64_MAX };
+    dr->list_last = dr->min_oid;
+    dr->unclean_next = dr->min_oid;
+    dr->parallel = req.parallel ? req.parallel : DEFAULT_DELETE_RANGE_PARALLEL;
+    if (dr->parallel > MAX_DELETE_RANGE_PARALLEL)
+        dr->parallel = MAX_DELETE_RANGE_PARALLEL;
+    dr->pos = dr->objects.end();
+    delete_range_list(dr);
+}
+
+static void add_unclean_objects(std::set<object_id> & objects, btree::btree_map<object_id, pg_osd_set_state_t*> & from,
+    object_id min_oid, object_id max_oid)
+{
+    for (auto it = from.lower_bound(min_oid); it != from.end() && !(max_oid < it->first); it++)
+    {
+        objects.insert(it->first);
+    }
+}
+
+void osd_t::delete_range_list(osd_delete_range_t *dr)
+{
+    dr->listing = true;
+    blockstore_op_t *bs_op = new blockstore_op_t();
+    bs_op->opcode = BS_OP_LIST;
+    bs_op->pg_alignment = st_cli.pool_config[dr->pg_id.pool_id].pg_stripe_size;
+    bs_op->min_oid = dr->list_last;
+    bs_op->max_oid = dr->max_oid;
+    bs_op->list_stable_limit = DELETE_RANGE_LIST_LIMIT;
+    bs_op->pg_count = pg_counts[dr->pg_id.pool_id];
+    bs_op->pg_number = dr->pg_id.pg_num-1;
+    bs_op->callback = [this, dr](blockstore_op_t *bs_op)
+    {
+        dr->listing = false;
+        obj_ver_id *list = (obj_ver_id*)bs_op->buf;
+        if (bs_op->retval < 0)
+        {
+            printf("[PG %u/%u] Local OP_LIST failed: retval=%d\n", dr->pg_id.pool_id, dr->pg_id.pg_num, bs_op->retval);
+            dr->errcode = bs_op->retval;
+            dr->list_done = true;
+        }
+        else
+        {
+            // When the page is full, dirty versions are only returned from the same interval
+            // as stable ones, i.e. up to the last stable object, and the next page starts
+            // right after it, so all returned entries must be processed with this page
+            uint64_t stable_count = bs_op->version;
+            object_id page_end = dr->max_oid;
+            if (stable_count >= DELETE_RANGE_LIST_LIMIT)
+            {
+                page_end = list[stable_count-1].oid;
+                dr->list_last = page_end;
+                dr->list_last.stripe++;
+            }
+            else
+            {
+                dr->list_done = true;
+            }
+            dr->objects.clear();
+            for (uint64_t i = 0; i < (uint64_t)bs_op->retval; i++)
+            {
+                object_id oid = list[i].oid;
+                oid.stripe &= ~STRIPE_MASK;
+                if (oid.inode == dr->min_oid.inode && oid.stripe >= dr->min_oid.stripe &&
+                    oid.stripe <= (page_end.stripe & ~STRIPE_MASK))
+                {
+                    dr->objects.insert(oid);
+                }
+            }
+            // Objects missing on this OSD are only present in unclean object lists
+            auto pg_it = pgs.find(dr->pg_id);
+            page_end.stripe &= ~STRIPE_MASK;
+            if (pg_it != pgs.end())
+            {
+                add_unclean_objects(dr->objects, pg_it->second.degraded_objects, dr->unclean_next, page_end);
+                add_unclean_objects(dr->objects, pg_it->second.misplaced_objects, dr->unclean_next, page_end);
+                add_unclean_objects(dr->objects, pg_it->second.incomplete_objects, dr->unclean_next, page_end);
+            }
+            dr->unclean_next = (object_id){ .inode = page_end.inode, .stripe = page_end.stripe+1 };
+        }
+        dr->pos = dr->objects.begin();
+        free(bs_op->buf);
+        delete bs_op;
+        continue_delete_range(dr);
+    };
+    bs->enqueue_op(bs_op);
+}
+
+void osd_t::continue_delete_range(osd_delete_range_t *dr)
+{
+    auto pg_it = pgs.find(dr->pg_id);
+    if (!dr->errcode && (pg_it == pgs.end() || !(pg_it->second.state & PG_ACTIVE)))
+    {
+        // PG is being stopped or repeered, the client should retry
+        dr->errcode = -EPIPE;
+    }
+    while (!dr->errcode && dr->in_flight < dr->parallel && dr->pos != dr->objects.end())
+    {
+        object_id oid = *dr->pos;
+        dr->pos++;
+        osd_op_t *op = new osd_op_t();
+        op->op_type = OSD_OP_OUT;
+        op->peer_fd = SELF_FD;
+        op->req = (osd_any_op_t){
+            .rw = {
+                .header = {
+                    .magic = SECONDARY_OSD_OP_MAGIC,
+                    .id = 1,
+                    .opcode = OSD_OP_DELETE,
+                },
+                .inode = oid.inode,
+                .offset = oid.stripe,
+                .len = 0,
+            },
+        };
+        op->callback = [this, dr](osd_op_t *op)
+        {
+            dr->in_flight--;
+            if (op->reply.hdr.retval < 0)
+            {
+                printf(
+                    "[PG %u/%u] Failed to delete object %jx:%jx: error %jd\n", dr->pg_id.pool_id, dr->pg_id.pg_num,
+                    op->req.rw.inode, op->req.rw.offset, op->reply.hdr.retval
+                );
+                dr->errors++;
+                if (op->reply.hdr.retval == -EPIPE)
+                    dr->errcode = -EPIPE;
+            }
+            else
+                dr->deleted++;
+            delete op;
+            if (!dr->submitting)
+                continue_delete_range(dr);
+        };
+        dr->in_flight++;
+        // Deletes may fail synchronously, don't let them finish the operation under us
+        dr->submitting = true;
+        exec_op(op);
+        dr->submitting = false;
+    }
+    if (dr->in_flight > 0 || dr->listing)
+    {
+        return;
+    }
+    if (!dr->errcode && dr->pos == dr->objects.end() && !dr->list_done)
+    {
+        delete_range_list(dr);
+        return;
+    }
+    // Done. Deletes are unstable until the client syncs them, like its own deletes
+    auto cur_op = dr->cur_op;
+    if (dr->deleted > 0)
+    {
+        auto cl_it = msgr.clients.find(cur_op->peer_fd);
+        if (cl_it != msgr.clients.end())
+        {
+            cl_it->second->dirty_pgs.insert(dr->pg_id);
+        }
+    }
+    cur_op->reply.delete_range.deleted_count = dr->deleted;
+    cur_op->reply.delete_range.error_count = dr->errors;
+    int retval = dr->errcode ? dr->errcode : (dr->errors > 0 ? -EIO : 0);
+    delete dr;
+    finish_op(cur_op, retval);
+}
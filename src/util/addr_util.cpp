@@ -191,7 +191,7 @@ std::vector<std::string> getifaddr_list(std::vector<std::string> mask_cfg, bool
     return std::vector<std::string>(addresses.begin(), addresses.end());
 }
 
-int create_and_bind_socket(std::string bind_address, int bind_port, int listen_backlog, int *listening_port)
+int create_and_bind_socket(std::string bind_address, int bind_port, int listen_backlog, int *listening_port, bool reuse_port)
 {
     sockaddr_storage addr;
     if (!string_to_addr(bind_address, 0, bind_port, &addr))
@@ -206,6 +206,11 @@ int create_and_bind_socket(std::string bind_address, int bind_port, int listen_b
     }
     int enable = 1;
     setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    if (reuse_port)
+    {
+        // Let multiple processes listen on the same port, kernel distributes connections between them
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+    }
 
     if (bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) < 0)
     {
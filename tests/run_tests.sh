@@ -38,6 +38,11 @@ SCHEME=ec ./test_snapshot_chain.sh
 ./test_snapshot_down.sh
 SCHEME=ec ./test_snapshot_down.sh
 
+./test_export_import.sh
+SCHEME=ec ./test_export_import.sh
+./test_diff.sh
+./test_bench.sh
+
 ./test_splitbrain.sh
 
 ./test_rebalance_verify.sh
@@ -79,3 +84,5 @@ PG_SIZE=6 PG_MINSIZE=4 OSD_COUNT=6 SCHEME=ec ./test_scrub.sh
 SCHEME=ec ./test_scrub.sh
 
 ./test_nfs.sh
+
+./test_kv.sh
@@ -0,0 +1,25 @@
+#!/bin/bash -ex
+
+. `dirname $0`/run_3osds.sh
+
+# Test the built-in benchmark
+
+RES=$(build/src/cmd/vitastor-cli bench --etcd_address $ETCD_URL --json --rw randwrite --runtime 2 --size 64M --iodepth 4 --fsync 16)
+if [[ $(echo "$RES" | jq -r .total.write.iops) -le 0 || $(echo "$RES" | jq -r .total.sync.ops) -le 0 ]]; then
+    format_error "No writes or syncs done: $RES"
+fi
+if [[ $(echo "$RES" | jq -r '.osds | length') -le 0 || $(echo "$RES" | jq -r '.pgs | length') -le 0 ]]; then
+    format_error "No per-OSD or per-PG statistics: $RES"
+fi
+
+RES=$(build/src/cmd/vitastor-cli bench --etcd_address $ETCD_URL --json --rw randrw --runtime 2 --size 64M --jobs 2)
+if [[ $(echo "$RES" | jq -r .total.read.iops) -le 0 || $(echo "$RES" | jq -r .total.write.iops) -le 0 ]]; then
+    format_error "No reads or writes done: $RES"
+fi
+
+# Temporary images must be removed
+if [[ "$(build/src/cmd/vitastor-cli ls --etcd_address $ETCD_URL --json | jq -r 'length')" != 0 ]]; then
+    format_error "Temporary image is not removed"
+fi
+
+format_green OK
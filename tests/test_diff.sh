@@ -0,0 +1,49 @@
+#!/bin/bash -ex
+
+. `dirname $0`/run_3osds.sh
+check_qemu
+
+# Test changed extent calculation between a snapshot and its child
+
+$ETCDCTL put /vitastor/config/inode/1/2 '{"name":"testimg@0","size":'$((32*1024*1024))'}'
+$ETCDCTL put /vitastor/config/inode/1/3 '{"parent_id":2,"name":"testimg","size":'$((32*1024*1024))'}'
+
+LD_PRELOAD="build/src/client/libfio_vitastor.so" \
+    fio -thread -name=test -ioengine=build/src/client/libfio_vitastor.so -bs=4k -direct=1 -iodepth=1 -fsync=32 -buffer_pattern=0xdeadface \
+        -rw=randwrite -etcd=$ETCD_URL -image=testimg@0 -size=16M -number_ios=256
+
+# Only the second half is changed after the snapshot
+LD_PRELOAD="build/src/client/libfio_vitastor.so" \
+    fio -thread -name=test -ioengine=build/src/client/libfio_vitastor.so -bs=4k -direct=1 -iodepth=1 -fsync=32 -buffer_pattern=0xbeefcafe \
+        -rw=randwrite -etcd=$ETCD_URL -image=testimg -offset=16M -size=16M -number_ios=256
+
+DIFF=$(build/src/cmd/vitastor-cli diff --etcd_address $ETCD_URL --json testimg@0 testimg)
+CHANGED=$(echo "$DIFF" | jq -r .changed_bytes)
+if [[ $CHANGED -le 0 || $CHANGED -gt $((256*4096)) ]]; then
+    format_error "Unexpected changed size: $CHANGED"
+fi
+if [[ $(echo "$DIFF" | jq '[ .extents[] | select(.offset < 16777216 or .offset+.len > 33554432) ] | length') != 0 ]]; then
+    format_error "Changed extents outside of the written range: $DIFF"
+fi
+if [[ $(echo "$DIFF" | jq '[ .extents[].len ] | add') != $CHANGED ]]; then
+    format_error "Extent lengths don't match changed_bytes"
+fi
+
+# Text output is streamed PG by PG and must contain the same extents
+TEXT_CHANGED=$(build/src/cmd/vitastor-cli diff --etcd_address $ETCD_URL testimg@0 testimg | awk '{ s += $2 } END { print s+0 }')
+if [[ $TEXT_CHANGED != $CHANGED ]]; then
+    format_error "Text output has $TEXT_CHANGED changed bytes instead of $CHANGED"
+fi
+
+# Without <from>, all allocated extents are reported, including the parent
+ALL=$(build/src/cmd/vitastor-cli diff --etcd_address $ETCD_URL --json testimg | jq -r .changed_bytes)
+if [[ $ALL -le $CHANGED ]]; then
+    format_error "Allocated size $ALL must include parent data"
+fi
+
+# <from> must be an ancestor of <to>
+if build/src/cmd/vitastor-cli diff --etcd_address $ETCD_URL testimg testimg@0; then
+    format_error "diff with a non-ancestor must fail"
+fi
+
+format_green OK
@@ -0,0 +1,48 @@
+#!/bin/bash -ex
+
+. `dirname $0`/run_3osds.sh
+check_qemu
+
+# Test sparse image export and import
+
+$ETCDCTL put /vitastor/config/inode/1/2 '{"name":"testimg@0","size":'$((32*1024*1024))'}'
+$ETCDCTL put /vitastor/config/inode/1/3 '{"parent_id":2,"name":"testimg","size":'$((32*1024*1024))'}'
+$ETCDCTL put /vitastor/config/inode/1/4 '{"name":"testimg2","size":'$((32*1024*1024))'}'
+
+LD_PRELOAD="build/src/client/libfio_vitastor.so" \
+    fio -thread -name=test -ioengine=build/src/client/libfio_vitastor.so -bs=4k -direct=1 -iodepth=1 -fsync=32 -buffer_pattern=0xdeadface \
+        -rw=randwrite -etcd=$ETCD_URL -image=testimg@0 -size=16M -number_ios=256
+
+LD_PRELOAD="build/src/client/libfio_vitastor.so" \
+    fio -thread -name=test -ioengine=build/src/client/libfio_vitastor.so -bs=4k -direct=1 -iodepth=1 -fsync=32 -buffer_pattern=0xbeefcafe \
+        -rw=randwrite -etcd=$ETCD_URL -image=testimg -number_ios=256
+
+qemu-img convert -S 4096 -p \
+    -f raw "vitastor:etcd_host=127.0.0.1\:$ETCD_PORT/v3:image=testimg" \
+    -O raw ./testdata/check.bin
+
+rm -f ./testdata/export.bin ./testdata/export2.bin ./testdata/export3.bin
+build/src/cmd/vitastor-cli export --etcd_address $ETCD_URL testimg ./testdata/export.bin
+cmp ./testdata/export.bin ./testdata/check.bin
+
+# Exported file must be sparse
+if [[ $(du -k ./testdata/export.bin | cut -f1) -ge 16384 ]]; then
+    format_error "Exported file is not sparse"
+fi
+
+build/src/cmd/vitastor-cli import --etcd_address $ETCD_URL ./testdata/export.bin testimg2
+build/src/cmd/vitastor-cli export --etcd_address $ETCD_URL testimg2 ./testdata/export2.bin
+cmp ./testdata/export2.bin ./testdata/check.bin
+
+# Import must refuse images with data or with a parent, because zeros aren't written
+if build/src/cmd/vitastor-cli import --etcd_address $ETCD_URL ./testdata/export.bin testimg2; then
+    format_error "Import into a non-empty image must fail without --force"
+fi
+if build/src/cmd/vitastor-cli import --etcd_address $ETCD_URL ./testdata/export.bin testimg; then
+    format_error "Import into an image with a parent must fail without --force"
+fi
+build/src/cmd/vitastor-cli import --etcd_address $ETCD_URL --force ./testdata/export.bin testimg2
+build/src/cmd/vitastor-cli export --etcd_address $ETCD_URL testimg2 ./testdata/export3.bin
+cmp ./testdata/export3.bin ./testdata/check.bin
+
+format_green OK
@@ -0,0 +1,136 @@
+#!/bin/bash -ex
+
+. `dirname $0`/run_3osds.sh
+
+# Random operations with consistency checks
+build/src/kv/vitastor-kv-stress --etcd_address $ETCD_URL --pool_id 1 --inode_id 1 \
+    --op_count 50000 --parallelism 16 --stop_on_error 1 --print_stats 0
+
+format_green "random stress ok"
+
+# YCSB workloads, each in its own key range
+for wl in a b c d e f; do
+    build/src/kv/vitastor-kv-stress --etcd_address $ETCD_URL --pool_id 1 --inode_id 1 --key_prefix ycsb_${wl}_ \
+        --workload $wl --record_count 10000 --op_count 20000 --parallelism 16 --stop_on_error 1 --print_stats 0 \
+        --seed 1 --json > ./testdata/kv_ycsb_$wl.json
+    jq -e '[.[]|objects|.lat.p99] | length > 0' ./testdata/kv_ycsb_$wl.json
+done
+
+# Open-loop fixed rate run
+build/src/kv/vitastor-kv-stress --etcd_address $ETCD_URL --pool_id 1 --inode_id 1 --key_prefix ycsb_rate_ \
+    --workload a --record_count 5000 --rate 2000 --runtime 5 --parallelism 64 --stop_on_error 1 \
+    --print_stats 0 --json > ./testdata/kv_ycsb_rate.json
+jq -e '.get.total.count > 0' ./testdata/kv_ycsb_rate.json
+
+# Separately stored values: GC, including segments left unsealed by killed clients, and reopen after GC
+KV="build/src/kv/vitastor-kv --etcd_address $ETCD_URL --kv_value_separation 1024 --kv_value_seal_timeout 1"
+VAL_A=$(head -c 3000 /dev/zero | tr '\0' a)
+VAL_B=$(head -c 3000 /dev/zero | tr '\0' b)
+for i in 1 2 3 4 5; do
+    # Single commands exit without closing the DB, so their segments stay unsealed
+    $KV "1 2" set k$i $VAL_A
+done
+(for i in 1 2 3 4 5; do echo set k$i $VAL_B; done; echo close) | $KV "1 2" 2>./testdata/kv_gc_open.log
+SIZE_BEFORE=$(grep -o 'Current size: [0-9]*' ./testdata/kv_gc_open.log | grep -o '[0-9]*$')
+(echo gc; sleep 2; echo gc; echo stats; echo close) | $KV "1 2" >./testdata/kv_gc_stats.log 2>&1
+grep 'was not written for' ./testdata/kv_gc_stats.log
+grep -E ' [1-9][0-9]* segments freed' ./testdata/kv_gc_stats.log
+$KV "1 2" set new $VAL_A 2>./testdata/kv_gc_reopen.log
+SIZE_AFTER=$(grep -o 'Current size: [0-9]*' ./testdata/kv_gc_reopen.log | grep -o '[0-9]*$')
+if [[ "$SIZE_AFTER" -lt "$SIZE_BEFORE" ]]; then
+    format_error "Index size after GC is $SIZE_AFTER, less than $SIZE_BEFORE before it"
+fi
+for i in 1 2 3 4 5; do
+    [[ "$($KV "1 2" get k$i)" = "$VAL_B" ]]
+done
+[[ "$($KV "1 2" get new)" = "$VAL_A" ]]
+
+format_green "value gc ok"
+
+# Compaction: delete-heavy random operations with automatic compaction and consistency checks
+build/src/kv/vitastor-kv-stress --etcd_address $ETCD_URL --pool_id 1 --inode_id 3 \
+    --record_count 20000 --op_count 40000 --parallelism 16 --stop_on_error 1 --print_stats 0 \
+    --get_prob 20 --add_prob 0 --update_prob 5 --del_prob 100 --list_prob 2 --reopen_prob 1 --kv_auto_compact 1
+
+# Explicit compaction of leaves left underfull without automatic compaction, it must not change the contents
+KV="build/src/kv/vitastor-kv --etcd_address $ETCD_URL"
+VAL_C=$(head -c 300 /dev/zero | tr '\0' c)
+(for i in $(seq 1000 1999); do echo set c$i $VAL_C; done; for i in $(seq 1000 1999); do
+    [[ $((i % 200)) = 0 ]] || echo del c$i; done; echo close) | $KV "1 4" >/dev/null
+for ino in 3 4; do
+    $KV "1 $ino" dumpjson > ./testdata/kv_compact_before_$ino.json
+    (echo compact; echo stats; echo close) | $KV "1 $ino" >./testdata/kv_compact_stats_$ino.log 2>&1
+    if grep Error ./testdata/kv_compact_stats_$ino.log; then
+        format_error "Compaction of inode $ino failed"
+    fi
+    $KV "1 $ino" dumpjson > ./testdata/kv_compact_after_$ino.json
+    diff ./testdata/kv_compact_before_$ino.json ./testdata/kv_compact_after_$ino.json
+done
+grep -E ' [1-9][0-9]* leaves merged' ./testdata/kv_compact_stats_4.log
+grep -E ' [1-9][0-9]* root levels removed' ./testdata/kv_compact_stats_4.log
+[[ "$($KV "1 4" get c1400)" = "$VAL_C" ]]
+if $KV "1 4" get c1401; then
+    format_error "Deleted key c1401 is present after compaction"
+fi
+
+# Only one compactor runs per client, but several clients may compact the same DB at once
+(for i in $(seq 1000 2999); do echo set c$i $VAL_C; done; for i in $(seq 1000 2999); do
+    [[ $((i % 50)) = 0 ]] || echo del c$i; done; echo close) | $KV "1 5" >/dev/null
+$KV "1 5" dumpjson > ./testdata/kv_compact_before_5.json
+(echo compact; echo close) | $KV "1 5" >./testdata/kv_compact_5a.log 2>&1 &
+COMPACT_A=$!
+(echo compact; echo close) | $KV "1 5" >./testdata/kv_compact_5b.log 2>&1 &
+COMPACT_B=$!
+wait $COMPACT_A
+wait $COMPACT_B
+if grep Error ./testdata/kv_compact_5a.log ./testdata/kv_compact_5b.log; then
+    format_error "Concurrent compaction failed"
+fi
+$KV "1 5" dumpjson > ./testdata/kv_compact_after_5.json
+diff ./testdata/kv_compact_before_5.json ./testdata/kv_compact_after_5.json
+
+# Two clients modifying the same DB with automatic compaction, each checks its own keys
+build/src/kv/vitastor-kv-stress --etcd_address $ETCD_URL --pool_id 1 --inode_id 5 --key_suffix _a \
+    --record_count 5000 --op_count 15000 --parallelism 8 --stop_on_error 1 --print_stats 0 \
+    --get_prob 20 --add_prob 0 --update_prob 5 --del_prob 100 --list_prob 2 --reopen_prob 0 --kv_auto_compact 1 &
+STRESS_A=$!
+build/src/kv/vitastor-kv-stress --etcd_address $ETCD_URL --pool_id 1 --inode_id 5 --key_suffix _b \
+    --record_count 5000 --op_count 15000 --parallelism 8 --stop_on_error 1 --print_stats 0 \
+    --get_prob 20 --add_prob 0 --update_prob 5 --del_prob 100 --list_prob 2 --reopen_prob 0 --kv_auto_compact 1 &
+STRESS_B=$!
+wait $STRESS_A
+wait $STRESS_B
+[[ "$($KV "1 5" get c2000)" = "$VAL_C" ]]
+
+format_green "compaction ok"
+
+# Bulk load of a dump into an empty DB must reproduce it exactly
+$KV "1 5" dumpjson > ./testdata/kv_bulk_src.json
+$KV "1 6" bulkload < ./testdata/kv_bulk_src.json
+$KV "1 6" dumpjson > ./testdata/kv_bulk_dst.json
+diff ./testdata/kv_bulk_src.json ./testdata/kv_bulk_dst.json
+# Only into an empty DB
+if $KV "1 6" bulkload < ./testdata/kv_bulk_src.json; then
+    format_error "Bulk load into a non-empty DB must fail"
+fi
+# Only sorted input
+if echo '{"b": "1", "a": "2"}' | $KV "1 7" bulkload; then
+    format_error "Bulk load of unsorted keys must fail"
+fi
+
+format_green "bulk load ok"
+
+# V1 blocks written by old versions must stay readable and writable by the default V2 writer
+VAL_D=$(head -c 200 /dev/zero | tr '\0' d)
+(for i in $(seq 1000 2999); do echo set v1k$i $VAL_D; done; echo close) | $KV --kv_block_format 1 "1 8" >/dev/null
+$KV "1 8" dumpjson > ./testdata/kv_v1_before.json
+build/src/kv/vitastor-kv-stress --etcd_address $ETCD_URL --pool_id 1 --inode_id 8 --key_suffix _v2 \
+    --op_count 20000 --parallelism 16 --stop_on_error 1 --print_stats 0
+$KV "1 8" dumpjson > ./testdata/kv_v1_after.json
+if [[ "$(jq -S . ./testdata/kv_v1_before.json)" != "$(jq -S 'with_entries(select((.key | startswith("v1k")) and (.key | endswith("_v2") | not)))' ./testdata/kv_v1_after.json)" ]]; then
+    format_error "Keys written in V1 format changed after writing in V2 format"
+fi
+
+format_green "block format compatibility ok"
+
+format_green OK
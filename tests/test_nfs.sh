@@ -5,7 +5,8 @@ PG_COUNT=16
 
 build/src/cmd/vitastor-cli --etcd_address $ETCD_URL create -s 10G fsmeta
 build/src/cmd/vitastor-cli --etcd_address $ETCD_URL modify-pool --used-for-fs fsmeta testpool
-build/src/nfs/vitastor-nfs start --fs fsmeta --etcd_address $ETCD_URL --portmap 0 --port 2050 --foreground 1 --trace 1 >>./testdata/nfs.log 2>&1 &
+build/src/nfs/vitastor-nfs start --fs fsmeta --etcd_address $ETCD_URL --portmap 0 --port 2050 --foreground 1 --trace 1 \
+    --stats_file ./testdata/nfs_stats.json --print_stats_interval 1 >>./testdata/nfs.log 2>&1 &
 NFS_PID=$!
 
 mkdir -p testdata/nfs
@@ -165,4 +166,142 @@ if ls ./testdata/nfs | grep over1; then false; fi
 [[ "`cat ./testdata/nfs/linked1`" = "BABABA" ]]
 format_green "rename over existing file ok"
 
+# load generator and statistics
+build/src/nfs/vitastor-nfs-stress --port 2050 --dir stress --file_count 10 --file_size 16k \
+    --parallelism 4 --op_count 2000 --print_stats 0 --json > ./testdata/nfs_stress.json
+jq -e '.getattr.total.count > 0 and .getattr.total.errors == 0' ./testdata/nfs_stress.json
+sleep 2
+jq -e '.op_stats.nfs3_getattr.count > 0 and .op_stats.nfs3_write.bytes > 0' ./testdata/nfs_stats.json
+format_green "load generator and statistics ok"
+
+# small file packing and shared block cache: the cache is only used without close-to-open
+build/src/nfs/vitastor-nfs start --fs fsmeta --etcd_address $ETCD_URL --portmap 0 --port 2052 --foreground 1 \
+    --close_to_open 0 --attr_cache_time 500 --shared_read_cache_time 500 --shared_pack_delay 2000 \
+    --print_stats_interval 1 >>./testdata/nfs_cache.log 2>&1 &
+NFS_CACHE_PID=$!
+mkdir -p testdata/nfs_cache
+sudo mount localhost:/ ./testdata/nfs_cache -o port=2052,mountport=2052,nfsvers=3,soft,nolock,tcp
+MNT_CACHE=$(pwd)/testdata/nfs_cache
+trap "sudo umount -f $MNT $MNT_CACHE"' || true; kill -9 $(jobs -p)' EXIT
+mkdir -p ./testdata/small ./testdata/nfs_cache/small
+CP_PIDS=
+for i in `seq 1 40`; do
+    dd if=/dev/urandom of=./testdata/small/s$i bs=3000 count=1 2>/dev/null
+    cp ./testdata/small/s$i ./testdata/nfs_cache/small/s$i &
+    CP_PIDS="$CP_PIDS $!"
+done
+for pid in $CP_PIDS; do
+    wait $pid
+done
+sudo umount ./testdata/nfs_cache/
+sudo mount localhost:/ ./testdata/nfs_cache -o port=2052,mountport=2052,nfsvers=3,soft,nolock,tcp
+for i in `seq 1 40`; do
+    diff ./testdata/small/s$i ./testdata/nfs_cache/small/s$i
+    diff ./testdata/small/s$i ./testdata/nfs/small/s$i
+done
+sleep 2
+grep 'shared block hits' ./testdata/nfs_cache.log
+# overwrite packed files in place through another proxy
+for i in 5 6; do
+    dd if=/dev/urandom of=./testdata/small/s$i bs=3000 count=1 2>/dev/null
+    dd if=./testdata/small/s$i of=./testdata/nfs/small/s$i bs=3000 count=1 conv=notrunc 2>/dev/null
+done
+sudo umount ./testdata/nfs/
+sudo mount localhost:/ ./testdata/nfs -o port=2050,mountport=2050,nfsvers=3,soft,nolock,tcp
+diff ./testdata/small/s5 ./testdata/nfs/small/s5
+sleep 1
+sudo umount ./testdata/nfs_cache/
+sudo mount localhost:/ ./testdata/nfs_cache -o port=2052,mountport=2052,nfsvers=3,soft,nolock,tcp
+diff ./testdata/small/s5 ./testdata/nfs_cache/small/s5
+diff ./testdata/small/s6 ./testdata/nfs_cache/small/s6
+sudo umount ./testdata/nfs_cache/
+kill $NFS_CACHE_PID
+trap "sudo umount -f $MNT"' || true; kill -9 $(jobs -p)' EXIT
+format_green "small file packing and shared block cache ok"
+
+# attribute copies in directory entries: listings must show the same sizes and
+# mtimes as inodes after creating, writing, renaming and hard-linking files
+build/src/nfs/vitastor-nfs start --fs fsmeta --etcd_address $ETCD_URL --portmap 0 --port 2053 \
+    --readdir_inline_attrs 1 --foreground 1 >>./testdata/nfs_inline.log 2>&1 &
+NFS_INLINE_PID=$!
+mkdir -p testdata/nfs_inline
+sudo mount localhost:/ ./testdata/nfs_inline -o port=2053,mountport=2053,nfsvers=3,soft,nolock,tcp
+MNT_INLINE=$(pwd)/testdata/nfs_inline
+trap "sudo umount -f $MNT $MNT_INLINE"' || true; kill -9 $(jobs -p)' EXIT
+mkdir ./testdata/nfs_inline/inl
+echo abc > ./testdata/nfs_inline/inl/a1
+dd if=/dev/urandom of=./testdata/nfs_inline/inl/b1 bs=5000 count=1
+dd if=/dev/urandom of=./testdata/nfs_inline/inl/c1 bs=200k count=1
+dd if=/dev/urandom of=./testdata/nfs_inline/inl/a1 bs=7000 count=1 seek=1 conv=notrunc
+touch -t 202401011404 ./testdata/nfs_inline/inl/c1
+mv ./testdata/nfs_inline/inl/b1 ./testdata/nfs_inline/inl/b2
+ln ./testdata/nfs_inline/inl/a1 ./testdata/nfs_inline/inl/a1link
+dd if=/dev/urandom of=./testdata/nfs_inline/inl/a1link bs=3000 count=1 seek=3 conv=notrunc
+# copies are updated in batches every touch_interval ms
+sleep 2
+sudo umount ./testdata/nfs_inline/
+sudo mount localhost:/ ./testdata/nfs_inline -o port=2053,mountport=2053,nfsvers=3,soft,nolock,tcp
+sudo umount ./testdata/nfs/
+sudo mount localhost:/ ./testdata/nfs -o port=2050,mountport=2050,nfsvers=3,soft,nolock,tcp
+LISTED=$(ls -l --time-style=+%s ./testdata/nfs_inline/inl | awk 'NR > 1 { print $7, $5, $6 }' | sort)
+STATED=$(cd ./testdata/nfs/inl && stat -c '%n %s %Y' * | sort)
+if [[ "$LISTED" != "$STATED" ]]; then
+    format_error "Listed attributes differ from inode attributes: $LISTED vs $STATED"
+fi
+[[ "`echo "$LISTED" | wc -l`" -eq 4 ]]
+sudo umount ./testdata/nfs_inline/
+kill $NFS_INLINE_PID
+trap "sudo umount -f $MNT"' || true; kill -9 $(jobs -p)' EXIT
+format_green "inline directory entry attributes ok"
+
+# pseudo-FS: listing of a directory with more images than fit into one READDIR reply
+for i in `seq 1001 1200`; do
+    $ETCDCTL put /vitastor/config/inode/1/$i '{"name":"blk/img'$i'","size":4096}' >/dev/null
+done
+build/src/nfs/vitastor-nfs start --block --etcd_address $ETCD_URL --portmap 0 --port 2054 --pool testpool \
+    --foreground 1 >>./testdata/nfs_block.log 2>&1 &
+NFS_BLOCK_PID=$!
+sleep 1
+mkdir -p testdata/nfs_block
+sudo mount localhost:/ ./testdata/nfs_block -o port=2054,mountport=2054,nfsvers=3,soft,nolock,tcp
+MNT_BLOCK=$(pwd)/testdata/nfs_block
+trap "sudo umount -f $MNT $MNT_BLOCK"' || true; kill -9 $(jobs -p)' EXIT
+[[ "`ls ./testdata/nfs_block/blk | sort`" = "`seq 1001 1200 | sed 's/^/img/'`" ]]
+[[ "`ls -l ./testdata/nfs_block/blk | grep -c ' img1[0-9]*$'`" -eq 200 ]]
+sudo umount ./testdata/nfs_block/
+kill $NFS_BLOCK_PID
+trap "sudo umount -f $MNT"' || true; kill -9 $(jobs -p)' EXIT
+format_green "pseudo-FS paged listing ok"
+
+# workers mode: all connections of one client must reach the same worker, so unstable
+# writes and COMMITs of a multi-connection mount go through one write verifier
+build/src/nfs/vitastor-nfs start --fs fsmeta --etcd_address $ETCD_URL --portmap 0 --port 2051 --workers 2 \
+    --foreground 1 >>./testdata/nfs_workers.log 2>&1 &
+NFS_WORKERS_PID=$!
+sleep 2
+[[ "`pgrep -P $NFS_WORKERS_PID | wc -l`" -eq 2 ]]
+mkdir -p testdata/nfs_workers
+sudo mount localhost:/ ./testdata/nfs_workers -o port=2051,mountport=2051,nfsvers=3,soft,nolock,tcp,nconnect=4
+MNT_WORKERS=$(pwd)/testdata/nfs_workers
+trap "sudo umount -f $MNT $MNT_WORKERS"' || true; kill -9 $(jobs -p) $(pgrep -P '$NFS_WORKERS_PID') || true' EXIT
+CP_PIDS=
+for i in 1 2 3 4; do
+    dd if=/dev/urandom of=./testdata/fw$i bs=1M count=3
+    cp ./testdata/fw$i ./testdata/nfs_workers/fw$i &
+    CP_PIDS="$CP_PIDS $!"
+done
+for pid in $CP_PIDS; do
+    wait $pid
+done
+sudo umount ./testdata/nfs_workers/
+sudo mount localhost:/ ./testdata/nfs_workers -o port=2051,mountport=2051,nfsvers=3,soft,nolock,tcp
+for i in 1 2 3 4; do
+    diff ./testdata/fw$i ./testdata/nfs_workers/fw$i
+    diff ./testdata/fw$i ./testdata/nfs/fw$i
+done
+sudo umount ./testdata/nfs_workers/
+kill $NFS_WORKERS_PID
+wait $NFS_WORKERS_PID
+format_green "workers mode ok"
+
 format_green OK